@@ -0,0 +1,30 @@
+#!/bin/bash
+
+CMAKE_BUILD_DIR_=cmake/build
+
+# the dataset size can be overridden
+DIMENSIONS=${DIMENSIONS:-768}
+NUM_VECTORS=${NUM_VECTORS:-100000}
+
+# this trap will only be executed when the server is running, so make sure it
+# is stopped if the benchmark is interrupted
+trap 'kill -TERM $PID' TERM INT
+
+for ENCODING in float32 float16 bfloat16 int8; do
+  # start from an empty index for every encoding, so each run measures ingest
+  ${CMAKE_BUILD_DIR_}/faiss_index_service 50051 ${DIMENSIONS} &
+  PID=$!
+  sleep 1
+
+  echo "encoding=${ENCODING}"
+  ${CMAKE_BUILD_DIR_}/vector_bench --dimensions=${DIMENSIONS} \
+    --num_vectors=${NUM_VECTORS} --encoding=${ENCODING} --mode=closed \
+    --concurrency=8
+
+  kill -TERM $PID
+  wait $PID
+done
+
+trap - TERM INT
+
+EXIT_STATUS=$?
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+CMAKE_BUILD_DIR_=cmake/build
+
+# the dataset size and the concurrency levels to sweep can be overridden
+DIMENSIONS=${DIMENSIONS:-128}
+NUM_VECTORS=${NUM_VECTORS:-100000}
+CONCURRENCIES=${CONCURRENCIES:-"1 8 64"}
+
+# this trap will only be executed when the server is running, so make sure it
+# is stopped if the benchmark is interrupted
+trap 'kill -TERM $PID' TERM INT
+
+for POLICY in inter_query intra_query; do
+  ${CMAKE_BUILD_DIR_}/faiss_index_service --threading_policy=${POLICY} 50051 ${DIMENSIONS} &
+  PID=$!
+  sleep 1
+
+  # only the first run loads the index, later runs search the loaded vectors
+  SKIP_INSERT=false
+  for CONCURRENCY in ${CONCURRENCIES}; do
+    echo "threading_policy=${POLICY} concurrency=${CONCURRENCY}"
+    ${CMAKE_BUILD_DIR_}/vector_bench --dimensions=${DIMENSIONS} \
+      --num_vectors=${NUM_VECTORS} --mode=closed \
+      --concurrency=${CONCURRENCY} --skip_insert=${SKIP_INSERT}
+    SKIP_INSERT=true
+  done
+
+  kill -TERM $PID
+  wait $PID
+done
+
+trap - TERM INT
+
+EXIT_STATUS=$?
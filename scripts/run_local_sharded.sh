@@ -0,0 +1,11 @@
+#!/bin/bash
+
+CMAKE_BUILD_DIR_=cmake/build
+
+# the index dimensions and number of in-process shards can be overridden
+DIMENSIONS=${DIMENSIONS:-1}
+NUM_SHARDS=${NUM_SHARDS:-2}
+
+${CMAKE_BUILD_DIR_}/local_sharded_index_service 50051 ${DIMENSIONS} ${NUM_SHARDS} "$@"
+
+EXIT_STATUS=$?
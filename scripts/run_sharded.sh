@@ -2,17 +2,23 @@
 
 CMAKE_BUILD_DIR_=cmake/build
 
+# the index dimensions and per-shard capacity can be overridden, e.g. to match
+# `vector_bench` flags, and the router's query cache can be enabled
+DIMENSIONS=${DIMENSIONS:-1}
+SHARD_CAPACITY=${SHARD_CAPACITY:-2}
+CACHE_BYTES=${CACHE_BYTES:-0}
+
 # this traps will only be executed when each process completes, so we need
 # to `wait` for them below
 trap 'kill -TERM $PID_0; kill -TERM $PID_1; kill -TERM $PID_2' TERM INT
 
-${CMAKE_BUILD_DIR_}/sharded_index_service 50051 1 2 localhost:50052 localhost:50053 &
+${CMAKE_BUILD_DIR_}/sharded_index_service --cache_bytes=${CACHE_BYTES} 50051 ${DIMENSIONS} ${SHARD_CAPACITY} localhost:50052 localhost:50053 &
 PID_0=$!
 
-${CMAKE_BUILD_DIR_}/faiss_index_service 50052 1 &
+${CMAKE_BUILD_DIR_}/faiss_index_service 50052 ${DIMENSIONS} &
 PID_1=$!
 
-${CMAKE_BUILD_DIR_}/faiss_index_service 50053 1 &
+${CMAKE_BUILD_DIR_}/faiss_index_service 50053 ${DIMENSIONS} &
 PID_2=$!
 
 wait
@@ -20,4 +26,3 @@ trap - TERM INT
 wait
 
 EXIT_STATUS=$?
-
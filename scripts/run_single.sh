@@ -2,7 +2,9 @@
 
 CMAKE_BUILD_DIR_=cmake/build
 
-${CMAKE_BUILD_DIR_}/faiss_index_service 50051 1
+# the index dimensions can be overridden, e.g. to match `vector_bench` flags
+DIMENSIONS=${DIMENSIONS:-1}
 
-EXIT_STATUS=$?
+${CMAKE_BUILD_DIR_}/faiss_index_service 50051 ${DIMENSIONS}
 
+EXIT_STATUS=$?
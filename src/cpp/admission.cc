@@ -0,0 +1,194 @@
+#include "src/cpp/admission.h"
+
+#include <grpcpp/support/status.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/str_format.h"
+#include "src/cpp/metrics.h"
+
+using grpc::Status;
+using grpc::StatusCode;
+
+namespace admission {
+
+namespace {
+
+// Bytes of bookkeeping per vector besides its values: its id in the index's
+// id map, and the hash set entry shards use to detect existing ids.
+constexpr int64_t kVectorOverheadBytes = 64;
+
+} // namespace
+
+Status check_k(uint32_t k, const Limits &limits) {
+  if (k > (uint32_t)std::numeric_limits<int>::max())
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat("Found k larger than the maximum. k=%d, "
+                                  "max_k=%d",
+                                  k, std::numeric_limits<int>::max()));
+
+  if (limits.max_k > 0 && k > (uint32_t)limits.max_k)
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat("Found k larger than the maximum. k=%d, "
+                                  "max_k=%d",
+                                  k, limits.max_k));
+
+  return Status::OK;
+}
+
+int64_t estimated_vector_bytes(int dimensions) {
+  return (int64_t)dimensions * sizeof(float) + kVectorOverheadBytes;
+}
+
+MemoryBudget::MemoryBudget(int64_t budget_bytes, metrics::Registry *metrics)
+    : m_budget_bytes_(budget_bytes), m_used_bytes_(0) {
+  if (!metrics)
+    metrics = &m_own_metrics_;
+
+  m_used_ = metrics->gauge("memory_budget_used_bytes");
+  m_rejected_ = metrics->counter("memory_budget_rejected_writes");
+}
+
+Status MemoryBudget::reserve(int64_t bytes) {
+  int64_t used_bytes = m_used_bytes_.load(std::memory_order_relaxed);
+  do {
+    if (m_budget_bytes_ > 0 && used_bytes + bytes > m_budget_bytes_) {
+      m_rejected_->increment();
+      return Status(StatusCode::RESOURCE_EXHAUSTED,
+                    absl::StrFormat("Writing %d more bytes of vectors would "
+                                    "exceed the memory budget. "
+                                    "used_bytes=%d, memory_budget_bytes=%d",
+                                    bytes, used_bytes, m_budget_bytes_));
+    }
+  } while (!m_used_bytes_.compare_exchange_weak(used_bytes, used_bytes + bytes,
+                                                std::memory_order_relaxed));
+
+  m_used_->add(bytes);
+  return Status::OK;
+}
+
+void MemoryBudget::release(int64_t bytes) {
+  m_used_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+  m_used_->add(-bytes);
+}
+
+CoDel::CoDel(Clock::duration target, Clock::duration interval)
+    : m_target_(target), m_interval_(interval), m_interval_end_(),
+      m_min_delay_(Clock::duration::zero()), m_overloaded_(false) {}
+
+bool CoDel::should_shed(Clock::duration delay, Clock::time_point now) {
+  if (now > m_interval_end_) {
+    m_overloaded_ = m_min_delay_ > m_target_;
+    m_min_delay_ = delay;
+    m_interval_end_ = now + m_interval_;
+  } else {
+    m_min_delay_ = std::min(m_min_delay_, delay);
+  }
+
+  return m_overloaded_ && delay > 2 * m_target_;
+}
+
+AdmissionQueue::AdmissionQueue(const AdmissionConfig &config,
+                               metrics::Registry *metrics)
+    : m_config_(config), m_codel_(config.codel_target, config.codel_interval),
+      m_num_arrived_(0), m_num_in_flight_(0) {
+  if (!metrics)
+    metrics = &m_own_metrics_;
+
+  m_admitted_ = metrics->counter("admission_admitted");
+  m_rejected_ = metrics->counter("admission_rejected");
+  m_shed_ = metrics->counter("admission_shed");
+  m_queued_ = metrics->gauge("admission_queued");
+  m_in_flight_ = metrics->gauge("admission_in_flight");
+}
+
+void AdmissionQueue::submit(int priority, Start start) {
+  bool admitted = false;
+  Start rejected;
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    const CoDel::Clock::time_point now = CoDel::Clock::now();
+
+    if (m_config_.max_in_flight <= 0 ||
+        m_num_in_flight_ < m_config_.max_in_flight) {
+      // Note: Record requests that didn't wait too, so CoDel sees that the
+      // queue drained.
+      m_codel_.should_shed(CoDel::Clock::duration::zero(), now);
+      m_num_in_flight_++;
+      m_in_flight_->set(m_num_in_flight_);
+      m_admitted_->increment();
+      admitted = true;
+    } else {
+      bool queued = true;
+      if (m_waiters_.size() >= (size_t)std::max(0, m_config_.max_queued)) {
+        // Reject the lowest priority, newest request, which is this one
+        // unless it has a higher priority than some waiting request.
+        m_rejected_->increment();
+        if (m_waiters_.empty() ||
+            std::prev(m_waiters_.end())->first.first >= priority) {
+          rejected = std::move(start);
+          queued = false;
+        } else {
+          rejected = std::move(std::prev(m_waiters_.end())->second.start);
+          m_waiters_.erase(std::prev(m_waiters_.end()));
+        }
+      }
+
+      if (queued) {
+        m_waiters_.emplace(WaiterKey(priority, m_num_arrived_++),
+                           Waiter{now, std::move(start)});
+        m_queued_->set(m_waiters_.size());
+      }
+    }
+  }
+
+  if (rejected)
+    rejected(Status(StatusCode::RESOURCE_EXHAUSTED,
+                    "Too many requests are queued."));
+  if (admitted)
+    start(Status::OK);
+}
+
+void AdmissionQueue::finish() {
+  std::vector<Start> shed;
+  Start next;
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    const CoDel::Clock::time_point now = CoDel::Clock::now();
+
+    while (!m_waiters_.empty() && !next) {
+      Waiter waiter = std::move(m_waiters_.begin()->second);
+      m_waiters_.erase(m_waiters_.begin());
+
+      if (m_codel_.should_shed(now - waiter.enqueued, now)) {
+        m_shed_->increment();
+        shed.push_back(std::move(waiter.start));
+      } else {
+        m_admitted_->increment();
+        next = std::move(waiter.start);
+      }
+    }
+    m_queued_->set(m_waiters_.size());
+
+    // Note: The finished request's slot passes on to the next request, if
+    // any.
+    if (!next) {
+      m_num_in_flight_--;
+      m_in_flight_->set(m_num_in_flight_);
+    }
+  }
+
+  for (const Start &start : shed)
+    start(Status(StatusCode::RESOURCE_EXHAUSTED,
+                 "Request was shed because the server is overloaded."));
+  if (next)
+    next(Status::OK);
+}
+
+} // namespace admission
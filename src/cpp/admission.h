@@ -0,0 +1,208 @@
+#pragma once
+
+#include <grpcpp/support/status.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include "src/cpp/metrics.h"
+
+namespace admission {
+
+// Limits on the size of requests and of the data a service stores.
+struct Limits {
+  // The largest `k` a search may ask for. Unbounded if not positive.
+  int max_k = 0;
+
+  // The approximate number of bytes of vectors a shard may store, as
+  // estimated by `estimated_vector_bytes`. Writes that would exceed it fail
+  // with `RESOURCE_EXHAUSTED`. Unbounded if not positive. Ignored by
+  // services given a shared `MemoryBudget`.
+  int64_t memory_budget_bytes = 0;
+};
+
+// Returns `INVALID_ARGUMENT` if `k` exceeds `limits.max_k`, or doesn't fit in
+// the `int` that `faiss` and the shards size results with.
+grpc::Status check_k(uint32_t k, const Limits &limits);
+
+// Estimates the bytes a shard spends per vector of `dimensions` values: the
+// raw values, plus the id and the bookkeeping that maps it to the vector.
+// Note: This is exact for flat indexes. It underestimates other indexes
+// (e.g. PQ or HNSW), which keep the raw vectors next to their codes or
+// links.
+int64_t estimated_vector_bytes(int dimensions);
+
+// Accounts for the estimated bytes of vectors stored by one or more indexes
+// against a shared budget, so the collections of a process can't together
+// exceed it.
+//
+// Exports `memory_budget_used_bytes` and `memory_budget_rejected_writes` to
+// `metrics`, if set.
+class MemoryBudget {
+public:
+  // Unbounded if `budget_bytes` isn't positive, in which case usage is still
+  // tracked.
+  explicit MemoryBudget(int64_t budget_bytes,
+                        metrics::Registry *metrics = nullptr);
+
+  MemoryBudget(const MemoryBudget &) = delete;
+  MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+  // Reserves `bytes`, or returns `RESOURCE_EXHAUSTED` without reserving
+  // anything if that would exceed the budget.
+  grpc::Status reserve(int64_t bytes);
+
+  // Returns `bytes` reserved earlier to the budget.
+  void release(int64_t bytes);
+
+  int64_t used_bytes() const {
+    return m_used_bytes_.load(std::memory_order_relaxed);
+  }
+
+private:
+  const int64_t m_budget_bytes_;
+
+  std::atomic<int64_t> m_used_bytes_;
+
+  metrics::Gauge *m_used_;
+  metrics::Counter *m_rejected_;
+
+  // Holds the metrics if no registry was given.
+  metrics::Registry m_own_metrics_;
+};
+
+// How an `AdmissionQueue` bounds concurrent and queued requests.
+struct AdmissionConfig {
+  // The number of requests that may run at once. Requests are admitted
+  // right away if not positive.
+  int max_in_flight = 0;
+
+  // The number of requests that may wait to be admitted. Further requests
+  // are rejected, unless they have a higher priority than a waiting request,
+  // which is rejected in their place.
+  int max_queued = 64;
+
+  // The queueing delay CoDel aims to keep requests under.
+  std::chrono::microseconds codel_target = std::chrono::milliseconds(5);
+
+  // The window over which CoDel looks for the queueing delay to stay above
+  // `codel_target` before it starts shedding.
+  std::chrono::microseconds codel_interval = std::chrono::milliseconds(100);
+};
+
+// Decides which requests to shed based on their queueing delay, following
+// CoDel (https://queue.acm.org/detail.cfm?id=2209336) as adapted for RPC
+// servers.
+//
+// A queue that's drained now and then absorbs bursts and is fine, but a
+// queue that never drains only adds latency. So a queue is considered
+// overloaded once even the shortest delay over a whole `interval` was above
+// `target`. While it's overloaded, requests that waited for more than twice
+// `target` are shed, since they're likely to miss their deadline anyway and
+// serving them would only make newer requests wait longer too.
+class CoDel {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  CoDel(Clock::duration target, Clock::duration interval);
+
+  // Records that a request waited for `delay` before being dequeued at
+  // `now`, and returns whether it should be shed.
+  bool should_shed(Clock::duration delay, Clock::time_point now);
+
+private:
+  Clock::duration m_target_;
+
+  Clock::duration m_interval_;
+
+  // The end of the current interval.
+  Clock::time_point m_interval_end_;
+
+  // The shortest delay seen in the current interval.
+  Clock::duration m_min_delay_;
+
+  // Whether the shortest delay of the last interval was above `m_target_`.
+  bool m_overloaded_;
+};
+
+// Bounds the number of requests running at once, with a bounded priority
+// queue for the rest and CoDel shedding, so latency stays stable under
+// overload instead of growing with the queue.
+//
+// Requests are admitted through a callback rather than by blocking, so
+// waiting requests don't hold a thread. Waiting requests are admitted
+// highest priority first, then oldest first.
+//
+// Exports `admission_*` metrics to `metrics`, if set, e.g.
+// `admission_shed` and `admission_queued`.
+class AdmissionQueue {
+public:
+  // Called with OK once a request is admitted, or with `RESOURCE_EXHAUSTED`
+  // if it's rejected or shed. Called without holding any lock, possibly
+  // from the thread of another request's `finish`, so it should return
+  // quickly, e.g. by handing the request to a thread pool.
+  using Start = std::function<void(grpc::Status)>;
+
+  explicit AdmissionQueue(const AdmissionConfig &config,
+                          metrics::Registry *metrics = nullptr);
+
+  AdmissionQueue(const AdmissionQueue &) = delete;
+  AdmissionQueue &operator=(const AdmissionQueue &) = delete;
+
+  // Admits a request with `priority` once there's room for it.
+  void submit(int priority, Start start);
+
+  // Marks an admitted request as done, admitting the next waiting request,
+  // if any.
+  void finish();
+
+private:
+  struct Waiter {
+    CoDel::Clock::time_point enqueued;
+    Start start;
+  };
+
+  // A waiter's priority and arrival.
+  using WaiterKey = std::pair<int, uint64_t>;
+
+  // Orders waiters by descending priority and then by arrival.
+  struct WaiterOrder {
+    bool operator()(const WaiterKey &first, const WaiterKey &second) const {
+      if (first.first != second.first)
+        return first.first > second.first;
+      return first.second < second.second;
+    }
+  };
+
+  const AdmissionConfig m_config_;
+
+  metrics::Counter *m_admitted_;
+  metrics::Counter *m_rejected_;
+  metrics::Counter *m_shed_;
+  metrics::Gauge *m_queued_;
+  metrics::Gauge *m_in_flight_;
+
+  // Guards every member below.
+  std::mutex m_mutex_;
+
+  CoDel m_codel_;
+
+  // Waiting requests, best first.
+  std::map<WaiterKey, Waiter, WaiterOrder> m_waiters_;
+
+  // The number of requests that arrived so far, used to order waiters of
+  // the same priority.
+  uint64_t m_num_arrived_;
+
+  int m_num_in_flight_;
+
+  // Holds the metrics if no registry was given.
+  metrics::Registry m_own_metrics_;
+};
+
+} // namespace admission
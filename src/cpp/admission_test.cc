@@ -0,0 +1,167 @@
+#include "src/cpp/admission.h"
+
+#include <grpcpp/support/status.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/cpp/metrics.h"
+
+using admission::AdmissionConfig;
+using admission::AdmissionQueue;
+using admission::check_k;
+using admission::CoDel;
+using admission::Limits;
+using grpc::Status;
+using grpc::StatusCode;
+using std::chrono::milliseconds;
+
+using testing::ElementsAre;
+
+namespace {
+
+AdmissionConfig make_config(int max_in_flight, int max_queued) {
+  AdmissionConfig config;
+  config.max_in_flight = max_in_flight;
+  config.max_queued = max_queued;
+  return config;
+}
+
+// Submits a request that records its name in `admitted` or `rejected`.
+void submit(AdmissionQueue *queue, int priority, const std::string &name,
+            std::vector<std::string> *admitted,
+            std::vector<std::string> *rejected) {
+  queue->submit(priority, [=](Status status) {
+    if (status.ok())
+      admitted->push_back(name);
+    else
+      rejected->push_back(name);
+  });
+}
+
+} // namespace
+
+TEST(CheckKTest, EnforcesMaxK) {
+  Limits limits;
+  EXPECT_TRUE(check_k(100000, limits).ok());
+
+  limits.max_k = 100;
+  EXPECT_TRUE(check_k(100, limits).ok());
+  EXPECT_EQ(check_k(101, limits).error_code(), StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(CheckKTest, RejectsKThatDoesntFitInAnInt) {
+  Limits limits;
+  EXPECT_TRUE(check_k(std::numeric_limits<int>::max(), limits).ok());
+  EXPECT_EQ(check_k((uint32_t)std::numeric_limits<int>::max() + 1, limits)
+                .error_code(),
+            StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(CoDelTest, ShedsOnlyWhenDelayStaysAboveTarget) {
+  CoDel codel(milliseconds(5), milliseconds(100));
+  CoDel::Clock::time_point now = CoDel::Clock::now();
+
+  // A long delay alone isn't overload.
+  EXPECT_FALSE(codel.should_shed(milliseconds(50), now));
+  EXPECT_FALSE(codel.should_shed(milliseconds(50), now + milliseconds(50)));
+
+  // The whole first interval stayed above the target, so long delays are
+  // shed in the next one, but short ones aren't.
+  now += milliseconds(101);
+  EXPECT_TRUE(codel.should_shed(milliseconds(50), now));
+  EXPECT_FALSE(codel.should_shed(milliseconds(8), now));
+
+  // A request that didn't wait in the last interval ends the overload.
+  codel.should_shed(milliseconds(0), now + milliseconds(1));
+  now += milliseconds(101);
+  EXPECT_FALSE(codel.should_shed(milliseconds(50), now));
+}
+
+TEST(AdmissionQueueTest, AdmitsByPriorityThenArrival) {
+  AdmissionQueue queue(make_config(1, 10));
+  std::vector<std::string> admitted, rejected;
+
+  submit(&queue, 0, "first", &admitted, &rejected);
+  submit(&queue, 0, "low", &admitted, &rejected);
+  submit(&queue, 5, "high", &admitted, &rejected);
+  submit(&queue, 0, "low2", &admitted, &rejected);
+  EXPECT_THAT(admitted, ElementsAre("first"));
+
+  for (int i = 0; i < 3; i++)
+    queue.finish();
+
+  EXPECT_THAT(admitted, ElementsAre("first", "high", "low", "low2"));
+  EXPECT_TRUE(rejected.empty());
+}
+
+TEST(AdmissionQueueTest, OrdersExtremePriorities) {
+  AdmissionQueue queue(make_config(1, 10));
+  std::vector<std::string> admitted, rejected;
+
+  submit(&queue, 0, "first", &admitted, &rejected);
+  submit(&queue, std::numeric_limits<int>::min(), "lowest", &admitted,
+         &rejected);
+  submit(&queue, std::numeric_limits<int>::max(), "highest", &admitted,
+         &rejected);
+  submit(&queue, 0, "default", &admitted, &rejected);
+
+  for (int i = 0; i < 3; i++)
+    queue.finish();
+
+  EXPECT_THAT(admitted, ElementsAre("first", "highest", "default", "lowest"));
+}
+
+TEST(AdmissionQueueTest, RejectsLowestPriorityWhenFull) {
+  metrics::Registry registry;
+  AdmissionQueue queue(make_config(1, 2), &registry);
+  std::vector<std::string> admitted, rejected;
+
+  submit(&queue, 0, "running", &admitted, &rejected);
+  submit(&queue, 1, "a", &admitted, &rejected);
+  submit(&queue, 0, "b", &admitted, &rejected);
+
+  // Not a higher priority than any waiting request.
+  submit(&queue, 0, "c", &admitted, &rejected);
+  EXPECT_THAT(rejected, ElementsAre("c"));
+
+  // Displaces the lowest priority waiting request.
+  submit(&queue, 2, "d", &admitted, &rejected);
+  EXPECT_THAT(rejected, ElementsAre("c", "b"));
+
+  queue.finish();
+  queue.finish();
+  EXPECT_THAT(admitted, ElementsAre("running", "d", "a"));
+  EXPECT_EQ(registry.snapshot()["admission_rejected"], 2);
+}
+
+TEST(AdmissionQueueTest, ShedsRequestsQueuedTooLongUnderOverload) {
+  metrics::Registry registry;
+  AdmissionConfig config = make_config(1, 100);
+  config.codel_target = milliseconds(1);
+  config.codel_interval = milliseconds(10);
+  AdmissionQueue queue(config, &registry);
+  std::vector<std::string> admitted, rejected;
+
+  // Keep the queue from draining for longer than an interval, so every
+  // request waits for more than twice the target.
+  submit(&queue, 0, "running", &admitted, &rejected);
+  for (int i = 0; i < 5; i++)
+    submit(&queue, 0, std::to_string(i), &admitted, &rejected);
+
+  std::this_thread::sleep_for(milliseconds(20));
+  queue.finish();
+  std::this_thread::sleep_for(milliseconds(20));
+  queue.finish();
+
+  EXPECT_THAT(admitted, ElementsAre("running", "0"));
+  EXPECT_THAT(rejected, ElementsAre("1", "2", "3", "4"));
+  EXPECT_EQ(registry.snapshot()["admission_shed"], 4);
+  EXPECT_EQ(registry.snapshot()["admission_in_flight"], 0);
+}
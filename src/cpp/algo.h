@@ -4,9 +4,14 @@
  * Future work:
  * - support passing custom comparator to heap functions
  */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <map>
 #include <utility>
+#include <vector>
 
 namespace {
 
@@ -65,7 +70,56 @@ template <typename T> T heap_replace(T *a, int size, T v) {
   return heap_replace(a, size, v, std::greater<T>());
 }
 
-std::pair<int, std::map<int, int>>
+// Merges lists that are each already sorted from best to worst, writing the
+// best `k` items across all lists to `out`, best first. `compare(a, b)`
+// returns whether `a` is better than `b`. Each list is given as a
+// (pointer, size) pair.
+//
+// This only ever looks at the head of each list, so it runs in
+// O(k * log(num_lists)) instead of the O(num_lists * k * log(k)) of
+// pushing every item through a k-sized heap.
+//
+// Returns the number of items written, which is less than `k` if the lists
+// hold fewer than `k` items in total.
+template <typename T, typename Compare>
+int merge_top_k(const std::vector<std::pair<const T *, int>> &lists, int k,
+                T *out, Compare compare) {
+  // Position of the next unmerged item in each list.
+  std::vector<int> cursors(lists.size(), 0);
+
+  // Max-heap of list indexes ordered by their next unmerged item, so the list
+  // holding the best remaining item is at the front.
+  auto is_head_worse = [&](int i, int j) {
+    return compare(lists[j].first[cursors[j]], lists[i].first[cursors[i]]);
+  };
+
+  std::vector<int> heap;
+  for (int i = 0; i < lists.size(); i++) {
+    if (lists[i].second > 0)
+      heap.push_back(i);
+  }
+  std::make_heap(heap.begin(), heap.end(), is_head_worse);
+
+  int num_merged = 0;
+  while (num_merged < k && !heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), is_head_worse);
+    int list_idx = heap.back();
+
+    out[num_merged++] = lists[list_idx].first[cursors[list_idx]++];
+
+    if (cursors[list_idx] < lists[list_idx].second)
+      std::push_heap(heap.begin(), heap.end(), is_head_worse);
+    else
+      heap.pop_back();
+  }
+
+  return num_merged;
+}
+
+// Note: Non-template functions defined in a header must be `inline` so that
+// including this header from multiple translation units doesn't violate the
+// one definition rule.
+inline std::pair<int, std::map<int, int>>
 greedy_fill(int num_elements, int bucket_capacity,
             const std::vector<int> &bucket_sizes) {
   if (!num_elements) {
@@ -98,4 +152,119 @@ greedy_fill(int num_elements, int bucket_capacity,
   return std::make_pair(num_elements_leftover, bucket_fills);
 }
 
+// Returns the hash bucket of `id` among `num_buckets` buckets. Ids are hashed
+// with the finalizer of 32-bit MurmurHash3, so runs of consecutive ids spread
+// evenly across buckets, and clients can compute the same buckets.
+inline uint32_t id_bucket(uint32_t id, uint32_t num_buckets) {
+  uint32_t hash = id;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  return hash % num_buckets;
+}
+
+// Selects the ids in `[begin_id, end_id)`, or from `begin_id` on if `end_id`
+// is 0. If `num_buckets` is positive, only ids in hash bucket `bucket` of
+// `num_buckets` are selected, which splits any range into `num_buckets`
+// disjoint pieces of roughly equal size.
+struct IdFilter {
+  uint32_t begin_id = 0;
+  uint32_t end_id = 0;
+  uint32_t num_buckets = 0;
+  uint32_t bucket = 0;
+
+  bool matches(uint32_t id) const {
+    return id >= begin_id && (!end_id || id < end_id) &&
+           (!num_buckets || id_bucket(id, num_buckets) == bucket);
+  }
+};
+
+// Returns the number of vectors of `dimensions` values to stream per export
+// response: `requested` if set, or about 1MB of vectors otherwise. Never more
+// than about 3MB of vectors, however many are requested, so responses stay
+// below gRPC's default 4MB message size limit.
+inline int export_batch_size(uint32_t requested, int dimensions) {
+  // Note: Besides its values, each vector encodes its id and the tags and
+  // lengths of its fields in at most 14 bytes.
+  const size_t vector_bytes = (size_t)dimensions * sizeof(float) + 16;
+  if (!requested)
+    return std::max<size_t>(1, (1 << 20) / vector_bytes);
+  return std::min<size_t>(requested,
+                          std::max<size_t>(1, (3 << 20) / vector_bytes));
+}
+
+// Moves `num_elements` from bucket `source` to bucket `target`.
+struct BucketMove {
+  int source;
+  int target;
+  int num_elements;
+
+  bool operator==(const BucketMove &other) const {
+    return source == other.source && target == other.target &&
+           num_elements == other.num_elements;
+  }
+};
+
+// Returns the moves that even out `bucket_sizes`, such that no two buckets
+// differ by more than one element afterwards, moving as few elements as
+// possible.
+inline std::vector<BucketMove>
+rebalance_plan(const std::vector<int> &bucket_sizes) {
+  const int num_buckets = bucket_sizes.size();
+  if (!num_buckets)
+    return {};
+
+  int total = 0;
+  for (int size : bucket_sizes)
+    total += size;
+
+  // Every bucket ends up with `total / num_buckets` elements, and the
+  // largest buckets keep one of the remaining elements each, since that
+  // moves fewer elements than giving them to smaller buckets.
+  std::vector<int> order(num_buckets);
+  for (int i = 0; i < num_buckets; i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](int i, int j) {
+    return bucket_sizes[i] > bucket_sizes[j];
+  });
+
+  std::vector<int> target_sizes(num_buckets, total / num_buckets);
+  for (int i = 0; i < total % num_buckets; i++)
+    target_sizes[order[i]]++;
+
+  // Pair up buckets with more elements than their target with buckets that
+  // have fewer, in bucket order.
+  std::vector<BucketMove> moves;
+  int source = 0, target = 0;
+  int source_surplus = 0, target_deficit = 0;
+  while (true) {
+    while (source < num_buckets && !source_surplus) {
+      source_surplus = std::max(0, bucket_sizes[source] - target_sizes[source]);
+      if (!source_surplus)
+        source++;
+    }
+    while (target < num_buckets && !target_deficit) {
+      target_deficit = std::max(0, target_sizes[target] - bucket_sizes[target]);
+      if (!target_deficit)
+        target++;
+    }
+    if (source == num_buckets || target == num_buckets)
+      break;
+
+    int num_to_move = std::min(source_surplus, target_deficit);
+    moves.push_back({source, target, num_to_move});
+
+    source_surplus -= num_to_move;
+    target_deficit -= num_to_move;
+    if (!source_surplus)
+      source++;
+    if (!target_deficit)
+      target++;
+  }
+
+  return moves;
+}
+
 } // namespace algo
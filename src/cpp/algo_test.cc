@@ -8,8 +8,13 @@
 #include <utility>
 #include <vector>
 
+using algo::export_batch_size;
 using algo::greedy_fill;
 using algo::heap_replace;
+using algo::id_bucket;
+using algo::IdFilter;
+using algo::merge_top_k;
+using algo::rebalance_plan;
 
 using testing::ElementsAre;
 
@@ -45,6 +50,29 @@ TEST(HeapTest, HeapReplaceMaxHeapCompare) {
   ASSERT_THAT(a, ElementsAre(2, 1, 1));
 }
 
+TEST(MergeTopKTest, MergesSortedLists) {
+  const float a[3] = {9, 5, 1};
+  const float b[2] = {8, 7};
+  const float c[1] = {6};
+  std::vector<std::pair<const float *, int>> lists = {{a, 3}, {b, 2}, {c, 1}};
+
+  float out[4];
+  EXPECT_EQ(merge_top_k(lists, 4, out, std::greater<float>()), 4);
+  ASSERT_THAT(out, ElementsAre(9, 8, 7, 6));
+}
+
+TEST(MergeTopKTest, FewerItemsThanK) {
+  // Test that empty lists are skipped and we stop once all lists are merged.
+  const float a[2] = {1, 3};
+  const float b[1] = {2};
+  std::vector<std::pair<const float *, int>> lists = {
+      {a, 2}, {nullptr, 0}, {b, 1}};
+
+  float out[5] = {};
+  EXPECT_EQ(merge_top_k(lists, 5, out, std::less<float>()), 3);
+  ASSERT_THAT(out, ElementsAre(1, 2, 3, 0, 0));
+}
+
 TEST(GreedyFillTest, NoElements) {
   const std::vector<int> bucket_sizes = {0};
   int bucket_capacity = 1;
@@ -104,3 +132,77 @@ TEST(GreedyFillTest, SomeElements_3) {
       greedy_fill(num_elements, bucket_capacity, bucket_sizes),
       std::make_pair(expected_num_elements_leftover, expected_bucket_fills));
 }
+
+TEST(RebalancePlanTest, AlreadyBalanced) {
+  EXPECT_TRUE(rebalance_plan({}).empty());
+  EXPECT_TRUE(rebalance_plan({7}).empty());
+  EXPECT_TRUE(rebalance_plan({3, 4, 3}).empty());
+}
+
+TEST(RebalancePlanTest, FillsNewBucket) {
+  // Test adding an empty bucket next to buckets filled greedily.
+  EXPECT_THAT(rebalance_plan({5, 5, 5, 0}),
+              ElementsAre(algo::BucketMove{0, 3, 1}, algo::BucketMove{1, 3, 1},
+                          algo::BucketMove{2, 3, 1}));
+}
+
+TEST(RebalancePlanTest, SplitsMovesAcrossBuckets) {
+  const std::vector<int> bucket_sizes = {10, 8, 0, 2};
+
+  // The total is 20, so every bucket should end up with 5.
+  EXPECT_THAT(
+      rebalance_plan(bucket_sizes),
+      ElementsAre(algo::BucketMove{0, 2, 5}, algo::BucketMove{1, 3, 3}));
+}
+
+TEST(IdBucketTest, MatchesMurmurHash3Finalizer) {
+  // Clients splitting an export must compute the same buckets.
+  EXPECT_EQ(id_bucket(1, 1u << 31), 1364076727u % (1u << 31));
+  EXPECT_EQ(id_bucket(42, 1000), 142593372u % 1000);
+}
+
+TEST(IdBucketTest, SpreadsConsecutiveIdsEvenly) {
+  const int num_buckets = 8;
+  const int num_ids = 80000;
+  std::vector<int> bucket_sizes(num_buckets);
+  for (uint32_t id = 0; id < num_ids; id++)
+    bucket_sizes[id_bucket(id, num_buckets)]++;
+
+  for (int bucket_size : bucket_sizes) {
+    EXPECT_GT(bucket_size, 0.9 * num_ids / num_buckets);
+    EXPECT_LT(bucket_size, 1.1 * num_ids / num_buckets);
+  }
+}
+
+TEST(IdFilterTest, FiltersByRangeAndBucket) {
+  IdFilter range{10, 20};
+  EXPECT_FALSE(range.matches(9));
+  EXPECT_TRUE(range.matches(10));
+  EXPECT_TRUE(range.matches(19));
+  EXPECT_FALSE(range.matches(20));
+
+  // An `end_id` of 0 leaves the range unbounded above.
+  EXPECT_TRUE(IdFilter{10}.matches(4000000000u));
+
+  // Every id is in exactly one bucket.
+  for (uint32_t id = 10; id < 20; id++) {
+    int num_matches = 0;
+    for (uint32_t bucket = 0; bucket < 3; bucket++)
+      num_matches += IdFilter{10, 20, 3, bucket}.matches(id);
+    EXPECT_EQ(num_matches, 1);
+  }
+}
+
+TEST(ExportBatchSizeTest, CapsBatchesBelowTheMessageSizeLimit) {
+  // Defaults to about 1MB of vectors.
+  EXPECT_EQ(export_batch_size(0, 128), (1 << 20) / (128 * 4 + 16));
+  EXPECT_EQ(export_batch_size(100, 128), 100);
+
+  // Caps requests to about 3MB of vectors, even for very few dimensions.
+  EXPECT_EQ(export_batch_size(1000000, 128), (3 << 20) / (128 * 4 + 16));
+  EXPECT_LT(export_batch_size(4000000000u, 1) * (4 + 16), 4 << 20);
+
+  // Always exports at least one vector per response.
+  EXPECT_EQ(export_batch_size(0, 1 << 20), 1);
+  EXPECT_EQ(export_batch_size(10, 1 << 20), 1);
+}
@@ -0,0 +1,396 @@
+#include "src/cpp/async_server.h"
+
+#include <grpcpp/completion_queue.h>
+#include <grpcpp/server_builder.h>
+#include <grpcpp/server_context.h>
+#include <grpcpp/support/async_unary_call.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/strings/str_format.h"
+#include "src/cpp/admission.h"
+#include "src/cpp/metrics.h"
+#include "src/cpp/profile.h"
+#include "src/cpp/thread_pool.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
+using grpc::ServerContext;
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::AddShardRequest;
+using index_service::AddShardResponse;
+using index_service::CreateCollectionRequest;
+using index_service::CreateCollectionResponse;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::DropCollectionRequest;
+using index_service::DropCollectionResponse;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::ProfileSpan;
+using index_service::ListCollectionsRequest;
+using index_service::ListCollectionsResponse;
+using index_service::RebalanceRequest;
+using index_service::RebalanceResponse;
+using index_service::RebuildRequest;
+using index_service::RebuildResponse;
+using index_service::RemoveRequest;
+using index_service::RemoveResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::UpsertRequest;
+using index_service::UpsertResponse;
+
+namespace index_service::async {
+
+absl::StatusOr<AsyncServerConfig>
+make_async_server_config(int num_cqs, const std::string &poller_cpus,
+                         int compute_threads, const std::string &compute_cpus,
+                         int max_pending_calls) {
+  if (num_cqs <= 0 || compute_threads <= 0)
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Expected positive numbers of completion queues and compute "
+        "threads. num_cqs=%d, compute_threads=%d",
+        num_cqs, compute_threads));
+
+  AsyncServerConfig config;
+  config.num_cqs = num_cqs;
+  config.compute_threads = compute_threads;
+  config.max_pending_calls = max_pending_calls;
+
+  absl::StatusOr<std::vector<int>> cpus =
+      executor::parse_cpu_list(poller_cpus);
+  if (!cpus.ok())
+    return cpus.status();
+  config.poller_cpus = *std::move(cpus);
+
+  cpus = executor::parse_cpu_list(compute_cpus);
+  if (!cpus.ok())
+    return cpus.status();
+  config.compute_cpus = *std::move(cpus);
+
+  return config;
+}
+
+class AsyncIndexServer::Call {
+public:
+  virtual ~Call() = default;
+
+  // Advances the call once the operation it's waiting for completes. `ok` is
+  // false if the operation failed, e.g. because the server is shutting down.
+  virtual void proceed(bool ok) = 0;
+};
+
+// A unary call, which first waits for a request and then for its response to
+// be sent. Deletes itself once done.
+template <typename Request, typename Response>
+class AsyncIndexServer::UnaryCall final : public AsyncIndexServer::Call {
+public:
+  // The generated method that requests the next call of an RPC.
+  using RequestMethod = void (Service::*)(ServerContext *, Request *,
+                                          ServerAsyncResponseWriter<Response> *,
+                                          grpc::CompletionQueue *,
+                                          ServerCompletionQueue *, void *);
+
+  // The synchronous implementation of the RPC.
+  using SyncMethod = Status (IndexService::Service::*)(ServerContext *,
+                                                       const Request *,
+                                                       Response *);
+
+  // Starts waiting for the next call of an RPC on `cq`.
+  static void request(AsyncIndexServer *server, ServerCompletionQueue *cq,
+                      RequestMethod request_method, SyncMethod sync_method) {
+    new UnaryCall(server, cq, request_method, sync_method);
+  }
+
+  void proceed(bool ok) override {
+    if (!ok || m_responded_) {
+      delete this;
+      return;
+    }
+
+    const int num_active_calls = m_server_->begin_call();
+    if (num_active_calls == 0) {
+      delete this;
+      return;
+    }
+    if (profiled())
+      m_received_ = profile::Clock::now();
+
+    // Wait for the next call before handling this one, so calls keep being
+    // received while it's handled.
+    request(m_server_, m_cq_, m_request_method_, m_sync_method_);
+
+    // Note: The call may be deleted as soon as its response is sent, so
+    // `done` must not touch it afterwards.
+    Done done = [this, server = m_server_](Status status) {
+      m_responded_ = true;
+      m_responder_.Finish(m_response_, status, this);
+      server->end_call();
+    };
+
+    const int max_pending_calls = m_server_->m_config_.max_pending_calls;
+    if (max_pending_calls > 0 && num_active_calls > max_pending_calls) {
+      done(Status(StatusCode::RESOURCE_EXHAUSTED,
+                  "Too many pending requests."));
+      return;
+    }
+
+    if constexpr (std::is_same_v<Request, SearchRequest>) {
+      // Note: Only admitted searches free an admission slot once done.
+      AsyncIndexServer *server = m_server_;
+      Done admitted_done = [server, done](Status status) {
+        server->m_search_admission_.finish();
+        done(std::move(status));
+      };
+      m_server_->m_search_admission_.submit(
+          m_request_.priority(),
+          [this, done = std::move(done),
+           admitted_done = std::move(admitted_done)](Status status) {
+            if (!status.ok())
+              done(std::move(status));
+            else
+              handle(std::move(admitted_done));
+          });
+      return;
+    }
+
+    handle(std::move(done));
+  }
+
+private:
+  // Handles the call on the compute pool, or with the search handler for
+  // searches if there is one.
+  void handle(Done done) {
+    if (profiled()) {
+      m_admitted_ = profile::Clock::now();
+      done = [this, done = std::move(done)](Status status) {
+        if (status.ok())
+          add_wait_spans();
+        done(std::move(status));
+      };
+    }
+
+    if constexpr (std::is_same_v<Request, SearchRequest>) {
+      if (m_server_->m_search_handler_) {
+        m_server_->m_search_handler_(&m_context_, &m_request_, &m_response_,
+                                     std::move(done));
+        return;
+      }
+    }
+
+    IndexService::Service *service = m_server_->m_service_;
+    const SyncMethod sync_method = m_sync_method_;
+    m_server_->dispatch(
+        [this, service, sync_method] {
+          if (profiled())
+            m_dispatched_ = profile::Clock::now();
+          return (service->*sync_method)(&m_context_, &m_request_,
+                                         &m_response_);
+        },
+        std::move(done));
+  }
+
+  // Whether the call is a search that asks for a profile, so the time it
+  // waits before its handler runs is measured.
+  bool profiled() const {
+    if constexpr (std::is_same_v<Request, SearchRequest>)
+      return m_request_.profile();
+    else
+      return false;
+  }
+
+  // Adds the time the search waited in the admission queue, and then for a
+  // compute thread if it ran on the compute pool, as the first spans of the
+  // profile its handler returned. The profile then lasts from when the
+  // search was received.
+  void add_wait_spans() {
+    if constexpr (std::is_same_v<Request, SearchRequest>) {
+      if (!m_response_.has_profile())
+        return;
+
+      ProfileSpan *span = m_response_.mutable_profile();
+      int64_t wait_us = 0;
+      if (m_dispatched_ != profile::Clock::time_point()) {
+        const int64_t dispatch_wait_us =
+            profile::microseconds_between(m_admitted_, m_dispatched_);
+        profile::add_first_span(span, "dispatch_wait", dispatch_wait_us);
+        wait_us += dispatch_wait_us;
+      }
+      const int64_t admission_wait_us =
+          profile::microseconds_between(m_received_, m_admitted_);
+      profile::add_first_span(span, "admission_wait", admission_wait_us);
+      wait_us += admission_wait_us;
+      span->set_duration_us(span->duration_us() + wait_us);
+    }
+  }
+
+  UnaryCall(AsyncIndexServer *server, ServerCompletionQueue *cq,
+            RequestMethod request_method, SyncMethod sync_method)
+      : m_server_(server), m_cq_(cq), m_request_method_(request_method),
+        m_sync_method_(sync_method), m_responder_(&m_context_),
+        m_responded_(false) {
+    (m_server_->m_async_service_.*m_request_method_)(
+        &m_context_, &m_request_, &m_responder_, m_cq_, m_cq_, this);
+  }
+
+  AsyncIndexServer *m_server_;
+
+  ServerCompletionQueue *m_cq_;
+
+  RequestMethod m_request_method_;
+
+  SyncMethod m_sync_method_;
+
+  ServerContext m_context_;
+
+  Request m_request_;
+
+  Response m_response_;
+
+  ServerAsyncResponseWriter<Response> m_responder_;
+
+  // Whether the response was sent, so the next completion ends the call.
+  bool m_responded_;
+
+  // When a profiled search was received, admitted, and picked up by a
+  // compute thread. Left unset for other calls, and the last when the search
+  // handler serves the search instead of the compute pool.
+  profile::Clock::time_point m_received_;
+  profile::Clock::time_point m_admitted_;
+  profile::Clock::time_point m_dispatched_;
+};
+
+AsyncIndexServer::AsyncIndexServer(IndexService::Service *service,
+                                   const AsyncServerConfig &config,
+                                   AsyncSearchHandler search_handler,
+                                   metrics::Registry *metrics)
+    : m_service_(service), m_config_(config),
+      m_search_handler_(std::move(search_handler)),
+      m_async_service_(service),
+      m_compute_pool_(std::vector<std::vector<int>>(config.compute_threads,
+                                                    config.compute_cpus)),
+      m_search_admission_(config.search_admission, metrics),
+      m_next_worker_(0), m_num_active_calls_(0), m_shutting_down_(false),
+      m_shut_down_(false) {}
+
+AsyncIndexServer::~AsyncIndexServer() { shutdown(); }
+
+void AsyncIndexServer::register_with(ServerBuilder *builder) {
+  builder->RegisterService(&m_async_service_);
+  for (int i = 0; i < m_config_.num_cqs; i++)
+    m_cqs_.push_back(builder->AddCompletionQueue());
+}
+
+void AsyncIndexServer::start() {
+  for (int i = 0; i < m_cqs_.size(); i++) {
+    request_calls(m_cqs_[i].get());
+    m_pollers_.emplace_back(&AsyncIndexServer::poll, this, i);
+  }
+}
+
+void AsyncIndexServer::shutdown() {
+  {
+    std::unique_lock<std::mutex> lock(m_mutex_);
+    if (m_shut_down_)
+      return;
+
+    m_shutting_down_ = true;
+    m_cv_.wait(lock, [this] { return m_num_active_calls_ == 0; });
+  }
+
+  for (const std::unique_ptr<ServerCompletionQueue> &cq : m_cqs_)
+    cq->Shutdown();
+  for (std::thread &poller : m_pollers_)
+    poller.join();
+
+  // Note: Drain the queues in case `start` was never called, since a
+  // completion queue must be drained before it's destroyed.
+  for (const std::unique_ptr<ServerCompletionQueue> &cq : m_cqs_) {
+    void *tag;
+    bool ok;
+    while (cq->Next(&tag, &ok))
+      static_cast<Call *>(tag)->proceed(false);
+  }
+
+  const std::lock_guard<std::mutex> _(m_mutex_);
+  m_shut_down_ = true;
+}
+
+void AsyncIndexServer::request_calls(ServerCompletionQueue *cq) {
+  UnaryCall<DescribeRequest, DescribeResponse>::request(
+      this, cq, &Service::RequestDescribe, &IndexService::Service::Describe);
+  UnaryCall<InsertRequest, InsertResponse>::request(
+      this, cq, &Service::RequestInsert, &IndexService::Service::Insert);
+  UnaryCall<UpsertRequest, UpsertResponse>::request(
+      this, cq, &Service::RequestUpsert, &IndexService::Service::Upsert);
+  UnaryCall<SearchRequest, SearchResponse>::request(
+      this, cq, &Service::RequestSearch, &IndexService::Service::Search);
+  UnaryCall<RemoveRequest, RemoveResponse>::request(
+      this, cq, &Service::RequestRemove, &IndexService::Service::Remove);
+  UnaryCall<AddShardRequest, AddShardResponse>::request(
+      this, cq, &Service::RequestAddShard, &IndexService::Service::AddShard);
+  UnaryCall<RebalanceRequest, RebalanceResponse>::request(
+      this, cq, &Service::RequestRebalance,
+      &IndexService::Service::Rebalance);
+  UnaryCall<RebuildRequest, RebuildResponse>::request(
+      this, cq, &Service::RequestRebuild, &IndexService::Service::Rebuild);
+  UnaryCall<CreateCollectionRequest, CreateCollectionResponse>::request(
+      this, cq, &Service::RequestCreateCollection,
+      &IndexService::Service::CreateCollection);
+  UnaryCall<DropCollectionRequest, DropCollectionResponse>::request(
+      this, cq, &Service::RequestDropCollection,
+      &IndexService::Service::DropCollection);
+  UnaryCall<ListCollectionsRequest, ListCollectionsResponse>::request(
+      this, cq, &Service::RequestListCollections,
+      &IndexService::Service::ListCollections);
+}
+
+int AsyncIndexServer::begin_call() {
+  const std::lock_guard<std::mutex> _(m_mutex_);
+  if (m_shutting_down_)
+    return 0;
+
+  return ++m_num_active_calls_;
+}
+
+void AsyncIndexServer::end_call() {
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    m_num_active_calls_--;
+  }
+  m_cv_.notify_all();
+}
+
+void AsyncIndexServer::dispatch(std::function<Status()> handler, Done done) {
+  const int worker_idx = m_next_worker_++ % m_compute_pool_.size();
+  m_compute_pool_.submit(
+      worker_idx, [handler = std::move(handler), done = std::move(done)] {
+        done(handler());
+      });
+}
+
+void AsyncIndexServer::poll(int cq_idx) {
+  if (!m_config_.poller_cpus.empty())
+    executor::pin_current_thread(
+        {m_config_.poller_cpus[cq_idx % m_config_.poller_cpus.size()]});
+
+  void *tag;
+  bool ok;
+  while (m_cqs_[cq_idx]->Next(&tag, &ok))
+    static_cast<Call *>(tag)->proceed(ok);
+}
+
+} // namespace index_service::async
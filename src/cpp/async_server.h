@@ -0,0 +1,204 @@
+#pragma once
+
+#include <grpcpp/completion_queue.h>
+#include <grpcpp/server_builder.h>
+#include <grpcpp/server_context.h>
+#include <grpcpp/support/sync_stream.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "src/cpp/admission.h"
+#include "src/cpp/metrics.h"
+#include "src/cpp/thread_pool.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+namespace index_service::async {
+
+struct AsyncServerConfig {
+  // The number of completion queues, each polled by its own thread.
+  int num_cqs = 1;
+
+  // The CPUs to pin polling threads to. The poller of queue `i` is pinned to
+  // `poller_cpus[i % poller_cpus.size()]`. Pollers aren't pinned if empty.
+  std::vector<int> poller_cpus;
+
+  // The number of threads that run request handlers, e.g. `faiss` searches.
+  int compute_threads = 1;
+
+  // The CPUs to pin compute threads to. Every compute thread may run on all
+  // of them, since OpenMP threads started by a search inherit the affinity
+  // of the thread that started them. Compute threads aren't pinned if empty.
+  std::vector<int> compute_cpus;
+
+  // The number of requests that may be handled or waiting for a compute
+  // thread at once. Further requests fail with `RESOURCE_EXHAUSTED`.
+  // Unbounded if non-positive.
+  int max_pending_calls = 0;
+
+  // Bounds the searches running at once, with a priority queue and CoDel
+  // shedding for the rest. Other requests aren't queued.
+  admission::AdmissionConfig search_admission;
+};
+
+// Parses the `--num_cqs`, `--poller_cpus` and `--compute_cpus` style flags
+// shared by the service binaries into a config. CPU lists use the Linux
+// format, e.g. "0-3,8".
+absl::StatusOr<AsyncServerConfig>
+make_async_server_config(int num_cqs, const std::string &poller_cpus,
+                         int compute_threads, const std::string &compute_cpus,
+                         int max_pending_calls);
+
+// Completes a request handled asynchronously with its final status. May be
+// called from any thread, but only once.
+using Done = std::function<void(grpc::Status)>;
+
+// Handles searches without blocking a thread for their duration, e.g. by
+// fanning out to shards with asynchronous calls.
+using AsyncSearchHandler = std::function<void(
+    grpc::ServerContext *context,
+    const index_service::SearchRequest *search_request,
+    index_service::SearchResponse *search_response, Done done)>;
+
+// Serves an `IndexService` implementation through gRPC's asynchronous API.
+//
+// Requests are received on `num_cqs` completion queues, each polled by a
+// (optionally pinned) thread that only moves requests along. Handlers run
+// on a separate, fixed-size compute pool, so a slow handler never stops
+// requests from being received, and the number of threads doing `faiss`
+// work doesn't grow with the number of requests.
+//
+// Every unary RPC is dispatched to the compute pool, which calls the
+// service's synchronous method. Searches can instead be served by an
+// `AsyncSearchHandler`, which completes them from whatever thread its work
+// finishes on. Either way, searches first pass through an admission queue,
+// so overload sheds searches rather than growing their latency. Searches that
+// ask for a profile get the time they waited for admission and for a compute
+// thread added to it. The streaming `Export` RPC keeps using gRPC's
+// synchronous threads.
+class AsyncIndexServer {
+public:
+  // `service` must outlive this server. Admission metrics are exported to
+  // `metrics`, if set, e.g. the service's registry.
+  AsyncIndexServer(index_service::IndexService::Service *service,
+                   const AsyncServerConfig &config,
+                   AsyncSearchHandler search_handler = nullptr,
+                   metrics::Registry *metrics = nullptr);
+
+  AsyncIndexServer(const AsyncIndexServer &) = delete;
+  AsyncIndexServer &operator=(const AsyncIndexServer &) = delete;
+
+  // Calls `shutdown` if it wasn't called yet.
+  ~AsyncIndexServer();
+
+  // Registers the service and its completion queues with `builder`. Must be
+  // called before the server is built.
+  void register_with(grpc::ServerBuilder *builder);
+
+  // Starts accepting requests. Must be called after the server is built.
+  void start();
+
+  // Waits for active calls to complete, then shuts down and drains the
+  // completion queues and joins the polling threads. Must be called after
+  // the gRPC server is shut down but before it's destroyed, since calls
+  // still waiting in the queues refer to it.
+  void shutdown();
+
+private:
+  using IndexService = index_service::IndexService;
+
+  // Marks every unary method as asynchronous, leaving the streaming `Export`
+  // synchronous.
+  using AsyncCollectionService =
+      IndexService::WithAsyncMethod_CreateCollection<
+          IndexService::WithAsyncMethod_DropCollection<
+              IndexService::WithAsyncMethod_ListCollections<
+                  IndexService::Service>>>;
+  using AsyncUnaryService = IndexService::WithAsyncMethod_Describe<
+      IndexService::WithAsyncMethod_Insert<
+          IndexService::WithAsyncMethod_Upsert<
+              IndexService::WithAsyncMethod_Search<
+                  IndexService::WithAsyncMethod_Remove<
+                      IndexService::WithAsyncMethod_AddShard<
+                          IndexService::WithAsyncMethod_Rebalance<
+                              IndexService::WithAsyncMethod_Rebuild<
+                                  AsyncCollectionService>>>>>>>>;
+
+  // Forwards the synchronous `Export` RPC to the wrapped service.
+  class Service final : public AsyncUnaryService {
+  public:
+    explicit Service(IndexService::Service *service) : m_service_(service) {}
+
+    grpc::Status
+    Export(grpc::ServerContext *context,
+           const index_service::ExportRequest *export_request,
+           grpc::ServerWriter<index_service::ExportResponse> *writer) override {
+      return m_service_->Export(context, export_request, writer);
+    }
+
+  private:
+    IndexService::Service *m_service_;
+  };
+
+  // The state of a call, used as its completion queue tag.
+  class Call;
+  template <typename Request, typename Response> class UnaryCall;
+
+  // Starts waiting for the first call of every asynchronous method on `cq`.
+  void request_calls(grpc::ServerCompletionQueue *cq);
+
+  // Counts a call as active and returns the number of active calls. Returns
+  // 0, without counting it, if the server is shutting down, since the
+  // completion queues may then no longer take new operations.
+  int begin_call();
+
+  // Counts an active call as complete, once its final status was sent.
+  void end_call();
+
+  // Runs `handler` on the next compute thread and completes the call with
+  // its status.
+  void dispatch(std::function<grpc::Status()> handler, Done done);
+
+  // Polls `cq` until it's shut down.
+  void poll(int cq_idx);
+
+  index_service::IndexService::Service *m_service_;
+
+  AsyncServerConfig m_config_;
+
+  AsyncSearchHandler m_search_handler_;
+
+  Service m_async_service_;
+
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> m_cqs_;
+
+  std::vector<std::thread> m_pollers_;
+
+  executor::ThreadPool m_compute_pool_;
+
+  admission::AdmissionQueue m_search_admission_;
+
+  // Used to spread handlers round robin across compute threads.
+  std::atomic<unsigned> m_next_worker_;
+
+  // Guards `m_num_active_calls_`, `m_shutting_down_` and `m_shut_down_`.
+  std::mutex m_mutex_;
+  std::condition_variable m_cv_;
+
+  // The number of calls being handled or waiting for a compute thread.
+  int m_num_active_calls_;
+
+  bool m_shutting_down_;
+
+  // Whether `shutdown` completed.
+  bool m_shut_down_;
+};
+
+} // namespace index_service::async
@@ -0,0 +1,303 @@
+#include "src/cpp/async_server.h"
+
+#include <grpcpp/server_builder.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "absl/synchronization/notification.h"
+#include "src/cpp/test_server.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+using grpc::ClientContext;
+using grpc::ServerContext;
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::IndexService;
+using index_service::ProfileSpan;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::async::AsyncIndexServer;
+using index_service::async::AsyncSearchHandler;
+using index_service::async::AsyncServerConfig;
+using index_service::async::Done;
+using index_service::async::make_async_server_config;
+
+namespace {
+
+// Describes itself with its dimensions, and searches return a neighbor with
+// the request's `k` as its id, and a `search` profile if asked for one.
+// Searches block until `unblock` is notified, if set.
+class FakeService final : public IndexService::Service {
+public:
+  Status Describe(ServerContext *context,
+                  const DescribeRequest *describe_request,
+                  DescribeResponse *describe_response) override {
+    describe_response->set_dimensions(3);
+    return Status::OK;
+  }
+
+  Status Search(ServerContext *context, const SearchRequest *search_request,
+                SearchResponse *search_response) override {
+    if (!searching.HasBeenNotified())
+      searching.Notify();
+    if (unblock)
+      unblock->WaitForNotification();
+
+    search_response->add_neighbors()->set_id(search_request->k());
+    if (search_request->profile()) {
+      search_response->mutable_profile()->set_name("search");
+      search_response->mutable_profile()->add_children()->set_name(
+          "faiss_search");
+    }
+    return Status::OK;
+  }
+
+  absl::Notification searching;
+  absl::Notification *unblock = nullptr;
+};
+
+// Serves `service` through an `AsyncIndexServer` on a local port.
+class TestServer {
+public:
+  TestServer(IndexService::Service *service, const AsyncServerConfig &config,
+             AsyncSearchHandler search_handler = nullptr)
+      : m_async_server_(service, config, std::move(search_handler)),
+        m_server_([this](grpc::ServerBuilder *builder) {
+          m_async_server_.register_with(builder);
+        }) {
+    m_async_server_.start();
+    stub = m_server_.stub();
+  }
+
+  ~TestServer() {
+    m_server_.shutdown();
+    m_async_server_.shutdown();
+  }
+
+  std::unique_ptr<IndexService::Stub> stub;
+
+private:
+  AsyncIndexServer m_async_server_;
+  test_server::LocalServer m_server_;
+};
+
+AsyncServerConfig make_config(int num_cqs, int compute_threads,
+                              int max_pending_calls = 0) {
+  AsyncServerConfig config;
+  config.num_cqs = num_cqs;
+  config.compute_threads = compute_threads;
+  config.max_pending_calls = max_pending_calls;
+  return config;
+}
+
+} // namespace
+
+TEST(MakeAsyncServerConfigTest, ParsesCpuLists) {
+  auto config = make_async_server_config(2, "0-1", 4, "2-3,5", 16);
+  ASSERT_TRUE(config.ok());
+  EXPECT_EQ(config->num_cqs, 2);
+  EXPECT_EQ(config->poller_cpus, std::vector<int>({0, 1}));
+  EXPECT_EQ(config->compute_threads, 4);
+  EXPECT_EQ(config->compute_cpus, std::vector<int>({2, 3, 5}));
+  EXPECT_EQ(config->max_pending_calls, 16);
+}
+
+TEST(MakeAsyncServerConfigTest, Invalid) {
+  EXPECT_FALSE(make_async_server_config(0, "", 1, "", 0).ok());
+  EXPECT_FALSE(make_async_server_config(1, "", 0, "", 0).ok());
+  EXPECT_FALSE(make_async_server_config(1, "x", 1, "", 0).ok());
+}
+
+TEST(AsyncIndexServerTest, ServesSynchronousMethods) {
+  FakeService service;
+  TestServer server(&service, make_config(2, 2));
+
+  for (int i = 0; i < 10; i++) {
+    ClientContext context;
+    DescribeResponse describe_response;
+    ASSERT_TRUE(
+        server.stub->Describe(&context, DescribeRequest(), &describe_response)
+            .ok());
+    EXPECT_EQ(describe_response.dimensions(), 3);
+  }
+
+  ClientContext context;
+  SearchRequest search_request;
+  search_request.set_k(7);
+  SearchResponse search_response;
+  ASSERT_TRUE(
+      server.stub->Search(&context, search_request, &search_response).ok());
+  ASSERT_EQ(search_response.neighbors_size(), 1);
+  EXPECT_EQ(search_response.neighbors(0).id(), 7);
+}
+
+TEST(AsyncIndexServerTest, CompletesSearchesFromOtherThreads) {
+  FakeService service;
+  TestServer server(&service, make_config(1, 1),
+                    [](ServerContext *context,
+                       const SearchRequest *search_request,
+                       SearchResponse *search_response, Done done) {
+                      std::thread([search_request, search_response, done] {
+                        search_response->add_neighbors()->set_id(
+                            search_request->k() + 1);
+                        done(Status::OK);
+                      }).detach();
+                    });
+
+  ClientContext context;
+  SearchRequest search_request;
+  search_request.set_k(7);
+  SearchResponse search_response;
+  ASSERT_TRUE(
+      server.stub->Search(&context, search_request, &search_response).ok());
+  ASSERT_EQ(search_response.neighbors_size(), 1);
+  EXPECT_EQ(search_response.neighbors(0).id(), 8);
+}
+
+TEST(AsyncIndexServerTest, RejectsCallsOverLimit) {
+  FakeService service;
+  absl::Notification unblock;
+  service.unblock = &unblock;
+  TestServer server(&service, make_config(1, 1, /*max_pending_calls=*/1));
+
+  // Hold the only pending call slot with a blocked search.
+  Status blocked_status;
+  std::thread blocked([&] {
+    ClientContext context;
+    SearchResponse search_response;
+    blocked_status =
+        server.stub->Search(&context, SearchRequest(), &search_response);
+  });
+  service.searching.WaitForNotification();
+
+  ClientContext context;
+  DescribeResponse describe_response;
+  EXPECT_EQ(
+      server.stub->Describe(&context, DescribeRequest(), &describe_response)
+          .error_code(),
+      StatusCode::RESOURCE_EXHAUSTED);
+
+  unblock.Notify();
+  blocked.join();
+  EXPECT_TRUE(blocked_status.ok());
+}
+
+TEST(AsyncIndexServerTest, RejectsSearchesBeyondAdmissionQueue) {
+  FakeService service;
+  absl::Notification unblock;
+  service.unblock = &unblock;
+  AsyncServerConfig config = make_config(1, 2);
+  config.search_admission.max_in_flight = 1;
+  config.search_admission.max_queued = 0;
+  TestServer server(&service, config);
+
+  Status blocked_status;
+  std::thread blocked([&] {
+    ClientContext context;
+    SearchResponse search_response;
+    blocked_status =
+        server.stub->Search(&context, SearchRequest(), &search_response);
+  });
+  service.searching.WaitForNotification();
+
+  // Searches are bounded, but other requests aren't.
+  {
+    ClientContext context;
+    SearchResponse search_response;
+    EXPECT_EQ(
+        server.stub->Search(&context, SearchRequest(), &search_response)
+            .error_code(),
+        StatusCode::RESOURCE_EXHAUSTED);
+  }
+  {
+    ClientContext context;
+    DescribeResponse describe_response;
+    EXPECT_TRUE(
+        server.stub->Describe(&context, DescribeRequest(), &describe_response)
+            .ok());
+  }
+
+  unblock.Notify();
+  blocked.join();
+  EXPECT_TRUE(blocked_status.ok());
+}
+
+TEST(AsyncIndexServerTest, ProfilesTheWaitBeforeSearches) {
+  FakeService service;
+  absl::Notification unblock;
+  service.unblock = &unblock;
+  AsyncServerConfig config = make_config(1, 2);
+  config.search_admission.max_in_flight = 1;
+  config.search_admission.codel_target = std::chrono::seconds(10);
+  TestServer server(&service, config);
+
+  std::thread blocked([&] {
+    ClientContext context;
+    SearchResponse search_response;
+    server.stub->Search(&context, SearchRequest(), &search_response);
+  });
+  service.searching.WaitForNotification();
+
+  // The profiled search waits for the blocked one to leave the admission
+  // queue.
+  SearchResponse search_response;
+  std::thread profiled([&] {
+    ClientContext context;
+    SearchRequest search_request;
+    search_request.set_profile(true);
+    EXPECT_TRUE(
+        server.stub->Search(&context, search_request, &search_response).ok());
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  unblock.Notify();
+  blocked.join();
+  profiled.join();
+
+  const ProfileSpan &profile = search_response.profile();
+  EXPECT_EQ(profile.name(), "search");
+  ASSERT_EQ(profile.children_size(), 3);
+  EXPECT_EQ(profile.children(0).name(), "admission_wait");
+  EXPECT_GE(profile.children(0).duration_us(), 50000);
+  EXPECT_EQ(profile.children(1).name(), "dispatch_wait");
+  EXPECT_EQ(profile.children(2).name(), "faiss_search");
+  EXPECT_GE(profile.duration_us(), profile.children(0).duration_us() +
+                                       profile.children(1).duration_us());
+
+  // Searches that don't ask for a profile don't get one.
+  ClientContext context;
+  ASSERT_TRUE(
+      server.stub->Search(&context, SearchRequest(), &search_response).ok());
+  EXPECT_FALSE(search_response.has_profile());
+}
+
+TEST(AsyncIndexServerTest, ProfilesTheAdmissionWaitOfAsyncSearches) {
+  FakeService service;
+  TestServer server(&service, make_config(1, 1),
+                    [](ServerContext *context,
+                       const SearchRequest *search_request,
+                       SearchResponse *search_response, Done done) {
+                      search_response->mutable_profile()->set_name(
+                          "router_search");
+                      done(Status::OK);
+                    });
+
+  ClientContext context;
+  SearchRequest search_request;
+  search_request.set_profile(true);
+  SearchResponse search_response;
+  ASSERT_TRUE(
+      server.stub->Search(&context, search_request, &search_response).ok());
+
+  // Searches served by the search handler don't wait for a compute thread.
+  const ProfileSpan &profile = search_response.profile();
+  EXPECT_EQ(profile.name(), "router_search");
+  ASSERT_EQ(profile.children_size(), 1);
+  EXPECT_EQ(profile.children(0).name(), "admission_wait");
+}
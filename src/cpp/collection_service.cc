@@ -0,0 +1,292 @@
+#include "src/cpp/collection_service.h"
+
+#include <absl/log/log.h>
+#include <absl/strings/str_format.h>
+#include <faiss/Index.h>
+#include <faiss/MetricType.h>
+#include <grpcpp/server_context.h>
+#include <grpcpp/support/sync_stream.h>
+
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+
+#include "src/cpp/admission.h"
+#include "src/cpp/faiss_index_service.h"
+#include "src/cpp/segmented_index.h"
+#include "src/cpp/threading.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+using faiss::MetricType;
+using grpc::ServerContext;
+using grpc::ServerWriter;
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::CreateCollectionRequest;
+using index_service::CreateCollectionResponse;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::DropCollectionRequest;
+using index_service::DropCollectionResponse;
+using index_service::ExportRequest;
+using index_service::ExportResponse;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::ListCollectionsRequest;
+using index_service::ListCollectionsResponse;
+using index_service::RebuildRequest;
+using index_service::RebuildResponse;
+using index_service::RemoveRequest;
+using index_service::RemoveResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::UpsertRequest;
+using index_service::UpsertResponse;
+using index_service::faiss::SharedResources;
+
+namespace index_service::collections {
+
+namespace {
+
+// The name of the default collection, used by requests that don't name one.
+const char kDefaultCollection[] = "";
+
+MetricType to_faiss_metric(index_service::Metric metric) {
+  return metric == index_service::METRIC_L2
+             ? MetricType::METRIC_L2
+             : MetricType::METRIC_INNER_PRODUCT;
+}
+
+} // namespace
+
+CollectionServiceImpl::CollectionServiceImpl(
+    int dimensions, const std::string &factory_string, MetricType metric_type,
+    const executor::ExecutorConfig &executor_config,
+    const std::optional<segmented::SegmentConfig> &segment_config,
+    const admission::Limits &limits)
+    : m_factory_string_(factory_string), m_executor_config_(executor_config),
+      m_segment_config_(segment_config), m_limits_(limits),
+      m_search_limiter_(executor_config.max_concurrent_queries),
+      m_memory_budget_(limits.memory_budget_bytes, &m_metrics_),
+      m_num_collections_(m_metrics_.gauge("collections")) {
+  const SharedResources shared{&m_search_limiter_, &m_memory_budget_};
+  m_collections_[kDefaultCollection] = std::make_shared<Collection>(
+      dimensions, m_factory_string_.c_str(), metric_type, m_executor_config_,
+      m_segment_config_, m_limits_, shared);
+  m_num_collections_->set(m_collections_.size());
+}
+
+Status CollectionServiceImpl::find(const std::string &name,
+                                   std::shared_ptr<Collection> *collection) {
+  const std::shared_lock<std::shared_mutex> _(m_mutex_);
+  auto it = m_collections_.find(name);
+  if (it == m_collections_.end())
+    return Status(StatusCode::NOT_FOUND,
+                  absl::StrFormat("Collection %s doesn't exist.", name));
+
+  *collection = it->second;
+  return Status::OK;
+}
+
+Status CollectionServiceImpl::Describe(ServerContext *context,
+                                       const DescribeRequest *describe_request,
+                                       DescribeResponse *describe_response) {
+  std::shared_ptr<Collection> collection;
+  Status status = find(describe_request->collection(), &collection);
+  if (!status.ok())
+    return status;
+
+  status = collection->Describe(context, describe_request, describe_response);
+  if (!status.ok())
+    return status;
+
+  const std::map<std::string, double> metrics = m_metrics_.snapshot();
+  describe_response->mutable_metrics()->insert(metrics.begin(), metrics.end());
+
+  return Status::OK;
+}
+
+Status CollectionServiceImpl::Insert(ServerContext *context,
+                                     const InsertRequest *insert_request,
+                                     InsertResponse *insert_response) {
+  std::shared_ptr<Collection> collection;
+  const Status status = find(insert_request->collection(), &collection);
+  if (!status.ok())
+    return status;
+
+  return collection->Insert(context, insert_request, insert_response);
+}
+
+Status CollectionServiceImpl::Upsert(ServerContext *context,
+                                     const UpsertRequest *upsert_request,
+                                     UpsertResponse *upsert_response) {
+  std::shared_ptr<Collection> collection;
+  const Status status = find(upsert_request->collection(), &collection);
+  if (!status.ok())
+    return status;
+
+  return collection->Upsert(context, upsert_request, upsert_response);
+}
+
+Status CollectionServiceImpl::Search(ServerContext *context,
+                                     const SearchRequest *search_request,
+                                     SearchResponse *search_response) {
+  std::shared_ptr<Collection> collection;
+  const Status status = find(search_request->collection(), &collection);
+  if (!status.ok())
+    return status;
+
+  return collection->Search(context, search_request, search_response);
+}
+
+Status CollectionServiceImpl::Export(ServerContext *context,
+                                     const ExportRequest *export_request,
+                                     ServerWriter<ExportResponse> *writer) {
+  std::shared_ptr<Collection> collection;
+  const Status status = find(export_request->collection(), &collection);
+  if (!status.ok())
+    return status;
+
+  return collection->Export(context, export_request, writer);
+}
+
+Status CollectionServiceImpl::Remove(ServerContext *context,
+                                     const RemoveRequest *remove_request,
+                                     RemoveResponse *remove_response) {
+  std::shared_ptr<Collection> collection;
+  const Status status = find(remove_request->collection(), &collection);
+  if (!status.ok())
+    return status;
+
+  return collection->Remove(context, remove_request, remove_response);
+}
+
+Status CollectionServiceImpl::Rebuild(ServerContext *context,
+                                      const RebuildRequest *rebuild_request,
+                                      RebuildResponse *rebuild_response) {
+  std::shared_ptr<Collection> collection;
+  const Status status = find(rebuild_request->collection(), &collection);
+  if (!status.ok())
+    return status;
+
+  return collection->Rebuild(context, rebuild_request, rebuild_response);
+}
+
+Status CollectionServiceImpl::restore(const std::string &collection_name,
+                                      std::unique_ptr<::faiss::Index> index) {
+  std::shared_ptr<Collection> collection;
+  const Status status = find(collection_name, &collection);
+  if (!status.ok())
+    return status;
+
+  return collection->restore(std::move(index));
+}
+
+Status CollectionServiceImpl::CreateCollection(
+    ServerContext *context, const CreateCollectionRequest *create_request,
+    CreateCollectionResponse *create_response) {
+  const std::string &name = create_request->name();
+  LOG(INFO) << absl::StrFormat(
+      "Received create collection request. name=%s, dimensions=%d", name,
+      create_request->dimensions());
+
+  if (name.empty())
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  "Expected a non-empty collection name.");
+  if (create_request->dimensions() == 0)
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  "Expected a positive number of dimensions.");
+
+  {
+    const std::shared_lock<std::shared_mutex> _(m_mutex_);
+    if (m_collections_.count(name))
+      return Status(StatusCode::ALREADY_EXISTS,
+                    absl::StrFormat("Collection %s already exists.", name));
+  }
+
+  const std::string factory_string = create_request->factory_string().empty()
+                                         ? m_factory_string_
+                                         : create_request->factory_string();
+
+  std::optional<segmented::SegmentConfig> segment_config;
+  if (create_request->segmented())
+    segment_config = m_segment_config_.value_or(segmented::SegmentConfig());
+
+  // Note: Create the index without holding the lock, since building a
+  // segmented index starts a thread.
+  std::shared_ptr<Collection> collection;
+  try {
+    collection = std::make_shared<Collection>(
+        create_request->dimensions(), factory_string.c_str(),
+        to_faiss_metric(create_request->metric()), m_executor_config_,
+        segment_config, m_limits_,
+        SharedResources{&m_search_limiter_, &m_memory_budget_});
+  } catch (const std::exception &e) {
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat("Failed to create %s index: %s",
+                                  factory_string, e.what()));
+  }
+
+  {
+    const std::lock_guard<std::shared_mutex> _(m_mutex_);
+    if (!m_collections_.emplace(name, std::move(collection)).second)
+      return Status(StatusCode::ALREADY_EXISTS,
+                    absl::StrFormat("Collection %s already exists.", name));
+    m_num_collections_->set(m_collections_.size());
+  }
+
+  LOG(INFO) << absl::StrFormat("Created collection %s.", name);
+
+  return Status::OK;
+}
+
+Status CollectionServiceImpl::DropCollection(
+    ServerContext *context, const DropCollectionRequest *drop_request,
+    DropCollectionResponse *drop_response) {
+  const std::string &name = drop_request->name();
+  LOG(INFO) << absl::StrFormat("Received drop collection request. name=%s",
+                               name);
+
+  if (name == kDefaultCollection)
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  "The default collection can't be dropped.");
+
+  // Note: Destroy the collection after releasing the lock, since that waits
+  // for any rebuild in progress to stop.
+  std::shared_ptr<Collection> collection;
+  {
+    const std::lock_guard<std::shared_mutex> _(m_mutex_);
+    auto it = m_collections_.find(name);
+    if (it == m_collections_.end())
+      return Status(StatusCode::NOT_FOUND,
+                    absl::StrFormat("Collection %s doesn't exist.", name));
+
+    collection = std::move(it->second);
+    m_collections_.erase(it);
+    m_num_collections_->set(m_collections_.size());
+  }
+  collection.reset();
+
+  LOG(INFO) << absl::StrFormat("Dropped collection %s.", name);
+
+  return Status::OK;
+}
+
+Status CollectionServiceImpl::ListCollections(
+    ServerContext *context, const ListCollectionsRequest *list_request,
+    ListCollectionsResponse *list_response) {
+  const std::shared_lock<std::shared_mutex> _(m_mutex_);
+  for (const auto &[name, collection] : m_collections_) {
+    if (name != kDefaultCollection)
+      list_response->add_names(name);
+  }
+
+  return Status::OK;
+}
+
+} // namespace index_service::collections
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <faiss/Index.h>
+#include <faiss/MetricType.h>
+#include <grpcpp/server_context.h>
+#include <grpcpp/support/sync_stream.h>
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+
+#include "src/cpp/admission.h"
+#include "src/cpp/faiss_index_service.h"
+#include "src/cpp/metrics.h"
+#include "src/cpp/segmented_index.h"
+#include "src/cpp/threading.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+namespace index_service::collections {
+
+// Serves any number of named indexes, called collections, from one process.
+//
+// Every request is routed to the collection named by its `collection` field,
+// or to the default collection if it's empty. The default collection is
+// created with the service and can't be dropped; others are created and
+// dropped with `CreateCollection` and `DropCollection`.
+//
+// Collections share the process's resources rather than each sizing their
+// own: searches across all collections share one set of search slots, the
+// vectors of all collections count against one memory budget, and
+// process-wide metrics (e.g. admission and memory) live in one registry,
+// reported by `Describe` alongside the collection's own metrics. A
+// collection on its own is just an index and a few locks, and doesn't start
+// any threads unless it's segmented, so many small collections pack into
+// one process cheaply.
+class CollectionServiceImpl final
+    : public index_service::IndexService::Service {
+public:
+  // Creates the default collection with `dimensions`. New collections use
+  // `factory_string` unless their request sets one, and `segment_config`
+  // if their request asks for segments. `limits.memory_budget_bytes` bounds
+  // the vectors of all collections together.
+  CollectionServiceImpl(
+      int dimensions, const std::string &factory_string,
+      ::faiss::MetricType metric_type,
+      const executor::ExecutorConfig &executor_config,
+      const std::optional<segmented::SegmentConfig> &segment_config,
+      const admission::Limits &limits);
+
+  grpc::Status Describe(grpc::ServerContext *context,
+                        const index_service::DescribeRequest *describe_request,
+                        index_service::DescribeResponse *describe_response);
+
+  grpc::Status Insert(grpc::ServerContext *context,
+                      const index_service::InsertRequest *insert_request,
+                      index_service::InsertResponse *insert_response);
+
+  grpc::Status Upsert(grpc::ServerContext *context,
+                      const index_service::UpsertRequest *upsert_request,
+                      index_service::UpsertResponse *upsert_response);
+
+  grpc::Status Search(grpc::ServerContext *context,
+                      const index_service::SearchRequest *search_request,
+                      index_service::SearchResponse *search_response);
+
+  grpc::Status
+  Export(grpc::ServerContext *context,
+         const index_service::ExportRequest *export_request,
+         grpc::ServerWriter<index_service::ExportResponse> *writer);
+
+  grpc::Status Remove(grpc::ServerContext *context,
+                      const index_service::RemoveRequest *remove_request,
+                      index_service::RemoveResponse *remove_response);
+
+  grpc::Status Rebuild(grpc::ServerContext *context,
+                       const index_service::RebuildRequest *rebuild_request,
+                       index_service::RebuildResponse *rebuild_response);
+
+  grpc::Status CreateCollection(
+      grpc::ServerContext *context,
+      const index_service::CreateCollectionRequest *create_request,
+      index_service::CreateCollectionResponse *create_response);
+
+  // Requests already routed to the collection still complete; its memory is
+  // released once the last of them does.
+  grpc::Status
+  DropCollection(grpc::ServerContext *context,
+                 const index_service::DropCollectionRequest *drop_request,
+                 index_service::DropCollectionResponse *drop_response);
+
+  grpc::Status
+  ListCollections(grpc::ServerContext *context,
+                  const index_service::ListCollectionsRequest *list_request,
+                  index_service::ListCollectionsResponse *list_response);
+
+  // Replaces the empty collection named `collection` with `index`, e.g. a
+  // snapshot built offline. See `FaissIndexServiceImpl::restore`.
+  grpc::Status restore(const std::string &collection,
+                       std::unique_ptr<::faiss::Index> index);
+
+  // The registry of process-wide metrics, e.g. for the admission queue.
+  metrics::Registry *metrics() { return &m_metrics_; }
+
+private:
+  using Collection = index_service::faiss::FaissIndexServiceImpl;
+
+  // Finds the collection named `name`, or returns `NOT_FOUND`.
+  grpc::Status find(const std::string &name,
+                    std::shared_ptr<Collection> *collection);
+
+  std::string m_factory_string_;
+
+  executor::ExecutorConfig m_executor_config_;
+
+  std::optional<segmented::SegmentConfig> m_segment_config_;
+
+  admission::Limits m_limits_;
+
+  metrics::Registry m_metrics_;
+
+  // Shared by every collection.
+  executor::ConcurrencyLimiter m_search_limiter_;
+
+  // Shared by every collection.
+  admission::MemoryBudget m_memory_budget_;
+
+  metrics::Gauge *m_num_collections_;
+
+  // Guards `m_collections_`. Only creating and dropping collections hold it
+  // exclusively, and requests only hold it to find their collection.
+  std::shared_mutex m_mutex_;
+
+  // Collections by name, including the default collection named "".
+  // Note: Declared last, so collections are destroyed before the resources
+  // they share.
+  std::map<std::string, std::shared_ptr<Collection>> m_collections_;
+};
+
+} // namespace index_service::collections
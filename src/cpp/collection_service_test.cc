@@ -0,0 +1,187 @@
+#include "src/cpp/collection_service.h"
+
+#include <faiss/MetricType.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "src/cpp/admission.h"
+#include "src/cpp/threading.h"
+#include "src/proto/index_service.pb.h"
+
+using faiss::MetricType;
+using grpc::StatusCode;
+using index_service::CreateCollectionRequest;
+using index_service::CreateCollectionResponse;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::DropCollectionRequest;
+using index_service::DropCollectionResponse;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::ListCollectionsRequest;
+using index_service::ListCollectionsResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::collections::CollectionServiceImpl;
+
+using testing::ElementsAre;
+
+namespace {
+
+CollectionServiceImpl make_service(int64_t memory_budget_bytes = 0) {
+  admission::Limits limits;
+  limits.memory_budget_bytes = memory_budget_bytes;
+  return CollectionServiceImpl(2, "IDMap,Flat",
+                               MetricType::METRIC_INNER_PRODUCT, {},
+                               std::nullopt, limits);
+}
+
+grpc::StatusCode create(CollectionServiceImpl *service, const std::string &name,
+                        int dimensions) {
+  CreateCollectionRequest request;
+  request.set_name(name);
+  request.set_dimensions(dimensions);
+  CreateCollectionResponse response;
+  return service->CreateCollection(nullptr, &request, &response).error_code();
+}
+
+// Inserts a vector of `dimensions` ones with `id` into `collection`.
+grpc::StatusCode insert(CollectionServiceImpl *service,
+                        const std::string &collection, int id,
+                        int dimensions) {
+  InsertRequest request;
+  request.set_collection(collection);
+  auto *vector = request.add_vectors();
+  vector->set_id(id);
+  for (int i = 0; i < dimensions; i++)
+    vector->add_raw(1);
+  InsertResponse response;
+  return service->Insert(nullptr, &request, &response).error_code();
+}
+
+DescribeResponse describe(CollectionServiceImpl *service,
+                          const std::string &collection) {
+  DescribeRequest request;
+  request.set_collection(collection);
+  DescribeResponse response;
+  EXPECT_TRUE(service->Describe(nullptr, &request, &response).ok());
+  return response;
+}
+
+std::vector<std::string> list(CollectionServiceImpl *service) {
+  ListCollectionsRequest request;
+  ListCollectionsResponse response;
+  EXPECT_TRUE(service->ListCollections(nullptr, &request, &response).ok());
+  return {response.names().begin(), response.names().end()};
+}
+
+} // namespace
+
+TEST(CollectionServiceTest, RoutesRequestsToCollections) {
+  CollectionServiceImpl service = make_service();
+  ASSERT_EQ(create(&service, "small", 3), StatusCode::OK);
+
+  EXPECT_EQ(insert(&service, "", 1, 2), StatusCode::OK);
+  EXPECT_EQ(insert(&service, "small", 1, 3), StatusCode::OK);
+  EXPECT_EQ(insert(&service, "small", 2, 3), StatusCode::OK);
+
+  // Each collection checks its own dimensions.
+  EXPECT_EQ(insert(&service, "small", 3, 2), StatusCode::INVALID_ARGUMENT);
+
+  EXPECT_EQ(describe(&service, "").num_vectors(), 1);
+  EXPECT_EQ(describe(&service, "small").dimensions(), 3);
+  EXPECT_EQ(describe(&service, "small").num_vectors(), 2);
+
+  SearchRequest search_request;
+  search_request.set_collection("small");
+  search_request.set_k(1);
+  for (float value : {1, 1, 1})
+    search_request.add_query_vector(value);
+  SearchResponse search_response;
+  ASSERT_TRUE(service.Search(nullptr, &search_request, &search_response).ok());
+  EXPECT_EQ(search_response.neighbors_size(), 1);
+
+  search_request.set_collection("missing");
+  EXPECT_EQ(service.Search(nullptr, &search_request, &search_response)
+                .error_code(),
+            StatusCode::NOT_FOUND);
+}
+
+TEST(CollectionServiceTest, ProfilesSearchesThatAskForIt) {
+  CollectionServiceImpl service = make_service();
+  ASSERT_EQ(insert(&service, "", 1, 2), StatusCode::OK);
+  ASSERT_EQ(insert(&service, "", 2, 2), StatusCode::OK);
+
+  SearchRequest search_request;
+  search_request.set_k(1);
+  for (float value : {1, 1})
+    search_request.add_query_vector(value);
+  SearchResponse search_response;
+  ASSERT_TRUE(service.Search(nullptr, &search_request, &search_response).ok());
+  EXPECT_FALSE(search_response.has_profile());
+
+  search_request.set_profile(true);
+  search_response.Clear();
+  ASSERT_TRUE(service.Search(nullptr, &search_request, &search_response).ok());
+  EXPECT_EQ(search_response.neighbors_size(), 1);
+
+  const index_service::ProfileSpan &profile = search_response.profile();
+  EXPECT_EQ(profile.name(), "search");
+  ASSERT_EQ(profile.children_size(), 2);
+  EXPECT_EQ(profile.children(0).name(), "queue_wait");
+  EXPECT_EQ(profile.children(1).name(), "faiss_search");
+  EXPECT_EQ(profile.children(1).stats().at("vectors_indexed"), 2);
+  EXPECT_EQ(profile.children(1).stats().at("vectors_scanned"), 2);
+  EXPECT_GE(profile.duration_us(), profile.children(1).duration_us());
+}
+
+TEST(CollectionServiceTest, CreatesListsAndDropsCollections) {
+  CollectionServiceImpl service = make_service();
+  EXPECT_EQ(create(&service, "b", 4), StatusCode::OK);
+  EXPECT_EQ(create(&service, "a", 4), StatusCode::OK);
+  EXPECT_EQ(create(&service, "a", 4), StatusCode::ALREADY_EXISTS);
+  EXPECT_EQ(create(&service, "", 4), StatusCode::INVALID_ARGUMENT);
+  EXPECT_EQ(create(&service, "c", 0), StatusCode::INVALID_ARGUMENT);
+  EXPECT_THAT(list(&service), ElementsAre("a", "b"));
+  EXPECT_EQ(describe(&service, "").metrics().at("collections"), 3);
+
+  DropCollectionRequest drop_request;
+  DropCollectionResponse drop_response;
+  drop_request.set_name("a");
+  EXPECT_TRUE(service.DropCollection(nullptr, &drop_request, &drop_response)
+                  .ok());
+  EXPECT_EQ(service.DropCollection(nullptr, &drop_request, &drop_response)
+                .error_code(),
+            StatusCode::NOT_FOUND);
+  drop_request.set_name("");
+  EXPECT_EQ(service.DropCollection(nullptr, &drop_request, &drop_response)
+                .error_code(),
+            StatusCode::INVALID_ARGUMENT);
+
+  EXPECT_THAT(list(&service), ElementsAre("b"));
+}
+
+TEST(CollectionServiceTest, SharesMemoryBudgetAcrossCollections) {
+  // Room for two 2-dimensional vectors.
+  CollectionServiceImpl service =
+      make_service(2 * admission::estimated_vector_bytes(2));
+  ASSERT_EQ(create(&service, "other", 2), StatusCode::OK);
+
+  EXPECT_EQ(insert(&service, "", 1, 2), StatusCode::OK);
+  EXPECT_EQ(insert(&service, "other", 1, 2), StatusCode::OK);
+  EXPECT_EQ(insert(&service, "", 2, 2), StatusCode::RESOURCE_EXHAUSTED);
+  EXPECT_EQ(describe(&service, "").metrics().at("memory_budget_used_bytes"),
+            2 * admission::estimated_vector_bytes(2));
+
+  // Dropping a collection returns its memory to the budget.
+  DropCollectionRequest drop_request;
+  drop_request.set_name("other");
+  DropCollectionResponse drop_response;
+  ASSERT_TRUE(service.DropCollection(nullptr, &drop_request, &drop_response)
+                  .ok());
+  EXPECT_EQ(insert(&service, "", 2, 2), StatusCode::OK);
+}
@@ -0,0 +1,388 @@
+#include "src/cpp/dataset.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "src/cpp/algo.h"
+
+namespace dataset {
+
+namespace {
+
+// Parses the header of a 2-d, C-ordered, little-endian float32 `.npy` file,
+// e.g. `{'descr': '<f4', 'fortran_order': False, 'shape': (1000, 128), }`.
+// The format is documented at
+// https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html.
+absl::Status parse_npy_header(const std::string &header, int64_t *num_vectors,
+                              int *dimensions) {
+  if (!absl::StrContains(header, "'descr': '<f4'"))
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Only little-endian float32 arrays are supported. header=%s", header));
+
+  if (!absl::StrContains(header, "'fortran_order': False"))
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Only C-ordered arrays are supported. header=%s", header));
+
+  // Parse the shape tuple, e.g. `'shape': (1000, 128), `.
+  size_t shape_start = header.find("'shape': (");
+  size_t shape_end = header.find(')', shape_start);
+  if (shape_start == std::string::npos || shape_end == std::string::npos)
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Could not find shape in header. header=%s", header));
+
+  shape_start += std::strlen("'shape': (");
+  std::vector<int64_t> shape;
+  for (absl::string_view dim :
+       absl::StrSplit(header.substr(shape_start, shape_end - shape_start), ',',
+                      absl::SkipWhitespace())) {
+    int64_t value;
+    if (!absl::SimpleAtoi(absl::StripAsciiWhitespace(dim), &value))
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Could not parse shape. header=%s", header));
+    shape.push_back(value);
+  }
+
+  if (shape.size() != 2)
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Only 2-d arrays are supported. Array dimensions: (%d).",
+        shape.size()));
+
+  *num_vectors = shape[0];
+  *dimensions = (int)shape[1];
+  return absl::OkStatus();
+}
+
+} // namespace
+
+Dataset generate_synthetic(int num_vectors, int dimensions, uint64_t seed) {
+  Dataset dataset;
+  dataset.num_vectors = num_vectors;
+  dataset.dimensions = dimensions;
+  dataset.data.resize((size_t)num_vectors * dimensions);
+
+  std::mt19937_64 generator(seed);
+  std::normal_distribution<float> distribution;
+
+  for (int i = 0; i < num_vectors; i++) {
+    float *v = dataset.data.data() + (size_t)i * dimensions;
+
+    float norm = 0;
+    for (int j = 0; j < dimensions; j++) {
+      v[j] = distribution(generator);
+      norm += v[j] * v[j];
+    }
+
+    norm = std::sqrt(norm);
+    for (int j = 0; j < dimensions && norm > 0; j++)
+      v[j] /= norm;
+  }
+
+  return dataset;
+}
+
+absl::StatusOr<Dataset> load_fvecs(const std::string &path, int max_vectors) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return absl::NotFoundError(absl::StrFormat("Could not open %s.", path));
+
+  Dataset dataset;
+  int32_t dimensions;
+  while ((max_vectors < 0 || dataset.num_vectors < max_vectors) &&
+         file.read(reinterpret_cast<char *>(&dimensions), sizeof(dimensions))) {
+    if (dimensions <= 0 ||
+        (dataset.dimensions && dimensions != dataset.dimensions))
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "Found vector with unexpected dimensions in %s. "
+          "Vector dimensions: (%d). Expected dimensions: (%d).",
+          path, dimensions, dataset.dimensions));
+
+    dataset.dimensions = dimensions;
+
+    size_t offset = dataset.data.size();
+    dataset.data.resize(offset + dimensions);
+    if (!file.read(reinterpret_cast<char *>(dataset.data.data() + offset),
+                   dimensions * sizeof(float)))
+      return absl::DataLossError(
+          absl::StrFormat("Found truncated vector in %s.", path));
+
+    dataset.num_vectors++;
+  }
+
+  return dataset;
+}
+
+absl::StatusOr<Dataset> load_npy(const std::string &path, int max_vectors) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return absl::NotFoundError(absl::StrFormat("Could not open %s.", path));
+
+  char magic[8];
+  if (!file.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, "\x93NUMPY", 6) != 0)
+    return absl::InvalidArgumentError(
+        absl::StrFormat("%s is not a .npy file.", path));
+
+  // Version 1.0 uses a 2-byte header length, later versions a 4-byte one.
+  const int major_version = magic[6];
+  uint32_t header_len = 0;
+  if (!file.read(reinterpret_cast<char *>(&header_len),
+                 major_version == 1 ? 2 : 4))
+    return absl::DataLossError(
+        absl::StrFormat("Found truncated header in %s.", path));
+
+  std::string header(header_len, '\0');
+  if (!file.read(header.data(), header_len))
+    return absl::DataLossError(
+        absl::StrFormat("Found truncated header in %s.", path));
+
+  int64_t num_vectors;
+  Dataset dataset;
+  const absl::Status status =
+      parse_npy_header(header, &num_vectors, &dataset.dimensions);
+  if (!status.ok())
+    return status;
+
+  dataset.num_vectors = (int)num_vectors;
+  if (max_vectors >= 0)
+    dataset.num_vectors = std::min(dataset.num_vectors, max_vectors);
+
+  dataset.data.resize((size_t)dataset.num_vectors * dataset.dimensions);
+  if (!file.read(reinterpret_cast<char *>(dataset.data.data()),
+                 dataset.data.size() * sizeof(float)))
+    return absl::DataLossError(
+        absl::StrFormat("Found truncated data in %s.", path));
+
+  return dataset;
+}
+
+absl::StatusOr<Dataset> load(const std::string &path, int max_vectors) {
+  if (absl::EndsWith(path, ".fvecs"))
+    return load_fvecs(path, max_vectors);
+
+  if (absl::EndsWith(path, ".npy"))
+    return load_npy(path, max_vectors);
+
+  return absl::InvalidArgumentError(absl::StrFormat(
+      "Unsupported dataset format. Expected .fvecs or .npy. path=%s", path));
+}
+
+absl::StatusOr<std::unique_ptr<VectorFile>>
+VectorFile::open(const std::string &path) {
+  Format format;
+  if (absl::EndsWith(path, ".fvecs"))
+    format = Format::kFvecs;
+  else if (absl::EndsWith(path, ".bvecs"))
+    format = Format::kBvecs;
+  else if (absl::EndsWith(path, ".npy"))
+    format = Format::kNpy;
+  else
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Unsupported vector file format. Expected .fvecs, .bvecs or .npy. "
+        "path=%s",
+        path));
+
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return absl::NotFoundError(absl::StrFormat("Could not open %s.", path));
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    return absl::InternalError(absl::StrFormat("Could not stat %s.", path));
+  }
+
+  const size_t size = file_stat.st_size;
+  void *data = nullptr;
+  if (size > 0) {
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return absl::InternalError(absl::StrFormat("Could not map %s.", path));
+    }
+
+    // Note: Vectors are mostly read front to back, so let the kernel read
+    // ahead aggressively.
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+
+  // Note: The mapping stays valid after the file is closed.
+  close(fd);
+
+  std::unique_ptr<VectorFile> file(
+      new VectorFile(path, format, static_cast<const char *>(data), size));
+  const absl::Status status = file->parse();
+  if (!status.ok())
+    return status;
+
+  return file;
+}
+
+VectorFile::VectorFile(std::string path, Format format, const char *data,
+                       size_t size)
+    : m_path_(std::move(path)), m_format_(format), m_data_(data),
+      m_size_(size), m_offset_(0), m_stride_(0), m_num_vectors_(0),
+      m_dimensions_(0) {}
+
+VectorFile::~VectorFile() {
+  if (m_data_)
+    munmap(const_cast<char *>(m_data_), m_size_);
+}
+
+absl::Status VectorFile::parse() {
+  if (m_format_ == Format::kNpy) {
+    if (m_size_ < 10 || std::memcmp(m_data_, "\x93NUMPY", 6) != 0)
+      return absl::InvalidArgumentError(
+          absl::StrFormat("%s is not a .npy file.", m_path_));
+
+    // Version 1.0 uses a 2-byte header length, later versions a 4-byte one.
+    const size_t header_len_size = m_data_[6] == 1 ? 2 : 4;
+    uint32_t header_len = 0;
+    std::memcpy(&header_len, m_data_ + 8, header_len_size);
+
+    m_offset_ = 8 + header_len_size + header_len;
+    if (m_offset_ > m_size_)
+      return absl::DataLossError(
+          absl::StrFormat("Found truncated header in %s.", m_path_));
+
+    const absl::Status status =
+        parse_npy_header(std::string(m_data_ + 8 + header_len_size, header_len),
+                         &m_num_vectors_, &m_dimensions_);
+    if (!status.ok())
+      return status;
+
+    m_stride_ = (size_t)m_dimensions_ * sizeof(float);
+    if (m_offset_ + m_num_vectors_ * m_stride_ > m_size_)
+      return absl::DataLossError(
+          absl::StrFormat("Found truncated data in %s.", m_path_));
+
+    return absl::OkStatus();
+  }
+
+  // Every vector of a `.fvecs` or `.bvecs` file has the same size, so the
+  // first one tells how many there are.
+  if (m_size_ == 0)
+    return absl::OkStatus();
+
+  int32_t dimensions = 0;
+  if (m_size_ >= sizeof(dimensions))
+    std::memcpy(&dimensions, m_data_, sizeof(dimensions));
+  if (dimensions <= 0)
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Found vector with unexpected dimensions in %s. Vector dimensions: "
+        "(%d).",
+        m_path_, dimensions));
+
+  const size_t value_size =
+      m_format_ == Format::kFvecs ? sizeof(float) : sizeof(uint8_t);
+  m_dimensions_ = dimensions;
+  m_offset_ = sizeof(dimensions);
+  m_stride_ = sizeof(dimensions) + (size_t)dimensions * value_size;
+  if (m_size_ % m_stride_ != 0)
+    return absl::DataLossError(
+        absl::StrFormat("Found truncated vector in %s.", m_path_));
+
+  m_num_vectors_ = m_size_ / m_stride_;
+  return absl::OkStatus();
+}
+
+absl::Status VectorFile::read(int64_t begin, int64_t count, float *out) const {
+  if (begin < 0 || count < 0 || begin + count > m_num_vectors_)
+    return absl::OutOfRangeError(absl::StrFormat(
+        "Expected vectors within [0, %d) of %s. begin=%d, count=%d",
+        m_num_vectors_, m_path_, begin, count));
+
+  // `.npy` vectors are stored contiguously, without any headers.
+  if (m_format_ == Format::kNpy) {
+    std::memcpy(out, m_data_ + m_offset_ + begin * m_stride_,
+                count * m_stride_);
+    return absl::OkStatus();
+  }
+
+  for (int64_t i = begin; i < begin + count; i++) {
+    const char *row = m_data_ + i * m_stride_;
+
+    int32_t dimensions;
+    std::memcpy(&dimensions, row, sizeof(dimensions));
+    if (dimensions != m_dimensions_)
+      return absl::DataLossError(absl::StrFormat(
+          "Found vector with unexpected dimensions in %s. "
+          "Vector dimensions: (%d). Expected dimensions: (%d).",
+          m_path_, dimensions, m_dimensions_));
+
+    const char *values = row + m_offset_;
+    if (m_format_ == Format::kFvecs) {
+      std::memcpy(out, values, (size_t)m_dimensions_ * sizeof(float));
+    } else {
+      const auto *bytes = reinterpret_cast<const uint8_t *>(values);
+      std::copy_n(bytes, m_dimensions_, out);
+    }
+    out += m_dimensions_;
+  }
+
+  return absl::OkStatus();
+}
+
+std::vector<int64_t> brute_force_knn(const Dataset &base,
+                                     const Dataset &queries, int k,
+                                     int num_threads) {
+  std::vector<int64_t> neighbors((size_t)queries.num_vectors * k, -1);
+
+  // Each thread handles a strided subset of the queries, keeping a k-sized
+  // min-heap of (score, index) pairs so the worst candidate is at the root.
+  auto search_queries = [&](int thread_idx) {
+    std::vector<std::pair<float, int64_t>> heap(k);
+
+    for (int q = thread_idx; q < queries.num_vectors; q += num_threads) {
+      const float *query = queries.vector(q);
+      std::fill(heap.begin(), heap.end(),
+                std::make_pair(-std::numeric_limits<float>::max(), -1));
+
+      for (int i = 0; i < base.num_vectors; i++) {
+        const float *v = base.vector(i);
+
+        float score = 0;
+        for (int j = 0; j < base.dimensions; j++)
+          score += query[j] * v[j];
+
+        if (score > heap[0].first)
+          algo::heap_replace(heap.data(), k, std::make_pair(score, (int64_t)i));
+      }
+
+      std::sort(heap.begin(), heap.end(), std::greater<>());
+      for (int i = 0; i < k; i++)
+        neighbors[(size_t)q * k + i] = heap[i].second;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++)
+    threads.emplace_back(search_queries, t);
+  for (std::thread &thread : threads)
+    thread.join();
+
+  return neighbors;
+}
+
+} // namespace dataset
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+
+#include "absl/status/statusor.h"
+
+namespace dataset {
+
+// A dense, row-major matrix of `num_vectors` x `dimensions` floats.
+struct Dataset {
+  int num_vectors = 0;
+  int dimensions = 0;
+
+  // Flat array storing all vectors contiguously.
+  std::vector<float> data;
+
+  const float *vector(int i) const {
+    return data.data() + (size_t)i * dimensions;
+  }
+};
+
+// Generates `num_vectors` random vectors drawn from a standard normal
+// distribution and scaled to unit length, which roughly mimics normalized
+// embeddings. The same `seed` always yields the same dataset.
+Dataset generate_synthetic(int num_vectors, int dimensions, uint64_t seed);
+
+// Loads a `.fvecs` file, where each vector is stored as a little-endian
+// int32 dimension followed by that many float32 values.
+// At most `max_vectors` are loaded if it is non-negative.
+absl::StatusOr<Dataset> load_fvecs(const std::string &path,
+                                   int max_vectors = -1);
+
+// Loads a 2-d, C-ordered, little-endian float32 `.npy` file.
+// At most `max_vectors` are loaded if it is non-negative.
+absl::StatusOr<Dataset> load_npy(const std::string &path,
+                                 int max_vectors = -1);
+
+// Loads a dataset, picking the format based on the file extension.
+absl::StatusOr<Dataset> load(const std::string &path, int max_vectors = -1);
+
+// A `.fvecs`, `.bvecs` or `.npy` file of vectors, memory-mapped rather than
+// loaded, so files much larger than memory can be read a block at a time.
+// `.bvecs` files store each vector as an int32 dimension followed by that
+// many uint8 values, which are read as floats.
+class VectorFile {
+public:
+  // Maps the file at `path`, picking the format based on its extension.
+  static absl::StatusOr<std::unique_ptr<VectorFile>>
+  open(const std::string &path);
+
+  ~VectorFile();
+
+  VectorFile(const VectorFile &) = delete;
+  VectorFile &operator=(const VectorFile &) = delete;
+
+  int64_t num_vectors() const { return m_num_vectors_; }
+
+  int dimensions() const { return m_dimensions_; }
+
+  // Copies `count` vectors starting at vector `begin` into `out` as floats.
+  // Returns `DATA_LOSS` if any of them has unexpected dimensions.
+  absl::Status read(int64_t begin, int64_t count, float *out) const;
+
+private:
+  enum class Format { kFvecs, kBvecs, kNpy };
+
+  VectorFile(std::string path, Format format, const char *data, size_t size);
+
+  // Finds the dimensions and number of vectors of the mapped file.
+  absl::Status parse();
+
+  std::string m_path_;
+
+  Format m_format_;
+
+  // The mapped file.
+  const char *m_data_;
+  size_t m_size_;
+
+  // The offset of the first vector and the distance between vectors, in
+  // bytes.
+  size_t m_offset_;
+  size_t m_stride_;
+
+  int64_t m_num_vectors_;
+  int m_dimensions_;
+};
+
+// Computes the exact top-k neighbors of each query by brute force using
+// inner product similarity, i.e. the ground truth used to measure recall.
+// Returns a `queries.num_vectors` x `k` row-major array of indexes into
+// `base`, best first. Queries are split across `num_threads` threads.
+std::vector<int64_t> brute_force_knn(const Dataset &base,
+                                     const Dataset &queries, int k,
+                                     int num_threads = 1);
+
+} // namespace dataset
@@ -0,0 +1,170 @@
+#include "src/cpp/dataset.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using dataset::Dataset;
+using dataset::VectorFile;
+
+using testing::ElementsAre;
+
+namespace {
+
+std::string temp_path(const std::string &name) {
+  return testing::TempDir() + name;
+}
+
+// Writes a 3 x 2 `.npy` file of the values 1 to 6.
+void write_npy(const std::string &path) {
+  // Header padded so the data starts on a 64-byte boundary, as numpy does.
+  std::string header =
+      "{'descr': '<f4', 'fortran_order': False, 'shape': (3, 2), }";
+  header.resize(128 - 10 - 1, ' ');
+  header += '\n';
+  uint16_t header_len = header.size();
+
+  std::ofstream file(path, std::ios::binary);
+  file.write("\x93NUMPY\x01\x00", 8);
+  file.write(reinterpret_cast<char *>(&header_len), sizeof(header_len));
+  file.write(header.data(), header.size());
+
+  float raw[6] = {1, 2, 3, 4, 5, 6};
+  file.write(reinterpret_cast<char *>(raw), sizeof(raw));
+}
+
+} // namespace
+
+TEST(DatasetTest, LoadFvecs) {
+  const std::string path = temp_path("dataset_test.fvecs");
+  {
+    std::ofstream file(path, std::ios::binary);
+    for (float offset : {0.f, 10.f}) {
+      int32_t dimensions = 2;
+      float raw[2] = {offset + 1, offset + 2};
+      file.write(reinterpret_cast<char *>(&dimensions), sizeof(dimensions));
+      file.write(reinterpret_cast<char *>(raw), sizeof(raw));
+    }
+  }
+
+  absl::StatusOr<Dataset> dataset = dataset::load(path);
+  ASSERT_TRUE(dataset.ok()) << dataset.status();
+  EXPECT_EQ(dataset->num_vectors, 2);
+  EXPECT_EQ(dataset->dimensions, 2);
+  EXPECT_THAT(dataset->data, ElementsAre(1, 2, 11, 12));
+
+  // Test that we can load a prefix of the file.
+  dataset = dataset::load(path, 1);
+  ASSERT_TRUE(dataset.ok()) << dataset.status();
+  EXPECT_THAT(dataset->data, ElementsAre(1, 2));
+}
+
+TEST(DatasetTest, LoadNpy) {
+  const std::string path = temp_path("dataset_test.npy");
+  write_npy(path);
+
+  absl::StatusOr<Dataset> dataset = dataset::load(path);
+  ASSERT_TRUE(dataset.ok()) << dataset.status();
+  EXPECT_EQ(dataset->num_vectors, 3);
+  EXPECT_EQ(dataset->dimensions, 2);
+  EXPECT_THAT(dataset->data, ElementsAre(1, 2, 3, 4, 5, 6));
+}
+
+TEST(DatasetTest, LoadUnsupportedFormat) {
+  EXPECT_FALSE(dataset::load(temp_path("dataset_test.csv")).ok());
+}
+
+TEST(DatasetTest, VectorFileReadsFvecsInBlocks) {
+  const std::string path = temp_path("vector_file_test.fvecs");
+  {
+    std::ofstream file(path, std::ios::binary);
+    for (float offset : {0.f, 10.f, 20.f}) {
+      int32_t dimensions = 2;
+      float raw[2] = {offset + 1, offset + 2};
+      file.write(reinterpret_cast<char *>(&dimensions), sizeof(dimensions));
+      file.write(reinterpret_cast<char *>(raw), sizeof(raw));
+    }
+  }
+
+  absl::StatusOr<std::unique_ptr<VectorFile>> file = VectorFile::open(path);
+  ASSERT_TRUE(file.ok()) << file.status();
+  EXPECT_EQ((*file)->num_vectors(), 3);
+  EXPECT_EQ((*file)->dimensions(), 2);
+
+  std::vector<float> block(4);
+  ASSERT_TRUE((*file)->read(1, 2, block.data()).ok());
+  EXPECT_THAT(block, ElementsAre(11, 12, 21, 22));
+
+  EXPECT_EQ((*file)->read(2, 2, block.data()).code(),
+            absl::StatusCode::kOutOfRange);
+}
+
+TEST(DatasetTest, VectorFileConvertsBvecs) {
+  const std::string path = temp_path("vector_file_test.bvecs");
+  {
+    std::ofstream file(path, std::ios::binary);
+    for (uint8_t offset : {0, 100}) {
+      int32_t dimensions = 3;
+      uint8_t raw[3] = {uint8_t(offset + 1), uint8_t(offset + 2), 255};
+      file.write(reinterpret_cast<char *>(&dimensions), sizeof(dimensions));
+      file.write(reinterpret_cast<char *>(raw), sizeof(raw));
+    }
+  }
+
+  absl::StatusOr<std::unique_ptr<VectorFile>> file = VectorFile::open(path);
+  ASSERT_TRUE(file.ok()) << file.status();
+  EXPECT_EQ((*file)->num_vectors(), 2);
+
+  std::vector<float> block(6);
+  ASSERT_TRUE((*file)->read(0, 2, block.data()).ok());
+  EXPECT_THAT(block, ElementsAre(1, 2, 255, 101, 102, 255));
+}
+
+TEST(DatasetTest, VectorFileReadsNpy) {
+  const std::string path = temp_path("vector_file_test.npy");
+  write_npy(path);
+
+  absl::StatusOr<std::unique_ptr<VectorFile>> file = VectorFile::open(path);
+  ASSERT_TRUE(file.ok()) << file.status();
+  EXPECT_EQ((*file)->num_vectors(), 3);
+  EXPECT_EQ((*file)->dimensions(), 2);
+
+  std::vector<float> block(4);
+  ASSERT_TRUE((*file)->read(1, 2, block.data()).ok());
+  EXPECT_THAT(block, ElementsAre(3, 4, 5, 6));
+}
+
+TEST(DatasetTest, VectorFileRejectsTruncatedFiles) {
+  const std::string path = temp_path("vector_file_truncated_test.fvecs");
+  {
+    std::ofstream file(path, std::ios::binary);
+    int32_t dimensions = 2;
+    float raw[3] = {1, 2, 3};
+    file.write(reinterpret_cast<char *>(&dimensions), sizeof(dimensions));
+    file.write(reinterpret_cast<char *>(raw), sizeof(raw));
+  }
+
+  EXPECT_EQ(VectorFile::open(path).status().code(),
+            absl::StatusCode::kDataLoss);
+}
+
+TEST(DatasetTest, BruteForceKnn) {
+  Dataset base;
+  base.num_vectors = 3;
+  base.dimensions = 2;
+  base.data = {1, 0, 0, 1, 0.7, 0.7};
+
+  Dataset queries;
+  queries.num_vectors = 2;
+  queries.dimensions = 2;
+  queries.data = {1, 0.1, 0, -1};
+
+  EXPECT_THAT(dataset::brute_force_knn(base, queries, 2, 2),
+              ElementsAre(0, 2, 0, 2));
+}
@@ -0,0 +1,183 @@
+/* This is a header-only library of exact distance and top-k kernels.
+ *
+ * Every kernel is a template over the number of dimensions, so the embedding
+ * sizes that are actually served get a copy whose loops have a compile-time
+ * trip count, and can be fully unrolled and vectorized. `flat_search_fn`
+ * picks the copy for a runtime number of dimensions, falling back to a
+ * generic copy for other sizes.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace distance {
+
+enum class Metric {
+  // Squared Euclidean distance, lower is better.
+  kL2,
+
+  // Inner product, higher is better.
+  kInnerProduct,
+};
+
+// The number of independent partial sums kept by distance kernels. Splitting
+// the sum breaks the dependency between consecutive additions, so they can
+// run as one SIMD lane each.
+constexpr int kLanes = 8;
+
+// Returns the distance between vectors `a` and `b` under `metric`. `D` is the
+// number of dimensions, or 0 to use the runtime `dimensions` instead.
+template <Metric metric, int D>
+float distance(const float *a, const float *b, int dimensions) {
+  static_assert(D % kLanes == 0, "Specialized dimensions must fill lanes.");
+
+  // Note: For `D > 0` this is a constant, so the loops below have a
+  // compile-time trip count and the tail loop disappears.
+  const int num_dimensions = D > 0 ? D : dimensions;
+  const int num_blocked = num_dimensions - num_dimensions % kLanes;
+
+  float sums[kLanes] = {};
+  for (int i = 0; i < num_blocked; i += kLanes) {
+    for (int lane = 0; lane < kLanes; lane++) {
+      if constexpr (metric == Metric::kL2) {
+        const float diff = a[i + lane] - b[i + lane];
+        sums[lane] += diff * diff;
+      } else {
+        sums[lane] += a[i + lane] * b[i + lane];
+      }
+    }
+  }
+
+  for (int i = num_blocked; i < num_dimensions; i++) {
+    if constexpr (metric == Metric::kL2) {
+      const float diff = a[i] - b[i];
+      sums[0] += diff * diff;
+    } else {
+      sums[0] += a[i] * b[i];
+    }
+  }
+
+  float sum = 0;
+  for (int lane = 0; lane < kLanes; lane++)
+    sum += sums[lane];
+  return sum;
+}
+
+// Returns whether distance `a` is better than distance `b` under `metric`.
+template <Metric metric> bool is_better(float a, float b) {
+  return metric == Metric::kL2 ? a < b : a > b;
+}
+
+// Finds the `k` vectors closest to `query` among the `num_vectors` vectors
+// stored back to back in `vectors`, and writes their distances and positions
+// to `distances` and `positions`, best first. `D` is as for `distance`.
+//
+// Returns the number of neighbors written, which is less than `k` if there
+// are fewer than `k` vectors.
+template <Metric metric, int D>
+int flat_search(const float *query, const float *vectors, int64_t num_vectors,
+                int dimensions, int k, float *distances, int64_t *positions) {
+  const int num_dimensions = D > 0 ? D : dimensions;
+  const int num_neighbors = (int)std::min<int64_t>(k, num_vectors);
+  if (num_neighbors <= 0)
+    return 0;
+
+  // Heap of the best neighbors so far, with the worst of them at the front.
+  auto is_better_neighbor = [](const std::pair<float, int64_t> &first,
+                               const std::pair<float, int64_t> &second) {
+    return is_better<metric>(first.first, second.first);
+  };
+  std::vector<std::pair<float, int64_t>> heap;
+  heap.reserve(num_neighbors);
+
+  for (int64_t i = 0; i < num_vectors; i++) {
+    const float d = distance<metric, D>(
+        query, vectors + i * num_dimensions, num_dimensions);
+
+    if ((int)heap.size() < num_neighbors) {
+      heap.emplace_back(d, i);
+      std::push_heap(heap.begin(), heap.end(), is_better_neighbor);
+    } else if (is_better<metric>(d, heap.front().first)) {
+      std::pop_heap(heap.begin(), heap.end(), is_better_neighbor);
+      heap.back() = std::make_pair(d, i);
+      std::push_heap(heap.begin(), heap.end(), is_better_neighbor);
+    }
+  }
+
+  std::sort_heap(heap.begin(), heap.end(), is_better_neighbor);
+  for (int i = 0; i < num_neighbors; i++) {
+    distances[i] = heap[i].first;
+    positions[i] = heap[i].second;
+  }
+
+  return num_neighbors;
+}
+
+using DistanceFn = float (*)(const float *a, const float *b, int dimensions);
+
+using FlatSearchFn = int (*)(const float *query, const float *vectors,
+                             int64_t num_vectors, int dimensions, int k,
+                             float *distances, int64_t *positions);
+
+namespace internal {
+
+template <Metric metric, int... Ds> struct KernelTable {
+  static constexpr int dimensions[] = {Ds...};
+  static constexpr DistanceFn distance_fns[] = {&distance<metric, Ds>...};
+  static constexpr FlatSearchFn flat_search_fns[] = {
+      &flat_search<metric, Ds>...};
+
+  // Returns the index of the kernels for `d` dimensions, or -1 if there's no
+  // specialization for it.
+  static int find(int d) {
+    for (int i = 0; i < (int)sizeof...(Ds); i++) {
+      if (dimensions[i] == d)
+        return i;
+    }
+    return -1;
+  }
+};
+
+// The embedding sizes with their own specialized kernels.
+template <Metric metric>
+using Kernels = KernelTable<metric, 64, 128, 256, 384, 512, 768, 1024, 1536>;
+
+} // namespace internal
+
+// Returns whether there are kernels specialized for `dimensions`.
+inline bool is_specialized(int dimensions) {
+  return internal::Kernels<Metric::kL2>::find(dimensions) >= 0;
+}
+
+// Returns the distance kernel for `metric` specialized for `dimensions`, or
+// the generic one if there's no specialization for it.
+inline DistanceFn distance_fn(Metric metric, int dimensions) {
+  if (metric == Metric::kL2) {
+    const int i = internal::Kernels<Metric::kL2>::find(dimensions);
+    return i < 0 ? &distance<Metric::kL2, 0>
+                 : internal::Kernels<Metric::kL2>::distance_fns[i];
+  }
+
+  const int i = internal::Kernels<Metric::kInnerProduct>::find(dimensions);
+  return i < 0 ? &distance<Metric::kInnerProduct, 0>
+               : internal::Kernels<Metric::kInnerProduct>::distance_fns[i];
+}
+
+// Returns the top-k kernel for `metric` specialized for `dimensions`, or the
+// generic one if there's no specialization for it.
+inline FlatSearchFn flat_search_fn(Metric metric, int dimensions) {
+  if (metric == Metric::kL2) {
+    const int i = internal::Kernels<Metric::kL2>::find(dimensions);
+    return i < 0 ? &flat_search<Metric::kL2, 0>
+                 : internal::Kernels<Metric::kL2>::flat_search_fns[i];
+  }
+
+  const int i = internal::Kernels<Metric::kInnerProduct>::find(dimensions);
+  return i < 0 ? &flat_search<Metric::kInnerProduct, 0>
+               : internal::Kernels<Metric::kInnerProduct>::flat_search_fns[i];
+}
+
+} // namespace distance
@@ -0,0 +1,123 @@
+#include "src/cpp/distance.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+
+using distance::distance_fn;
+using distance::flat_search_fn;
+using distance::is_specialized;
+using distance::Metric;
+
+namespace {
+
+std::vector<float> random_vectors(int num_vectors, int dimensions, int seed) {
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> distribution(-1, 1);
+
+  std::vector<float> vectors(num_vectors * dimensions);
+  for (float &value : vectors)
+    value = distribution(generator);
+  return vectors;
+}
+
+double reference_distance(Metric metric, const float *a, const float *b,
+                          int dimensions) {
+  double sum = 0;
+  for (int i = 0; i < dimensions; i++)
+    sum += metric == Metric::kL2 ? (double)(a[i] - b[i]) * (a[i] - b[i])
+                                 : (double)a[i] * b[i];
+  return sum;
+}
+
+} // namespace
+
+TEST(DistanceTest, DispatchesToSpecializations) {
+  EXPECT_TRUE(is_specialized(128));
+  EXPECT_TRUE(is_specialized(1536));
+  EXPECT_FALSE(is_specialized(100));
+
+  EXPECT_EQ(flat_search_fn(Metric::kL2, 768),
+            (&distance::flat_search<Metric::kL2, 768>));
+  EXPECT_EQ(flat_search_fn(Metric::kInnerProduct, 64),
+            (&distance::flat_search<Metric::kInnerProduct, 64>));
+  EXPECT_EQ(flat_search_fn(Metric::kL2, 100),
+            (&distance::flat_search<Metric::kL2, 0>));
+  EXPECT_EQ(distance_fn(Metric::kInnerProduct, 3),
+            (&distance::distance<Metric::kInnerProduct, 0>));
+}
+
+TEST(DistanceTest, MatchesReferenceForEveryDimension) {
+  // Specialized sizes, and generic ones with and without a partial block.
+  for (int dimensions : {64, 128, 256, 384, 512, 768, 1024, 1536, 3, 100}) {
+    const std::vector<float> vectors = random_vectors(2, dimensions, 0);
+    const float *a = vectors.data();
+    const float *b = vectors.data() + dimensions;
+
+    for (Metric metric : {Metric::kL2, Metric::kInnerProduct}) {
+      EXPECT_NEAR(distance_fn(metric, dimensions)(a, b, dimensions),
+                  reference_distance(metric, a, b, dimensions), 1e-3)
+          << "dimensions=" << dimensions;
+    }
+  }
+}
+
+TEST(FlatSearchTest, FindsTopKBestFirst) {
+  const int dimensions = 128;
+  const int num_vectors = 1000;
+  const int k = 10;
+  const std::vector<float> vectors =
+      random_vectors(num_vectors, dimensions, 0);
+  const std::vector<float> query = random_vectors(1, dimensions, 1);
+
+  for (Metric metric : {Metric::kL2, Metric::kInnerProduct}) {
+    std::vector<int64_t> expected(num_vectors);
+    std::iota(expected.begin(), expected.end(), 0);
+    std::sort(expected.begin(), expected.end(), [&](int64_t i, int64_t j) {
+      const double d_i = reference_distance(
+          metric, query.data(), vectors.data() + i * dimensions, dimensions);
+      const double d_j = reference_distance(
+          metric, query.data(), vectors.data() + j * dimensions, dimensions);
+      return metric == Metric::kL2 ? d_i < d_j : d_i > d_j;
+    });
+    expected.resize(k);
+
+    std::vector<float> distances(k);
+    std::vector<int64_t> positions(k);
+    EXPECT_EQ(flat_search_fn(metric, dimensions)(
+                  query.data(), vectors.data(), num_vectors, dimensions, k,
+                  distances.data(), positions.data()),
+              k);
+    EXPECT_EQ(positions, expected);
+    EXPECT_TRUE(std::is_sorted(distances.begin(), distances.end(),
+                               [metric](float a, float b) {
+                                 return metric == Metric::kL2 ? a < b : a > b;
+                               }));
+  }
+}
+
+TEST(FlatSearchTest, ReturnsFewerThanKNeighbors) {
+  const int dimensions = 3;
+  const std::vector<float> vectors = {0, 0, 0, 2, 2, 2};
+  const std::vector<float> query = {1.5, 1.5, 1.5};
+
+  std::vector<float> distances(5);
+  std::vector<int64_t> positions(5);
+  EXPECT_EQ(flat_search_fn(Metric::kL2, dimensions)(
+                query.data(), vectors.data(), 2, dimensions, 5,
+                distances.data(), positions.data()),
+            2);
+  EXPECT_EQ(positions[0], 1);
+  EXPECT_EQ(positions[1], 0);
+  EXPECT_FLOAT_EQ(distances[0], 0.75);
+  EXPECT_FLOAT_EQ(distances[1], 6.75);
+
+  EXPECT_EQ(flat_search_fn(Metric::kL2, dimensions)(
+                query.data(), vectors.data(), 0, dimensions, 5,
+                distances.data(), positions.data()),
+            0);
+}
@@ -0,0 +1,262 @@
+/* This is a header-only library implementing the compact wire encodings of
+ * vectors: half-precision floats, bfloat16 and int8 with a per-vector scale.
+ *
+ * Encoded vectors take 2 or 1 bytes per dimension on the wire instead of 4.
+ * They're decoded back into floats right before being handed to `faiss`, so
+ * an index built from encoded vectors stores (and searches) the decoded
+ * values.
+ *
+ * Multi-byte codes are always written little-endian, so clients and servers
+ * on any platform agree on them.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "src/proto/index_service.pb.h"
+
+namespace encoding {
+
+// Converts a float to the nearest half-precision float, rounding ties to
+// even. Values too large for half precision become infinity.
+inline uint16_t float_to_half(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const int exponent = (bits >> 23) & 0xff;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  // Infinity and NaN. Keep NaNs NaNs by setting a mantissa bit.
+  if (exponent == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+  const int half_exponent = exponent - 127 + 15;
+  if (half_exponent >= 31)
+    return sign | 0x7c00;
+
+  if (half_exponent <= 0) {
+    // The value is a subnormal half, or too small to be represented at all.
+    if (half_exponent < -10)
+      return sign;
+
+    mantissa |= 0x800000;
+    const int shift = 14 - half_exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1)))
+      half++;
+    return sign | half;
+  }
+
+  // Note: Rounding up may carry into the exponent, which is still correct and
+  // turns the largest values into infinity.
+  uint32_t half = (half_exponent << 10) | (mantissa >> 13);
+  const uint32_t remainder = mantissa & 0x1fff;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+    half++;
+  return sign | half;
+}
+
+inline float half_to_float(uint16_t half) {
+  const uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  const int exponent = (half >> 10) & 0x1f;
+  const uint32_t mantissa = half & 0x3ff;
+
+  uint32_t bits;
+  if (exponent == 0) {
+    // Zero or a subnormal half, which is a normal float.
+    const float value = std::ldexp((float)mantissa, -24);
+    return sign ? -value : value;
+  } else if (exponent == 31) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    bits = sign | ((uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Converts a float to the nearest bfloat16, rounding ties to even.
+inline uint16_t float_to_bfloat16(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  if (std::isnan(value))
+    return (bits >> 16) | 0x40;
+
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
+inline float bfloat16_to_float(uint16_t bfloat16) {
+  const uint32_t bits = (uint32_t)bfloat16 << 16;
+
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Returns the number of bytes each value takes in `encoding`.
+inline int bytes_per_value(index_service::Encoding encoding) {
+  switch (encoding) {
+  case index_service::ENCODING_FLOAT16:
+  case index_service::ENCODING_BFLOAT16:
+    return 2;
+  case index_service::ENCODING_INT8:
+    return 1;
+  default:
+    return sizeof(float);
+  }
+}
+
+// Returns the number of values of a vector with the given encoding, given
+// its float values (used by `ENCODING_FLOAT32`) and its codes (used by all
+// other encodings). Returns -1 if the encoding is unknown or the codes are
+// not a whole number of values.
+inline int num_values(index_service::Encoding encoding, int num_raw,
+                      const std::string &codes) {
+  if (encoding == index_service::ENCODING_FLOAT32)
+    return num_raw;
+
+  if (!index_service::Encoding_IsValid(encoding))
+    return -1;
+
+  const int num_bytes = bytes_per_value(encoding);
+  if (codes.size() % num_bytes)
+    return -1;
+
+  return codes.size() / num_bytes;
+}
+
+// Encodes `num_values` floats into `codes`. For `ENCODING_INT8`, also sets
+// `scale` so that the largest magnitude value maps to 127. Must not be called
+// with `ENCODING_FLOAT32`, which is sent as plain floats.
+inline void encode(const float *values, int num_values,
+                   index_service::Encoding encoding, std::string *codes,
+                   float *scale) {
+  codes->resize((size_t)num_values * bytes_per_value(encoding));
+  uint8_t *out = reinterpret_cast<uint8_t *>(codes->data());
+
+  switch (encoding) {
+  case index_service::ENCODING_FLOAT16:
+  case index_service::ENCODING_BFLOAT16:
+    for (int i = 0; i < num_values; i++) {
+      const uint16_t code = encoding == index_service::ENCODING_FLOAT16
+                                ? float_to_half(values[i])
+                                : float_to_bfloat16(values[i]);
+      out[2 * i] = code & 0xff;
+      out[2 * i + 1] = code >> 8;
+    }
+    break;
+
+  case index_service::ENCODING_INT8: {
+    float max_magnitude = 0;
+    for (int i = 0; i < num_values; i++)
+      max_magnitude = std::max(max_magnitude, std::abs(values[i]));
+
+    *scale = max_magnitude / 127;
+    const float inverse_scale = *scale > 0 ? 1 / *scale : 0;
+    for (int i = 0; i < num_values; i++) {
+      const float code =
+          std::clamp(std::round(values[i] * inverse_scale), -127.0f, 127.0f);
+      out[i] = (uint8_t)(int8_t)code;
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+// Decodes `num_values` values from `codes` into `values`. The codes must hold
+// exactly `num_values` values, e.g. as checked with `num_values`.
+inline void decode(index_service::Encoding encoding, const std::string &codes,
+                   float scale, int num_values, float *values) {
+  const uint8_t *in = reinterpret_cast<const uint8_t *>(codes.data());
+
+  switch (encoding) {
+  case index_service::ENCODING_FLOAT16:
+    for (int i = 0; i < num_values; i++)
+      values[i] = half_to_float(in[2 * i] | (in[2 * i + 1] << 8));
+    break;
+
+  case index_service::ENCODING_BFLOAT16:
+    for (int i = 0; i < num_values; i++)
+      values[i] = bfloat16_to_float(in[2 * i] | (in[2 * i + 1] << 8));
+    break;
+
+  case index_service::ENCODING_INT8:
+    for (int i = 0; i < num_values; i++)
+      values[i] = (int8_t)in[i] * scale;
+    break;
+
+  default:
+    break;
+  }
+}
+
+// Sets the values of `vector` to `values`, encoded with `encoding`.
+inline void encode_vector(const float *values, int num_values,
+                          index_service::Encoding encoding,
+                          index_service::Vector *vector) {
+  vector->set_encoding(encoding);
+  if (encoding == index_service::ENCODING_FLOAT32) {
+    vector->mutable_raw()->Add(values, values + num_values);
+    return;
+  }
+
+  float scale = 0;
+  encode(values, num_values, encoding, vector->mutable_codes(), &scale);
+  if (encoding == index_service::ENCODING_INT8)
+    vector->set_scale(scale);
+}
+
+// Sets the query vector of `request` to `values`, encoded with `encoding`.
+inline void encode_query(const float *values, int num_values,
+                         index_service::Encoding encoding,
+                         index_service::SearchRequest *request) {
+  request->set_query_encoding(encoding);
+  if (encoding == index_service::ENCODING_FLOAT32) {
+    request->mutable_query_vector()->Add(values, values + num_values);
+    return;
+  }
+
+  float scale = 0;
+  encode(values, num_values, encoding, request->mutable_query_codes(), &scale);
+  if (encoding == index_service::ENCODING_INT8)
+    request->set_query_scale(scale);
+}
+
+// Returns the number of values in `vector`, or -1 if it's malformed.
+inline int num_values(const index_service::Vector &vector) {
+  return num_values(vector.encoding(), vector.raw_size(), vector.codes());
+}
+
+// Returns the number of values in the query vector of `request`, or -1 if
+// it's malformed.
+inline int num_query_values(const index_service::SearchRequest &request) {
+  return num_values(request.query_encoding(), request.query_vector_size(),
+                    request.query_codes());
+}
+
+// Writes the values of `vector` to `values` as floats. `vector` must hold
+// exactly `num_values` values.
+inline void decode_vector(const index_service::Vector &vector, int num_values,
+                          float *values) {
+  if (vector.encoding() == index_service::ENCODING_FLOAT32)
+    std::copy_n(vector.raw().begin(), num_values, values);
+  else
+    decode(vector.encoding(), vector.codes(), vector.scale(), num_values,
+           values);
+}
+
+} // namespace encoding
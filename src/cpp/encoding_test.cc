@@ -0,0 +1,101 @@
+#include "src/cpp/encoding.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "src/proto/index_service.pb.h"
+
+using index_service::ENCODING_BFLOAT16;
+using index_service::ENCODING_FLOAT16;
+using index_service::ENCODING_FLOAT32;
+using index_service::ENCODING_INT8;
+using index_service::SearchRequest;
+using index_service::Vector;
+
+TEST(HalfTest, ExactValues) {
+  for (float value : {0.0f, 1.0f, -2.0f, 0.5f, 65504.0f, 0.25f, -1024.0f})
+    EXPECT_EQ(encoding::half_to_float(encoding::float_to_half(value)), value);
+
+  // Test subnormal halves.
+  const float smallest_half = std::ldexp(1.0f, -24);
+  EXPECT_EQ(encoding::half_to_float(encoding::float_to_half(smallest_half)),
+            smallest_half);
+  EXPECT_EQ(encoding::float_to_half(smallest_half), 0x0001);
+}
+
+TEST(HalfTest, RoundsAndSaturates) {
+  // 1 + 2^-11 is halfway between two halves and rounds to the even one.
+  EXPECT_EQ(encoding::float_to_half(1.0f + std::ldexp(1.0f, -11)), 0x3c00);
+  EXPECT_EQ(encoding::float_to_half(1.0f + 3 * std::ldexp(1.0f, -11)),
+            0x3c02);
+
+  EXPECT_EQ(encoding::float_to_half(1e6f), 0x7c00);
+  EXPECT_EQ(encoding::float_to_half(-1e6f), 0xfc00);
+  EXPECT_EQ(encoding::float_to_half(1e-10f), 0x0000);
+  EXPECT_TRUE(std::isnan(encoding::half_to_float(
+      encoding::float_to_half(std::numeric_limits<float>::quiet_NaN()))));
+}
+
+TEST(BFloat16Test, RoundTrip) {
+  for (float value : {0.0f, 1.0f, -2.0f, 0.5f, std::ldexp(1.0f, 100),
+                      -std::ldexp(1.0f, -100)})
+    EXPECT_EQ(encoding::bfloat16_to_float(encoding::float_to_bfloat16(value)),
+              value);
+
+  // 1 + 2^-8 is halfway between two bfloat16s and rounds to the even one.
+  EXPECT_EQ(encoding::float_to_bfloat16(1.0f + std::ldexp(1.0f, -8)), 0x3f80);
+  EXPECT_NEAR(
+      encoding::bfloat16_to_float(encoding::float_to_bfloat16(0.1234f)),
+      0.1234f, 0.1234f / 128);
+}
+
+TEST(EncodingTest, EncodesAndDecodesVectors) {
+  const std::vector<float> values = {0.5f, -0.25f, 0.125f, -1.0f, 0.0f, 0.75f};
+
+  for (auto encoding :
+       {ENCODING_FLOAT32, ENCODING_FLOAT16, ENCODING_BFLOAT16, ENCODING_INT8}) {
+    Vector vector;
+    encoding::encode_vector(values.data(), values.size(), encoding, &vector);
+
+    ASSERT_EQ(encoding::num_values(vector), values.size());
+    if (encoding != ENCODING_FLOAT32)
+      EXPECT_EQ(vector.codes().size(),
+                values.size() * encoding::bytes_per_value(encoding));
+
+    std::vector<float> decoded(values.size());
+    encoding::decode_vector(vector, values.size(), decoded.data());
+
+    // int8 codes are off by at most half a step of the scale.
+    const float tolerance = encoding == ENCODING_INT8 ? 0.5f / 127 : 0;
+    for (int i = 0; i < values.size(); i++)
+      EXPECT_NEAR(decoded[i], values[i], tolerance);
+  }
+}
+
+TEST(EncodingTest, EncodesQueries) {
+  const std::vector<float> values = {3.0f, -6.0f};
+
+  SearchRequest request;
+  encoding::encode_query(values.data(), values.size(), ENCODING_INT8,
+                         &request);
+
+  EXPECT_EQ(encoding::num_query_values(request), 2);
+  EXPECT_EQ(request.query_vector_size(), 0);
+  EXPECT_FLOAT_EQ(request.query_scale(), 6.0f / 127);
+  EXPECT_EQ((int8_t)request.query_codes()[1], -127);
+}
+
+TEST(EncodingTest, RejectsMalformedCodes) {
+  Vector vector;
+  vector.set_encoding(ENCODING_FLOAT16);
+  vector.set_codes(std::string(3, '\0'));
+  EXPECT_EQ(encoding::num_values(vector), -1);
+
+  vector.set_encoding((index_service::Encoding)42);
+  EXPECT_EQ(encoding::num_values(vector), -1);
+}
@@ -2,7 +2,11 @@
 
 #include <absl/log/log.h>
 #include <absl/strings/str_format.h>
+#include <faiss/IVFlib.h>
 #include <faiss/Index.h>
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexIDMap.h>
+#include <faiss/IndexIVF.h>
 #include <faiss/MetricType.h>
 #include <faiss/impl/IDSelector.h>
 #include <faiss/index_factory.h>
@@ -10,26 +14,56 @@
 #include <grpc/grpc.h>
 #include <grpcpp/server.h>
 #include <grpcpp/server_context.h>
-
+#include <omp.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "src/cpp/admission.h"
+#include "src/cpp/algo.h"
+#include "src/cpp/encoding.h"
+#include "src/cpp/metrics.h"
+#include "src/cpp/profile.h"
+#include "src/cpp/segmented_index.h"
+#include "src/cpp/threading.h"
 #include "src/proto/index_service.grpc.pb.h"
 
 using faiss::IDSelectorBatch;
+using faiss::IndexIDMap;
 using faiss::idx_t;
 using faiss::MetricType;
 using google::protobuf::RepeatedField;
+using google::protobuf::RepeatedPtrField;
 using grpc::Server;
 using grpc::ServerContext;
+using grpc::ServerWriter;
 using grpc::Status;
 using grpc::StatusCode;
 
 using index_service::DescribeRequest;
 using index_service::DescribeResponse;
+using index_service::ExportRequest;
+using index_service::ExportResponse;
 using index_service::InsertRequest;
 using index_service::InsertResponse;
 using index_service::Neighbor;
+using index_service::ProfileSpan;
+using index_service::RebuildRequest;
+using index_service::RebuildResponse;
+using index_service::RemoveRequest;
+using index_service::RemoveResponse;
 using index_service::SearchRequest;
 using index_service::SearchResponse;
 using index_service::UpsertRequest;
@@ -37,22 +71,259 @@ using index_service::UpsertResponse;
 using index_service::Vector;
 using index_service::faiss::FaissIndexServiceImpl;
 
-FaissIndexServiceImpl::FaissIndexServiceImpl(int dimensions,
-                                             const char *factory_string,
-                                             MetricType metric_type)
+namespace {
+
+// The number of vectors added to an index being rebuilt at a time, between
+// which progress is reported and the rebuild may be stopped.
+constexpr int kRebuildBatchSize = 10000;
+
+// Once at most this many writes were captured while rebuilding, they're
+// replayed while holding the lock, right before swapping in the new index.
+// Otherwise they're replayed without the lock, so writes aren't blocked for
+// long.
+constexpr int kMaxWritesReplayedUnderLock = 64;
+
+// Calls `fn` with the id and values of every vector in `index`, read from
+// `raw_vectors` if set. Returns `UNIMPLEMENTED` if `index` can't map its
+// vectors back to ids or can't reconstruct them.
+Status for_each_vector(const faiss::Index &index,
+                       const faiss::Index *raw_vectors, int dimensions,
+                       const std::string &factory_string,
+                       const std::function<void(idx_t, const float *)> &fn) {
+  // Note: The raw vectors are an `IDMap` over a flat index, so they're read
+  // back exactly.
+  if (raw_vectors)
+    return for_each_vector(*raw_vectors, nullptr, dimensions, factory_string,
+                           fn);
+
+  if (const auto *segmented_index =
+          dynamic_cast<const segmented::SegmentedIndex *>(&index)) {
+    segmented_index->for_each(fn);
+    return Status::OK;
+  }
+
+  const auto *id_map_index = dynamic_cast<const IndexIDMap *>(&index);
+  if (!id_map_index)
+    return Status(StatusCode::UNIMPLEMENTED,
+                  absl::StrFormat("%s indexes don't map vectors to ids.",
+                                  factory_string));
+
+  std::vector<float> values(dimensions);
+  try {
+    for (idx_t i = 0; i < id_map_index->ntotal; i++) {
+      id_map_index->index->reconstruct(i, values.data());
+      fn(id_map_index->id_map[i], values.data());
+    }
+  } catch (const std::exception &e) {
+    // Note: e.g. IVF indexes can only reconstruct vectors with a direct map.
+    return Status(StatusCode::UNIMPLEMENTED,
+                  absl::StrFormat("%s indexes can't reconstruct vectors: %s",
+                                  factory_string, e.what()));
+  }
+
+  return Status::OK;
+}
+
+std::unique_ptr<faiss::Index>
+make_index(int dimensions, const char *factory_string, MetricType metric_type,
+           const std::optional<segmented::SegmentConfig> &segment_config) {
+  if (segment_config)
+    return std::make_unique<segmented::SegmentedIndex>(
+        dimensions, factory_string, metric_type, *segment_config);
+
+  return std::unique_ptr<faiss::Index>(
+      faiss::index_factory(dimensions, factory_string, metric_type));
+}
+
+// Returns an `IDMap` over a flat index to keep the raw vectors of `index` in,
+// or null if `index` keeps them itself: segmented indexes keep them next to
+// their segments, and `IDMap` indexes over a flat index store them as is.
+// Note: Other indexes can't reconstruct the vectors added to them, e.g. IVF
+// indexes without a direct map, or only approximately, e.g. PQ indexes.
+// Keeping the raw vectors lets them be exported, and rebuilt without losing
+// precision on every rebuild.
+std::unique_ptr<faiss::Index> make_raw_vectors(const faiss::Index &index,
+                                               int dimensions,
+                                               MetricType metric_type) {
+  if (dynamic_cast<const segmented::SegmentedIndex *>(&index))
+    return nullptr;
+
+  const auto *id_map_index = dynamic_cast<const IndexIDMap *>(&index);
+  if (!id_map_index ||
+      dynamic_cast<const faiss::IndexFlat *>(id_map_index->index))
+    return nullptr;
+
+  return std::unique_ptr<faiss::Index>(
+      faiss::index_factory(dimensions, "IDMap,Flat", metric_type));
+}
+
+// Returns the `IDMap` exports read the vectors of `index` from by position:
+// `raw_vectors` if set, or else `index` if it's an `IDMap`. Returns null for
+// other indexes, e.g. segmented ones.
+const IndexIDMap *positioned_vectors(const faiss::Index &index,
+                                     const faiss::Index *raw_vectors) {
+  return dynamic_cast<const IndexIDMap *>(raw_vectors ? raw_vectors : &index);
+}
+
+// Adds vectors to `index`, and to `raw_vectors` if set.
+void add_vectors(faiss::Index *index, faiss::Index *raw_vectors, idx_t n,
+                 const float *x, const idx_t *ids) {
+  index->add_with_ids(n, x, ids);
+  if (raw_vectors)
+    raw_vectors->add_with_ids(n, x, ids);
+}
+
+// Removes the vectors with `ids` from `index`, and from `raw_vectors` if set.
+// Returns the number of vectors removed from `index`.
+size_t remove_vectors(faiss::Index *index, faiss::Index *raw_vectors,
+                      const std::vector<idx_t> &ids) {
+  const IDSelectorBatch selector(ids.size(), ids.data());
+  if (raw_vectors)
+    raw_vectors->remove_ids(selector);
+  return index->remove_ids(selector);
+}
+
+// Adds to `span` how much of `index` a search scans, as far as that's known
+// without instrumenting `faiss`: flat indexes scan every vector, IVF indexes
+// scan `nprobe` of their lists, and segmented indexes scan their unbuilt
+// segments by brute force and search the others with their own index.
+void add_scan_stats(const faiss::Index &index, ProfileSpan *span) {
+  profile::set_stat(span, "vectors_indexed", index.ntotal);
+
+  if (const auto *segmented_index =
+          dynamic_cast<const segmented::SegmentedIndex *>(&index)) {
+    const segmented::SegmentStats stats = segmented_index->stats();
+    profile::set_stat(span, "segments_searched",
+                      1 + stats.sealed_segments + stats.built_segments);
+    profile::set_stat(span, "flat_vectors_scanned", stats.flat_vectors);
+    return;
+  }
+
+  const faiss::Index *inner_index = &index;
+  if (const auto *id_map_index = dynamic_cast<const IndexIDMap *>(&index))
+    inner_index = id_map_index->index;
+
+  if (dynamic_cast<const faiss::IndexFlat *>(inner_index)) {
+    profile::set_stat(span, "vectors_scanned", index.ntotal);
+  } else if (const faiss::IndexIVF *ivf_index =
+                 faiss::ivflib::try_extract_index_ivf(&index)) {
+    profile::set_stat(span, "lists_scanned",
+                      std::min(ivf_index->nprobe, ivf_index->nlist));
+    profile::set_stat(span, "lists", ivf_index->nlist);
+  }
+}
+
+} // namespace
+
+Status index_service::faiss::pack_vectors(
+    const RepeatedPtrField<Vector> &vectors, int dimensions,
+    std::vector<idx_t> *ids, std::vector<float> *raw) {
+  for (const Vector &vector : vectors) {
+    const int vector_dimensions = encoding::num_values(vector);
+    if (vector_dimensions != dimensions) {
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    absl::StrFormat(
+                        "Found vector that does not match dimensions of index. "
+                        "Vector dimensions: (%d). Index dimensions: (%d).",
+                        vector_dimensions, dimensions));
+    }
+  }
+
+  const size_t offset = raw->size();
+  ids->reserve(ids->size() + vectors.size());
+  raw->resize(offset + (size_t)vectors.size() * dimensions);
+
+  // Decode each vector straight into its slot of the flat buffer.
+  float *out = raw->data() + offset;
+  for (const Vector &vector : vectors) {
+    ids->push_back(vector.id());
+    encoding::decode_vector(vector, dimensions, out);
+    out += dimensions;
+  }
+
+  return Status::OK;
+}
+
+FaissIndexServiceImpl::FaissIndexServiceImpl(
+    int dimensions, const char *factory_string, MetricType metric_type,
+    const executor::ExecutorConfig &executor_config,
+    const std::optional<segmented::SegmentConfig> &segment_config,
+    const admission::Limits &limits, const SharedResources &shared)
     : m_dimensions_(dimensions), m_factory_string_(factory_string),
-      m_metric_type_(metric_type),
-      m_index_(::faiss::index_factory(m_dimensions_, m_factory_string_,
-                                      m_metric_type_)),
-      m_ids_seen_{} {};
+      m_metric_type_(metric_type), m_segment_config_(segment_config),
+      m_index_(make_index(m_dimensions_, m_factory_string_.c_str(),
+                          m_metric_type_, m_segment_config_)),
+      m_raw_vectors_(
+          make_raw_vectors(*m_index_, m_dimensions_, m_metric_type_)),
+      m_ids_seen_{},
+      m_omp_threads_per_query_(executor_config.omp_threads_per_query),
+      m_search_limiter_(shared.search_limiter), m_limits_(limits),
+      m_epoch_(0), m_capturing_(false),
+      m_memory_budget_(shared.memory_budget),
+      m_rebuilding_(false), m_stopping_(false) {
+  if (!m_search_limiter_) {
+    m_own_search_limiter_ = std::make_unique<executor::ConcurrencyLimiter>(
+        executor_config.max_concurrent_queries);
+    m_search_limiter_ = m_own_search_limiter_.get();
+  }
+
+  if (!m_memory_budget_) {
+    m_own_memory_budget_ = std::make_unique<admission::MemoryBudget>(
+        m_limits_.memory_budget_bytes, &m_metrics_);
+    m_memory_budget_ = m_own_memory_budget_.get();
+  }
+}
+
+FaissIndexServiceImpl::~FaissIndexServiceImpl() {
+  m_stopping_ = true;
+
+  {
+    const std::lock_guard<std::mutex> _(m_rebuild_mutex_);
+    if (m_rebuild_thread_.joinable())
+      m_rebuild_thread_.join();
+  }
+
+  release_memory(m_ids_seen_.size());
+}
+
+Status FaissIndexServiceImpl::reserve_memory(size_t num_vectors) {
+  return m_memory_budget_->reserve(
+      num_vectors * admission::estimated_vector_bytes(m_dimensions_));
+}
+
+void FaissIndexServiceImpl::release_memory(size_t num_vectors) {
+  m_memory_budget_->release(num_vectors *
+                            admission::estimated_vector_bytes(m_dimensions_));
+}
 
 Status FaissIndexServiceImpl::Describe(ServerContext *context,
                                        const DescribeRequest *describe_request,
                                        DescribeResponse *describe_response) {
   LOG(INFO) << absl::StrFormat("Received describe request.");
 
+  const std::shared_lock<std::shared_mutex> _(m_mutex_);
   describe_response->set_dimensions(m_dimensions_);
   describe_response->set_num_vectors(m_index_->ntotal);
+  (*describe_response->mutable_metrics())["memory_estimated_bytes"] =
+      m_ids_seen_.size() * admission::estimated_vector_bytes(m_dimensions_);
+
+  if (const auto *segmented_index =
+          dynamic_cast<const segmented::SegmentedIndex *>(m_index_.get())) {
+    const segmented::SegmentStats stats = segmented_index->stats();
+    auto &metrics = *describe_response->mutable_metrics();
+    metrics["segment_buffer_vectors"] = stats.buffer_vectors;
+    metrics["segment_sealed_segments"] = stats.sealed_segments;
+    metrics["segment_built_segments"] = stats.built_segments;
+    metrics["segment_dead_vectors"] = stats.dead_vectors;
+  }
+
+  std::map<std::string, double> metrics = m_metrics_.snapshot();
+  if (metrics["rebuild_vectors_total"] > 0) {
+    metrics["rebuild_progress"] =
+        metrics["rebuild_vectors_added"] / metrics["rebuild_vectors_total"];
+  }
+  describe_response->mutable_metrics()->insert(metrics.begin(), metrics.end());
+
   return Status::OK;
 }
 
@@ -68,33 +339,50 @@ Status FaissIndexServiceImpl::Insert(ServerContext *context,
   std::vector<idx_t> ids;
   std::vector<float> vectors;
 
-  for (int i = 0; i < num_vectors; i++) {
-    Vector vector_ = insert_request->vectors()[i];
-    const idx_t id = vector_.id();
-    RepeatedField<float> raw = vector_.raw();
-
-    if (raw.size() != m_dimensions_) {
-      return Status(StatusCode::INVALID_ARGUMENT,
-                    absl::StrFormat(
-                        "Found vector that does not match dimensions of index. "
-                        "Vector dimensions: (%d). Index dimensions: (%d).",
-                        raw.size(), m_dimensions_));
+  Status status =
+      pack_vectors(insert_request->vectors(), m_dimensions_, &ids, &vectors);
+  if (!status.ok())
+    return status;
+
+  const std::lock_guard<std::shared_mutex> _(m_mutex_);
+
+  // Note: Ids repeated within the request are reserved for once per
+  // repetition, and the excess is released below.
+  const size_t num_reserved =
+      std::count_if(ids.begin(), ids.end(), [this](idx_t id) {
+        return m_ids_seen_.find(id) == m_ids_seen_.end();
+      });
+  status = reserve_memory(num_reserved);
+  if (!status.ok())
+    return status;
+
+  // Only insert vectors into the index if they're not already present by
+  // compacting new vectors to the front of the buffers.
+  // TODO: Support upsert for indexes that support removal.
+  int num_new = 0;
+  for (int i = 0; i < ids.size(); i++) {
+    if (!m_ids_seen_.insert(ids[i]).second)
+      continue;
+
+    if (num_new != i) {
+      ids[num_new] = ids[i];
+      std::copy_n(vectors.begin() + (size_t)i * m_dimensions_, m_dimensions_,
+                  vectors.begin() + (size_t)num_new * m_dimensions_);
     }
+    num_new++;
+  }
 
-    if (m_ids_seen_.find(id) == m_ids_seen_.end()) {
-      // Only insert the vector into the index if its not already present.
-      // TODO: Support upsert for indexes that support removal.
-      ids.push_back(id);
+  release_memory(num_reserved - num_new);
 
-      for (int j = 0; j < m_dimensions_; j++)
-        vectors.push_back(raw[j]);
+  add_vectors(m_index_.get(), m_raw_vectors_.get(), num_new, vectors.data(),
+              ids.data());
 
-      m_ids_seen_.insert(id);
-    }
+  if (m_capturing_) {
+    ids.resize(num_new);
+    vectors.resize((size_t)num_new * m_dimensions_);
+    capture_write({{}, std::move(ids), std::move(vectors)});
   }
 
-  m_index_->add_with_ids(ids.size(), vectors.data(), ids.data());
-
   return Status::OK;
 }
 
@@ -114,40 +402,41 @@ Status FaissIndexServiceImpl::Upsert(ServerContext *context,
 
   std::vector<idx_t> ids_to_update;
 
-  for (int i = 0; i < num_vectors; i++) {
-    Vector vector_ = upsert_request->vectors()[i];
-    const idx_t id = vector_.id();
-    RepeatedField<float> raw = vector_.raw();
+  Status status =
+      pack_vectors(upsert_request->vectors(), m_dimensions_, &ids, &vectors);
+  if (!status.ok())
+    return status;
 
-    if (raw.size() != m_dimensions_) {
-      return Status(StatusCode::INVALID_ARGUMENT,
-                    absl::StrFormat(
-                        "Found vector that does not match dimensions of index. "
-                        "Vector dimensions: (%d). Index dimensions: (%d).",
-                        raw.size(), m_dimensions_));
-    }
+  const std::lock_guard<std::shared_mutex> _(m_mutex_);
 
+  for (const idx_t id : ids) {
     if (m_ids_seen_.find(id) != m_ids_seen_.end())
       ids_to_update.push_back(id);
-
-    ids.push_back(id);
-    for (int j = 0; j < m_dimensions_; j++)
-      vectors.push_back(raw[j]);
   }
 
-  m_ids_seen_.insert(ids.begin(), ids.end());
+  const size_t num_reserved = ids.size() - ids_to_update.size();
+  status = reserve_memory(num_reserved);
+  if (!status.ok())
+    return status;
 
-  const IDSelectorBatch ids_to_update_selector(ids_to_update.size(),
-                                               ids_to_update.data());
-  m_index_->remove_ids(ids_to_update_selector);
+  const size_t num_ids_seen = m_ids_seen_.size();
+  m_ids_seen_.insert(ids.begin(), ids.end());
+  release_memory(num_reserved - (m_ids_seen_.size() - num_ids_seen));
 
-  m_index_->add_with_ids(ids.size(), vectors.data(), ids.data());
+  remove_vectors(m_index_.get(), m_raw_vectors_.get(), ids_to_update);
+  m_epoch_++;
+  add_vectors(m_index_.get(), m_raw_vectors_.get(), ids.size(),
+              vectors.data(), ids.data());
 
   LOG(INFO) << absl::StrFormat("Updated %d existing vectors.",
                                ids_to_update.size());
   LOG(INFO) << absl::StrFormat("Inserted %d new vectors.",
                                ids.size() - ids_to_update.size());
 
+  if (m_capturing_)
+    capture_write(
+        {std::move(ids_to_update), std::move(ids), std::move(vectors)});
+
   return Status::OK;
 }
 
@@ -157,16 +446,60 @@ Status FaissIndexServiceImpl::Search(ServerContext *context,
   LOG(INFO) << absl::StrFormat("Received search request. k=%d",
                                search_request->k());
 
+  const int query_dimensions = encoding::num_query_values(*search_request);
+  if (query_dimensions != m_dimensions_)
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat(
+                      "Found query that does not match dimensions of index. "
+                      "Query dimensions: (%d). Index dimensions: (%d).",
+                      query_dimensions, m_dimensions_));
+
+  Status status = admission::check_k(search_request->k(), m_limits_);
+  if (!status.ok())
+    return status;
+
   // Allocate arrays for neighbor IDs and scores to populate by search.
   int k = search_request->k();
-  auto *neighbor_ids = new idx_t[k];
-  auto *neighbor_scores = new float[k];
+  std::vector<idx_t> neighbor_ids(k);
+  std::vector<float> neighbor_scores(k);
 
-  // Prepare query vector.
-  RepeatedField<float> query_vector = search_request->query_vector();
+  ProfileSpan *search_profile =
+      profile::start(*search_request, search_response, "search");
+  profile::Timer timer(search_profile);
 
   // Search for nearest neighbors of query vector.
-  m_index_->search(1, query_vector.data(), k, neighbor_scores, neighbor_ids);
+  // Note: Plain float queries are read in place so they aren't copied; only
+  // encoded queries are decoded into a buffer, before waiting for a search
+  // slot so the slot isn't held while decoding.
+  std::vector<float> decoded_query;
+  const float *query_vector = search_request->query_vector().data();
+  if (search_request->query_encoding() != index_service::ENCODING_FLOAT32) {
+    decoded_query.resize(m_dimensions_);
+    encoding::decode(search_request->query_encoding(),
+                     search_request->query_codes(),
+                     search_request->query_scale(), m_dimensions_,
+                     decoded_query.data());
+    query_vector = decoded_query.data();
+  }
+  timer.skip();
+
+  // Wait for a search slot, so that concurrent searches don't use more
+  // threads than there are CPUs.
+  const executor::ConcurrencyLimiter::Slot slot(m_search_limiter_);
+
+  // Note: This only sets the size of OpenMP teams started from the calling
+  // thread, which is what `faiss` uses below.
+  if (m_omp_threads_per_query_ > 0)
+    omp_set_num_threads(m_omp_threads_per_query_);
+
+  const std::shared_lock<std::shared_mutex> _(m_mutex_);
+  timer.lap("queue_wait");
+
+  m_index_->search(1, query_vector, k, neighbor_scores.data(),
+                   neighbor_ids.data());
+
+  if (ProfileSpan *span = timer.lap("faiss_search"))
+    add_scan_stats(*m_index_, span);
 
   // Build response using `neighbor_scores` and `neighbor_ids` populated by
   // search.
@@ -176,8 +509,441 @@ Status FaissIndexServiceImpl::Search(ServerContext *context,
     neighbor.set_score(neighbor_scores[i]);
     search_response->add_neighbors()->CopyFrom(neighbor);
   }
+  timer.finish();
 
   LOG(INFO) << absl::StrFormat("Successfully searched.");
 
   return Status::OK;
 }
+
+Status FaissIndexServiceImpl::Export(ServerContext *context,
+                                     const ExportRequest *export_request,
+                                     ServerWriter<ExportResponse> *writer) {
+  const algo::IdFilter filter{
+      export_request->begin_id(), export_request->end_id(),
+      export_request->num_buckets(), export_request->bucket()};
+  const int batch_size =
+      algo::export_batch_size(export_request->batch_size(), m_dimensions_);
+
+  LOG(INFO) << absl::StrFormat(
+      "Received export request. begin_id=%d, end_id=%d, num_buckets=%d, "
+      "bucket=%d, batch_size=%d",
+      filter.begin_id, filter.end_id, filter.num_buckets, filter.bucket,
+      batch_size);
+
+  if (filter.num_buckets && filter.bucket >= filter.num_buckets)
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat("Expected a bucket less than %d. Bucket: "
+                                  "(%d).",
+                                  filter.num_buckets, filter.bucket));
+
+  // Note: Only snapshot the ids of the selected vectors and where they're
+  // stored while holding the lock. Each batch is then copied while holding
+  // the lock again, and streamed after releasing it, so writers wait for at
+  // most one batch to be copied, and a slow reader never blocks them.
+  std::vector<ExportedVector> selected;
+  uint64_t epoch;
+  {
+    const std::shared_lock<std::shared_mutex> _(m_mutex_);
+    if (const IndexIDMap *vectors =
+            positioned_vectors(*m_index_, m_raw_vectors_.get())) {
+      for (idx_t i = 0; i < vectors->ntotal; i++) {
+        if (filter.matches(vectors->id_map[i]))
+          selected.push_back({vectors->id_map[i], i});
+      }
+    } else if (const auto *segmented_index =
+                   dynamic_cast<const segmented::SegmentedIndex *>(
+                       m_index_.get())) {
+      segmented_index->for_each([&](idx_t id, const float *values) {
+        if (filter.matches(id))
+          selected.push_back({id, -1});
+      });
+    } else {
+      return Status(StatusCode::UNIMPLEMENTED,
+                    absl::StrFormat("%s indexes don't map vectors to ids.",
+                                    m_factory_string_));
+    }
+    epoch = m_epoch_;
+  }
+
+  // Export in id order, so exports of several shards can be merged and an
+  // interrupted export can resume from the last id it received.
+  std::sort(selected.begin(), selected.end(),
+            [](const ExportedVector &a, const ExportedVector &b) {
+              return a.id < b.id;
+            });
+
+  // Note: Reuse one response, so its vectors are only allocated once.
+  ExportResponse batch;
+  int num_batches = 0;
+  size_t num_exported = 0;
+  for (size_t begin = 0; begin < selected.size(); begin += batch_size) {
+    const size_t end = std::min(selected.size(), begin + batch_size);
+    batch.mutable_vectors()->Clear();
+    {
+      const std::shared_lock<std::shared_mutex> _(m_mutex_);
+      const Status status =
+          read_export_batch(&selected, begin, end, &epoch, &batch);
+      if (!status.ok())
+        return status;
+    }
+
+    // Skip batches whose vectors were all removed since the snapshot.
+    if (!batch.vectors_size())
+      continue;
+
+    if (!writer->Write(batch))
+      return Status(StatusCode::CANCELLED, "Export was cancelled.");
+    num_batches++;
+    num_exported += batch.vectors_size();
+  }
+
+  LOG(INFO) << absl::StrFormat("Exported %d vectors in %d batches.",
+                               num_exported, num_batches);
+
+  return Status::OK;
+}
+
+Status FaissIndexServiceImpl::read_export_batch(
+    std::vector<ExportedVector> *selected, size_t begin, size_t end,
+    uint64_t *epoch, ExportResponse *batch) {
+  const IndexIDMap *vectors =
+      positioned_vectors(*m_index_, m_raw_vectors_.get());
+
+  // Note: Segmented indexes can only be read as a whole, so the vectors of
+  // the batch are picked out of a scan of every vector.
+  if (!vectors) {
+    const auto &segmented_index =
+        dynamic_cast<const segmented::SegmentedIndex &>(*m_index_);
+    std::unordered_map<idx_t, size_t> slots;
+    for (size_t i = begin; i < end; i++)
+      slots[(*selected)[i].id] = i - begin;
+
+    std::vector<float> raw((end - begin) * m_dimensions_);
+    std::vector<bool> found(end - begin);
+    segmented_index.for_each([&](idx_t id, const float *values) {
+      auto it = slots.find(id);
+      if (it == slots.end())
+        return;
+      std::copy_n(values, m_dimensions_,
+                  raw.data() + it->second * m_dimensions_);
+      found[it->second] = true;
+    });
+
+    for (size_t i = 0; i < end - begin; i++) {
+      if (!found[i])
+        continue;
+      Vector *vector = batch->add_vectors();
+      vector->set_id((*selected)[begin + i].id);
+      const float *values = raw.data() + i * m_dimensions_;
+      vector->mutable_raw()->Add(values, values + m_dimensions_);
+    }
+    return Status::OK;
+  }
+
+  // Removes, upserts and rebuilds move vectors, so look up where the vectors
+  // left to export are stored again if any ran since the last lookup.
+  // Vectors removed since the snapshot aren't found, and are skipped.
+  if (*epoch != m_epoch_) {
+    std::unordered_map<idx_t, size_t> remaining;
+    for (size_t i = begin; i < selected->size(); i++) {
+      remaining[(*selected)[i].id] = i;
+      (*selected)[i].position = -1;
+    }
+    for (idx_t i = 0; i < vectors->ntotal; i++) {
+      auto it = remaining.find(vectors->id_map[i]);
+      if (it != remaining.end())
+        (*selected)[it->second].position = i;
+    }
+    *epoch = m_epoch_;
+  }
+
+  try {
+    for (size_t i = begin; i < end; i++) {
+      const ExportedVector &exported = (*selected)[i];
+      if (exported.position < 0)
+        continue;
+
+      Vector *vector = batch->add_vectors();
+      vector->set_id(exported.id);
+      vector->mutable_raw()->Resize(m_dimensions_, 0);
+      vectors->index->reconstruct(exported.position,
+                                  vector->mutable_raw()->mutable_data());
+    }
+  } catch (const std::exception &e) {
+    // Note: e.g. IVF indexes restored from a snapshot can only reconstruct
+    // vectors with a direct map.
+    return Status(StatusCode::UNIMPLEMENTED,
+                  absl::StrFormat("%s indexes can't reconstruct vectors: %s",
+                                  m_factory_string_, e.what()));
+  }
+
+  return Status::OK;
+}
+
+Status FaissIndexServiceImpl::Remove(ServerContext *context,
+                                     const RemoveRequest *remove_request,
+                                     RemoveResponse *remove_response) {
+  LOG(INFO) << absl::StrFormat("Received remove request. num_ids=%d",
+                               remove_request->ids_size());
+
+  const std::vector<idx_t> ids(remove_request->ids().begin(),
+                               remove_request->ids().end());
+
+  const std::lock_guard<std::shared_mutex> _(m_mutex_);
+
+  size_t num_forgotten = 0;
+  for (const idx_t id : ids)
+    num_forgotten += m_ids_seen_.erase(id);
+  release_memory(num_forgotten);
+
+  remove_response->set_num_removed(
+      remove_vectors(m_index_.get(), m_raw_vectors_.get(), ids));
+  m_epoch_++;
+
+  if (m_capturing_)
+    capture_write({ids, {}, {}});
+
+  LOG(INFO) << absl::StrFormat("Removed %d vectors.",
+                               remove_response->num_removed());
+
+  return Status::OK;
+}
+
+Status FaissIndexServiceImpl::Rebuild(ServerContext *context,
+                                      const RebuildRequest *rebuild_request,
+                                      RebuildResponse *rebuild_response) {
+  LOG(INFO) << absl::StrFormat(
+      "Received rebuild request. factory_string=%s, build_threads=%d",
+      rebuild_request->factory_string(), rebuild_request->build_threads());
+
+  const std::lock_guard<std::mutex> rebuild_lock(m_rebuild_mutex_);
+  if (m_rebuilding_)
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  "A rebuild is already in progress.");
+
+  // Join the thread of the last rebuild, which has finished.
+  if (m_rebuild_thread_.joinable())
+    m_rebuild_thread_.join();
+
+  std::string factory_string = rebuild_request->factory_string();
+  if (factory_string.empty()) {
+    const std::shared_lock<std::shared_mutex> _(m_mutex_);
+    factory_string = m_factory_string_;
+  }
+
+  // Create the new index up front, so an invalid factory string fails the
+  // request rather than the rebuild.
+  std::unique_ptr<::faiss::Index> index;
+  std::unique_ptr<::faiss::Index> raw_vectors;
+  try {
+    index = make_index(m_dimensions_, factory_string.c_str(), m_metric_type_,
+                       m_segment_config_);
+    raw_vectors = make_raw_vectors(*index, m_dimensions_, m_metric_type_);
+  } catch (const std::exception &e) {
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat("Failed to create %s index: %s",
+                                  factory_string, e.what()));
+  }
+
+  // Snapshot the vectors and start capturing writes at the same time, so
+  // every write is either in the snapshot or replayed after it.
+  // Note: Writes hold `m_mutex_` exclusively, so none can run while the
+  // snapshot is taken. Searches can.
+  std::vector<idx_t> ids;
+  std::vector<float> raw;
+  int64_t reserved_bytes;
+  {
+    const std::shared_lock<std::shared_mutex> _(m_mutex_);
+
+    // Reserve the memory of the snapshot and of the new index, which each
+    // take about as much as the current index, or twice as much for a new
+    // index that keeps the raw vectors next to it. Both are held until the
+    // rebuild ends.
+    const int64_t snapshot_bytes =
+        m_index_->ntotal * admission::estimated_vector_bytes(m_dimensions_);
+    reserved_bytes = snapshot_bytes + (raw_vectors ? 2 : 1) * snapshot_bytes;
+    Status status = m_memory_budget_->reserve(reserved_bytes);
+    if (!status.ok())
+      return status;
+
+    ids.reserve(m_index_->ntotal);
+    raw.reserve((size_t)m_index_->ntotal * m_dimensions_);
+    status = for_each_vector(
+        *m_index_, m_raw_vectors_.get(), m_dimensions_, m_factory_string_,
+        [&](idx_t id, const float *values) {
+          ids.push_back(id);
+          raw.insert(raw.end(), values, values + m_dimensions_);
+        });
+    if (!status.ok()) {
+      m_memory_budget_->release(reserved_bytes);
+      return status;
+    }
+
+    m_capturing_ = true;
+  }
+
+  rebuild_response->set_num_vectors(ids.size());
+  m_rebuilding_ = true;
+  m_rebuild_thread_ = std::thread(
+      &FaissIndexServiceImpl::run_rebuild, this, std::move(index),
+      std::move(raw_vectors), std::move(factory_string), std::move(ids),
+      std::move(raw), reserved_bytes,
+      std::max<int>(1, rebuild_request->build_threads()));
+
+  return Status::OK;
+}
+
+Status FaissIndexServiceImpl::restore(std::unique_ptr<::faiss::Index> index) {
+  if (m_segment_config_)
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  "Segmented indexes can't be restored from a snapshot.");
+
+  if (index->d != m_dimensions_ || index->metric_type != m_metric_type_)
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat(
+                      "Found snapshot that does not match index. Snapshot "
+                      "dimensions: (%d). Index dimensions: (%d). Snapshot "
+                      "metric: (%d). Index metric: (%d).",
+                      index->d, m_dimensions_, index->metric_type,
+                      m_metric_type_));
+
+  const auto *id_map_index = dynamic_cast<const IndexIDMap *>(index.get());
+  if (!id_map_index)
+    return Status(StatusCode::UNIMPLEMENTED,
+                  "Snapshots must map vectors to ids, e.g. with an IDMap "
+                  "prefix.");
+
+  const std::lock_guard<std::shared_mutex> _(m_mutex_);
+  if (m_index_->ntotal || m_capturing_)
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  "Only empty indexes can be restored from a snapshot.");
+
+  const Status status = reserve_memory(id_map_index->id_map.size());
+  if (!status.ok())
+    return status;
+
+  m_ids_seen_.reserve(id_map_index->id_map.size());
+  m_ids_seen_.insert(id_map_index->id_map.begin(), id_map_index->id_map.end());
+  release_memory(id_map_index->id_map.size() - m_ids_seen_.size());
+
+  // Note: The empty index is destroyed when `index` goes out of scope. The
+  // raw vectors of a snapshot aren't known, so they're decoded from it if
+  // it's exported or rebuilt.
+  m_index_.swap(index);
+  m_raw_vectors_.reset();
+  m_epoch_++;
+
+  LOG(INFO) << absl::StrFormat("Restored index with %d vectors.",
+                               m_index_->ntotal);
+
+  return Status::OK;
+}
+
+void FaissIndexServiceImpl::capture_write(CapturedWrite write) {
+  m_captured_writes_.push_back(std::move(write));
+}
+
+void FaissIndexServiceImpl::run_rebuild(
+    std::unique_ptr<::faiss::Index> index,
+    std::unique_ptr<::faiss::Index> raw_vectors, std::string factory_string,
+    std::vector<idx_t> ids, std::vector<float> raw, int64_t reserved_bytes,
+    int build_threads) {
+  metrics::Gauge *in_progress = m_metrics_.gauge("rebuild_in_progress");
+  metrics::Gauge *vectors_total = m_metrics_.gauge("rebuild_vectors_total");
+  metrics::Gauge *vectors_added = m_metrics_.gauge("rebuild_vectors_added");
+  metrics::Counter *writes_replayed =
+      m_metrics_.counter("rebuild_writes_replayed");
+
+  in_progress->set(1);
+  vectors_total->set(ids.size());
+  vectors_added->set(0);
+
+  // Note: This only sets the size of OpenMP teams started from this thread,
+  // which is what `faiss` uses to train and add to `index`.
+  omp_set_num_threads(build_threads);
+
+  auto replay = [&](const std::vector<CapturedWrite> &writes) {
+    for (const CapturedWrite &write : writes) {
+      if (!write.removed_ids.empty())
+        remove_vectors(index.get(), raw_vectors.get(), write.removed_ids);
+      if (!write.ids.empty())
+        add_vectors(index.get(), raw_vectors.get(), write.ids.size(),
+                    write.raw.data(), write.ids.data());
+    }
+    writes_replayed->increment(writes.size());
+  };
+
+  bool swapped = false;
+  try {
+    const idx_t num_vectors = ids.size();
+    if (!index->is_trained && num_vectors > 0)
+      index->train(num_vectors, raw.data());
+
+    for (idx_t i = 0; i < num_vectors && !m_stopping_;
+         i += kRebuildBatchSize) {
+      const idx_t batch_size = std::min<idx_t>(kRebuildBatchSize,
+                                               num_vectors - i);
+      add_vectors(index.get(), raw_vectors.get(), batch_size,
+                  raw.data() + i * m_dimensions_, ids.data() + i);
+      vectors_added->set(i + batch_size);
+    }
+
+    // Note: Free the snapshot before replaying writes, which may take a
+    // while.
+    std::vector<idx_t>().swap(ids);
+    std::vector<float>().swap(raw);
+
+    // Build a segmented index's segments before it serves searches.
+    if (auto *segmented_index =
+            dynamic_cast<segmented::SegmentedIndex *>(index.get()))
+      segmented_index->wait_until_idle();
+
+    // Replay captured writes without the lock until few enough are left to
+    // replay with it, so writes aren't blocked for long.
+    while (!m_stopping_) {
+      std::vector<CapturedWrite> writes;
+      {
+        const std::lock_guard<std::shared_mutex> _(m_mutex_);
+        if (m_captured_writes_.size() <= kMaxWritesReplayedUnderLock) {
+          replay(m_captured_writes_);
+
+          // Note: Searches hold the lock while using `m_index_`, so they
+          // see either the old or the new index, never neither.
+          m_index_.swap(index);
+          m_raw_vectors_.swap(raw_vectors);
+          m_factory_string_ = factory_string;
+          m_epoch_++;
+          swapped = true;
+          break;
+        }
+        writes.swap(m_captured_writes_);
+      }
+      replay(writes);
+    }
+  } catch (const std::exception &e) {
+    LOG(ERROR) << absl::StrFormat("Failed to rebuild %s index: %s",
+                                  factory_string, e.what());
+    m_metrics_.counter("rebuild_errors")->increment();
+  }
+
+  {
+    const std::lock_guard<std::shared_mutex> _(m_mutex_);
+    m_capturing_ = false;
+    m_captured_writes_.clear();
+  }
+
+  if (swapped) {
+    m_metrics_.counter("rebuilds_completed")->increment();
+    LOG(INFO) << absl::StrFormat("Swapped in rebuilt %s index.",
+                                 factory_string);
+  }
+
+  // Note: After a swap, this destroys the old index outside of the lock.
+  index.reset();
+  raw_vectors.reset();
+  m_memory_budget_->release(reserved_bytes);
+
+  in_progress->set(0);
+  m_rebuilding_ = false;
+}
@@ -2,18 +2,52 @@
 
 #include <faiss/Index.h>
 #include <faiss/MetricType.h>
+#include <google/protobuf/repeated_field.h>
 #include <grpc/grpc.h>
 #include <grpcpp/server.h>
 #include <grpcpp/server_context.h>
+#include <grpcpp/support/sync_stream.h>
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <unordered_set>
+#include <vector>
 
+#include "src/cpp/admission.h"
+#include "src/cpp/metrics.h"
+#include "src/cpp/segmented_index.h"
+#include "src/cpp/threading.h"
 #include "src/proto/index_service.grpc.pb.h"
 
 namespace index_service::faiss {
 
+// Validates that every vector has `dimensions` values and appends their ids
+// and raw values to `ids` and `raw`, the flat, contiguous buffers `faiss`
+// expects. Encoded vectors are decoded directly into `raw`. Returns
+// `INVALID_ARGUMENT` without appending anything if any vector has the wrong
+// dimensions.
+grpc::Status
+pack_vectors(const google::protobuf::RepeatedPtrField<index_service::Vector>
+                 &vectors,
+             int dimensions, std::vector<::faiss::idx_t> *ids,
+             std::vector<float> *raw);
+
+// Resources that the indexes of a process share, e.g. the collections of a
+// `CollectionServiceImpl`. A service creates its own for any that isn't set.
+struct SharedResources {
+  // Bounds the number of searches running at once across indexes.
+  executor::ConcurrencyLimiter *search_limiter = nullptr;
+
+  // Accounts for the memory of vectors across indexes.
+  admission::MemoryBudget *memory_budget = nullptr;
+};
+
 // Note: `public` inheritance makes `public` members of the base class
 // `public` in the derived class, `protected` members of the base class become
 // `protected` (i.e. accessible to inherited classes) in the derived class.
@@ -23,10 +57,27 @@ class FaissIndexServiceImpl final
 public:
   // Note: The `explicit` function specific disallows implicit type conversions.
   // For example, `FaissIndexServiceImple service = 1;` is disallowed.
-  explicit FaissIndexServiceImpl(int dimensions,
-                                 const char *factory_string = "IDMap,Flat",
-                                 ::faiss::MetricType metric_type =
-                                     ::faiss::MetricType::METRIC_INNER_PRODUCT);
+  // `executor_config` bounds the number of concurrent searches and the
+  // number of OpenMP threads each search may use.
+  // If `segment_config` is set, vectors are written to a flat buffer and
+  // built into `factory_string` segments in the background (see
+  // `segmented::SegmentedIndex`), rather than written straight to a single
+  // `factory_string` index.
+  // `limits` bounds the `k` of searches and the memory spent on vectors.
+  // `shared` must outlive the service.
+  explicit FaissIndexServiceImpl(
+      int dimensions, const char *factory_string = "IDMap,Flat",
+      ::faiss::MetricType metric_type =
+          ::faiss::MetricType::METRIC_INNER_PRODUCT,
+      const executor::ExecutorConfig &executor_config = {},
+      const std::optional<segmented::SegmentConfig> &segment_config =
+          std::nullopt,
+      const admission::Limits &limits = {},
+      const SharedResources &shared = {});
+
+  // Stops any rebuild in progress without swapping in its index, and
+  // releases the memory of its vectors to the budget.
+  ~FaissIndexServiceImpl();
 
   grpc::Status Describe(grpc::ServerContext *context,
                         const index_service::DescribeRequest *describe_request,
@@ -44,7 +95,87 @@ public:
                       const index_service::SearchRequest *search_request,
                       index_service::SearchResponse *search_response);
 
+  // Only supported by `IDMap` and segmented indexes, which can map their
+  // vectors back to ids. Exports the raw vectors written to the index, even
+  // if it only stores them approximately, e.g. PQ.
+  // The vectors to export are selected when the export starts, and each batch
+  // of them is copied while writes wait and streamed after writes resume, so
+  // a slow reader never blocks writes. Vectors removed in between are
+  // skipped, and vectors overwritten in between are exported as overwritten.
+  grpc::Status
+  Export(grpc::ServerContext *context,
+         const index_service::ExportRequest *export_request,
+         grpc::ServerWriter<index_service::ExportResponse> *writer);
+
+  grpc::Status Remove(grpc::ServerContext *context,
+                      const index_service::RemoveRequest *remove_request,
+                      index_service::RemoveResponse *remove_response);
+
+  // Only supported by indexes that support `Export`, since the new index is
+  // built from the vectors of the current one. The snapshot of those
+  // vectors and the new index are charged to the memory budget until the
+  // rebuild ends, and the request fails with `RESOURCE_EXHAUSTED` if they
+  // don't fit.
+  grpc::Status Rebuild(grpc::ServerContext *context,
+                       const index_service::RebuildRequest *rebuild_request,
+                       index_service::RebuildResponse *rebuild_response);
+
+  // Replaces this index, which must be empty, with `index`, e.g. a snapshot
+  // built offline by `index_builder`. `index` must have the dimensions and
+  // metric of this index and map its vectors to ids, e.g. with an `IDMap`
+  // prefix. Segmented indexes can't be restored. Unless `index` is flat, it
+  // must be able to reconstruct its vectors to be exported or rebuilt.
+  grpc::Status restore(std::unique_ptr<::faiss::Index> index);
+
+  // The registry of metrics exported through `Describe`.
+  metrics::Registry *metrics() { return &m_metrics_; }
+
 private:
+  // A write made while rebuilding, to replay on the new index: `removed_ids`
+  // are removed first, and then `ids` are added with the values in `raw`.
+  struct CapturedWrite {
+    std::vector<::faiss::idx_t> removed_ids;
+    std::vector<::faiss::idx_t> ids;
+    std::vector<float> raw;
+  };
+
+  // A vector selected by an export, and its position in the vectors the
+  // export reads, or -1 if it's not known, e.g. for segmented indexes, or if
+  // it was removed.
+  struct ExportedVector {
+    ::faiss::idx_t id;
+    ::faiss::idx_t position;
+  };
+
+  // Reserves the memory of `num_vectors` more vectors, or returns
+  // `RESOURCE_EXHAUSTED` if that would exceed the memory budget.
+  grpc::Status reserve_memory(size_t num_vectors);
+
+  // Returns the memory of `num_vectors` vectors to the memory budget.
+  void release_memory(size_t num_vectors);
+
+  // Appends the vectors in `[begin, end)` of `selected` to `batch`, skipping
+  // those that were removed. Looks up the positions of the vectors left to
+  // export again if vectors moved since `epoch`, and updates it.
+  // Note: The caller must hold `m_mutex_`.
+  grpc::Status read_export_batch(std::vector<ExportedVector> *selected,
+                                 size_t begin, size_t end, uint64_t *epoch,
+                                 index_service::ExportResponse *batch);
+
+  // Records a write to replay on the index being rebuilt, if any.
+  // Note: The caller must hold `m_mutex_` exclusively.
+  void capture_write(CapturedWrite write);
+
+  // Builds `index` and `raw_vectors`, if set, from the snapshot of vectors
+  // in `ids` and `raw`, replays the writes captured since the snapshot on
+  // them, and swaps them in. Releases `reserved_bytes` to the memory budget
+  // when done.
+  void run_rebuild(std::unique_ptr<::faiss::Index> index,
+                   std::unique_ptr<::faiss::Index> raw_vectors,
+                   std::string factory_string,
+                   std::vector<::faiss::idx_t> ids, std::vector<float> raw,
+                   int64_t reserved_bytes, int build_threads);
+
   // Note: The google style guide calls for class data members variables
   // to be suffixed with trailing underscores. The `m_` prefix comes
   // from https://en.wikipedia.org/wiki/Hungarian_notation.
@@ -53,16 +184,78 @@ private:
   int m_dimensions_;
 
   // The `faiss` factory string used to construct this index.
-  const char *m_factory_string_;
+  std::string m_factory_string_;
 
   // The `faiss` similarity metric type that this index supports.
   ::faiss::MetricType m_metric_type_;
 
+  // If set, `m_index_` is a segmented index with segments built with
+  // `m_factory_string_`.
+  std::optional<segmented::SegmentConfig> m_segment_config_;
+
   // The actual `faiss` index storing the vectors.
   std::unique_ptr<::faiss::Index> m_index_;
 
+  // The raw vectors of `m_index_`, if it can't reconstruct them exactly
+  // (e.g. IVF or PQ indexes), as an `IDMap` over a flat index. Written
+  // along with `m_index_`, and read by exports and rebuilds instead of it.
+  std::unique_ptr<::faiss::Index> m_raw_vectors_;
+
   // The identifiers we've seen so far.
   std::unordered_set<int> m_ids_seen_;
+
+  // The number of OpenMP threads `faiss` may use for a single search, or
+  // non-positive to use OpenMP's default.
+  int m_omp_threads_per_query_;
+
+  // Bounds the number of searches running at once, possibly across
+  // services.
+  executor::ConcurrencyLimiter *m_search_limiter_;
+
+  // Set if `m_search_limiter_` isn't shared.
+  std::unique_ptr<executor::ConcurrencyLimiter> m_own_search_limiter_;
+
+  admission::Limits m_limits_;
+
+  // Guards `m_index_`, `m_raw_vectors_`, `m_ids_seen_` and the captured
+  // writes. Writes (inserts, upserts and removes) and swapping in a rebuilt
+  // index hold it exclusively; reads (searches, describes and exports) share
+  // it, since `faiss` indexes support concurrent searches but not searches
+  // concurrent with writes.
+  std::shared_mutex m_mutex_;
+
+  // Incremented by every write that may move vectors within `m_index_` or
+  // `m_raw_vectors_`, i.e. upserts, removes, and swapping in a rebuilt or
+  // restored index, so exports know when to look up their positions again.
+  // Inserts only append vectors. Guarded by `m_mutex_`.
+  uint64_t m_epoch_;
+
+  // Whether writes are captured for the index being rebuilt.
+  bool m_capturing_;
+
+  // The writes made since the snapshot a rebuild started from, in order.
+  std::vector<CapturedWrite> m_captured_writes_;
+
+  metrics::Registry m_metrics_;
+
+  // Accounts for the memory of the vectors in `m_ids_seen_`, possibly across
+  // services.
+  admission::MemoryBudget *m_memory_budget_;
+
+  // Set if `m_memory_budget_` isn't shared.
+  std::unique_ptr<admission::MemoryBudget> m_own_memory_budget_;
+
+  // Serializes `Rebuild` requests and guards `m_rebuild_thread_`.
+  std::mutex m_rebuild_mutex_;
+
+  // The thread running the current or last rebuild, if any.
+  std::thread m_rebuild_thread_;
+
+  // Whether a rebuild is in progress.
+  std::atomic<bool> m_rebuilding_;
+
+  // Set to stop a rebuild in progress.
+  std::atomic<bool> m_stopping_;
 };
 
 } // namespace index_service::faiss
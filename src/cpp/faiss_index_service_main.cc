@@ -1,45 +1,220 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/log/log.h"
+#include "absl/status/statusor.h"
 #include "absl/strings/str_format.h"
 #include "grpc/grpc.h"
 #include "grpcpp/security/server_credentials.h"
 #include "grpcpp/server_builder.h"
-#include "src/cpp/faiss_index_service.h"
+#include "src/cpp/admission.h"
+#include "src/cpp/async_server.h"
+#include "src/cpp/collection_service.h"
+#include "src/cpp/segmented_index.h"
+#include "src/cpp/snapshot.h"
+#include "src/cpp/threading.h"
+
+ABSL_FLAG(std::string, threading_policy, "inter_query",
+          "`inter_query` to run many concurrent searches with one thread "
+          "each, or `intra_query` to run few concurrent searches with many "
+          "threads each.");
+ABSL_FLAG(int, num_cpus, 0,
+          "Number of CPUs to size threads for. Defaults to all CPUs.");
+ABSL_FLAG(int, max_concurrent_queries, 0,
+          "Number of searches that may run at once. Defaults to the number of "
+          "CPUs for `inter_query` and 1 for `intra_query`.");
+ABSL_FLAG(int, max_queued_queries, 64,
+          "Number of searches that may wait for a search slot before new "
+          "searches are rejected, lowest priority first.");
+ABSL_FLAG(std::string, factory_string, "IDMap,Flat",
+          "The `faiss` factory string of the index, e.g. `IDMap,HNSW32`. Must "
+          "map vectors to ids, e.g. with an `IDMap` prefix.");
+ABSL_FLAG(std::string, snapshot, "",
+          "Path of a snapshot written by `index_builder` to serve from "
+          "startup, e.g. one shard of a sharded snapshot. Its dimensions must "
+          "match <dimensions>. Not supported with `--segment_buffer_size`.");
+ABSL_FLAG(int, segment_buffer_size, 0,
+          "If positive, vectors are written to a flat buffer of this many "
+          "vectors, which is built into a `--factory_string` segment in the "
+          "background once full. Otherwise vectors are written straight to a "
+          "single `--factory_string` index.");
+ABSL_FLAG(int, max_segments, 8,
+          "Number of built segments above which the smallest segments are "
+          "merged. Only used with `--segment_buffer_size`.");
+ABSL_FLAG(int, segment_build_threads, 1,
+          "Number of OpenMP threads used to build segments in the background. "
+          "Only used with `--segment_buffer_size`.");
+ABSL_FLAG(int, num_cqs, 1,
+          "Number of gRPC completion queues, each polled by its own thread.");
+ABSL_FLAG(std::string, poller_cpus, "",
+          "CPUs to pin completion queue polling threads to, e.g. `0-1`, one "
+          "CPU per thread. Pollers aren't pinned if empty.");
+ABSL_FLAG(int, compute_threads, 0,
+          "Number of threads that handle requests. Defaults to "
+          "`--max_concurrent_queries`.");
+ABSL_FLAG(std::string, compute_cpus, "",
+          "CPUs to pin compute threads to, e.g. `2-15`. Compute threads "
+          "aren't pinned if empty.");
+ABSL_FLAG(int64_t, memory_budget_bytes, 0,
+          "Approximate number of bytes of vectors all collections together "
+          "may store, estimated from their dimensions. Writes beyond it are "
+          "rejected. Unbounded if 0.");
+ABSL_FLAG(int, max_k, 1000,
+          "Largest `k` a search may ask for. Unbounded if 0.");
+ABSL_FLAG(int, codel_target_ms, 5,
+          "Queueing delay searches are kept under. Once even the shortest "
+          "queueing delay stays above it for `--codel_interval_ms`, searches "
+          "that queued for more than twice as long are shed.");
+ABSL_FLAG(int, codel_interval_ms, 100,
+          "Window over which queueing delay must stay above "
+          "`--codel_target_ms` before searches are shed.");
 
 using absl::ParseCommandLine;
 using grpc::InsecureServerCredentials;
 using grpc::Server;
 using grpc::ServerBuilder;
-using index_service::faiss::FaissIndexServiceImpl;
+using index_service::collections::CollectionServiceImpl;
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    std::cout << "Expected 2 arguments." << std::endl;
+  std::vector<char *> args = ParseCommandLine(argc, argv);
+  if (args.size() != 3) {
+    std::cout << "Expected 2 arguments: <port> <dimensions>." << std::endl;
+    return 1;
+  }
+
+  int port = std::stoi(args[1]);
+  int dimensions = std::stoi(args[2]);
+
+  absl::StatusOr<executor::ThreadingPolicy> threading_policy =
+      executor::parse_threading_policy(absl::GetFlag(FLAGS_threading_policy));
+  if (!threading_policy.ok()) {
+    std::cout << threading_policy.status() << std::endl;
+    return 1;
+  }
+
+  int num_cpus = absl::GetFlag(FLAGS_num_cpus);
+  if (num_cpus <= 0)
+    num_cpus = std::thread::hardware_concurrency();
+
+  const executor::ExecutorConfig executor_config =
+      executor::make_executor_config(
+          *threading_policy, num_cpus,
+          absl::GetFlag(FLAGS_max_concurrent_queries),
+          absl::GetFlag(FLAGS_max_queued_queries));
+
+  LOG(INFO) << absl::StrFormat(
+      "Using threading policy %s. max_concurrent_queries=%d, "
+      "omp_threads_per_query=%d, max_server_threads=%d",
+      absl::GetFlag(FLAGS_threading_policy),
+      executor_config.max_concurrent_queries,
+      executor_config.omp_threads_per_query,
+      executor_config.max_server_threads);
+
+  int compute_threads = absl::GetFlag(FLAGS_compute_threads);
+  if (compute_threads <= 0)
+    compute_threads = executor_config.max_concurrent_queries;
+
+  // Note: Allow one more pending request than the searches admission can
+  // hold, so a search arriving at a full queue can still displace a lower
+  // priority one.
+  const int max_queued_queries =
+      std::max(0, absl::GetFlag(FLAGS_max_queued_queries));
+  absl::StatusOr<index_service::async::AsyncServerConfig> async_config =
+      index_service::async::make_async_server_config(
+          absl::GetFlag(FLAGS_num_cqs), absl::GetFlag(FLAGS_poller_cpus),
+          compute_threads, absl::GetFlag(FLAGS_compute_cpus),
+          executor_config.max_concurrent_queries + max_queued_queries + 1);
+  if (!async_config.ok()) {
+    std::cout << async_config.status() << std::endl;
     return 1;
   }
+  async_config->search_admission.max_in_flight =
+      executor_config.max_concurrent_queries;
+  async_config->search_admission.max_queued = max_queued_queries;
+  async_config->search_admission.codel_target =
+      std::chrono::milliseconds(absl::GetFlag(FLAGS_codel_target_ms));
+  async_config->search_admission.codel_interval =
+      std::chrono::milliseconds(absl::GetFlag(FLAGS_codel_interval_ms));
 
-  int port = std::stoi(argv[1]);
-  int dimensions = std::stoi(argv[2]);
+  LOG(INFO) << absl::StrFormat(
+      "Serving asynchronously. num_cqs=%d, compute_threads=%d, "
+      "max_pending_calls=%d",
+      async_config->num_cqs, async_config->compute_threads,
+      async_config->max_pending_calls);
 
   std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
 
-  FaissIndexServiceImpl service(dimensions);
+  std::optional<segmented::SegmentConfig> segment_config;
+  if (absl::GetFlag(FLAGS_segment_buffer_size) > 0) {
+    segment_config.emplace();
+    segment_config->buffer_capacity = absl::GetFlag(FLAGS_segment_buffer_size);
+    segment_config->max_segments = absl::GetFlag(FLAGS_max_segments);
+    segment_config->build_threads = absl::GetFlag(FLAGS_segment_build_threads);
+  }
+
+  admission::Limits limits;
+  limits.max_k = absl::GetFlag(FLAGS_max_k);
+  limits.memory_budget_bytes = absl::GetFlag(FLAGS_memory_budget_bytes);
+
+  // Note: Searches are already bounded to `max_concurrent_queries` by the
+  // server's admission queue, which also orders them by priority and sheds
+  // them under overload. Bounding them again in the service would only make
+  // admitted searches block a compute thread.
+  executor::ExecutorConfig service_executor_config = executor_config;
+  service_executor_config.max_concurrent_queries = 0;
+
+  const std::string factory_string = absl::GetFlag(FLAGS_factory_string);
+  CollectionServiceImpl service(dimensions, factory_string,
+                                ::faiss::MetricType::METRIC_INNER_PRODUCT,
+                                service_executor_config, segment_config,
+                                limits);
+
+  const std::string snapshot_path = absl::GetFlag(FLAGS_snapshot);
+  if (!snapshot_path.empty()) {
+    absl::StatusOr<std::unique_ptr<::faiss::Index>> index =
+        snapshot::read(snapshot_path);
+    if (!index.ok()) {
+      std::cout << index.status() << std::endl;
+      return 1;
+    }
+
+    // Note: The snapshot is served as the default collection, named "".
+    const grpc::Status status = service.restore("", *std::move(index));
+    if (!status.ok()) {
+      std::cout << "Failed to restore snapshot: " << status.error_message()
+                << std::endl;
+      return 1;
+    }
+  }
+
+  index_service::async::AsyncIndexServer async_server(
+      &service, *async_config, /*search_handler=*/nullptr, service.metrics());
 
+  // Note: The synchronous server options still apply to `Export`, which is
+  // served by gRPC's synchronous threads.
   ServerBuilder builder;
+  executor::configure_server_builder(executor_config, &builder);
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
+  async_server.register_with(&builder);
 
   std::unique_ptr<Server> server(builder.BuildAndStart());
+  async_server.start();
 
   LOG(INFO) << absl::StrFormat(
       "Index service with %d dimensions listening on %s ...", dimensions,
       server_address);
 
   server->Wait();
+  async_server.shutdown();
 
   return 0;
 }
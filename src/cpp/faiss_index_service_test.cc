@@ -0,0 +1,350 @@
+#include "src/cpp/faiss_index_service.h"
+
+#include <faiss/MetricType.h>
+#include <grpcpp/client_context.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/cpp/admission.h"
+#include "src/cpp/test_server.h"
+#include "src/proto/index_service.pb.h"
+
+using faiss::MetricType;
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::ExportRequest;
+using index_service::ExportResponse;
+using index_service::IndexService;
+using index_service::RebuildRequest;
+using index_service::RebuildResponse;
+using index_service::RemoveRequest;
+using index_service::RemoveResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::UpsertRequest;
+using index_service::UpsertResponse;
+using index_service::faiss::FaissIndexServiceImpl;
+
+namespace {
+
+constexpr int kDimensions = 2;
+
+// Upserts vectors with ids in `[begin_id, end_id)`, each with the values
+// `{value, id}`.
+Status upsert(FaissIndexServiceImpl *service, int begin_id, int end_id,
+              float value) {
+  UpsertRequest request;
+  for (int id = begin_id; id < end_id; id++) {
+    auto *vector = request.add_vectors();
+    vector->set_id(id);
+    vector->add_raw(value);
+    vector->add_raw(id);
+  }
+  UpsertResponse response;
+  return service->Upsert(nullptr, &request, &response);
+}
+
+Status remove(FaissIndexServiceImpl *service, int id) {
+  RemoveRequest request;
+  request.add_ids(id);
+  RemoveResponse response;
+  return service->Remove(nullptr, &request, &response);
+}
+
+Status rebuild(FaissIndexServiceImpl *service,
+               const std::string &factory_string) {
+  RebuildRequest request;
+  request.set_factory_string(factory_string);
+  RebuildResponse response;
+  return service->Rebuild(nullptr, &request, &response);
+}
+
+DescribeResponse describe(FaissIndexServiceImpl *service) {
+  DescribeRequest request;
+  DescribeResponse response;
+  EXPECT_TRUE(service->Describe(nullptr, &request, &response).ok());
+  return response;
+}
+
+double metric(const DescribeResponse &response, const std::string &name) {
+  auto it = response.metrics().find(name);
+  return it == response.metrics().end() ? 0 : it->second;
+}
+
+// Waits until `num_rebuilds` rebuilds completed, and returns the last
+// description of `service`.
+DescribeResponse wait_for_rebuilds(FaissIndexServiceImpl *service,
+                                   int num_rebuilds) {
+  while (true) {
+    DescribeResponse response = describe(service);
+    if (metric(response, "rebuilds_completed") >= num_rebuilds &&
+        metric(response, "rebuild_in_progress") == 0)
+      return response;
+    EXPECT_EQ(metric(response, "rebuild_errors"), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+// Exports through `stub`, and returns the ids of each batch.
+std::vector<std::vector<int>> export_batches(IndexService::Stub *stub,
+                                             const ExportRequest &request) {
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReader<ExportResponse>> reader =
+      stub->Export(&context, request);
+  std::vector<std::vector<int>> batches;
+  ExportResponse response;
+  while (reader->Read(&response)) {
+    batches.emplace_back();
+    for (const auto &vector : response.vectors())
+      batches.back().push_back(vector.id());
+  }
+  EXPECT_TRUE(reader->Finish().ok());
+  return batches;
+}
+
+// Exports through `stub`, and returns the exported ids.
+std::vector<int> export_ids(IndexService::Stub *stub,
+                            const ExportRequest &request) {
+  std::vector<int> ids;
+  for (const std::vector<int> &batch : export_batches(stub, request))
+    ids.insert(ids.end(), batch.begin(), batch.end());
+  return ids;
+}
+
+std::vector<int> range(int begin, int end) {
+  std::vector<int> values;
+  for (int value = begin; value < end; value++)
+    values.push_back(value);
+  return values;
+}
+
+// Returns the neighbor of `service` closest to `{1, 0}` by inner product,
+// i.e. the vector with the largest first value.
+index_service::Neighbor top_neighbor(FaissIndexServiceImpl *service) {
+  SearchRequest request;
+  request.set_k(1);
+  request.add_query_vector(1);
+  request.add_query_vector(0);
+  SearchResponse response;
+  EXPECT_TRUE(service->Search(nullptr, &request, &response).ok());
+  return response.neighbors(0);
+}
+
+} // namespace
+
+TEST(FaissIndexServiceTest, RebuildReplaysWritesMadeDuringTheBuild) {
+  FaissIndexServiceImpl service(kDimensions);
+  ASSERT_TRUE(upsert(&service, 0, 1000, 1).ok());
+
+  RebuildRequest rebuild_request;
+  rebuild_request.set_factory_string("IDMap,IVF4,Flat");
+  RebuildResponse rebuild_response;
+  ASSERT_TRUE(
+      service.Rebuild(nullptr, &rebuild_request, &rebuild_response).ok());
+  EXPECT_EQ(rebuild_response.num_vectors(), 1000);
+
+  // Writes made after the snapshot reach the new index whether they're made
+  // before or after it's swapped in.
+  ASSERT_TRUE(upsert(&service, 1000, 1100, 1).ok());
+  ASSERT_TRUE(upsert(&service, 10, 11, 100).ok());
+  ASSERT_TRUE(remove(&service, 20).ok());
+
+  const DescribeResponse description = wait_for_rebuilds(&service, 1);
+  EXPECT_EQ(description.num_vectors(), 1099);
+  EXPECT_EQ(metric(description, "rebuild_vectors_total"), 1000);
+  EXPECT_EQ(metric(description, "rebuild_vectors_added"), 1000);
+  EXPECT_EQ(metric(description, "rebuild_progress"), 1);
+  EXPECT_EQ(metric(description, "rebuild_errors"), 0);
+}
+
+TEST(FaissIndexServiceTest, RebuildsIndexesThatCantReconstructVectors) {
+  FaissIndexServiceImpl service(kDimensions);
+  ASSERT_TRUE(upsert(&service, 0, 1000, 1).ok());
+  ASSERT_TRUE(upsert(&service, 10, 11, 100).ok());
+
+  // IVF indexes can't reconstruct their vectors, so rebuilding one again
+  // reads the raw vectors kept next to it.
+  ASSERT_TRUE(rebuild(&service, "IDMap,IVF4,Flat").ok());
+  wait_for_rebuilds(&service, 1);
+  ASSERT_TRUE(remove(&service, 20).ok());
+  ASSERT_TRUE(rebuild(&service, "IDMap,Flat").ok());
+  const DescribeResponse description = wait_for_rebuilds(&service, 2);
+  EXPECT_EQ(description.num_vectors(), 999);
+  EXPECT_EQ(metric(description, "rebuild_vectors_total"), 999);
+
+  // The vectors are exactly the ones written.
+  const index_service::Neighbor neighbor = top_neighbor(&service);
+  EXPECT_EQ(neighbor.id(), 10);
+  EXPECT_EQ(neighbor.score(), 100);
+}
+
+TEST(FaissIndexServiceTest, RejectsRebuildsThatExceedTheMemoryBudget) {
+  admission::Limits limits;
+  limits.memory_budget_bytes =
+      300 * admission::estimated_vector_bytes(kDimensions);
+  FaissIndexServiceImpl service(kDimensions, "IDMap,Flat",
+                                MetricType::METRIC_INNER_PRODUCT, {},
+                                std::nullopt, limits);
+
+  // The snapshot and the new index each take as much memory as the index.
+  ASSERT_TRUE(upsert(&service, 0, 101, 1).ok());
+  EXPECT_EQ(rebuild(&service, "IDMap,Flat").error_code(),
+            StatusCode::RESOURCE_EXHAUSTED);
+  EXPECT_EQ(metric(describe(&service), "memory_budget_used_bytes"),
+            101 * admission::estimated_vector_bytes(kDimensions));
+
+  ASSERT_TRUE(remove(&service, 0).ok());
+  ASSERT_TRUE(rebuild(&service, "IDMap,Flat").ok());
+  wait_for_rebuilds(&service, 1);
+  EXPECT_EQ(metric(describe(&service), "memory_budget_used_bytes"),
+            100 * admission::estimated_vector_bytes(kDimensions));
+}
+
+TEST(FaissIndexServiceTest, RejectsConcurrentAndInvalidRebuilds) {
+  FaissIndexServiceImpl service(kDimensions);
+  ASSERT_TRUE(upsert(&service, 0, 100000, 1).ok());
+
+  EXPECT_EQ(rebuild(&service, "NotAnIndex").error_code(),
+            StatusCode::INVALID_ARGUMENT);
+
+  // Note: The first rebuild may finish before the second starts, which then
+  // succeeds.
+  ASSERT_TRUE(rebuild(&service, "").ok());
+  const Status status = rebuild(&service, "");
+  if (!status.ok())
+    EXPECT_EQ(status.error_code(), StatusCode::FAILED_PRECONDITION);
+  wait_for_rebuilds(&service, status.ok() ? 2 : 1);
+  EXPECT_EQ(describe(&service).num_vectors(), 100000);
+}
+
+TEST(FaissIndexServiceTest, ExportsSelectedIdsInOrder) {
+  FaissIndexServiceImpl service(kDimensions);
+  ASSERT_TRUE(upsert(&service, 50, 100, 1).ok());
+  ASSERT_TRUE(upsert(&service, 0, 50, 1).ok());
+  test_server::LocalServer server(&service);
+  std::unique_ptr<IndexService::Stub> stub = server.stub();
+
+  EXPECT_EQ(export_ids(stub.get(), ExportRequest()), range(0, 100));
+
+  ExportRequest request;
+  request.set_begin_id(40);
+  request.set_end_id(60);
+  EXPECT_EQ(export_ids(stub.get(), request), range(40, 60));
+
+  // The buckets of a range split it into disjoint pieces, each in order.
+  request.set_num_buckets(3);
+  std::vector<int> ids;
+  for (int bucket = 0; bucket < 3; bucket++) {
+    request.set_bucket(bucket);
+    const std::vector<int> bucket_ids = export_ids(stub.get(), request);
+    EXPECT_TRUE(std::is_sorted(bucket_ids.begin(), bucket_ids.end()));
+    ids.insert(ids.end(), bucket_ids.begin(), bucket_ids.end());
+  }
+  std::sort(ids.begin(), ids.end());
+  EXPECT_EQ(ids, range(40, 60));
+}
+
+TEST(FaissIndexServiceTest, ExportsInBatches) {
+  FaissIndexServiceImpl service(kDimensions);
+  ASSERT_TRUE(upsert(&service, 0, 20, 1).ok());
+  test_server::LocalServer server(&service);
+  std::unique_ptr<IndexService::Stub> stub = server.stub();
+
+  ExportRequest request;
+  request.set_batch_size(7);
+  EXPECT_EQ(export_batches(stub.get(), request),
+            (std::vector<std::vector<int>>{
+                range(0, 7), range(7, 14), range(14, 20)}));
+
+  // Batches larger than fit in a message are capped.
+  request.set_batch_size(4000000000u);
+  EXPECT_EQ(export_batches(stub.get(), request),
+            (std::vector<std::vector<int>>{range(0, 20)}));
+}
+
+TEST(FaissIndexServiceTest, ExportsSegmentedIndexes) {
+  segmented::SegmentConfig segment_config;
+  segment_config.buffer_capacity = 8;
+  FaissIndexServiceImpl service(kDimensions, "IDMap,Flat",
+                                MetricType::METRIC_INNER_PRODUCT, {},
+                                segment_config);
+  ASSERT_TRUE(upsert(&service, 0, 30, 1).ok());
+  ASSERT_TRUE(remove(&service, 5).ok());
+  test_server::LocalServer server(&service);
+  std::unique_ptr<IndexService::Stub> stub = server.stub();
+
+  ExportRequest request;
+  request.set_end_id(20);
+  request.set_batch_size(10);
+  std::vector<int> first_batch = range(0, 11);
+  first_batch.erase(first_batch.begin() + 5);
+  EXPECT_EQ(export_batches(stub.get(), request),
+            (std::vector<std::vector<int>>{first_batch, range(11, 20)}));
+}
+
+TEST(FaissIndexServiceTest, ExportsIndexesThatCantReconstructVectors) {
+  FaissIndexServiceImpl service(kDimensions);
+  ASSERT_TRUE(upsert(&service, 0, 100, 1).ok());
+  ASSERT_TRUE(rebuild(&service, "IDMap,IVF4,Flat").ok());
+  wait_for_rebuilds(&service, 1);
+  test_server::LocalServer server(&service);
+  std::unique_ptr<IndexService::Stub> stub = server.stub();
+
+  ExportRequest request;
+  request.set_begin_id(10);
+  request.set_end_id(12);
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReader<ExportResponse>> reader =
+      stub->Export(&context, request);
+  ExportResponse response;
+  ASSERT_TRUE(reader->Read(&response));
+  ASSERT_EQ(response.vectors_size(), 2);
+  EXPECT_EQ(response.vectors(1).id(), 11);
+  EXPECT_EQ(response.vectors(1).raw(0), 1);
+  EXPECT_EQ(response.vectors(1).raw(1), 11);
+  EXPECT_FALSE(reader->Read(&response));
+  EXPECT_TRUE(reader->Finish().ok());
+}
+
+TEST(FaissIndexServiceTest, ExportsWritesMadeWhileStreaming) {
+  FaissIndexServiceImpl service(kDimensions);
+  constexpr int kNumVectors = 500000;
+  ASSERT_TRUE(upsert(&service, 0, kNumVectors, 1).ok());
+  test_server::LocalServer server(&service);
+  std::unique_ptr<IndexService::Stub> stub = server.stub();
+
+  ExportRequest request;
+  request.set_batch_size(10000);
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReader<ExportResponse>> reader =
+      stub->Export(&context, request);
+  ExportResponse response;
+  ASSERT_TRUE(reader->Read(&response));
+
+  // Writes aren't blocked by the export, and batches that weren't read yet
+  // see them: removed vectors are skipped, and overwritten vectors are
+  // exported with their new values.
+  ASSERT_TRUE(remove(&service, kNumVectors - 1).ok());
+  ASSERT_TRUE(upsert(&service, kNumVectors - 2, kNumVectors - 1, 5).ok());
+
+  int num_exported = response.vectors_size();
+  index_service::Vector last_vector;
+  while (reader->Read(&response)) {
+    num_exported += response.vectors_size();
+    last_vector = response.vectors(response.vectors_size() - 1);
+  }
+  EXPECT_TRUE(reader->Finish().ok());
+  EXPECT_EQ(num_exported, kNumVectors - 1);
+  EXPECT_EQ(last_vector.id(), kNumVectors - 2);
+  EXPECT_EQ(last_vector.raw(0), 5);
+}
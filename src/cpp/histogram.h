@@ -0,0 +1,139 @@
+/* This is a header-only library implementing a latency histogram used by
+ * benchmarks and clients to summarize request latencies.
+ *
+ * Values are bucketed log-linearly: each power-of-two range is split into
+ * `kSubBuckets` equal-width buckets, so any recorded value is off by at most
+ * 1 / `kSubBuckets` (~3%) of its true value, while the whole histogram stays
+ * a small, fixed-size array that is cheap to copy and merge.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+
+#include "absl/strings/str_format.h"
+
+namespace stats {
+
+class LatencyHistogram {
+public:
+  // The number of linear sub-buckets each power-of-two range is split into.
+  static constexpr int kSubBucketBits = 5;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+
+  // The number of power-of-two ranges we track. Values at or above
+  // `2^(kRanges + kSubBucketBits - 1)` are clamped into the last bucket.
+  static constexpr int kRanges = 40;
+  static constexpr int kNumBuckets = (kRanges + 1) * kSubBuckets;
+
+  LatencyHistogram() : m_counts_{}, m_count_(0), m_sum_(0), m_max_(0) {}
+
+  // Records a single value (e.g. a latency in microseconds).
+  void record(uint64_t value) {
+    m_counts_[bucket_index(value)]++;
+    m_count_++;
+    m_sum_ += value;
+    m_max_ = std::max(m_max_, value);
+  }
+
+  // Adds all values recorded in `other` to this histogram.
+  void merge(const LatencyHistogram &other) {
+    for (int i = 0; i < kNumBuckets; i++)
+      m_counts_[i] += other.m_counts_[i];
+    m_count_ += other.m_count_;
+    m_sum_ += other.m_sum_;
+    m_max_ = std::max(m_max_, other.m_max_);
+  }
+
+  void reset() { *this = LatencyHistogram(); }
+
+  uint64_t count() const { return m_count_; }
+
+  uint64_t max() const { return m_max_; }
+
+  double mean() const { return m_count_ ? (double)m_sum_ / m_count_ : 0; }
+
+  // Returns the value at the given percentile, where `percentile` is in
+  // [0, 100]. This is the largest value of the bucket holding the percentile,
+  // so it errs on the side of overestimating latencies.
+  uint64_t percentile(double percentile) const {
+    if (!m_count_)
+      return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100 * m_count_ + 0.5);
+    rank = std::clamp<uint64_t>(rank, 1, m_count_);
+
+    uint64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; i++) {
+      seen += m_counts_[i];
+      if (seen >= rank)
+        return std::min(bucket_upper_bound(i) - 1, m_max_);
+    }
+
+    return m_max_;
+  }
+
+  // Formats every non-empty bucket as a line of
+  // `[lower, upper) count cumulative_percent`.
+  std::string to_string() const {
+    std::string out;
+    uint64_t seen = 0;
+    for (int i = 0; i < kNumBuckets; i++) {
+      if (!m_counts_[i])
+        continue;
+
+      seen += m_counts_[i];
+      absl::StrAppendFormat(&out, "[%d, %d) %d %.3f%%\n", bucket_lower_bound(i),
+                            bucket_upper_bound(i), m_counts_[i],
+                            100.0 * seen / m_count_);
+    }
+
+    return out;
+  }
+
+  // Maps a value to its bucket. Values below `kSubBuckets` get one bucket
+  // each; above that, each power-of-two range gets `kSubBuckets` buckets.
+  static int bucket_index(uint64_t value) {
+    if (value < kSubBuckets)
+      return (int)value;
+
+    // Position of the highest set bit, i.e. floor(log2(value)).
+    int msb = 63 - __builtin_clzll(value);
+    int range = msb - kSubBucketBits + 1;
+    if (range > kRanges)
+      return kNumBuckets - 1;
+
+    int sub_bucket = (int)(value >> (range - 1)) - kSubBuckets;
+    return range * kSubBuckets + sub_bucket;
+  }
+
+  static uint64_t bucket_lower_bound(int idx) {
+    int range = idx / kSubBuckets;
+    uint64_t sub_bucket = idx % kSubBuckets;
+    if (!range)
+      return sub_bucket;
+
+    return (kSubBuckets + sub_bucket) << (range - 1);
+  }
+
+  static uint64_t bucket_upper_bound(int idx) {
+    int range = idx / kSubBuckets;
+    if (!range)
+      return bucket_lower_bound(idx) + 1;
+
+    return bucket_lower_bound(idx) + (1ull << (range - 1));
+  }
+
+private:
+  std::array<uint64_t, kNumBuckets> m_counts_;
+
+  uint64_t m_count_;
+
+  uint64_t m_sum_;
+
+  uint64_t m_max_;
+};
+
+} // namespace stats
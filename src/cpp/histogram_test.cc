@@ -0,0 +1,58 @@
+#include "src/cpp/histogram.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+using stats::LatencyHistogram;
+
+TEST(LatencyHistogramTest, SmallValuesAreExact) {
+  LatencyHistogram histogram;
+  for (uint64_t value = 1; value <= 10; value++)
+    histogram.record(value);
+
+  EXPECT_EQ(histogram.count(), 10);
+  EXPECT_EQ(histogram.max(), 10);
+  EXPECT_DOUBLE_EQ(histogram.mean(), 5.5);
+  EXPECT_EQ(histogram.percentile(50), 5);
+  EXPECT_EQ(histogram.percentile(90), 9);
+  EXPECT_EQ(histogram.percentile(100), 10);
+}
+
+TEST(LatencyHistogramTest, LargeValuesAreWithinBucketError) {
+  // Test that every value lands in a bucket whose bounds contain it and whose
+  // width is within the documented relative error.
+  for (uint64_t value : {32ull, 33ull, 1000ull, 123456ull, 987654321ull}) {
+    int idx = LatencyHistogram::bucket_index(value);
+    uint64_t lower = LatencyHistogram::bucket_lower_bound(idx);
+    uint64_t upper = LatencyHistogram::bucket_upper_bound(idx);
+
+    EXPECT_LE(lower, value);
+    EXPECT_GT(upper, value);
+    EXPECT_LE(upper - lower, value / LatencyHistogram::kSubBuckets + 1);
+  }
+}
+
+TEST(LatencyHistogramTest, Merge) {
+  LatencyHistogram first;
+  LatencyHistogram second;
+  first.record(1);
+  second.record(1000);
+  second.record(3);
+
+  first.merge(second);
+
+  EXPECT_EQ(first.count(), 3);
+  EXPECT_EQ(first.max(), 1000);
+  EXPECT_EQ(first.percentile(50), 3);
+  EXPECT_EQ(first.percentile(100), 1000);
+}
+
+TEST(LatencyHistogramTest, Empty) {
+  LatencyHistogram histogram;
+
+  EXPECT_EQ(histogram.count(), 0);
+  EXPECT_EQ(histogram.percentile(99), 0);
+  EXPECT_EQ(histogram.to_string(), "");
+}
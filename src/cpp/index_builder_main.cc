@@ -0,0 +1,273 @@
+/* An offline builder of index snapshots that `faiss_index_service` serves
+ * from startup, so a new corpus doesn't have to be pushed through `Insert`.
+ *
+ * The builder:
+ * 1. memory-maps a `.fvecs`, `.bvecs` or `.npy` file rather than loading it,
+ * 2. trains the index on up to `--train_size` vectors sampled evenly from the
+ * file, if it needs training,
+ * 3. splits the vectors into `--num_shards` shards the way the sharded index
+ * places inserts, filling each shard to `--shard_capacity` before the next,
+ * 4. adds each shard's vectors in blocks of `--block_size`, reading the next
+ * block while the current one is added, with all CPUs by default,
+ * 5. writes each shard as a snapshot.
+ *
+ * Vectors get ids `0..num_vectors-1`, their position in the file.
+ */
+#include <faiss/Index.h>
+#include <faiss/IndexIDMap.h>
+#include <faiss/MetricType.h>
+#include <faiss/clone_index.h>
+#include <faiss/index_factory.h>
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_format.h"
+#include "src/cpp/algo.h"
+#include "src/cpp/dataset.h"
+#include "src/cpp/snapshot.h"
+
+ABSL_FLAG(std::string, input, "",
+          "Path to the vectors to index, a .fvecs, .bvecs or .npy file.");
+ABSL_FLAG(std::string, output, "",
+          "Path to write the snapshot to. With more than one shard, shard `i` "
+          "is written to `<output>.shard<i>`.");
+ABSL_FLAG(std::string, factory_string, "IDMap,Flat",
+          "The `faiss` factory string of the index, e.g. `IDMap,HNSW32`. Must "
+          "map vectors to ids, e.g. with an `IDMap` prefix.");
+ABSL_FLAG(int, num_shards, 1, "Number of shards to split the vectors into.");
+ABSL_FLAG(int, shard_capacity, 0,
+          "Number of vectors each shard holds at most, as passed to "
+          "`sharded_index_service`. Defaults to an even split.");
+ABSL_FLAG(int, block_size, 100000,
+          "Number of vectors read from the input and added at a time.");
+ABSL_FLAG(int, train_size, 1000000,
+          "Number of vectors sampled to train indexes that need training.");
+ABSL_FLAG(int, threads, 0,
+          "Number of OpenMP threads to train and build with. Defaults to all "
+          "CPUs.");
+
+using dataset::VectorFile;
+using faiss::idx_t;
+
+namespace {
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Trains `index` on up to `train_size` vectors spread evenly across `file`,
+// so a file sorted by e.g. topic still yields a representative sample.
+absl::Status train(faiss::Index *index, const VectorFile &file,
+                   int64_t train_size) {
+  const int64_t num_vectors = std::min(train_size, file.num_vectors());
+  std::vector<float> sample((size_t)num_vectors * file.dimensions());
+  for (int64_t i = 0; i < num_vectors; i++) {
+    const int64_t position = i * file.num_vectors() / num_vectors;
+    const absl::Status status = file.read(
+        position, 1, sample.data() + (size_t)i * file.dimensions());
+    if (!status.ok())
+      return status;
+  }
+
+  LOG(INFO) << absl::StrFormat("Training on %d vectors...", num_vectors);
+  const auto start = std::chrono::steady_clock::now();
+  index->train(num_vectors, sample.data());
+  LOG(INFO) << absl::StrFormat("Trained in %.1fs.", seconds_since(start));
+
+  return absl::OkStatus();
+}
+
+// Adds the vectors at positions `[begin, end)` of `file` to `index`, with
+// their positions as ids, `block_size` vectors at a time.
+absl::Status add_range(faiss::Index *index, const VectorFile &file,
+                       int64_t begin, int64_t end, int block_size) {
+  const int dimensions = file.dimensions();
+  std::vector<float> block((size_t)block_size * dimensions);
+  std::vector<float> next_block((size_t)block_size * dimensions);
+  std::vector<idx_t> ids(block_size);
+
+  // Note: Reading a block mostly waits on page faults, so the next block is
+  // read on another thread while `faiss` adds the current one.
+  auto read_async = [&file, end, block_size](int64_t position,
+                                             std::vector<float> *out) {
+    const int64_t count = std::min<int64_t>(block_size, end - position);
+    return std::async(std::launch::async, [&file, position, count, out] {
+      return file.read(position, count, out->data());
+    });
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  std::future<absl::Status> next_read;
+  if (begin < end)
+    next_read = read_async(begin, &next_block);
+
+  for (int64_t position = begin; position < end;) {
+    const absl::Status status = next_read.get();
+    if (!status.ok())
+      return status;
+
+    block.swap(next_block);
+    const int64_t count = std::min<int64_t>(block_size, end - position);
+    if (position + count < end)
+      next_read = read_async(position + count, &next_block);
+
+    std::iota(ids.begin(), ids.begin() + count, position);
+    index->add_with_ids(count, block.data(), ids.data());
+    position += count;
+
+    LOG(INFO) << absl::StrFormat("Added %d of %d vectors. vectors_per_s=%.0f",
+                                 position - begin, end - begin,
+                                 (position - begin) / seconds_since(start));
+  }
+
+  return absl::OkStatus();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  absl::ParseCommandLine(argc, argv);
+
+  const std::string output = absl::GetFlag(FLAGS_output);
+  const std::string factory_string = absl::GetFlag(FLAGS_factory_string);
+  const int num_shards = absl::GetFlag(FLAGS_num_shards);
+  const int block_size = absl::GetFlag(FLAGS_block_size);
+  if (output.empty() || num_shards <= 0 || block_size <= 0) {
+    std::cout << "Expected an --output path, a positive --num_shards and a "
+                 "positive --block_size."
+              << std::endl;
+    return 1;
+  }
+
+  absl::StatusOr<std::unique_ptr<VectorFile>> file =
+      VectorFile::open(absl::GetFlag(FLAGS_input));
+  if (!file.ok()) {
+    std::cout << "Failed to open input: " << file.status() << std::endl;
+    return 1;
+  }
+
+  // Note: Ids are `int`s throughout the services.
+  const int64_t num_vectors = (*file)->num_vectors();
+  if (num_vectors > std::numeric_limits<int>::max()) {
+    std::cout << absl::StrFormat("Expected at most %d vectors. Found: (%d).",
+                                 std::numeric_limits<int>::max(), num_vectors)
+              << std::endl;
+    return 1;
+  }
+
+  int shard_capacity = absl::GetFlag(FLAGS_shard_capacity);
+  if (shard_capacity <= 0)
+    shard_capacity = std::max<int64_t>(
+        1, (num_vectors + num_shards - 1) / num_shards);
+
+  // Place vectors exactly like the sharded index places inserts into empty
+  // shards, so it can serve the shards as if it had inserted them.
+  const std::pair<int, std::map<int, int>> placement = algo::greedy_fill(
+      num_vectors, shard_capacity, std::vector<int>(num_shards));
+  if (placement.first) {
+    std::cout << absl::StrFormat(
+                     "%d vectors don't fit in %d shards of %d vectors.",
+                     num_vectors, num_shards, shard_capacity)
+              << std::endl;
+    return 1;
+  }
+
+  if (absl::GetFlag(FLAGS_threads) > 0)
+    omp_set_num_threads(absl::GetFlag(FLAGS_threads));
+
+  LOG(INFO) << absl::StrFormat(
+      "Building %s index of %d vectors with %d dimensions in %d shards. "
+      "shard_capacity=%d, threads=%d",
+      factory_string, num_vectors, (*file)->dimensions(), num_shards,
+      shard_capacity, omp_get_max_threads());
+
+  // Note: The service only serves inner product indexes from startup.
+  std::unique_ptr<faiss::Index> trained_index;
+  try {
+    trained_index.reset(faiss::index_factory((*file)->dimensions(),
+                                             factory_string.c_str(),
+                                             faiss::METRIC_INNER_PRODUCT));
+  } catch (const std::exception &e) {
+    std::cout << absl::StrFormat("Failed to create %s index: %s",
+                                 factory_string, e.what())
+              << std::endl;
+    return 1;
+  }
+
+  if (!dynamic_cast<faiss::IndexIDMap *>(trained_index.get())) {
+    std::cout << "Expected a --factory_string that maps vectors to ids, e.g. "
+                 "with an IDMap prefix."
+              << std::endl;
+    return 1;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    if (!trained_index->is_trained && num_vectors > 0) {
+      const absl::Status status = train(trained_index.get(), **file,
+                                        absl::GetFlag(FLAGS_train_size));
+      if (!status.ok()) {
+        std::cout << "Failed to train: " << status << std::endl;
+        return 1;
+      }
+    }
+
+    // Every shard starts from a copy of the trained, empty index, so shards
+    // share their centroids and are only trained once.
+    int64_t begin = 0;
+    for (int shard_idx = 0; shard_idx < num_shards; shard_idx++) {
+      const auto fill = placement.second.find(shard_idx);
+      const int64_t end =
+          begin + (fill == placement.second.end() ? 0 : fill->second);
+
+      std::unique_ptr<faiss::Index> index(
+          faiss::clone_index(trained_index.get()));
+      absl::Status status =
+          add_range(index.get(), **file, begin, end, block_size);
+      if (!status.ok()) {
+        std::cout << "Failed to read input: " << status << std::endl;
+        return 1;
+      }
+
+      const std::string path =
+          num_shards == 1 ? output : snapshot::shard_path(output, shard_idx);
+      status = snapshot::write(*index, path);
+      if (!status.ok()) {
+        std::cout << status << std::endl;
+        return 1;
+      }
+
+      LOG(INFO) << absl::StrFormat("Wrote shard %d with %d vectors to %s.",
+                                   shard_idx, end - begin, path);
+      begin = end;
+    }
+  } catch (const std::exception &e) {
+    std::cout << "Failed to build index: " << e.what() << std::endl;
+    return 1;
+  }
+
+  LOG(INFO) << absl::StrFormat("Built %d vectors in %.1fs.", num_vectors,
+                               seconds_since(start));
+
+  return 0;
+}
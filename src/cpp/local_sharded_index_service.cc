@@ -0,0 +1,382 @@
+#include "src/cpp/local_sharded_index_service.h"
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/log/log.h"
+#include "absl/strings/str_format.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "grpc/grpc.h"
+#include "grpcpp/server_context.h"
+#include "src/cpp/admission.h"
+#include "src/cpp/algo.h"
+#include "src/cpp/encoding.h"
+#include "src/cpp/faiss_index_service.h"
+#include "src/cpp/profile.h"
+#include "src/cpp/thread_pool.h"
+#include "src/cpp/threading.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+using faiss::MetricType;
+using grpc::ServerContext;
+using grpc::Status;
+using grpc::StatusCode;
+
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::Neighbor;
+using index_service::ProfileSpan;
+using index_service::RemoveRequest;
+using index_service::RemoveResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::UpsertRequest;
+using index_service::UpsertResponse;
+using index_service::Vector;
+using index_service::faiss::FaissIndexServiceImpl;
+using index_service::faiss::SharedResources;
+using index_service::local::LocalShardedIndexServiceImpl;
+
+namespace {
+
+// Returns the CPUs for each worker in the pool, given the CPUs of each shard.
+std::vector<std::vector<int>>
+get_worker_cpus(int num_shards, const std::vector<std::vector<int>> &shard_cpus,
+                int workers_per_shard) {
+  std::vector<std::vector<int>> worker_cpus;
+  for (int shard_idx = 0; shard_idx < num_shards; shard_idx++) {
+    for (int i = 0; i < workers_per_shard; i++)
+      worker_cpus.push_back(shard_idx < shard_cpus.size()
+                                ? shard_cpus[shard_idx]
+                                : std::vector<int>{});
+  }
+
+  return worker_cpus;
+}
+
+// Returns the first non-ok status, or ok if all statuses are ok.
+Status first_error(const std::vector<Status> &statuses) {
+  for (const Status &status : statuses) {
+    if (!status.ok())
+      return status;
+  }
+
+  return Status::OK;
+}
+
+// Returns `UNIMPLEMENTED` if a request names a collection, since shards only
+// have their default collection.
+Status check_collection(const std::string &collection) {
+  if (collection.empty())
+    return Status::OK;
+
+  return Status(StatusCode::UNIMPLEMENTED,
+                absl::StrFormat("Sharded indexes only serve the default "
+                                "collection. Collection: (%s).",
+                                collection));
+}
+
+} // namespace
+
+LocalShardedIndexServiceImpl::LocalShardedIndexServiceImpl(
+    int dimensions, int num_shards,
+    const std::vector<std::vector<int>> &shard_cpus, int workers_per_shard,
+    const char *factory_string, MetricType metric_type,
+    const admission::Limits &limits)
+    : m_dimensions_(dimensions), m_limits_(limits),
+      m_memory_budget_(limits.memory_budget_bytes),
+      m_workers_per_shard_(workers_per_shard),
+      m_next_worker_(0),
+      m_pool_(get_worker_cpus(num_shards, shard_cpus, workers_per_shard)),
+      m_shards_(num_shards) {
+  // Searches are parallelized across shards on the pool, so a single shard
+  // search must not start an OpenMP team of its own on top of that.
+  executor::ExecutorConfig shard_executor_config;
+  shard_executor_config.omp_threads_per_query = 1;
+
+  // Create each shard from one of its own workers so that whatever memory the
+  // shard allocates up front is local to the shard's CPUs.
+  std::vector<int> shard_idxs;
+  for (int i = 0; i < num_shards; i++)
+    shard_idxs.push_back(i);
+
+  // Note: Every shard charges its vectors to the same budget, so the limit
+  // applies to the whole index rather than to each shard.
+  const SharedResources shared{nullptr, &m_memory_budget_};
+  run_on_shards(shard_idxs, [&](int shard_idx) {
+    m_shards_[shard_idx] = std::make_unique<FaissIndexServiceImpl>(
+        dimensions, factory_string, metric_type, shard_executor_config,
+        std::nullopt, limits, shared);
+  });
+
+  LOG(INFO) << absl::StrFormat(
+      "Created %d in-process shards with %d workers each.", num_shards,
+      workers_per_shard);
+}
+
+void LocalShardedIndexServiceImpl::run_on_shards(
+    const std::vector<int> &shard_idxs, const std::function<void(int)> &fn) {
+  absl::BlockingCounter pending(shard_idxs.size());
+
+  for (int shard_idx : shard_idxs) {
+    int worker_idx = shard_idx * m_workers_per_shard_ +
+                     m_next_worker_++ % m_workers_per_shard_;
+
+    m_pool_.submit(worker_idx, [&fn, &pending, shard_idx]() {
+      fn(shard_idx);
+      pending.DecrementCount();
+    });
+  }
+
+  pending.Wait();
+}
+
+Status LocalShardedIndexServiceImpl::Describe(
+    ServerContext *context, const DescribeRequest *describe_request,
+    DescribeResponse *describe_response) {
+  LOG(INFO) << absl::StrFormat("Received describe request.");
+
+  const Status collection_status =
+      check_collection(describe_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
+
+  int total_num_vectors = 0;
+  for (auto &shard : m_shards_) {
+    DescribeResponse shard_describe_response;
+    shard->Describe(context, describe_request, &shard_describe_response);
+    total_num_vectors += shard_describe_response.num_vectors();
+  }
+
+  describe_response->set_dimensions(m_dimensions_);
+  describe_response->set_num_vectors(total_num_vectors);
+
+  return Status::OK;
+}
+
+Status LocalShardedIndexServiceImpl::Insert(ServerContext *context,
+                                            const InsertRequest *insert_request,
+                                            InsertResponse *insert_response) {
+  LOG(INFO) << absl::StrFormat("Received insert request. num_vectors=%d",
+                               insert_request->vectors_size());
+
+  const Status collection_status =
+      check_collection(insert_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
+
+  // Validate every vector up front so a request is either applied to all
+  // shards or rejected.
+  for (const Vector &vector : insert_request->vectors()) {
+    const int vector_dimensions = encoding::num_values(vector);
+    if (vector_dimensions != m_dimensions_)
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    absl::StrFormat(
+                        "Found vector that does not match dimensions of index. "
+                        "Vector dimensions: (%d). Index dimensions: (%d).",
+                        vector_dimensions, m_dimensions_));
+  }
+
+  std::vector<InsertRequest> shard_insert_requests(m_shards_.size());
+  for (const Vector &vector : insert_request->vectors())
+    shard_insert_requests[shard_of(vector.id())].add_vectors()->CopyFrom(
+        vector);
+
+  std::vector<int> shard_idxs;
+  for (int i = 0; i < m_shards_.size(); i++) {
+    if (shard_insert_requests[i].vectors_size())
+      shard_idxs.push_back(i);
+  }
+
+  std::vector<Status> shard_statuses(m_shards_.size());
+  run_on_shards(shard_idxs, [&](int shard_idx) {
+    InsertResponse shard_insert_response;
+    shard_statuses[shard_idx] =
+        m_shards_[shard_idx]->Insert(context, &shard_insert_requests[shard_idx],
+                                     &shard_insert_response);
+  });
+
+  return first_error(shard_statuses);
+}
+
+Status LocalShardedIndexServiceImpl::Upsert(ServerContext *context,
+                                            const UpsertRequest *upsert_request,
+                                            UpsertResponse *upsert_response) {
+  LOG(INFO) << absl::StrFormat("Received upsert request. num_vectors=%d",
+                               upsert_request->vectors_size());
+
+  const Status collection_status =
+      check_collection(upsert_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
+
+  for (const Vector &vector : upsert_request->vectors()) {
+    const int vector_dimensions = encoding::num_values(vector);
+    if (vector_dimensions != m_dimensions_)
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    absl::StrFormat(
+                        "Found vector that does not match dimensions of index. "
+                        "Vector dimensions: (%d). Index dimensions: (%d).",
+                        vector_dimensions, m_dimensions_));
+  }
+
+  // Since vectors are placed by id, an upsert always goes to the shard that
+  // already stores the vector, if any.
+  std::vector<UpsertRequest> shard_upsert_requests(m_shards_.size());
+  for (const Vector &vector : upsert_request->vectors())
+    shard_upsert_requests[shard_of(vector.id())].add_vectors()->CopyFrom(
+        vector);
+
+  std::vector<int> shard_idxs;
+  for (int i = 0; i < m_shards_.size(); i++) {
+    if (shard_upsert_requests[i].vectors_size())
+      shard_idxs.push_back(i);
+  }
+
+  std::vector<Status> shard_statuses(m_shards_.size());
+  run_on_shards(shard_idxs, [&](int shard_idx) {
+    UpsertResponse shard_upsert_response;
+    shard_statuses[shard_idx] =
+        m_shards_[shard_idx]->Upsert(context, &shard_upsert_requests[shard_idx],
+                                     &shard_upsert_response);
+  });
+
+  return first_error(shard_statuses);
+}
+
+Status LocalShardedIndexServiceImpl::check_search(
+    const SearchRequest &search_request) const {
+  const Status status = check_collection(search_request.collection());
+  if (!status.ok())
+    return status;
+
+  const int query_dimensions = encoding::num_query_values(search_request);
+  if (query_dimensions != m_dimensions_)
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat(
+                      "Found query that does not match dimensions of index. "
+                      "Query dimensions: (%d). Index dimensions: (%d).",
+                      query_dimensions, m_dimensions_));
+
+  return admission::check_k(search_request.k(), m_limits_);
+}
+
+Status LocalShardedIndexServiceImpl::Search(ServerContext *context,
+                                            const SearchRequest *search_request,
+                                            SearchResponse *search_response) {
+  LOG(INFO) << absl::StrFormat("Received search request. k=%d",
+                               search_request->k());
+
+  Status status = check_search(*search_request);
+  if (!status.ok())
+    return status;
+
+  const int k = search_request->k();
+
+  ProfileSpan *search_profile =
+      profile::start(*search_request, search_response, "local_search");
+  const profile::Clock::time_point start =
+      search_profile ? profile::Clock::now() : profile::Clock::time_point();
+
+  std::vector<int> shard_idxs;
+  for (int i = 0; i < m_shards_.size(); i++)
+    shard_idxs.push_back(i);
+
+  // Search all shards in parallel. Each shard writes into its own response,
+  // so no synchronization is needed besides waiting for all of them.
+  std::vector<SearchResponse> shard_search_responses(m_shards_.size());
+  std::vector<Status> shard_statuses(m_shards_.size());
+  std::vector<int64_t> shard_durations_us(m_shards_.size());
+  run_on_shards(shard_idxs, [&](int shard_idx) {
+    shard_statuses[shard_idx] = m_shards_[shard_idx]->Search(
+        context, search_request, &shard_search_responses[shard_idx]);
+    if (search_profile)
+      shard_durations_us[shard_idx] = profile::microseconds_since(start);
+  });
+
+  status = first_error(shard_statuses);
+  if (!status.ok())
+    return status;
+
+  // Note: A shard's span lasts from when the search was handed to the pool
+  // until the shard finished, so it includes the time waiting for a worker.
+  profile::Timer timer(search_profile);
+  for (int shard_idx : shard_idxs) {
+    ProfileSpan *shard_span = profile::add_span(
+        search_profile, "shard", shard_durations_us[shard_idx]);
+    profile::set_stat(shard_span, "shard", shard_idx);
+
+    SearchResponse &shard_search_response = shard_search_responses[shard_idx];
+    if (shard_search_response.has_profile())
+      shard_span->add_children()->Swap(
+          shard_search_response.mutable_profile());
+  }
+
+  // Each shard returns its neighbors sorted best first, so a k-way merge of
+  // the shard results gives the global top-k. Merge pointers to the neighbors
+  // so we only copy the k neighbors we keep.
+  std::vector<std::pair<const Neighbor *const *, int>> shard_neighbors;
+  for (const SearchResponse &shard_search_response : shard_search_responses)
+    shard_neighbors.emplace_back(shard_search_response.neighbors().data(),
+                                 shard_search_response.neighbors_size());
+
+  std::vector<const Neighbor *> best_candidates(k);
+  int num_merged = algo::merge_top_k(
+      shard_neighbors, k, best_candidates.data(),
+      [](const Neighbor *first_neighbor, const Neighbor *second_neighbor) {
+        return first_neighbor->score() > second_neighbor->score();
+      });
+
+  for (int i = 0; i < num_merged; i++)
+    search_response->add_neighbors()->CopyFrom(*best_candidates[i]);
+
+  if (search_profile) {
+    profile::set_stat(timer.lap("merge"), "candidates", num_merged);
+    search_profile->set_duration_us(profile::microseconds_since(start));
+  }
+
+  return Status::OK;
+}
+
+Status LocalShardedIndexServiceImpl::Remove(ServerContext *context,
+                                            const RemoveRequest *remove_request,
+                                            RemoveResponse *remove_response) {
+  LOG(INFO) << absl::StrFormat("Received remove request. num_ids=%d",
+                               remove_request->ids_size());
+
+  const Status collection_status =
+      check_collection(remove_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
+
+  std::vector<RemoveRequest> shard_remove_requests(m_shards_.size());
+  for (uint32_t id : remove_request->ids())
+    shard_remove_requests[shard_of(id)].add_ids(id);
+
+  std::vector<int> shard_idxs;
+  for (int i = 0; i < m_shards_.size(); i++) {
+    if (shard_remove_requests[i].ids_size())
+      shard_idxs.push_back(i);
+  }
+
+  std::vector<RemoveResponse> shard_remove_responses(m_shards_.size());
+  std::vector<Status> shard_statuses(m_shards_.size());
+  run_on_shards(shard_idxs, [&](int shard_idx) {
+    shard_statuses[shard_idx] = m_shards_[shard_idx]->Remove(
+        context, &shard_remove_requests[shard_idx],
+        &shard_remove_responses[shard_idx]);
+  });
+
+  uint32_t num_removed = 0;
+  for (const RemoveResponse &shard_remove_response : shard_remove_responses)
+    num_removed += shard_remove_response.num_removed();
+  remove_response->set_num_removed(num_removed);
+
+  return first_error(shard_statuses);
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <faiss/MetricType.h>
+#include <grpc/grpc.h>
+#include <grpcpp/server_context.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "src/cpp/admission.h"
+#include "src/cpp/faiss_index_service.h"
+#include "src/cpp/thread_pool.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+namespace index_service::local {
+
+// An index sharded across multiple in-memory `faiss` indexes in a single
+// process.
+//
+// This serves the same role as `ShardedIndexServiceImpl` in front of
+// several `FaissIndexServiceImpl` processes on one host, but without paying
+// for serialization and a loopback gRPC call per shard: shards are searched
+// in parallel on a thread pool and their results are merged directly from
+// memory.
+//
+// Each shard has its own workers in the pool, optionally pinned to a set of
+// CPUs (e.g. the CPUs of one NUMA node). A shard is created and written to
+// only from its own workers, and the pool only lets workers pinned to the
+// same CPUs steal each other's tasks, so, with Linux's default first-touch
+// memory policy, its vectors are allocated on the memory node local to those
+// CPUs.
+//
+// Like `ShardedIndexServiceImpl`, it only serves the default collection and
+// fails requests that name one with `UNIMPLEMENTED`. `Export` and `Rebuild`
+// aren't supported either and fail with `UNIMPLEMENTED`.
+class LocalShardedIndexServiceImpl final
+    : public index_service::IndexService::Service {
+public:
+  // Creates `num_shards` shards. `shard_cpus[i]` are the CPUs the workers of
+  // shard `i` are pinned to; if `shard_cpus` is empty, workers aren't pinned.
+  // Each shard gets `workers_per_shard` workers.
+  // `limits.max_k` bounds the `k` of searches, and
+  // `limits.memory_budget_bytes` bounds the memory of the vectors of all
+  // shards together.
+  explicit LocalShardedIndexServiceImpl(
+      int dimensions, int num_shards,
+      const std::vector<std::vector<int>> &shard_cpus = {},
+      int workers_per_shard = 1, const char *factory_string = "IDMap,Flat",
+      ::faiss::MetricType metric_type =
+          ::faiss::MetricType::METRIC_INNER_PRODUCT,
+      const admission::Limits &limits = {});
+
+  grpc::Status Describe(grpc::ServerContext *context,
+                        const index_service::DescribeRequest *describe_request,
+                        index_service::DescribeResponse *describe_response);
+
+  grpc::Status Insert(grpc::ServerContext *context,
+                      const index_service::InsertRequest *insert_request,
+                      index_service::InsertResponse *insert_response);
+
+  grpc::Status Upsert(grpc::ServerContext *context,
+                      const index_service::UpsertRequest *upsert_request,
+                      index_service::UpsertResponse *upsert_response);
+
+  grpc::Status Search(grpc::ServerContext *context,
+                      const index_service::SearchRequest *search_request,
+                      index_service::SearchResponse *search_response);
+
+  grpc::Status Remove(grpc::ServerContext *context,
+                      const index_service::RemoveRequest *remove_request,
+                      index_service::RemoveResponse *remove_response);
+
+private:
+  // Returns the shard that stores the vector with the given id.
+  // Vectors are placed by id rather than greedily filling shards, so that
+  // every shard holds a similar number of vectors (and so does a similar
+  // amount of work per search) and upserts need no id -> shard mapping.
+  inline int shard_of(uint32_t id) const { return id % m_shards_.size(); }
+
+  // Runs `fn(shard_idx)` for every shard in `shard_idxs` on the shard's own
+  // workers and waits for all of them to complete.
+  void run_on_shards(const std::vector<int> &shard_idxs,
+                     const std::function<void(int)> &fn);
+
+  // Returns `INVALID_ARGUMENT` if the query doesn't have the index's
+  // dimensions or `k` is over the limit, or `UNIMPLEMENTED` if it names a
+  // collection, before the search is sent to any shard.
+  grpc::Status
+  check_search(const index_service::SearchRequest &search_request) const;
+
+  // The dimensionality of vectors in this index.
+  int m_dimensions_;
+
+  const admission::Limits m_limits_;
+
+  // Accounts for the memory of the vectors of every shard.
+  // Note: Declared before the shards so it's destroyed after them.
+  admission::MemoryBudget m_memory_budget_;
+
+  // The number of workers assigned to each shard. The workers of shard `i`
+  // are `[i * m_workers_per_shard_, (i + 1) * m_workers_per_shard_)`.
+  int m_workers_per_shard_;
+
+  // Used to spread tasks round robin across the workers of a shard.
+  std::atomic<unsigned> m_next_worker_;
+
+  // Note: The pool is declared before the shards so it's destroyed after
+  // them.
+  executor::ThreadPool m_pool_;
+
+  std::vector<std::unique_ptr<index_service::faiss::FaissIndexServiceImpl>>
+      m_shards_;
+};
+
+} // namespace index_service::local
@@ -0,0 +1,96 @@
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/log.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "grpc/grpc.h"
+#include "grpcpp/security/server_credentials.h"
+#include "grpcpp/server_builder.h"
+#include "src/cpp/admission.h"
+#include "src/cpp/local_sharded_index_service.h"
+#include "src/cpp/thread_pool.h"
+
+ABSL_FLAG(std::string, shard_cpus, "",
+          "Semicolon-separated CPU lists to pin the workers of each shard to, "
+          "e.g. `0-7;8-15` for two shards. Typically one list per NUMA node. "
+          "Workers aren't pinned if empty.");
+ABSL_FLAG(int, workers_per_shard, 1,
+          "Number of threads serving each shard. Searches across shards run "
+          "in parallel on these threads and idle threads steal work from "
+          "other shards.");
+ABSL_FLAG(int, max_k, 1000,
+          "Largest `k` a search may ask for. Unbounded if 0.");
+ABSL_FLAG(int64_t, memory_budget_bytes, 0,
+          "Approximate number of bytes of vectors all shards together may "
+          "store, estimated from their dimensions. Writes beyond it are "
+          "rejected. Unbounded if 0.");
+
+using grpc::Server;
+using grpc::ServerBuilder;
+using index_service::local::LocalShardedIndexServiceImpl;
+
+int main(int argc, char *argv[]) {
+  std::vector<char *> args = absl::ParseCommandLine(argc, argv);
+  if (args.size() != 4) {
+    std::cout << "Expected 3 arguments: <port> <dimensions> <num_shards>."
+              << std::endl;
+    return 1;
+  }
+
+  int port = std::stoi(args[1]);
+  int dimensions = std::stoi(args[2]);
+  int num_shards = std::stoi(args[3]);
+
+  std::vector<std::vector<int>> shard_cpus;
+  for (absl::string_view cpu_list :
+       absl::StrSplit(absl::GetFlag(FLAGS_shard_cpus), ';',
+                      absl::SkipWhitespace())) {
+    absl::StatusOr<std::vector<int>> cpus =
+        executor::parse_cpu_list(std::string(cpu_list));
+    if (!cpus.ok()) {
+      std::cout << cpus.status() << std::endl;
+      return 1;
+    }
+    shard_cpus.push_back(*cpus);
+  }
+
+  if (!shard_cpus.empty() && shard_cpus.size() != num_shards) {
+    std::cout << absl::StrFormat("Expected one CPU list per shard. Found %d "
+                                 "CPU lists for %d shards.",
+                                 shard_cpus.size(), num_shards)
+              << std::endl;
+    return 1;
+  }
+
+  std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
+
+  admission::Limits limits;
+  limits.max_k = absl::GetFlag(FLAGS_max_k);
+  limits.memory_budget_bytes = absl::GetFlag(FLAGS_memory_budget_bytes);
+
+  LocalShardedIndexServiceImpl service(
+      dimensions, num_shards, shard_cpus,
+      absl::GetFlag(FLAGS_workers_per_shard), "IDMap,Flat",
+      ::faiss::MetricType::METRIC_INNER_PRODUCT, limits);
+
+  ServerBuilder builder;
+  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  builder.RegisterService(&service);
+
+  std::unique_ptr<Server> server(builder.BuildAndStart());
+
+  LOG(INFO) << absl::StrFormat(
+      "Index service with %d dimensions and %d in-process shards listening on "
+      "%s ...",
+      dimensions, num_shards, server_address);
+
+  server->Wait();
+
+  return 0;
+}
@@ -0,0 +1,254 @@
+#include "src/cpp/local_sharded_index_service.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <vector>
+
+#include "src/cpp/admission.h"
+#include "src/proto/index_service.pb.h"
+
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::ProfileSpan;
+using index_service::RemoveRequest;
+using index_service::RemoveResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::UpsertRequest;
+using index_service::UpsertResponse;
+using index_service::Vector;
+using index_service::local::LocalShardedIndexServiceImpl;
+
+namespace {
+
+constexpr int kDimensions = 2;
+
+Vector make_vector(int id, std::initializer_list<float> values) {
+  Vector vector;
+  vector.set_id(id);
+  for (float value : values)
+    vector.add_raw(value);
+  return vector;
+}
+
+// Inserts vectors with `ids`, each with the values `{id, 0}`.
+Status insert(LocalShardedIndexServiceImpl *service,
+              std::initializer_list<int> ids) {
+  InsertRequest request;
+  for (int id : ids)
+    *request.add_vectors() = make_vector(id, {(float)id, 0});
+  InsertResponse response;
+  return service->Insert(nullptr, &request, &response);
+}
+
+SearchResponse search(LocalShardedIndexServiceImpl *service, int k,
+                      std::initializer_list<float> query) {
+  SearchRequest request;
+  request.set_k(k);
+  for (float value : query)
+    request.add_query_vector(value);
+  SearchResponse response;
+  EXPECT_TRUE(service->Search(nullptr, &request, &response).ok());
+  return response;
+}
+
+int num_vectors(LocalShardedIndexServiceImpl *service) {
+  DescribeRequest request;
+  DescribeResponse response;
+  service->Describe(nullptr, &request, &response);
+  return response.num_vectors();
+}
+
+std::vector<int> ids_of(const SearchResponse &response) {
+  std::vector<int> ids;
+  for (const auto &neighbor : response.neighbors())
+    ids.push_back(neighbor.id());
+  return ids;
+}
+
+} // namespace
+
+TEST(LocalShardedIndexServiceTest, SearchMergesTopKAcrossShards) {
+  LocalShardedIndexServiceImpl service(kDimensions, 3, {}, 2);
+  ASSERT_TRUE(insert(&service, {1, 2, 3, 4, 5, 6, 7}).ok());
+  EXPECT_EQ(num_vectors(&service), 7);
+
+  // Each shard holds some of the best neighbors, which are merged in order of
+  // score.
+  EXPECT_EQ(ids_of(search(&service, 4, {1, 0})),
+            (std::vector<int>{7, 6, 5, 4}));
+
+  // Asking for more neighbors than there are vectors pads with -1, like a
+  // single shard does.
+  std::vector<int> ids = ids_of(search(&service, 8, {-1, 0}));
+  EXPECT_EQ(ids, (std::vector<int>{1, 2, 3, 4, 5, 6, 7, -1}));
+}
+
+TEST(LocalShardedIndexServiceTest, WritesGoToTheShardOfTheId) {
+  LocalShardedIndexServiceImpl service(kDimensions, 3, {}, 2);
+  ASSERT_TRUE(insert(&service, {1, 2, 3, 4, 5, 6}).ok());
+
+  // Inserting an id that exists is ignored by the shard that already stores
+  // it, so it isn't duplicated on another shard.
+  InsertRequest insert_request;
+  *insert_request.add_vectors() = make_vector(4, {100, 0});
+  InsertResponse insert_response;
+  ASSERT_TRUE(service.Insert(nullptr, &insert_request, &insert_response).ok());
+  EXPECT_EQ(num_vectors(&service), 6);
+  EXPECT_EQ(search(&service, 1, {1, 0}).neighbors(0).id(), 6);
+
+  // Upserts replace the vector in the shard that stores it.
+  UpsertRequest upsert_request;
+  *upsert_request.add_vectors() = make_vector(2, {100, 0});
+  *upsert_request.add_vectors() = make_vector(8, {50, 0});
+  UpsertResponse upsert_response;
+  ASSERT_TRUE(service.Upsert(nullptr, &upsert_request, &upsert_response).ok());
+  EXPECT_EQ(num_vectors(&service), 7);
+  EXPECT_EQ(ids_of(search(&service, 3, {1, 0})),
+            (std::vector<int>{2, 8, 6}));
+}
+
+TEST(LocalShardedIndexServiceTest, RejectsVectorsWithWrongDimensions) {
+  LocalShardedIndexServiceImpl service(kDimensions, 3);
+  ASSERT_TRUE(insert(&service, {1, 2}).ok());
+
+  // The whole request is rejected, even the vectors with the right
+  // dimensions.
+  InsertRequest insert_request;
+  *insert_request.add_vectors() = make_vector(3, {3, 0});
+  *insert_request.add_vectors() = make_vector(4, {4, 0, 0});
+  InsertResponse insert_response;
+  EXPECT_EQ(service.Insert(nullptr, &insert_request, &insert_response)
+                .error_code(),
+            StatusCode::INVALID_ARGUMENT);
+
+  UpsertRequest upsert_request;
+  *upsert_request.add_vectors() = make_vector(1, {1, 0});
+  *upsert_request.add_vectors() = make_vector(2, {2});
+  UpsertResponse upsert_response;
+  EXPECT_EQ(service.Upsert(nullptr, &upsert_request, &upsert_response)
+                .error_code(),
+            StatusCode::INVALID_ARGUMENT);
+
+  EXPECT_EQ(num_vectors(&service), 2);
+
+  SearchRequest search_request;
+  search_request.set_k(1);
+  search_request.add_query_vector(1);
+  SearchResponse search_response;
+  EXPECT_EQ(service.Search(nullptr, &search_request, &search_response)
+                .error_code(),
+            StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(LocalShardedIndexServiceTest, RejectsSearchesOverTheMaxK) {
+  admission::Limits limits;
+  limits.max_k = 10;
+  LocalShardedIndexServiceImpl service(kDimensions, 3, {}, 1, "IDMap,Flat",
+                                       faiss::MetricType::METRIC_INNER_PRODUCT,
+                                       limits);
+  ASSERT_TRUE(insert(&service, {1, 2}).ok());
+
+  SearchRequest search_request;
+  search_request.add_query_vector(1);
+  search_request.add_query_vector(0);
+  SearchResponse search_response;
+  search_request.set_k(11);
+  EXPECT_EQ(service.Search(nullptr, &search_request, &search_response)
+                .error_code(),
+            StatusCode::INVALID_ARGUMENT);
+
+  // A `k` that doesn't fit in an `int` is rejected even without a limit,
+  // rather than reaching the shards.
+  LocalShardedIndexServiceImpl unlimited_service(kDimensions, 3);
+  search_request.set_k((uint32_t)std::numeric_limits<int>::max() + 1);
+  EXPECT_EQ(
+      unlimited_service.Search(nullptr, &search_request, &search_response)
+          .error_code(),
+      StatusCode::INVALID_ARGUMENT);
+}
+
+TEST(LocalShardedIndexServiceTest, ShardsShareTheMemoryBudget) {
+  admission::Limits limits;
+  limits.memory_budget_bytes =
+      3 * admission::estimated_vector_bytes(kDimensions);
+  LocalShardedIndexServiceImpl service(kDimensions, 3, {}, 1, "IDMap,Flat",
+                                       faiss::MetricType::METRIC_INNER_PRODUCT,
+                                       limits);
+
+  // Each vector goes to a different shard, but they all count against the
+  // same budget.
+  ASSERT_TRUE(insert(&service, {1, 2, 3}).ok());
+  EXPECT_EQ(insert(&service, {4}).error_code(),
+            StatusCode::RESOURCE_EXHAUSTED);
+  EXPECT_EQ(num_vectors(&service), 3);
+}
+
+TEST(LocalShardedIndexServiceTest, RemovesFromTheShardOfTheId) {
+  LocalShardedIndexServiceImpl service(kDimensions, 3);
+  ASSERT_TRUE(insert(&service, {1, 2, 3, 4, 5, 6}).ok());
+
+  RemoveRequest remove_request;
+  remove_request.add_ids(2);
+  remove_request.add_ids(6);
+  remove_request.add_ids(100);
+  RemoveResponse remove_response;
+  ASSERT_TRUE(service.Remove(nullptr, &remove_request, &remove_response).ok());
+  EXPECT_EQ(remove_response.num_removed(), 2);
+  EXPECT_EQ(num_vectors(&service), 4);
+  EXPECT_EQ(ids_of(search(&service, 2, {1, 0})), (std::vector<int>{5, 4}));
+}
+
+TEST(LocalShardedIndexServiceTest, ProfilesTheSearchOfEveryShard) {
+  LocalShardedIndexServiceImpl service(kDimensions, 3);
+  ASSERT_TRUE(insert(&service, {1, 2, 3, 4}).ok());
+
+  SearchRequest search_request;
+  search_request.set_k(2);
+  search_request.add_query_vector(1);
+  search_request.add_query_vector(0);
+  search_request.set_profile(true);
+  SearchResponse search_response;
+  ASSERT_TRUE(service.Search(nullptr, &search_request, &search_response).ok());
+
+  const ProfileSpan &profile = search_response.profile();
+  EXPECT_EQ(profile.name(), "local_search");
+  ASSERT_EQ(profile.children_size(), 4);
+  for (int i = 0; i < 3; i++) {
+    const ProfileSpan &shard_span = profile.children(i);
+    EXPECT_EQ(shard_span.name(), "shard");
+    EXPECT_EQ(shard_span.stats().at("shard"), i);
+    ASSERT_EQ(shard_span.children_size(), 1);
+    EXPECT_EQ(shard_span.children(0).name(), "search");
+  }
+  EXPECT_EQ(profile.children(3).name(), "merge");
+}
+
+TEST(LocalShardedIndexServiceTest, RejectsRequestsForCollections) {
+  LocalShardedIndexServiceImpl service(kDimensions, 3);
+
+  InsertRequest insert_request;
+  insert_request.set_collection("other");
+  *insert_request.add_vectors() = make_vector(1, {1, 0});
+  InsertResponse insert_response;
+  EXPECT_EQ(service.Insert(nullptr, &insert_request, &insert_response)
+                .error_code(),
+            StatusCode::UNIMPLEMENTED);
+
+  SearchRequest search_request;
+  search_request.set_collection("other");
+  search_request.set_k(1);
+  search_request.add_query_vector(1);
+  search_request.add_query_vector(0);
+  SearchResponse search_response;
+  EXPECT_EQ(service.Search(nullptr, &search_request, &search_response)
+                .error_code(),
+            StatusCode::UNIMPLEMENTED);
+}
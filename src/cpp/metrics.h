@@ -0,0 +1,92 @@
+/* This is a header-only library implementing a registry of named metrics that
+ * services export through `Describe`.
+ *
+ * Metrics are created once by name and then updated lock-free through the
+ * returned pointer, so they're cheap enough to update on every request. Only
+ * creating a metric and taking a snapshot of all metrics lock the registry.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace metrics {
+
+// A value that only goes up, e.g. the number of requests served.
+class Counter {
+public:
+  Counter() : m_value_(0) {}
+
+  void increment(int64_t delta = 1) {
+    m_value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  int64_t value() const { return m_value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> m_value_;
+};
+
+// A value that goes up and down, e.g. the number of bytes in a cache.
+class Gauge {
+public:
+  Gauge() : m_value_(0) {}
+
+  void set(int64_t value) { m_value_.store(value, std::memory_order_relaxed); }
+
+  void add(int64_t delta) {
+    m_value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  int64_t value() const { return m_value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> m_value_;
+};
+
+class Registry {
+public:
+  // Returns the counter with the given name, creating it if needed. The
+  // counter lives as long as the registry.
+  Counter *counter(const std::string &name) {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    std::unique_ptr<Counter> &counter = m_counters_[name];
+    if (!counter)
+      counter = std::make_unique<Counter>();
+    return counter.get();
+  }
+
+  // Returns the gauge with the given name, creating it if needed. The gauge
+  // lives as long as the registry.
+  Gauge *gauge(const std::string &name) {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    std::unique_ptr<Gauge> &gauge = m_gauges_[name];
+    if (!gauge)
+      gauge = std::make_unique<Gauge>();
+    return gauge.get();
+  }
+
+  // Returns the current value of every metric by name.
+  std::map<std::string, double> snapshot() const {
+    std::map<std::string, double> values;
+
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    for (const auto &[name, counter] : m_counters_)
+      values[name] = counter->value();
+    for (const auto &[name, gauge] : m_gauges_)
+      values[name] = gauge->value();
+
+    return values;
+  }
+
+private:
+  mutable std::mutex m_mutex_;
+  std::map<std::string, std::unique_ptr<Counter>> m_counters_;
+  std::map<std::string, std::unique_ptr<Gauge>> m_gauges_;
+};
+
+} // namespace metrics
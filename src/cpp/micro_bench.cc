@@ -0,0 +1,282 @@
+/* Microbenchmarks for the hot paths of the index services.
+ *
+ * Run with `--benchmark_format=json --benchmark_out=<file>` to export results,
+ * e.g. to compare two builds with Google Benchmark's `tools/compare.py`.
+ */
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "absl/log/globals.h"
+#include "absl/log/log.h"
+#include "src/cpp/algo.h"
+#include "src/cpp/dataset.h"
+#include "src/cpp/distance.h"
+#include "src/cpp/encoding.h"
+#include "src/cpp/faiss_index_service.h"
+#include "src/proto/index_service.pb.h"
+
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::Neighbor;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::faiss::FaissIndexServiceImpl;
+
+namespace {
+
+auto is_score_greater = [](const Neighbor &first_neighbor,
+                           const Neighbor &second_neighbor) {
+  return first_neighbor.score() > second_neighbor.score();
+};
+
+// Builds `num_shards` candidate lists of `k` neighbors each, sorted best
+// first, like the per-shard responses merged by the sharded index.
+std::vector<std::vector<Neighbor>> make_shard_candidates(int num_shards,
+                                                         int k) {
+  std::mt19937 generator(0);
+  std::uniform_real_distribution<float> distribution(-1, 1);
+
+  std::vector<std::vector<Neighbor>> shard_candidates(num_shards);
+  for (int shard_idx = 0; shard_idx < num_shards; shard_idx++) {
+    for (int i = 0; i < k; i++) {
+      Neighbor neighbor;
+      neighbor.set_id(shard_idx * k + i);
+      neighbor.set_score(distribution(generator));
+      shard_candidates[shard_idx].push_back(neighbor);
+    }
+    std::sort(shard_candidates[shard_idx].begin(),
+              shard_candidates[shard_idx].end(), is_score_greater);
+  }
+
+  return shard_candidates;
+}
+
+InsertRequest make_insert_request(
+    int num_vectors, int dimensions,
+    index_service::Encoding encoding = index_service::ENCODING_FLOAT32) {
+  dataset::Dataset vectors =
+      dataset::generate_synthetic(num_vectors, dimensions, 0);
+
+  InsertRequest request;
+  for (int i = 0; i < num_vectors; i++) {
+    auto *vector = request.add_vectors();
+    vector->set_id(i);
+    encoding::encode_vector(vectors.vector(i), dimensions, encoding, vector);
+  }
+
+  return request;
+}
+
+} // namespace
+
+// Merges per-shard candidates through a k-sized min-heap, the way
+// `ShardedIndexServiceImpl::Search` does.
+static void BM_HeapTopK(benchmark::State &state) {
+  const int k = state.range(0);
+  const int num_shards = state.range(1);
+  const auto shard_candidates = make_shard_candidates(num_shards, k);
+
+  std::vector<Neighbor> best_candidates(k);
+  for (auto _ : state) {
+    const std::vector<Neighbor> &first = shard_candidates[0];
+    for (int i = k - 1; i >= 0; i--)
+      best_candidates[k - i - 1] = first[i];
+
+    for (int shard_idx = 1; shard_idx < num_shards; shard_idx++) {
+      for (const Neighbor &neighbor : shard_candidates[shard_idx]) {
+        if (is_score_greater(neighbor, best_candidates[0]))
+          algo::heap_replace(best_candidates.data(), k, neighbor,
+                             is_score_greater);
+      }
+    }
+
+    std::sort(best_candidates.begin(), best_candidates.end(),
+              is_score_greater);
+    benchmark::DoNotOptimize(best_candidates.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_shards * k);
+}
+BENCHMARK(BM_HeapTopK)->ArgsProduct({{10, 100, 1000}, {2, 8, 32}});
+
+// Merges per-shard candidates with a k-way merge of the sorted lists.
+static void BM_MergeTopK(benchmark::State &state) {
+  const int k = state.range(0);
+  const int num_shards = state.range(1);
+  const auto shard_candidates = make_shard_candidates(num_shards, k);
+
+  std::vector<std::pair<const Neighbor *, int>> lists;
+  for (const auto &candidates : shard_candidates)
+    lists.emplace_back(candidates.data(), candidates.size());
+
+  std::vector<Neighbor> best_candidates(k);
+  for (auto _ : state) {
+    algo::merge_top_k(lists, k, best_candidates.data(), is_score_greater);
+    benchmark::DoNotOptimize(best_candidates.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_shards * k);
+}
+BENCHMARK(BM_MergeTopK)->ArgsProduct({{10, 100, 1000}, {2, 8, 32}});
+
+// Parses an insert request into the flat id and vector buffers passed to
+// `faiss`, decoding vectors sent with a compact encoding. Bytes processed are
+// the bytes of the request on the wire.
+static void BM_PackVectors(benchmark::State &state) {
+  const int dimensions = state.range(0);
+  const int num_vectors = state.range(1);
+  const auto encoding = (index_service::Encoding)state.range(2);
+  const InsertRequest request =
+      make_insert_request(num_vectors, dimensions, encoding);
+  state.SetLabel(index_service::Encoding_Name(encoding));
+
+  for (auto _ : state) {
+    std::vector<faiss::idx_t> ids;
+    std::vector<float> raw;
+    index_service::faiss::pack_vectors(request.vectors(), dimensions, &ids,
+                                       &raw);
+    benchmark::DoNotOptimize(raw.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_vectors);
+  state.SetBytesProcessed(state.iterations() * request.ByteSizeLong());
+}
+BENCHMARK(BM_PackVectors)
+    ->ArgsProduct({{128, 768, 1536},
+                   {1, 1000},
+                   {index_service::ENCODING_FLOAT32,
+                    index_service::ENCODING_FLOAT16,
+                    index_service::ENCODING_BFLOAT16,
+                    index_service::ENCODING_INT8}});
+
+// Looks up ids in the set types used to track which ids are already stored,
+// half of which are hits.
+template <typename Set> static void BM_IdSetLookup(benchmark::State &state) {
+  const int num_ids = state.range(0);
+
+  Set ids;
+  for (int i = 0; i < num_ids; i++)
+    ids.insert(2 * i);
+
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<int> distribution(0, 2 * num_ids);
+  std::vector<int> lookups(4096);
+  for (int &id : lookups)
+    id = distribution(generator);
+
+  int i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ids.find(lookups[i++ & 4095]) == ids.end());
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_IdSetLookup, std::unordered_set<int>)
+    ->Range(1 << 10, 1 << 22);
+BENCHMARK_TEMPLATE(BM_IdSetLookup, absl::flat_hash_set<int>)
+    ->Range(1 << 10, 1 << 22);
+
+// Measures the in-process cost of a single search request against an exact
+// index, including building the response, but without the gRPC transport.
+static void BM_FaissIndexServiceSearch(benchmark::State &state) {
+  const int dimensions = state.range(0);
+  const int num_vectors = state.range(1);
+  const int k = 10;
+
+  FaissIndexServiceImpl service(dimensions);
+  InsertRequest insert_request = make_insert_request(num_vectors, dimensions);
+  InsertResponse insert_response;
+  service.Insert(nullptr, &insert_request, &insert_response);
+
+  dataset::Dataset query = dataset::generate_synthetic(1, dimensions, 1);
+  SearchRequest search_request;
+  search_request.set_k(k);
+  search_request.mutable_query_vector()->Add(query.vector(0),
+                                             query.vector(0) + dimensions);
+
+  for (auto _ : state) {
+    SearchResponse search_response;
+    service.Search(nullptr, &search_request, &search_response);
+    benchmark::DoNotOptimize(search_response.neighbors_size());
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FaissIndexServiceSearch)
+    ->ArgsProduct({{128, 384, 768, 1536}, {10000}})
+    ->Unit(benchmark::kMicrosecond);
+
+// Scans vectors for the top 10 by L2 distance with the kernel specialized for
+// the number of dimensions, if there's one.
+static void BM_FlatSearchSpecialized(benchmark::State &state) {
+  const int dimensions = state.range(0);
+  const int num_vectors = state.range(1);
+  const int k = 10;
+  const distance::FlatSearchFn flat_search =
+      distance::flat_search_fn(distance::Metric::kL2, dimensions);
+
+  dataset::Dataset vectors =
+      dataset::generate_synthetic(num_vectors, dimensions, 0);
+  dataset::Dataset query = dataset::generate_synthetic(1, dimensions, 1);
+
+  std::vector<float> distances(k);
+  std::vector<int64_t> positions(k);
+  for (auto _ : state) {
+    flat_search(query.vector(0), vectors.vector(0), num_vectors, dimensions,
+                k, distances.data(), positions.data());
+    benchmark::DoNotOptimize(positions.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_vectors);
+}
+BENCHMARK(BM_FlatSearchSpecialized)
+    ->ArgsProduct({{64, 128, 256, 384, 512, 768, 1024, 1536}, {10000}})
+    ->Unit(benchmark::kMicrosecond);
+
+// The same scan with the generic kernel, whose number of dimensions is only
+// known at runtime.
+static void BM_FlatSearchGeneric(benchmark::State &state) {
+  const int dimensions = state.range(0);
+  const int num_vectors = state.range(1);
+  const int k = 10;
+
+  dataset::Dataset vectors =
+      dataset::generate_synthetic(num_vectors, dimensions, 0);
+  dataset::Dataset query = dataset::generate_synthetic(1, dimensions, 1);
+
+  std::vector<float> distances(k);
+  std::vector<int64_t> positions(k);
+  for (auto _ : state) {
+    distance::flat_search<distance::Metric::kL2, 0>(
+        query.vector(0), vectors.vector(0), num_vectors, dimensions, k,
+        distances.data(), positions.data());
+    benchmark::DoNotOptimize(positions.data());
+  }
+
+  state.SetItemsProcessed(state.iterations() * num_vectors);
+}
+BENCHMARK(BM_FlatSearchGeneric)
+    ->ArgsProduct({{64, 128, 256, 384, 512, 768, 1024, 1536}, {10000}})
+    ->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char **argv) {
+  // Services log every request at `INFO`; keep that out of the output.
+  absl::SetMinLogLevel(absl::LogSeverityAtLeast::kWarning);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+/* This is a header-only library for building the execution profiles of
+ * searches that ask for one, as a tree of `ProfileSpan`s.
+ *
+ * Everything here is a no-op when given a null span, which is what searches
+ * that aren't profiled pass, so they don't even read the clock.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "src/proto/index_service.pb.h"
+
+namespace profile {
+
+using Clock = std::chrono::steady_clock;
+
+inline int64_t microseconds_between(Clock::time_point start,
+                                    Clock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+      .count();
+}
+
+inline int64_t microseconds_since(Clock::time_point start) {
+  return microseconds_between(start, Clock::now());
+}
+
+// Returns the profile of `response`, named `name`, if `request` asks for
+// one, and null otherwise.
+inline index_service::ProfileSpan *
+start(const index_service::SearchRequest &request,
+      index_service::SearchResponse *response, const std::string &name) {
+  if (!request.profile())
+    return nullptr;
+
+  index_service::ProfileSpan *span = response->mutable_profile();
+  span->set_name(name);
+  return span;
+}
+
+// Adds a child span to `parent` and returns it, or returns null if `parent`
+// is null.
+inline index_service::ProfileSpan *add_span(index_service::ProfileSpan *parent,
+                                            const std::string &name,
+                                            int64_t duration_us) {
+  if (!parent)
+    return nullptr;
+
+  index_service::ProfileSpan *span = parent->add_children();
+  span->set_name(name);
+  span->set_duration_us(duration_us);
+  return span;
+}
+
+// Like `add_span`, but makes the child the first of `parent`'s children,
+// e.g. for a step that's only timed once the steps after it are.
+inline index_service::ProfileSpan *
+add_first_span(index_service::ProfileSpan *parent, const std::string &name,
+               int64_t duration_us) {
+  index_service::ProfileSpan *span = add_span(parent, name, duration_us);
+  if (!span)
+    return nullptr;
+
+  for (int i = parent->children_size() - 1; i > 0; i--)
+    parent->mutable_children()->SwapElements(i, i - 1);
+  return parent->mutable_children(0);
+}
+
+// Sets stat `name` of `span`, unless it's null.
+inline void set_stat(index_service::ProfileSpan *span, const std::string &name,
+                     double value) {
+  if (span)
+    (*span->mutable_stats())[name] = value;
+}
+
+// Times the steps of a span one after another.
+class Timer {
+public:
+  explicit Timer(index_service::ProfileSpan *span) : m_span_(span) {
+    if (m_span_)
+      m_start_ = m_lap_start_ = Clock::now();
+  }
+
+  // Adds a child span named `name` that lasted from the previous lap, or
+  // from the start, until now. Returns the child, so stats can be added to
+  // it.
+  index_service::ProfileSpan *lap(const std::string &name) {
+    if (!m_span_)
+      return nullptr;
+
+    const Clock::time_point now = Clock::now();
+    index_service::ProfileSpan *child =
+        add_span(m_span_, name, microseconds_between(m_lap_start_, now));
+    m_lap_start_ = now;
+    return child;
+  }
+
+  // Starts the next lap now, so the time since the previous lap isn't
+  // counted in any child.
+  void skip() {
+    if (m_span_)
+      m_lap_start_ = Clock::now();
+  }
+
+  // Sets the duration of the span to the time since the timer started.
+  void finish() {
+    if (m_span_)
+      m_span_->set_duration_us(microseconds_since(m_start_));
+  }
+
+private:
+  index_service::ProfileSpan *m_span_;
+  Clock::time_point m_start_;
+  Clock::time_point m_lap_start_;
+};
+
+} // namespace profile
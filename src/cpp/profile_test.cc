@@ -0,0 +1,48 @@
+#include "src/cpp/profile.h"
+
+#include <gtest/gtest.h>
+
+#include "src/proto/index_service.pb.h"
+
+using index_service::ProfileSpan;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+
+TEST(ProfileTest, OnlyProfilesRequestsThatAskForIt) {
+  SearchRequest request;
+  SearchResponse response;
+  EXPECT_EQ(profile::start(request, &response, "search"), nullptr);
+  EXPECT_FALSE(response.has_profile());
+
+  request.set_profile(true);
+  ProfileSpan *span = profile::start(request, &response, "search");
+  ASSERT_EQ(span, response.mutable_profile());
+  EXPECT_EQ(span->name(), "search");
+}
+
+TEST(ProfileTest, NullSpansAreIgnored) {
+  profile::Timer timer(nullptr);
+  EXPECT_EQ(timer.lap("step"), nullptr);
+  timer.finish();
+
+  EXPECT_EQ(profile::add_span(nullptr, "step", 1), nullptr);
+  profile::set_stat(nullptr, "count", 1);
+}
+
+TEST(ProfileTest, TimerAddsLapsAsChildren) {
+  ProfileSpan span;
+  profile::Timer timer(&span);
+  profile::set_stat(timer.lap("first"), "count", 3);
+  timer.skip();
+  timer.lap("second");
+  profile::add_span(&span, "third", 7);
+  timer.finish();
+
+  ASSERT_EQ(span.children_size(), 3);
+  EXPECT_EQ(span.children(0).name(), "first");
+  EXPECT_EQ(span.children(0).stats().at("count"), 3);
+  EXPECT_EQ(span.children(1).name(), "second");
+  EXPECT_EQ(span.children(2).duration_us(), 7);
+  EXPECT_GE(span.duration_us(), span.children(0).duration_us() +
+                                    span.children(1).duration_us());
+}
@@ -0,0 +1,128 @@
+#include "src/cpp/query_cache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "src/cpp/metrics.h"
+#include "src/proto/index_service.pb.h"
+
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+
+namespace cache {
+
+namespace {
+
+template <typename T> void append_bytes(const T &value, std::string *out) {
+  out->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+} // namespace
+
+std::string make_search_key(const SearchRequest &request) {
+  std::string key;
+  append_bytes(request.k(), &key);
+  append_bytes((int)request.query_encoding(), &key);
+  append_bytes(request.query_scale(), &key);
+
+  // Note: Only one of the query fields is set for a given encoding, so
+  // appending both can't make two different queries collide.
+  key.append(reinterpret_cast<const char *>(request.query_vector().data()),
+             request.query_vector_size() * sizeof(float));
+  key.append(request.query_codes());
+
+  return key;
+}
+
+QueryCache::QueryCache(size_t capacity_bytes, int num_segments,
+                       metrics::Registry *registry)
+    : m_segment_capacity_bytes_(capacity_bytes / std::max(1, num_segments)),
+      m_hits_(registry->counter("query_cache_hits")),
+      m_misses_(registry->counter("query_cache_misses")),
+      m_stale_(registry->counter("query_cache_stale")),
+      m_evictions_(registry->counter("query_cache_evictions")),
+      m_entries_(registry->gauge("query_cache_entries")),
+      m_bytes_(registry->gauge("query_cache_bytes")) {
+  for (int i = 0; i < std::max(1, num_segments); i++)
+    m_segments_.push_back(std::make_unique<Segment>());
+}
+
+QueryCache::Segment &QueryCache::segment_of(const std::string &key) {
+  return *m_segments_[std::hash<std::string>()(key) % m_segments_.size()];
+}
+
+void QueryCache::erase(Segment &segment, std::list<Entry>::iterator it) {
+  segment.num_bytes -= it->num_bytes;
+  m_bytes_->add(-(int64_t)it->num_bytes);
+  m_entries_->add(-1);
+
+  segment.index.erase(it->key);
+  segment.entries.erase(it);
+}
+
+bool QueryCache::lookup(const std::string &key,
+                        const std::vector<uint64_t> &shard_epochs,
+                        SearchResponse *response) {
+  Segment &segment = segment_of(key);
+  const std::lock_guard<std::mutex> _(segment.mutex);
+
+  auto index_it = segment.index.find(key);
+  if (index_it == segment.index.end()) {
+    m_misses_->increment();
+    return false;
+  }
+
+  auto it = index_it->second;
+  if (it->shard_epochs != shard_epochs) {
+    // A shard was written to since this entry was cached.
+    erase(segment, it);
+    m_stale_->increment();
+    m_misses_->increment();
+    return false;
+  }
+
+  // Move the entry to the front, since it's now the most recently used.
+  segment.entries.splice(segment.entries.begin(), segment.entries, it);
+
+  response->CopyFrom(it->response);
+  m_hits_->increment();
+  return true;
+}
+
+void QueryCache::insert(const std::string &key,
+                        const std::vector<uint64_t> &shard_epochs,
+                        const SearchResponse &response) {
+  // Note: Charge for the key twice, since it's also stored in the index.
+  const size_t num_bytes = sizeof(Entry) + 2 * key.size() +
+                           shard_epochs.size() * sizeof(uint64_t) +
+                           response.SpaceUsedLong();
+  if (num_bytes > m_segment_capacity_bytes_)
+    return;
+
+  Segment &segment = segment_of(key);
+  const std::lock_guard<std::mutex> _(segment.mutex);
+
+  auto index_it = segment.index.find(key);
+  if (index_it != segment.index.end())
+    erase(segment, index_it->second);
+
+  segment.entries.push_front(Entry{key, shard_epochs, response, num_bytes});
+  segment.index[key] = segment.entries.begin();
+  segment.num_bytes += num_bytes;
+  m_bytes_->add(num_bytes);
+  m_entries_->add(1);
+
+  while (segment.num_bytes > m_segment_capacity_bytes_) {
+    erase(segment, std::prev(segment.entries.end()));
+    m_evictions_->increment();
+  }
+}
+
+} // namespace cache
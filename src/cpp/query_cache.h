@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "src/cpp/metrics.h"
+#include "src/proto/index_service.pb.h"
+
+namespace cache {
+
+// Returns the cache key of a search, made of every field that affects its
+// results: k and the query vector's encoding, scale and values.
+std::string make_search_key(const index_service::SearchRequest &request);
+
+// A cache of search responses, bounded by the approximate number of bytes
+// its entries take.
+//
+// Each entry remembers the write epoch of every shard at the time its search
+// started. Writes bump the epochs of the shards they write to, so an entry is
+// only returned while none of the shards it was computed from have been
+// written to since. Stale entries are dropped when they're looked up, or
+// evicted like any other entry.
+//
+// The cache is split into independently locked segments by key hash, so
+// concurrent searches rarely contend on the same lock. Each segment evicts
+// its least recently used entries once it exceeds its share of the budget.
+class QueryCache {
+public:
+  // Registers the cache's metrics in `registry`, prefixed with
+  // `query_cache_`.
+  QueryCache(size_t capacity_bytes, int num_segments,
+             metrics::Registry *registry);
+
+  QueryCache(const QueryCache &) = delete;
+  QueryCache &operator=(const QueryCache &) = delete;
+
+  // Copies the cached response for `key` into `response` and returns true if
+  // there's one computed at `shard_epochs`. Otherwise returns false.
+  bool lookup(const std::string &key,
+              const std::vector<uint64_t> &shard_epochs,
+              index_service::SearchResponse *response);
+
+  // Caches `response` for `key`, computed at `shard_epochs`. Responses larger
+  // than a segment's budget aren't cached.
+  void insert(const std::string &key,
+              const std::vector<uint64_t> &shard_epochs,
+              const index_service::SearchResponse &response);
+
+private:
+  struct Entry {
+    std::string key;
+    std::vector<uint64_t> shard_epochs;
+    index_service::SearchResponse response;
+    size_t num_bytes;
+  };
+
+  struct Segment {
+    std::mutex mutex;
+
+    // Entries from most to least recently used.
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t num_bytes = 0;
+  };
+
+  Segment &segment_of(const std::string &key);
+
+  // Removes `it` from `segment`. The caller must hold the segment's lock.
+  void erase(Segment &segment, std::list<Entry>::iterator it);
+
+  size_t m_segment_capacity_bytes_;
+  std::vector<std::unique_ptr<Segment>> m_segments_;
+
+  metrics::Counter *m_hits_;
+  metrics::Counter *m_misses_;
+  metrics::Counter *m_stale_;
+  metrics::Counter *m_evictions_;
+  metrics::Gauge *m_entries_;
+  metrics::Gauge *m_bytes_;
+};
+
+} // namespace cache
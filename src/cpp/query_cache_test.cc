@@ -0,0 +1,115 @@
+#include "src/cpp/query_cache.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "src/cpp/metrics.h"
+#include "src/proto/index_service.pb.h"
+
+using cache::make_search_key;
+using cache::QueryCache;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+
+namespace {
+
+SearchRequest make_request(int k, std::vector<float> query) {
+  SearchRequest request;
+  request.set_k(k);
+  request.mutable_query_vector()->Add(query.begin(), query.end());
+  return request;
+}
+
+SearchResponse make_response(int id) {
+  SearchResponse response;
+  auto *neighbor = response.add_neighbors();
+  neighbor->set_id(id);
+  neighbor->set_score(1);
+  return response;
+}
+
+} // namespace
+
+TEST(MakeSearchKeyTest, DependsOnEveryField) {
+  const std::string key = make_search_key(make_request(10, {1, 2}));
+
+  EXPECT_EQ(key, make_search_key(make_request(10, {1, 2})));
+  EXPECT_NE(key, make_search_key(make_request(5, {1, 2})));
+  EXPECT_NE(key, make_search_key(make_request(10, {1, 3})));
+
+  SearchRequest encoded = make_request(10, {});
+  encoded.set_query_encoding(index_service::ENCODING_INT8);
+  encoded.set_query_codes("ab");
+  encoded.set_query_scale(0.5);
+  SearchRequest rescaled = encoded;
+  rescaled.set_query_scale(0.25);
+  EXPECT_NE(make_search_key(encoded), make_search_key(rescaled));
+}
+
+TEST(QueryCacheTest, HitsAndMisses) {
+  metrics::Registry registry;
+  QueryCache cache(1 << 20, 4, &registry);
+  const std::string key = make_search_key(make_request(10, {1, 2}));
+
+  SearchResponse response;
+  EXPECT_FALSE(cache.lookup(key, {0, 0}, &response));
+
+  cache.insert(key, {0, 0}, make_response(7));
+  ASSERT_TRUE(cache.lookup(key, {0, 0}, &response));
+  EXPECT_EQ(response.neighbors(0).id(), 7);
+
+  std::map<std::string, double> metrics = registry.snapshot();
+  EXPECT_EQ(metrics["query_cache_hits"], 1);
+  EXPECT_EQ(metrics["query_cache_misses"], 1);
+  EXPECT_EQ(metrics["query_cache_entries"], 1);
+  EXPECT_GT(metrics["query_cache_bytes"], 0);
+}
+
+TEST(QueryCacheTest, InvalidatesOnWrite) {
+  metrics::Registry registry;
+  QueryCache cache(1 << 20, 1, &registry);
+  const std::string key = make_search_key(make_request(10, {1, 2}));
+
+  cache.insert(key, {3, 5}, make_response(7));
+
+  // A write to the second shard makes the entry stale.
+  SearchResponse response;
+  EXPECT_FALSE(cache.lookup(key, {3, 6}, &response));
+  EXPECT_FALSE(cache.lookup(key, {3, 5}, &response));
+
+  std::map<std::string, double> metrics = registry.snapshot();
+  EXPECT_EQ(metrics["query_cache_stale"], 1);
+  EXPECT_EQ(metrics["query_cache_entries"], 0);
+  EXPECT_EQ(metrics["query_cache_bytes"], 0);
+}
+
+TEST(QueryCacheTest, EvictsLeastRecentlyUsed) {
+  metrics::Registry registry;
+
+  // Size the cache to hold exactly two entries.
+  QueryCache sizing_cache(1 << 20, 1, &registry);
+  sizing_cache.insert(make_search_key(make_request(1, {0})), {0},
+                      make_response(0));
+  const double entry_bytes = registry.snapshot()["query_cache_bytes"];
+
+  metrics::Registry cache_registry;
+  QueryCache cache(2 * entry_bytes, 1, &cache_registry);
+  const std::string first_key = make_search_key(make_request(1, {1}));
+  const std::string second_key = make_search_key(make_request(1, {2}));
+  const std::string third_key = make_search_key(make_request(1, {3}));
+
+  SearchResponse response;
+  cache.insert(first_key, {0}, make_response(1));
+  cache.insert(second_key, {0}, make_response(2));
+  ASSERT_TRUE(cache.lookup(first_key, {0}, &response));
+  cache.insert(third_key, {0}, make_response(3));
+
+  EXPECT_TRUE(cache.lookup(first_key, {0}, &response));
+  EXPECT_FALSE(cache.lookup(second_key, {0}, &response));
+  EXPECT_TRUE(cache.lookup(third_key, {0}, &response));
+  EXPECT_EQ(cache_registry.snapshot()["query_cache_evictions"], 1);
+}
@@ -0,0 +1,482 @@
+#include "src/cpp/segmented_index.h"
+
+#include <absl/log/log.h>
+#include <absl/strings/str_format.h>
+#include <faiss/Index.h>
+#include <faiss/MetricType.h>
+#include <faiss/impl/IDSelector.h>
+#include <faiss/index_factory.h>
+#include <omp.h>
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "src/cpp/algo.h"
+#include "src/cpp/distance.h"
+
+using faiss::IDSelector;
+using faiss::IDSelectorBatch;
+using faiss::idx_t;
+using faiss::Index;
+using faiss::MetricType;
+using faiss::SearchParameters;
+
+namespace segmented {
+
+namespace {
+
+// The index type of the buffer, and of segments that failed to build.
+constexpr char kBufferFactoryString[] = "IDMap,Flat";
+
+// A segment with more than this fraction of dead vectors is rewritten on its
+// own, so searches don't overfetch too much from it.
+constexpr double kMaxDeadFraction = 0.5;
+
+// Batches of at least this many queries search flat segments with `faiss`,
+// which computes distances for a batch as one matrix product. Matches
+// `faiss::distance_compute_blas_threshold`.
+constexpr idx_t kMinBlasQueries = 20;
+
+// Returns the native top-k kernel for `metric`, or null if there's none.
+distance::FlatSearchFn native_flat_search(int dimensions, MetricType metric) {
+  switch (metric) {
+  case MetricType::METRIC_L2:
+    return distance::flat_search_fn(distance::Metric::kL2, dimensions);
+  case MetricType::METRIC_INNER_PRODUCT:
+    return distance::flat_search_fn(distance::Metric::kInnerProduct,
+                                    dimensions);
+  default:
+    return nullptr;
+  }
+}
+
+} // namespace
+
+SegmentedIndex::SegmentedIndex(int dimensions,
+                               const std::string &segment_factory_string,
+                               MetricType metric_type,
+                               const SegmentConfig &config)
+    : Index(dimensions, metric_type), m_dimensions_(dimensions),
+      m_segment_factory_string_(segment_factory_string), m_config_(config),
+      m_native_flat_search_(native_flat_search(dimensions, metric_type)),
+      m_busy_(false), m_stopping_(false) {
+  m_buffer_ = make_buffer();
+  m_background_thread_ = std::thread([this] { run_background(); });
+}
+
+SegmentedIndex::~SegmentedIndex() {
+  {
+    const std::lock_guard<std::shared_mutex> _(m_mutex_);
+    m_stopping_ = true;
+  }
+  m_cv_.notify_all();
+  m_background_thread_.join();
+}
+
+std::shared_ptr<SegmentedIndex::Segment> SegmentedIndex::make_buffer() {
+  auto buffer = std::make_shared<Segment>();
+  buffer->index.reset(::faiss::index_factory(m_dimensions_,
+                                             kBufferFactoryString,
+                                             metric_type));
+  return buffer;
+}
+
+void SegmentedIndex::add(idx_t n, const float *x) {
+  throw std::runtime_error("SegmentedIndex requires ids; use add_with_ids.");
+}
+
+void SegmentedIndex::add_with_ids(idx_t n, const float *x, const idx_t *xids) {
+  // Only keep the last vector of each id, the one that would win if the
+  // vectors were added one by one.
+  std::unordered_map<idx_t, idx_t> last_positions;
+  for (idx_t i = 0; i < n; i++)
+    last_positions[xids[i]] = i;
+
+  std::vector<idx_t> ids;
+  std::vector<float> raw;
+  ids.reserve(last_positions.size());
+  raw.reserve(last_positions.size() * m_dimensions_);
+  for (idx_t i = 0; i < n; i++) {
+    if (last_positions[xids[i]] != i)
+      continue;
+    ids.push_back(xids[i]);
+    raw.insert(raw.end(), x + i * m_dimensions_, x + (i + 1) * m_dimensions_);
+  }
+
+  const std::lock_guard<std::shared_mutex> _(m_mutex_);
+
+  remove_live(ids);
+
+  m_buffer_->index->add_with_ids(ids.size(), raw.data(), ids.data());
+  m_buffer_->ids.insert(m_buffer_->ids.end(), ids.begin(), ids.end());
+  m_buffer_->raw.insert(m_buffer_->raw.end(), raw.begin(), raw.end());
+  for (const idx_t id : ids)
+    m_locations_[id] = m_buffer_.get();
+  ntotal = m_locations_.size();
+
+  if (m_buffer_->ids.size() >= m_config_.buffer_capacity) {
+    m_segments_.push_back(std::move(m_buffer_));
+    m_buffer_ = make_buffer();
+    m_cv_.notify_all();
+  }
+}
+
+size_t SegmentedIndex::remove_live(const std::vector<idx_t> &ids) {
+  std::vector<idx_t> buffer_ids;
+  size_t num_removed = 0;
+
+  for (const idx_t id : ids) {
+    auto it = m_locations_.find(id);
+    if (it == m_locations_.end())
+      continue;
+
+    if (it->second == m_buffer_.get())
+      buffer_ids.push_back(id);
+    else
+      it->second->num_dead++;
+
+    m_locations_.erase(it);
+    num_removed++;
+  }
+
+  // Wake the background thread in case a segment is now mostly dead.
+  if (num_removed > buffer_ids.size())
+    m_cv_.notify_all();
+
+  if (buffer_ids.empty())
+    return num_removed;
+
+  // The buffer isn't sealed yet, so remove overwritten vectors from it
+  // outright instead of leaving them dead.
+  const IDSelectorBatch buffer_selector(buffer_ids.size(), buffer_ids.data());
+  m_buffer_->index->remove_ids(buffer_selector);
+
+  const std::unordered_set<idx_t> removed(buffer_ids.begin(),
+                                          buffer_ids.end());
+  size_t num_kept = 0;
+  for (size_t i = 0; i < m_buffer_->ids.size(); i++) {
+    if (removed.count(m_buffer_->ids[i]))
+      continue;
+
+    if (num_kept != i) {
+      m_buffer_->ids[num_kept] = m_buffer_->ids[i];
+      std::copy_n(m_buffer_->raw.begin() + i * m_dimensions_, m_dimensions_,
+                  m_buffer_->raw.begin() + num_kept * m_dimensions_);
+    }
+    num_kept++;
+  }
+  m_buffer_->ids.resize(num_kept);
+  m_buffer_->raw.resize(num_kept * m_dimensions_);
+
+  return num_removed;
+}
+
+void SegmentedIndex::search(idx_t n, const float *x, idx_t k,
+                            float *distances, idx_t *labels,
+                            const SearchParameters *params) const {
+  const bool higher_is_better =
+      metric_type == MetricType::METRIC_INNER_PRODUCT;
+  const float worst_distance = higher_is_better
+                                   ? -std::numeric_limits<float>::max()
+                                   : std::numeric_limits<float>::max();
+
+  const std::shared_lock<std::shared_mutex> _(m_mutex_);
+
+  std::vector<const Segment *> segments = {m_buffer_.get()};
+  for (const std::shared_ptr<Segment> &segment : m_segments_)
+    segments.push_back(segment.get());
+
+  // The live neighbors of each query in each segment, best first.
+  std::vector<std::vector<std::vector<std::pair<float, idx_t>>>> candidates(
+      n, std::vector<std::vector<std::pair<float, idx_t>>>(segments.size()));
+
+  std::vector<float> segment_distances;
+  std::vector<idx_t> segment_labels;
+  for (int s = 0; s < segments.size(); s++) {
+    const Segment *segment = segments[s];
+
+    // Overfetch by the number of dead vectors, so there are still `k` live
+    // neighbors left after dropping dead ones.
+    const idx_t segment_k =
+        std::min<idx_t>(k + segment->num_dead, segment->ids.size());
+    if (segment_k == 0)
+      continue;
+
+    segment_distances.resize(n * segment_k);
+    segment_labels.resize(n * segment_k);
+    if (!segment->built && m_native_flat_search_ && !params &&
+        n < kMinBlasQueries) {
+      // Note: Segments that aren't built yet are flat, and keep their raw
+      // vectors, so scan those directly with the kernel specialized for the
+      // index's dimensions.
+      for (idx_t q = 0; q < n; q++) {
+        idx_t *query_labels = segment_labels.data() + q * segment_k;
+        const int num_found = m_native_flat_search_(
+            x + q * m_dimensions_, segment->raw.data(), segment->ids.size(),
+            m_dimensions_, segment_k, segment_distances.data() + q * segment_k,
+            query_labels);
+        for (int i = 0; i < segment_k; i++)
+          query_labels[i] = i < num_found ? segment->ids[query_labels[i]] : -1;
+      }
+    } else {
+      segment->index->search(n, x, segment_k, segment_distances.data(),
+                             segment_labels.data(), params);
+    }
+
+    for (idx_t q = 0; q < n; q++) {
+      auto &live = candidates[q][s];
+      for (idx_t i = q * segment_k; i < (q + 1) * segment_k; i++) {
+        const idx_t label = segment_labels[i];
+        if (label < 0 || live.size() == k)
+          continue;
+
+        auto it = m_locations_.find(label);
+        if (it != m_locations_.end() && it->second == segment)
+          live.emplace_back(segment_distances[i], label);
+      }
+    }
+  }
+
+  std::vector<std::pair<float, idx_t>> merged(k);
+  for (idx_t q = 0; q < n; q++) {
+    std::vector<std::pair<const std::pair<float, idx_t> *, int>> lists;
+    for (const auto &live : candidates[q])
+      lists.emplace_back(live.data(), live.size());
+
+    const int num_merged = algo::merge_top_k(
+        lists, k, merged.data(),
+        [higher_is_better](const std::pair<float, idx_t> &first,
+                           const std::pair<float, idx_t> &second) {
+          return higher_is_better ? first.first > second.first
+                                  : first.first < second.first;
+        });
+
+    for (idx_t i = 0; i < k; i++) {
+      distances[q * k + i] = i < num_merged ? merged[i].first : worst_distance;
+      labels[q * k + i] = i < num_merged ? merged[i].second : -1;
+    }
+  }
+}
+
+void SegmentedIndex::reset() {
+  const std::lock_guard<std::shared_mutex> _(m_mutex_);
+
+  // Note: A rebuild in progress notices its inputs are gone and drops its
+  // output.
+  m_segments_.clear();
+  m_locations_.clear();
+  m_buffer_ = make_buffer();
+  ntotal = 0;
+}
+
+size_t SegmentedIndex::remove_ids(const IDSelector &sel) {
+  const std::lock_guard<std::shared_mutex> _(m_mutex_);
+
+  // Note: Upserts remove ids through a batch selector, so look its ids up
+  // directly rather than scanning every live vector.
+  std::vector<idx_t> ids;
+  if (const auto *batch = dynamic_cast<const IDSelectorBatch *>(&sel)) {
+    ids.assign(batch->set.begin(), batch->set.end());
+  } else {
+    for (const auto &[id, segment] : m_locations_) {
+      if (sel.is_member(id))
+        ids.push_back(id);
+    }
+  }
+
+  const size_t num_removed = remove_live(ids);
+  ntotal = m_locations_.size();
+  return num_removed;
+}
+
+void SegmentedIndex::for_each(
+    const std::function<void(idx_t id, const float *vector)> &fn) const {
+  const std::shared_lock<std::shared_mutex> _(m_mutex_);
+
+  std::vector<const Segment *> segments = {m_buffer_.get()};
+  for (const std::shared_ptr<Segment> &segment : m_segments_)
+    segments.push_back(segment.get());
+
+  for (const Segment *segment : segments) {
+    for (size_t i = 0; i < segment->ids.size(); i++) {
+      auto it = m_locations_.find(segment->ids[i]);
+      if (it != m_locations_.end() && it->second == segment)
+        fn(segment->ids[i], segment->raw.data() + i * m_dimensions_);
+    }
+  }
+}
+
+SegmentStats SegmentedIndex::stats() const {
+  const std::shared_lock<std::shared_mutex> _(m_mutex_);
+
+  SegmentStats stats;
+  stats.buffer_vectors = m_buffer_->ids.size();
+  stats.flat_vectors = stats.buffer_vectors;
+  for (const std::shared_ptr<Segment> &segment : m_segments_) {
+    if (segment->built) {
+      stats.built_segments++;
+    } else {
+      stats.sealed_segments++;
+      stats.flat_vectors += segment->ids.size();
+    }
+    stats.dead_vectors += segment->num_dead;
+  }
+
+  return stats;
+}
+
+void SegmentedIndex::wait_until_idle() const {
+  std::unique_lock<std::shared_mutex> lock(m_mutex_);
+  m_cv_.wait(lock, [this] {
+    return m_stopping_ || (!m_busy_ && next_work().empty());
+  });
+}
+
+std::vector<std::shared_ptr<SegmentedIndex::Segment>>
+SegmentedIndex::next_work() const {
+  // Build sealed segments first, since they're searched by brute force.
+  for (const std::shared_ptr<Segment> &segment : m_segments_) {
+    if (!segment->built)
+      return {segment};
+  }
+
+  for (const std::shared_ptr<Segment> &segment : m_segments_) {
+    if (segment->num_dead > kMaxDeadFraction * segment->ids.size())
+      return {segment};
+  }
+
+  if (m_segments_.size() <= std::max(1, m_config_.max_segments))
+    return {};
+
+  // Merge the smallest segments into one, so there are `max_segments` left.
+  std::vector<std::shared_ptr<Segment>> segments = m_segments_;
+  std::sort(segments.begin(), segments.end(),
+            [](const std::shared_ptr<Segment> &first,
+               const std::shared_ptr<Segment> &second) {
+              return first->ids.size() - first->num_dead <
+                     second->ids.size() - second->num_dead;
+            });
+  segments.resize(m_segments_.size() - std::max(1, m_config_.max_segments) +
+                  1);
+
+  return segments;
+}
+
+void SegmentedIndex::run_background() {
+  // Note: This only sets the size of OpenMP teams started from this thread,
+  // which is what `faiss` uses to build segments.
+  if (m_config_.build_threads > 0)
+    omp_set_num_threads(m_config_.build_threads);
+
+  std::unique_lock<std::shared_mutex> lock(m_mutex_);
+  while (true) {
+    m_cv_.wait(lock, [this] { return m_stopping_ || !next_work().empty(); });
+    if (m_stopping_)
+      return;
+
+    const std::vector<std::shared_ptr<Segment>> inputs = next_work();
+    m_busy_ = true;
+
+    lock.unlock();
+    rebuild(inputs);
+    lock.lock();
+
+    m_busy_ = false;
+    m_cv_.notify_all();
+  }
+}
+
+void SegmentedIndex::rebuild(
+    const std::vector<std::shared_ptr<Segment>> &inputs) {
+  auto output = std::make_shared<Segment>();
+  output->built = true;
+
+  {
+    const std::shared_lock<std::shared_mutex> _(m_mutex_);
+    for (const std::shared_ptr<Segment> &input : inputs) {
+      for (size_t i = 0; i < input->ids.size(); i++) {
+        auto it = m_locations_.find(input->ids[i]);
+        if (it == m_locations_.end() || it->second != input.get())
+          continue;
+
+        output->ids.push_back(input->ids[i]);
+        output->raw.insert(output->raw.end(),
+                           input->raw.begin() + i * m_dimensions_,
+                           input->raw.begin() + (i + 1) * m_dimensions_);
+      }
+    }
+  }
+
+  const idx_t num_vectors = output->ids.size();
+  if (num_vectors > 0) {
+    try {
+      output->index.reset(::faiss::index_factory(
+          m_dimensions_, m_segment_factory_string_.c_str(), metric_type));
+      if (!output->index->is_trained)
+        output->index->train(num_vectors, output->raw.data());
+      output->index->add_with_ids(num_vectors, output->raw.data(),
+                                  output->ids.data());
+    } catch (const std::exception &e) {
+      // Note: e.g. an IVF index can't be trained on fewer vectors than it
+      // has lists. Fall back to a flat index rather than retrying forever.
+      LOG(WARNING) << absl::StrFormat(
+          "Failed to build %s segment of %d vectors, keeping it flat: %s",
+          m_segment_factory_string_, num_vectors, e.what());
+      output->index.reset(::faiss::index_factory(
+          m_dimensions_, kBufferFactoryString, metric_type));
+      output->index->add_with_ids(num_vectors, output->raw.data(),
+                                  output->ids.data());
+    }
+  }
+
+  const std::lock_guard<std::shared_mutex> _(m_mutex_);
+
+  // `reset` may have dropped the inputs while building.
+  for (const std::shared_ptr<Segment> &input : inputs) {
+    if (std::find(m_segments_.begin(), m_segments_.end(), input) ==
+        m_segments_.end())
+      return;
+  }
+
+  // Point every vector that's still live in an input at the output. The
+  // rest were removed or overwritten while building.
+  for (const idx_t id : output->ids) {
+    auto it = m_locations_.find(id);
+    const bool is_live =
+        it != m_locations_.end() &&
+        std::any_of(inputs.begin(), inputs.end(),
+                    [&](const std::shared_ptr<Segment> &input) {
+                      return it->second == input.get();
+                    });
+    if (is_live)
+      it->second = output.get();
+    else
+      output->num_dead++;
+  }
+
+  m_segments_.erase(std::remove_if(m_segments_.begin(), m_segments_.end(),
+                                   [&](const std::shared_ptr<Segment> &s) {
+                                     return std::find(inputs.begin(),
+                                                      inputs.end(),
+                                                      s) != inputs.end();
+                                   }),
+                    m_segments_.end());
+  if (num_vectors > 0)
+    m_segments_.push_back(std::move(output));
+
+  LOG(INFO) << absl::StrFormat(
+      "Rebuilt %d segments into one segment of %d vectors.", inputs.size(),
+      num_vectors);
+}
+
+} // namespace segmented
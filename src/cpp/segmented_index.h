@@ -0,0 +1,200 @@
+#pragma once
+
+#include <faiss/Index.h>
+#include <faiss/MetricType.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "src/cpp/distance.h"
+
+namespace segmented {
+
+struct SegmentConfig {
+  // The number of vectors the mutable buffer holds before it's sealed into a
+  // segment.
+  int buffer_capacity = 10000;
+
+  // Once there are more built segments than this, the smallest are merged.
+  int max_segments = 8;
+
+  // The number of OpenMP threads used to build segments in the background,
+  // or non-positive to use OpenMP's default. Kept small by default so
+  // building doesn't starve searches.
+  int build_threads = 1;
+};
+
+// Counts of what's stored in a `SegmentedIndex`, exported through `Describe`.
+struct SegmentStats {
+  // The number of vectors in the mutable buffer.
+  int buffer_vectors = 0;
+
+  // The number of sealed segments that are still searched by brute force
+  // while they wait to be built.
+  int sealed_segments = 0;
+
+  // The number of segments built with the segment factory string.
+  int built_segments = 0;
+
+  // The number of removed or overwritten vectors still stored in segments.
+  int dead_vectors = 0;
+
+  // The number of vectors, including dead ones, in the buffer and the sealed
+  // segments, which searches scan by brute force.
+  int flat_vectors = 0;
+};
+
+// A log-structured index made of a small mutable buffer and immutable
+// segments.
+//
+// Writes only append to the buffer, an `IDMap,Flat` index, so they're cheap
+// regardless of how expensive the segment index type is to add to. Once the
+// buffer is full it's sealed, and a background thread builds it into a
+// segment with `segment_factory_string` (e.g. `IDMap,HNSW32`), training the
+// index on the segment's vectors first if needed. Until then, the sealed
+// buffer is still searched by brute force. The background thread also merges
+// the smallest segments once there are more than `max_segments`, so searches
+// don't have to visit ever more segments.
+//
+// The buffer and sealed segments are scanned with a native kernel
+// specialized for the index's dimensions (see `distance.h`), except for
+// large batches of queries, which `faiss` computes as a matrix product.
+//
+// Segments are immutable, so removing or overwriting a vector only moves or
+// erases it in the map from ids to the segment storing their live copy. The
+// old copy is dead: searches ask each segment for `k` plus its number of
+// dead vectors, and drop the dead ones. Merging drops dead vectors for good,
+// and a segment that's mostly dead is rewritten on its own.
+//
+// Each segment keeps the raw vectors it was built from, so segments can be
+// rebuilt and merged with any index type, including ones that can't
+// reconstruct their vectors.
+//
+// This is itself a `faiss::Index`, so it can be used anywhere a `faiss`
+// index is. It's safe to call from multiple threads.
+class SegmentedIndex final : public ::faiss::Index {
+public:
+  SegmentedIndex(int dimensions, const std::string &segment_factory_string,
+                 ::faiss::MetricType metric_type,
+                 const SegmentConfig &config = {});
+
+  SegmentedIndex(const SegmentedIndex &) = delete;
+  SegmentedIndex &operator=(const SegmentedIndex &) = delete;
+
+  // Stops the background thread once it finishes the build in progress, if
+  // any.
+  ~SegmentedIndex() override;
+
+  // Always throws, since vectors need ids to be removed or overwritten.
+  void add(::faiss::idx_t n, const float *x) override;
+
+  // Adds vectors to the buffer. Vectors with an existing id overwrite the
+  // existing vector.
+  void add_with_ids(::faiss::idx_t n, const float *x,
+                    const ::faiss::idx_t *xids) override;
+
+  // Note: `params` is passed through to every segment, so an id selector
+  // applies to ids rather than positions, like it does for `IDMap` indexes.
+  void search(::faiss::idx_t n, const float *x, ::faiss::idx_t k,
+              float *distances, ::faiss::idx_t *labels,
+              const ::faiss::SearchParameters *params = nullptr) const override;
+
+  void reset() override;
+
+  size_t remove_ids(const ::faiss::IDSelector &sel) override;
+
+  // Calls `fn` with every live vector, in no particular order.
+  void for_each(const std::function<void(::faiss::idx_t id,
+                                         const float *vector)> &fn) const;
+
+  SegmentStats stats() const;
+
+  // Blocks until every sealed segment is built and no merges are due.
+  void wait_until_idle() const;
+
+private:
+  struct Segment {
+    // The vectors stored in this segment, including dead ones. Only the
+    // buffer appends to these; they're immutable once sealed.
+    std::vector<::faiss::idx_t> ids;
+    std::vector<float> raw;
+
+    std::unique_ptr<::faiss::Index> index;
+
+    // Whether `index` was built in the background, as opposed to being the
+    // flat index the segment was written to.
+    bool built = false;
+
+    // The number of vectors in `ids` that are no longer live in this segment.
+    // Always zero for the buffer, since overwritten vectors are removed from
+    // it outright.
+    int num_dead = 0;
+  };
+
+  // Returns a new, empty flat segment.
+  // Note: The caller must hold `m_mutex_` exclusively.
+  std::shared_ptr<Segment> make_buffer();
+
+  // Removes the live copies of `ids`, if any, and returns how many there
+  // were.
+  // Note: The caller must hold `m_mutex_` exclusively.
+  size_t remove_live(const std::vector<::faiss::idx_t> &ids);
+
+  // Returns the segments the background thread should rebuild next, or
+  // nothing if there's no work.
+  // Note: The caller must hold `m_mutex_`.
+  std::vector<std::shared_ptr<Segment>> next_work() const;
+
+  // Builds or merges segments until the index is destroyed.
+  void run_background();
+
+  // Builds the live vectors of `inputs` into one segment, and replaces
+  // `inputs` with it. Vectors that died while building are counted as dead
+  // in the new segment. Called without holding `m_mutex_`.
+  void rebuild(const std::vector<std::shared_ptr<Segment>> &inputs);
+
+  int m_dimensions_;
+
+  std::string m_segment_factory_string_;
+
+  SegmentConfig m_config_;
+
+  // Searches segments that aren't built yet, or null if there's no native
+  // kernel for the metric.
+  distance::FlatSearchFn m_native_flat_search_;
+
+  // Guards every member below. Searches share it; writes and swapping in
+  // rebuilt segments hold it exclusively. Builds run without it.
+  mutable std::shared_mutex m_mutex_;
+
+  // Signalled when there's work for the background thread, or when it
+  // becomes idle.
+  mutable std::condition_variable_any m_cv_;
+
+  // The segment new vectors are appended to.
+  std::shared_ptr<Segment> m_buffer_;
+
+  // Sealed segments, both built and waiting to be built.
+  std::vector<std::shared_ptr<Segment>> m_segments_;
+
+  // Maps the id of every live vector to the segment storing it.
+  // Note: Rebuilding moves every vector of its inputs to its output while
+  // holding `m_mutex_`, so no entry outlives the segment it points to.
+  std::unordered_map<::faiss::idx_t, Segment *> m_locations_;
+
+  // Whether the background thread is building or merging segments.
+  bool m_busy_;
+
+  bool m_stopping_;
+
+  std::thread m_background_thread_;
+};
+
+} // namespace segmented
@@ -0,0 +1,166 @@
+#include "src/cpp/segmented_index.h"
+
+#include <faiss/MetricType.h>
+#include <faiss/impl/IDSelector.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <map>
+#include <vector>
+
+using faiss::IDSelectorBatch;
+using faiss::idx_t;
+using faiss::MetricType;
+using segmented::SegmentConfig;
+using segmented::SegmentedIndex;
+using segmented::SegmentStats;
+
+using testing::ElementsAre;
+using testing::Pair;
+
+namespace {
+
+constexpr int kDimensions = 2;
+
+SegmentConfig make_config(int buffer_capacity, int max_segments) {
+  SegmentConfig config;
+  config.buffer_capacity = buffer_capacity;
+  config.max_segments = max_segments;
+  return config;
+}
+
+// Adds a vector pointing along the x axis with a length of `length`, so
+// vectors with larger lengths score higher against the query (1, 0).
+void add(SegmentedIndex *index, idx_t id, float length) {
+  const float vector[kDimensions] = {length, 0};
+  index->add_with_ids(1, vector, &id);
+}
+
+std::vector<idx_t> search(const SegmentedIndex &index, int k) {
+  const float query[kDimensions] = {1, 0};
+  std::vector<float> distances(k);
+  std::vector<idx_t> labels(k);
+  index.search(1, query, k, distances.data(), labels.data());
+  return labels;
+}
+
+} // namespace
+
+TEST(SegmentedIndexTest, SearchesBufferAndSegments) {
+  SegmentedIndex index(kDimensions, "IDMap,Flat",
+                       MetricType::METRIC_INNER_PRODUCT, make_config(2, 8));
+  for (int id = 0; id < 7; id++)
+    add(&index, id, id);
+  index.wait_until_idle();
+
+  const SegmentStats stats = index.stats();
+  EXPECT_EQ(stats.buffer_vectors, 1);
+  EXPECT_EQ(stats.built_segments, 3);
+  EXPECT_EQ(stats.flat_vectors, 1);
+  EXPECT_EQ(index.ntotal, 7);
+
+  EXPECT_THAT(search(index, 4), ElementsAre(6, 5, 4, 3));
+  EXPECT_THAT(search(index, 9), ElementsAre(6, 5, 4, 3, 2, 1, 0, -1, -1));
+}
+
+TEST(SegmentedIndexTest, OverwritesHideOldCopies) {
+  SegmentedIndex index(kDimensions, "IDMap,Flat",
+                       MetricType::METRIC_INNER_PRODUCT, make_config(2, 8));
+  add(&index, 0, 10);
+  add(&index, 1, 9);
+  index.wait_until_idle();
+
+  // Overwrite vector 0, which is now in a sealed segment, so that it's the
+  // worst match.
+  add(&index, 0, 1);
+
+  EXPECT_EQ(index.ntotal, 2);
+  EXPECT_THAT(search(index, 1), ElementsAre(1));
+  EXPECT_THAT(search(index, 2), ElementsAre(1, 0));
+  EXPECT_THAT(search(index, 3), ElementsAre(1, 0, -1));
+}
+
+TEST(SegmentedIndexTest, OverwritesWithinBuffer) {
+  SegmentedIndex index(kDimensions, "IDMap,Flat",
+                       MetricType::METRIC_INNER_PRODUCT, make_config(10, 8));
+  const float vectors[3 * kDimensions] = {5, 0, 1, 0, 3, 0};
+  const idx_t ids[3] = {0, 1, 0};
+  index.add_with_ids(3, vectors, ids);
+  add(&index, 1, 4);
+
+  EXPECT_EQ(index.ntotal, 2);
+  EXPECT_EQ(index.stats().buffer_vectors, 2);
+  EXPECT_THAT(search(index, 3), ElementsAre(1, 0, -1));
+}
+
+TEST(SegmentedIndexTest, RemovesIds) {
+  SegmentedIndex index(kDimensions, "IDMap,Flat",
+                       MetricType::METRIC_INNER_PRODUCT, make_config(2, 8));
+  for (int id = 0; id < 5; id++)
+    add(&index, id, id);
+  index.wait_until_idle();
+
+  const idx_t ids[3] = {4, 1, 100};
+  EXPECT_EQ(index.remove_ids(IDSelectorBatch(3, ids)), 2);
+
+  EXPECT_EQ(index.ntotal, 3);
+  EXPECT_THAT(search(index, 5), ElementsAre(3, 2, 0, -1, -1));
+}
+
+TEST(SegmentedIndexTest, MergesSmallestSegments) {
+  SegmentedIndex index(kDimensions, "IDMap,Flat",
+                       MetricType::METRIC_INNER_PRODUCT, make_config(2, 2));
+  for (int id = 0; id < 10; id++)
+    add(&index, id, id);
+  index.wait_until_idle();
+
+  const SegmentStats stats = index.stats();
+  EXPECT_EQ(stats.buffer_vectors, 0);
+  EXPECT_EQ(stats.sealed_segments, 0);
+  EXPECT_LE(stats.built_segments, 2);
+  EXPECT_EQ(index.ntotal, 10);
+  EXPECT_THAT(search(index, 3), ElementsAre(9, 8, 7));
+}
+
+TEST(SegmentedIndexTest, CompactsMostlyDeadSegments) {
+  SegmentedIndex index(kDimensions, "IDMap,Flat",
+                       MetricType::METRIC_INNER_PRODUCT, make_config(4, 8));
+  for (int id = 0; id < 4; id++)
+    add(&index, id, id);
+  index.wait_until_idle();
+
+  const idx_t ids[3] = {0, 1, 2};
+  index.remove_ids(IDSelectorBatch(3, ids));
+  index.wait_until_idle();
+
+  const SegmentStats stats = index.stats();
+  EXPECT_EQ(stats.built_segments, 1);
+  EXPECT_EQ(stats.dead_vectors, 0);
+  EXPECT_THAT(search(index, 2), ElementsAre(3, -1));
+}
+
+TEST(SegmentedIndexTest, ForEachVisitsLiveVectors) {
+  SegmentedIndex index(kDimensions, "IDMap,Flat", MetricType::METRIC_L2,
+                       make_config(2, 8));
+  for (int id = 0; id < 3; id++)
+    add(&index, id, id);
+  add(&index, 0, 7);
+
+  std::map<idx_t, float> lengths;
+  index.for_each([&](idx_t id, const float *vector) {
+    lengths[id] = vector[0];
+  });
+
+  EXPECT_THAT(lengths, ElementsAre(Pair(0, 7), Pair(1, 1), Pair(2, 2)));
+}
+
+TEST(SegmentedIndexTest, L2PrefersSmallerDistances) {
+  SegmentedIndex index(kDimensions, "IDMap,Flat", MetricType::METRIC_L2,
+                       make_config(2, 8));
+  for (int id = 0; id < 5; id++)
+    add(&index, id, 3 * id);
+  index.wait_until_idle();
+
+  // The query (1, 0) is closest to the shortest vectors.
+  EXPECT_THAT(search(index, 3), ElementsAre(0, 1, 2));
+}
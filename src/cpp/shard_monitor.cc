@@ -0,0 +1,199 @@
+#include "src/cpp/shard_monitor.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/log/log.h"
+#include "absl/strings/str_format.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "grpc/grpc.h"
+#include "grpcpp/channel.h"
+#include "grpcpp/client_context.h"
+#include "grpcpp/support/status.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::IndexService;
+
+namespace index_service::sharded {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double milliseconds_since(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+} // namespace
+
+ShardMonitor::ShardMonitor(const MonitorConfig &config)
+    : m_config_(config), m_polled_at_(Clock::now()) {
+  const std::lock_guard<std::mutex> _(m_mutex_);
+  publish();
+}
+
+ShardMonitor::~ShardMonitor() {
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    m_stopping_ = true;
+  }
+  m_stop_cv_.notify_all();
+
+  if (m_thread_.joinable())
+    m_thread_.join();
+}
+
+void ShardMonitor::add_shard(std::shared_ptr<Channel> channel) {
+  const std::lock_guard<std::mutex> _(m_mutex_);
+  m_stubs_.push_back(IndexService::NewStub(channel));
+  m_channels_.push_back(std::move(channel));
+  m_shards_.emplace_back();
+  publish();
+}
+
+void ShardMonitor::start() {
+  poll();
+  m_thread_ = std::thread(&ShardMonitor::run, this);
+
+  LOG(INFO) << absl::StrFormat(
+      "Monitoring shards. poll_interval_ms=%d, poll_timeout_ms=%d",
+      m_config_.poll_interval.count(), m_config_.poll_timeout.count());
+}
+
+void ShardMonitor::run() {
+  std::unique_lock<std::mutex> lock(m_mutex_);
+  while (!m_stop_cv_.wait_for(lock, m_config_.poll_interval,
+                              [this] { return m_stopping_; })) {
+    lock.unlock();
+    poll();
+    lock.lock();
+  }
+}
+
+void ShardMonitor::poll() {
+  std::vector<std::shared_ptr<Channel>> channels;
+  std::vector<IndexService::Stub *> stubs;
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    channels = m_channels_;
+    for (const auto &stub : m_stubs_)
+      stubs.push_back(stub.get());
+  }
+
+  const int num_shards = stubs.size();
+  std::vector<ClientContext> contexts(num_shards);
+  std::vector<DescribeResponse> responses(num_shards);
+  std::vector<Status> statuses(num_shards);
+  std::vector<double> latencies_ms(num_shards);
+  const DescribeRequest request;
+
+  // Describe every shard at once, so a poll takes at most `poll_timeout`
+  // however many shards are down.
+  absl::BlockingCounter num_pending(num_shards);
+  const Clock::time_point start = Clock::now();
+  const auto deadline =
+      std::chrono::system_clock::now() + m_config_.poll_timeout;
+  for (int i = 0; i < num_shards; i++) {
+    // Note: Asking an idle channel to connect makes the next poll see
+    // whether it can.
+    const grpc_connectivity_state connectivity =
+        channels[i]->GetState(/*try_to_connect=*/true);
+    if (connectivity == GRPC_CHANNEL_TRANSIENT_FAILURE ||
+        connectivity == GRPC_CHANNEL_SHUTDOWN) {
+      statuses[i] = Status(StatusCode::UNAVAILABLE, "Channel is failing.");
+      num_pending.DecrementCount();
+      continue;
+    }
+
+    contexts[i].set_deadline(deadline);
+    stubs[i]->async()->Describe(
+        &contexts[i], &request, &responses[i],
+        [&statuses, &latencies_ms, &num_pending, start, i](Status status) {
+          latencies_ms[i] = milliseconds_since(start);
+          statuses[i] = std::move(status);
+          num_pending.DecrementCount();
+        });
+  }
+  num_pending.Wait();
+
+  const std::lock_guard<std::mutex> _(m_mutex_);
+  for (int i = 0; i < num_shards; i++) {
+    ShardState &state = m_shards_[i];
+    state.connectivity = channels[i]->GetState(/*try_to_connect=*/false);
+
+    if (!statuses[i].ok()) {
+      if (state.healthy)
+        LOG(INFO) << absl::StrFormat(
+            "Shard %d is unhealthy. error_code=%d, error_message=%s", i,
+            (int)statuses[i].error_code(), statuses[i].error_message());
+      state.healthy = false;
+      state.consecutive_failures++;
+      continue;
+    }
+
+    if (!state.healthy)
+      LOG(INFO) << absl::StrFormat(
+          "Shard %d is healthy again after %d failed polls.", i,
+          state.consecutive_failures);
+    state.healthy = true;
+    state.consecutive_failures = 0;
+    state.dimensions = responses[i].dimensions();
+    state.num_vectors = responses[i].num_vectors();
+    add_latency(&state, latencies_ms[i]);
+  }
+
+  m_polled_at_ = Clock::now();
+  publish();
+}
+
+std::shared_ptr<const ClusterView> ShardMonitor::view() const {
+  return std::atomic_load(&m_view_);
+}
+
+void ShardMonitor::report_failure(int shard_idx) {
+  const std::lock_guard<std::mutex> _(m_mutex_);
+  if (shard_idx >= m_shards_.size() || !m_shards_[shard_idx].healthy)
+    return;
+
+  LOG(INFO) << absl::StrFormat(
+      "Shard %d failed a request. Routing around it until it answers a poll.",
+      shard_idx);
+  m_shards_[shard_idx].healthy = false;
+  publish();
+}
+
+void ShardMonitor::report_latency(int shard_idx, double latency_ms) {
+  const std::lock_guard<std::mutex> _(m_mutex_);
+  if (shard_idx < m_shards_.size())
+    add_latency(&m_shards_[shard_idx], latency_ms);
+}
+
+void ShardMonitor::add_latency(ShardState *state, double latency_ms) {
+  // Note: The first sample seeds the average, so it doesn't start from 0.
+  state->latency_ewma_ms =
+      state->latency_ewma_ms
+          ? m_config_.latency_ewma_alpha * latency_ms +
+                (1 - m_config_.latency_ewma_alpha) * state->latency_ewma_ms
+          : latency_ms;
+}
+
+void ShardMonitor::publish() {
+  auto view = std::make_shared<ClusterView>();
+  view->shards = m_shards_;
+  view->version = ++m_version_;
+  view->polled_at = m_polled_at_;
+  std::atomic_store(&m_view_, std::shared_ptr<const ClusterView>(view));
+}
+
+} // namespace index_service::sharded
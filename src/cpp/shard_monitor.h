@@ -0,0 +1,151 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "grpc/grpc.h"
+#include "grpcpp/channel.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+namespace index_service::sharded {
+
+struct MonitorConfig {
+  // How often every shard is polled.
+  std::chrono::milliseconds poll_interval{1000};
+
+  // How long a poll waits for a shard before counting it as unhealthy.
+  std::chrono::milliseconds poll_timeout{500};
+
+  // The weight of the newest sample in a shard's latency average.
+  double latency_ewma_alpha = 0.2;
+};
+
+// What the router last learned about a shard.
+struct ShardState {
+  // Whether the shard answered its last poll, and no request failed on it
+  // since. Shards are assumed healthy until their first poll.
+  bool healthy = true;
+
+  // The connectivity state of the shard's channel at its last poll.
+  grpc_connectivity_state connectivity = GRPC_CHANNEL_IDLE;
+
+  // As described by the shard at its last successful poll.
+  int dimensions = 0;
+  int64_t num_vectors = 0;
+
+  // A moving average of the shard's response time to polls and searches.
+  double latency_ewma_ms = 0;
+
+  // The number of polls in a row the shard failed.
+  int consecutive_failures = 0;
+};
+
+// An immutable snapshot of the state of every shard, in shard order.
+struct ClusterView {
+  std::vector<ShardState> shards;
+
+  // Bumped every time a view is published.
+  uint64_t version = 0;
+
+  // When the last poll completed.
+  std::chrono::steady_clock::time_point polled_at;
+
+  // Returns whether the shard at `shard_idx` is healthy. Shards added after
+  // this view was published are assumed healthy.
+  bool healthy(int shard_idx) const {
+    return shard_idx >= shards.size() || shards[shard_idx].healthy;
+  }
+};
+
+// Tracks the health and stats of shards in the background, so requests can
+// read them instantly instead of asking every shard.
+//
+// A background thread polls every shard each `poll_interval`: it reads the
+// connectivity state of the shard's channel, asking idle channels to
+// connect, and sends every shard a `Describe` at once with a deadline of
+// `poll_timeout`. A shard whose channel is failing, or that doesn't answer
+// in time, is unhealthy until a later poll succeeds. Requests that fail on a
+// shard mark it unhealthy right away, so later requests route around it
+// without waiting for the next poll.
+//
+// After every poll, the state of all shards is published as a new
+// `ClusterView`, which readers load without taking any lock the monitor
+// holds while polling.
+class ShardMonitor {
+public:
+  explicit ShardMonitor(const MonitorConfig &config);
+
+  ShardMonitor(const ShardMonitor &) = delete;
+  ShardMonitor &operator=(const ShardMonitor &) = delete;
+
+  // Stops polling, after waiting for a poll in progress.
+  ~ShardMonitor();
+
+  // Starts monitoring a shard reached through `channel`. Shards are indexed
+  // in the order they're added.
+  void add_shard(std::shared_ptr<grpc::Channel> channel);
+
+  // Polls every shard once, and then keeps polling them in the background.
+  void start();
+
+  // Polls every shard once and publishes the result. Blocks until every
+  // shard answered or timed out.
+  void poll();
+
+  // Returns the latest view of the cluster. Never blocks on shards.
+  std::shared_ptr<const ClusterView> view() const;
+
+  // Marks the shard at `shard_idx` unhealthy after a request to it failed,
+  // until its next successful poll.
+  void report_failure(int shard_idx);
+
+  // Folds the latency of a successful request to the shard at `shard_idx`
+  // into its average. Published with the next poll.
+  void report_latency(int shard_idx, double latency_ms);
+
+private:
+  void run();
+
+  // Publishes the current state of all shards as a new view.
+  // Note: The caller must hold `m_mutex_`.
+  void publish();
+
+  // Folds `latency_ms` into the average of `state`.
+  void add_latency(ShardState *state, double latency_ms);
+
+  MonitorConfig m_config_;
+
+  // Guards the channels, stubs and state of shards, and `m_stopping_`.
+  std::mutex m_mutex_;
+
+  std::vector<std::shared_ptr<grpc::Channel>> m_channels_;
+
+  // Note: Stubs are never removed, so a stub may be used after releasing
+  // `m_mutex_`.
+  std::vector<std::unique_ptr<index_service::IndexService::Stub>> m_stubs_;
+
+  // The current state of each shard, published as views.
+  std::vector<ShardState> m_shards_;
+
+  uint64_t m_version_ = 0;
+
+  std::chrono::steady_clock::time_point m_polled_at_;
+
+  // The latest published view, read and written with `std::atomic_load` and
+  // `std::atomic_store`.
+  std::shared_ptr<const ClusterView> m_view_;
+
+  bool m_stopping_ = false;
+
+  // Notified to stop polling.
+  std::condition_variable m_stop_cv_;
+
+  std::thread m_thread_;
+};
+
+} // namespace index_service::sharded
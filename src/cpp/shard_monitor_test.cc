@@ -0,0 +1,139 @@
+#include "src/cpp/shard_monitor.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "src/cpp/test_server.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+using grpc::ServerContext;
+using grpc::Status;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::IndexService;
+using index_service::sharded::ClusterView;
+using index_service::sharded::MonitorConfig;
+using index_service::sharded::ShardMonitor;
+
+namespace {
+
+// Describes itself with 3 dimensions and `num_vectors` vectors.
+class FakeShard final : public IndexService::Service {
+public:
+  explicit FakeShard(int num_vectors) : m_num_vectors_(num_vectors) {}
+
+  Status Describe(ServerContext *context,
+                  const DescribeRequest *describe_request,
+                  DescribeResponse *describe_response) override {
+    describe_response->set_dimensions(3);
+    describe_response->set_num_vectors(m_num_vectors_);
+    return Status::OK;
+  }
+
+private:
+  int m_num_vectors_;
+};
+
+// Serves a `FakeShard` on a local port until `stop` is called.
+class TestShard {
+public:
+  explicit TestShard(int num_vectors)
+      : m_service_(num_vectors), m_server_(&m_service_) {
+    channel = m_server_.channel();
+  }
+
+  void stop() { m_server_.shutdown(); }
+
+  std::shared_ptr<grpc::Channel> channel;
+
+private:
+  FakeShard m_service_;
+  test_server::LocalServer m_server_;
+};
+
+// Polls only when the test calls `poll`.
+MonitorConfig make_config() {
+  MonitorConfig config;
+  config.poll_interval = std::chrono::hours(1);
+  config.poll_timeout = std::chrono::milliseconds(500);
+  return config;
+}
+
+} // namespace
+
+TEST(ShardMonitorTest, PublishesShardStats) {
+  TestShard first(10);
+  TestShard second(20);
+  ShardMonitor monitor(make_config());
+  monitor.add_shard(first.channel);
+  monitor.add_shard(second.channel);
+  monitor.start();
+
+  std::shared_ptr<const ClusterView> view = monitor.view();
+  ASSERT_EQ(view->shards.size(), 2);
+  EXPECT_TRUE(view->healthy(0));
+  EXPECT_TRUE(view->healthy(1));
+  EXPECT_EQ(view->shards[0].dimensions, 3);
+  EXPECT_EQ(view->shards[0].num_vectors, 10);
+  EXPECT_EQ(view->shards[1].num_vectors, 20);
+  EXPECT_GT(view->shards[0].latency_ewma_ms, 0);
+
+  // Shards the view doesn't know of yet are assumed healthy.
+  EXPECT_TRUE(view->healthy(2));
+}
+
+TEST(ShardMonitorTest, DetectsStoppedShards) {
+  TestShard first(10);
+  TestShard second(20);
+  ShardMonitor monitor(make_config());
+  monitor.add_shard(first.channel);
+  monitor.add_shard(second.channel);
+  monitor.start();
+  const uint64_t version = monitor.view()->version;
+
+  second.stop();
+  monitor.poll();
+
+  std::shared_ptr<const ClusterView> view = monitor.view();
+  EXPECT_GT(view->version, version);
+  EXPECT_TRUE(view->healthy(0));
+  EXPECT_FALSE(view->healthy(1));
+  EXPECT_EQ(view->shards[1].consecutive_failures, 1);
+
+  // The last stats of the stopped shard are kept.
+  EXPECT_EQ(view->shards[1].num_vectors, 20);
+}
+
+TEST(ShardMonitorTest, ReportedFailuresLastUntilNextPoll) {
+  TestShard shard(10);
+  ShardMonitor monitor(make_config());
+  monitor.add_shard(shard.channel);
+  monitor.start();
+
+  monitor.report_failure(0);
+  EXPECT_FALSE(monitor.view()->healthy(0));
+
+  monitor.poll();
+  EXPECT_TRUE(monitor.view()->healthy(0));
+}
+
+TEST(ShardMonitorTest, AveragesLatencies) {
+  MonitorConfig config = make_config();
+  config.latency_ewma_alpha = 0.5;
+  TestShard shard(10);
+  ShardMonitor monitor(config);
+  monitor.add_shard(shard.channel);
+
+  // Reported latencies are published with the next poll.
+  monitor.report_latency(0, 10);
+  monitor.report_latency(0, 20);
+  EXPECT_EQ(monitor.view()->shards[0].latency_ewma_ms, 0);
+
+  monitor.poll();
+  const double latency_ewma_ms = monitor.view()->shards[0].latency_ewma_ms;
+  EXPECT_GT(latency_ewma_ms, 7.5);
+  EXPECT_LT(latency_ewma_ms, 15);
+}
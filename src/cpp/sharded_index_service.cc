@@ -1,19 +1,38 @@
 #include "src/cpp/sharded_index_service.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "absl/container/flat_hash_set.h"
 #include "absl/log/log.h"
 #include "absl/strings/str_format.h"
 #include "grpc/grpc.h"
+#include "grpcpp/create_channel.h"
+#include "grpcpp/security/credentials.h"
 #include "grpcpp/server.h"
 #include "grpcpp/server_context.h"
 #include "grpcpp/support/status_code_enum.h"
+#include "src/cpp/admission.h"
 #include "src/cpp/algo.h"
+#include "src/cpp/async_server.h"
+#include "src/cpp/encoding.h"
+#include "src/cpp/profile.h"
+#include "src/cpp/query_cache.h"
+#include "src/cpp/shard_monitor.h"
 #include "src/proto/index_service.grpc.pb.h"
 
 using google::protobuf::RepeatedField;
@@ -22,71 +41,264 @@ using grpc::Channel;
 using grpc::ClientContext;
 using grpc::Server;
 using grpc::ServerContext;
+using grpc::ServerWriter;
 using grpc::Status;
 using grpc::StatusCode;
 
+using index_service::AddShardRequest;
+using index_service::AddShardResponse;
 using index_service::DescribeRequest;
 using index_service::DescribeResponse;
+using index_service::ExportRequest;
+using index_service::ExportResponse;
 using index_service::IndexService;
 using index_service::InsertRequest;
 using index_service::InsertResponse;
 using index_service::Neighbor;
+using index_service::ProfileSpan;
+using index_service::RebalanceRequest;
+using index_service::RebalanceResponse;
+using index_service::RemoveRequest;
+using index_service::RemoveResponse;
 using index_service::SearchRequest;
 using index_service::SearchResponse;
+using index_service::UpsertRequest;
+using index_service::UpsertResponse;
 using index_service::Vector;
+using index_service::sharded::ClusterView;
+using index_service::sharded::MonitorConfig;
 using index_service::sharded::ShardedIndexServiceImpl;
+using index_service::sharded::ShardState;
+
+namespace {
+
+// The number of independently locked segments of the query cache.
+constexpr int kQueryCacheSegments = 16;
+
+// The number of vectors moved at a time while rebalancing, if the request
+// doesn't set one.
+constexpr int kDefaultRebalanceRangeSize = 1000;
+
+// The maximum number of vectors per upsert while moving a range, to stay
+// below gRPC's default 4MB message size limit for large vectors.
+constexpr int kMaxMoveBatchSize = 500;
+
+// The deadline of each shard call made while moving a range, so a shard that
+// hangs fails the move rather than stalling the rebalance.
+constexpr std::chrono::seconds kMoveCallTimeout(30);
+
+// The number of times a rebalance tries to remove the vectors it moved from
+// their source shard before it completes, and the delay between tries.
+// Removes that still fail are retried before later writes.
+constexpr int kMaxRemoveAttempts = 3;
+constexpr std::chrono::milliseconds kRemoveRetryDelay(100);
+
+// Whether `status` means a shard couldn't be reached or didn't answer in
+// time, as opposed to an error the shard returned itself.
+bool is_transport_failure(const Status &status) {
+  return status.error_code() == StatusCode::UNAVAILABLE ||
+         status.error_code() == StatusCode::DEADLINE_EXCEEDED;
+}
+
+// Returns the error of a request that failed on a shard. Errors the shard
+// returned itself, e.g. `INVALID_ARGUMENT` or `RESOURCE_EXHAUSTED` for shed
+// load, are passed through, so clients don't retry them as outages.
+Status shard_error(const Status &shard_status) {
+  LOG(INFO) << absl::StrFormat(
+      "Shard returned non-ok response. error_code=%d, error_message=%s",
+      (int)shard_status.error_code(), shard_status.error_message());
+
+  if (!is_transport_failure(shard_status))
+    return shard_status;
+
+  return Status(StatusCode::UNAVAILABLE, "One or more shards are not healthy.");
+}
+
+// Returns `UNIMPLEMENTED` if a request names a collection, since the sharded
+// index only serves the default collection of its shards.
+Status check_collection(const std::string &collection) {
+  if (collection.empty())
+    return Status::OK;
+
+  return Status(StatusCode::UNIMPLEMENTED,
+                absl::StrFormat("Sharded indexes only serve the default "
+                                "collection. Collection: (%s).",
+                                collection));
+}
+
+// Returns the number of ids in all of `id_sets`.
+int64_t count_ids(const std::vector<std::unordered_set<uint32_t>> &id_sets) {
+  int64_t num_ids = 0;
+  for (const std::unordered_set<uint32_t> &ids : id_sets)
+    num_ids += ids.size();
+  return num_ids;
+}
+
+double milliseconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Adds a `shard_rpc` span for the search of each shard in `shard_idx` to
+// `span`, with the profile the shard returned nested in it.
+void add_shard_spans(const std::vector<int> &shard_idx,
+                     const std::vector<double> &shard_latencies_ms,
+                     std::vector<SearchResponse> *shard_search_responses,
+                     ProfileSpan *span) {
+  profile::set_stat(span, "shards_searched", shard_idx.size());
+  for (int i = 0; i < shard_idx.size(); i++) {
+    ProfileSpan *shard_span =
+        profile::add_span(span, "shard_rpc", shard_latencies_ms[i] * 1000);
+    profile::set_stat(shard_span, "shard", shard_idx[i]);
+
+    SearchResponse &shard_search_response = (*shard_search_responses)[i];
+    if (shard_search_response.has_profile())
+      shard_span->add_children()->Swap(
+          shard_search_response.mutable_profile());
+  }
+}
+
+} // namespace
 
 ShardedIndexServiceImpl::ShardedIndexServiceImpl(
     int dimensions,
     std::vector<std::shared_ptr<Channel>> shard_service_channels,
-    int shard_capacity)
+    int shard_capacity, size_t query_cache_bytes,
+    const admission::Limits &limits, const MonitorConfig &monitor_config)
     : m_dimensions_(dimensions), m_shard_capacity_(shard_capacity),
-      m_shard_sizes_(shard_service_channels.size()) {
+      m_limits_(limits),
+      m_shard_sizes_(shard_service_channels.size()),
+      m_shard_epochs_(shard_service_channels.size()),
+      m_stale_ids_(shard_service_channels.size()),
+      m_pending_removes_(shard_service_channels.size()),
+      m_search_shards_skipped_(m_metrics_.counter("search_shards_skipped")),
+      m_pending_removes_gauge_(m_metrics_.gauge("rebalance_pending_removes")),
+      m_monitor_(monitor_config), m_rebalancing_(false), m_stopping_(false) {
   // Initial service stubs for each shard.
   // The order in which channels are given is the order in which shards will
   // be filled with inserted vectors.
   for (auto channel : shard_service_channels) {
     m_shard_service_stubs_.push_back(IndexService::NewStub(channel));
+    m_monitor_.add_shard(channel);
   }
 
   LOG(INFO) << absl::StrFormat("Registered %d shard stubs.",
                                m_shard_service_stubs_.size());
+
+  if (query_cache_bytes > 0) {
+    m_query_cache_ = std::make_unique<cache::QueryCache>(
+        query_cache_bytes, kQueryCacheSegments, &m_metrics_);
+    LOG(INFO) << absl::StrFormat("Caching searches in up to %d bytes.",
+                                 query_cache_bytes);
+  }
+
+  m_monitor_.start();
 };
 
+ShardedIndexServiceImpl::~ShardedIndexServiceImpl() {
+  {
+    const std::lock_guard<std::mutex> _(m_stop_mutex_);
+    m_stopping_ = true;
+  }
+  m_stop_cv_.notify_all();
+
+  const std::lock_guard<std::mutex> _(m_rebalance_mutex_);
+  if (m_rebalance_thread_.joinable())
+    m_rebalance_thread_.join();
+}
+
+void ShardedIndexServiceImpl::record_shard_write(int shard_idx,
+                                                 int size_delta) {
+  const std::lock_guard<std::shared_mutex> _(m_shards_mutex_);
+  m_shard_sizes_[shard_idx] += size_delta;
+  m_shard_epochs_[shard_idx]++;
+}
+
+Status ShardedIndexServiceImpl::check_healthy(
+    const std::vector<int> &shard_idx) const {
+  const std::shared_ptr<const ClusterView> view = m_monitor_.view();
+  for (int i : shard_idx) {
+    if (!view->healthy(i))
+      return Status(StatusCode::UNAVAILABLE,
+                    absl::StrFormat("Shard %d is unhealthy.", i));
+  }
+
+  return Status::OK;
+}
+
+Status ShardedIndexServiceImpl::check_search(
+    const SearchRequest &search_request) const {
+  const Status status = check_collection(search_request.collection());
+  if (!status.ok())
+    return status;
+
+  const int query_dimensions = encoding::num_query_values(search_request);
+  if (query_dimensions != m_dimensions_)
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat(
+                      "Found query that does not match dimensions of index. "
+                      "Query dimensions: (%d). Index dimensions: (%d).",
+                      query_dimensions, m_dimensions_));
+
+  return admission::check_k(search_request.k(), m_limits_);
+}
+
+void ShardedIndexServiceImpl::report_shard_failure(int shard_idx,
+                                                   const Status &shard_status) {
+  if (is_transport_failure(shard_status))
+    m_monitor_.report_failure(shard_idx);
+}
+
 Status ShardedIndexServiceImpl::Describe(
     ServerContext *context,
     const index_service::DescribeRequest *describe_request,
     index_service::DescribeResponse *describe_response) {
   LOG(INFO) << absl::StrFormat("Received describe request.");
 
-  int total_num_vectors = 0;
-  for (int shard_idx = 0; shard_idx < m_shard_service_stubs_.size();
-       shard_idx++) {
-    ClientContext context;
-    DescribeRequest describe_request;
-    DescribeResponse describe_response;
-
-    auto &stub = m_shard_service_stubs_[shard_idx];
-
-    LOG(INFO) << absl::StrFormat("Describing shard %d...", shard_idx);
-    Status status =
-        stub->Describe(&context, describe_request, &describe_response);
+  const Status collection_status =
+      check_collection(describe_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
 
-    if (!status.ok())
-      return Status(StatusCode::UNAVAILABLE,
-                    absl::StrFormat("Shard %d is unhealthy.", shard_idx));
-
-    if (status.ok())
-      total_num_vectors += describe_response.num_vectors();
-    LOG(INFO) << absl::StrFormat(
-        "Successfully described shard %d. dimensions=%d. num_vectors=%d",
-        shard_idx, describe_response.dimensions(),
-        describe_response.num_vectors());
+  // Note: The view may be up to a poll interval old, but the router's own
+  // shard sizes are exact, since every write goes through it. Unhealthy
+  // shards are reported in the metrics rather than failing the request, so
+  // the view can be inspected while a shard is down.
+  const std::shared_ptr<const ClusterView> view = m_monitor_.view();
+  int total_num_vectors = 0;
+  {
+    const std::shared_lock<std::shared_mutex> _(m_shards_mutex_);
+    for (int shard_size : m_shard_sizes_)
+      total_num_vectors += shard_size;
   }
 
   describe_response->set_dimensions(m_dimensions_);
   describe_response->set_num_vectors(total_num_vectors);
 
+  std::map<std::string, double> metrics = m_metrics_.snapshot();
+  if (m_query_cache_) {
+    double num_lookups =
+        metrics["query_cache_hits"] + metrics["query_cache_misses"];
+    metrics["query_cache_hit_rate"] =
+        num_lookups ? metrics["query_cache_hits"] / num_lookups : 0;
+  }
+
+  metrics["cluster_view_age_ms"] = milliseconds_since(view->polled_at);
+  for (int shard_idx = 0; shard_idx < view->shards.size(); shard_idx++) {
+    const ShardState &shard = view->shards[shard_idx];
+    metrics[absl::StrFormat("shard_%d_num_vectors", shard_idx)] =
+        shard.num_vectors;
+    metrics[absl::StrFormat("shard_%d_latency_ewma_ms", shard_idx)] =
+        shard.latency_ewma_ms;
+    metrics[absl::StrFormat("shard_%d_healthy", shard_idx)] = shard.healthy;
+    metrics[absl::StrFormat("shard_%d_connectivity", shard_idx)] =
+        shard.connectivity;
+    metrics[absl::StrFormat("shard_%d_consecutive_failures", shard_idx)] =
+        shard.consecutive_failures;
+  }
+  describe_response->mutable_metrics()->insert(metrics.begin(), metrics.end());
+
   return Status::OK;
 }
 
@@ -94,14 +306,21 @@ Status ShardedIndexServiceImpl::Insert(
     grpc::ServerContext *context,
     const index_service::InsertRequest *insert_request,
     index_service::InsertResponse *insert_response) {
-  // Acquire the insertion lock.
+  const Status collection_status =
+      check_collection(insert_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
+
+  // Acquire the write lock.
   // Note: `lock_guard` will automatically release lock when this guard
   // instance goes out of scope (i.e. the function completes).
-  const std::lock_guard<std::mutex> _(m_insertion_mutex_);
+  const std::lock_guard<std::mutex> _(m_write_mutex_);
 
   LOG(INFO) << absl::StrFormat("Received insert request. num_vectors=%d",
                                insert_request->vectors().size());
 
+  remove_all_pending();
+
   // Greedily assign vectors to shard, filling the first shard, then the
   // second, and so on.
   const std::pair<int, std::map<int, int>> greedy_fill_result =
@@ -119,6 +338,22 @@ Status ShardedIndexServiceImpl::Insert(
     return Status(StatusCode::RESOURCE_EXHAUSTED, "Insufficient capacity.");
   }
 
+  std::vector<int> target_shard_idx;
+  for (const auto &[shard_idx, num_to_fill] : shard_fills)
+    target_shard_idx.push_back(shard_idx);
+  Status status = check_healthy(target_shard_idx);
+  if (!status.ok())
+    return status;
+
+  for (const Vector &vector : insert_request->vectors()) {
+    if (m_vector_shard_assignments_.find(vector.id()) ==
+        m_vector_shard_assignments_.end()) {
+      status = check_not_stale(vector.id());
+      if (!status.ok())
+        return status;
+    }
+  }
+
   // Insert the allocated batch of vectors to each shard.
   int offset = 0;
   int vector_idx = 0;
@@ -155,21 +390,23 @@ Status ShardedIndexServiceImpl::Insert(
                                  shard_insert_request.vectors().size(),
                                  shard_idx);
 
+    for (const Vector &vector : shard_insert_request.vectors())
+      record_moving_write(shard_idx, vector.id());
+
     Status shard_status = shard_stub->Insert(
         &shard_client_context, shard_insert_request, &shard_insert_response);
 
     if (!shard_status.ok()) {
-      LOG(INFO) << absl::StrFormat(
-          "Shard returned non-ok response. error_code=%v, error_message=%s",
-          shard_status.error_code(), shard_status.error_message());
-
-      return Status(StatusCode::UNAVAILABLE,
-                    "One or more shards are not healthy.");
+      // Note: Bump the epoch even if the insert failed, since the shard may
+      // have applied part of it.
+      record_shard_write(shard_idx, 0);
+      report_shard_failure(shard_idx, shard_status);
+      return shard_error(shard_status);
     }
 
-    if (num_inserted) {
-      m_shard_sizes_[shard_idx] += num_inserted;
+    record_shard_write(shard_idx, num_inserted);
 
+    if (num_inserted) {
       for (const Vector &vector : shard_insert_request.vectors())
         m_vector_shard_assignments_.insert({vector.id(), shard_idx});
 
@@ -189,10 +426,19 @@ Status ShardedIndexServiceImpl::Upsert(
     grpc::ServerContext *context,
     const index_service::UpsertRequest *upsert_request,
     index_service::UpsertResponse *upsert_response) {
+  const Status collection_status =
+      check_collection(upsert_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
+
+  const std::lock_guard<std::mutex> _(m_write_mutex_);
+
   int num_vectors = upsert_request->vectors_size();
   LOG(INFO) << absl::StrFormat("Received upsert request. num_vectors=%d",
                                num_vectors);
 
+  remove_all_pending();
+
   std::vector<int> new_shard_sizes(m_shard_sizes_);
   std::unordered_map<int, UpsertRequest> shard_upsert_requests;
   std::unordered_map<int, int> shards_num_updated;
@@ -253,6 +499,19 @@ Status ShardedIndexServiceImpl::Upsert(
     offset = vector_idx;
   }
 
+  std::vector<int> target_shard_idx;
+  for (const auto &[shard_idx, shard_upsert_request] : shard_upsert_requests)
+    target_shard_idx.push_back(shard_idx);
+  Status status = check_healthy(target_shard_idx);
+  if (!status.ok())
+    return status;
+
+  for (const Vector &vector : new_vectors) {
+    status = check_not_stale(vector.id());
+    if (!status.ok())
+      return status;
+  }
+
   for (const auto it : shard_upsert_requests) {
     const int shard_idx = it.first;
     UpsertRequest shard_upsert_request = it.second;
@@ -267,6 +526,9 @@ Status ShardedIndexServiceImpl::Upsert(
     // Get the stub of the shard to insert batch to.
     auto &shard_stub = m_shard_service_stubs_.at(shard_idx);
 
+    for (const Vector &vector : shard_upsert_request.vectors())
+      record_moving_write(shard_idx, vector.id());
+
     Status shard_status = shard_stub->Upsert(
         &shard_client_context, shard_upsert_request, &shard_upsert_response);
 
@@ -276,17 +538,14 @@ Status ShardedIndexServiceImpl::Upsert(
       m_vector_shard_assignments_.insert({vector.id(), shard_idx});
 
     if (!shard_status.ok()) {
-      LOG(INFO) << absl::StrFormat(
-          "Shard returned non-ok response. error_code=%v, error_message=%s",
-          shard_status.error_code(), shard_status.error_message());
-
-      return Status(StatusCode::UNAVAILABLE,
-                    "One or more shards are not healthy.");
+      record_shard_write(shard_idx, 0);
+      report_shard_failure(shard_idx, shard_status);
+      return shard_error(shard_status);
     }
 
     // Update the size of the current shard to reflect the new vectors we
     // inserted.
-    m_shard_sizes_[shard_idx] += shards_num_inserted[shard_idx];
+    record_shard_write(shard_idx, shards_num_inserted[shard_idx]);
 
     LOG(INFO) << absl::StrFormat(
         "Successfully upserted vectors into shard %d. Shard is at %.2f %% "
@@ -298,16 +557,39 @@ Status ShardedIndexServiceImpl::Upsert(
   return Status::OK;
 }
 
-Status ShardedIndexServiceImpl::Search(
-    grpc::ServerContext *context,
-    const index_service::SearchRequest *search_request,
-    index_service::SearchResponse *search_response) {
+bool ShardedIndexServiceImpl::plan_search(const SearchRequest *search_request,
+                                          SearchResponse *search_response,
+                                          SearchPlan *plan) {
   LOG(INFO) << absl::StrFormat("Received search request. k=%d",
                                search_request->k());
 
-  std::vector<int> search_shard_idx = get_search_shard_idx();
+  // Note: Read the epochs before searching any shard, so a write that lands
+  // during the search leaves the cached response stale rather than caching
+  // results that miss the write under the new epoch.
+  int num_shards;
+  {
+    const std::shared_lock<std::shared_mutex> _(m_shards_mutex_);
+    plan->shard_idx = get_search_shard_idx();
+    for (int shard_idx : plan->shard_idx) {
+      plan->shard_stubs.push_back(m_shard_service_stubs_[shard_idx].get());
+      plan->shard_stale_ids.push_back(m_stale_ids_[shard_idx]);
+    }
+    plan->shard_epochs = m_shard_epochs_;
+    num_shards = m_shard_service_stubs_.size();
+  }
 
-  if (!search_shard_idx.size()) {
+  // Note: Profiled searches bypass the cache, so their profile is of a real
+  // execution rather than of a cache lookup.
+  if (m_query_cache_ && !search_request->profile()) {
+    plan->cache_key = cache::make_search_key(*search_request);
+    if (m_query_cache_->lookup(plan->cache_key, plan->shard_epochs,
+                               search_response)) {
+      LOG(INFO) << absl::StrFormat("Served search from cache.");
+      return false;
+    }
+  }
+
+  if (!plan->shard_idx.size()) {
     LOG(INFO) << absl::StrFormat(
         "All shards are empty. Returning empty neighbors.");
 
@@ -318,101 +600,916 @@ Status ShardedIndexServiceImpl::Search(
       neighbor->set_score(-std::numeric_limits<float>::max());
     }
 
-    return Status::OK;
+    return false;
+  }
+
+  // Route around shards the monitor has as unhealthy rather than waiting on
+  // them. If every non-empty shard is unhealthy, search them anyway, since
+  // that's no worse than failing outright.
+  const std::shared_ptr<const ClusterView> view = m_monitor_.view();
+  SearchPlan healthy_plan;
+  for (int i = 0; i < plan->shard_idx.size(); i++) {
+    if (view->healthy(plan->shard_idx[i])) {
+      healthy_plan.shard_idx.push_back(plan->shard_idx[i]);
+      healthy_plan.shard_stubs.push_back(plan->shard_stubs[i]);
+      healthy_plan.shard_stale_ids.push_back(plan->shard_stale_ids[i]);
+    }
+  }
+
+  const int num_skipped =
+      plan->shard_idx.size() - healthy_plan.shard_idx.size();
+  if (num_skipped && !healthy_plan.shard_idx.empty()) {
+    LOG(INFO) << absl::StrFormat("Skipping %d unhealthy shards.", num_skipped);
+    m_search_shards_skipped_->increment(num_skipped);
+    plan->shard_idx = std::move(healthy_plan.shard_idx);
+    plan->shard_stubs = std::move(healthy_plan.shard_stubs);
+    plan->shard_stale_ids = std::move(healthy_plan.shard_stale_ids);
+    plan->partial = true;
   }
 
   LOG(INFO) << absl::StrFormat(
       "Searching %d non-empty shards out of %d total shards.",
-      search_shard_idx.size(), m_shard_service_stubs_.size());
+      plan->shard_idx.size(), num_shards);
 
-  // Maintain the top-k best candidates seen so far across all shards.
-  Neighbor best_candidates[search_request->k()];
+  return true;
+}
 
-  // Populate best candidates with results from the first shard. Then merge
-  // each subsequent result, only keeping the top-k.
-  ClientContext first_shard_client_context;
-  SearchRequest first_shard_search_request;
-  SearchResponse first_shard_search_response;
+void ShardedIndexServiceImpl::merge_search(
+    const SearchRequest *search_request, const SearchPlan &plan,
+    const std::vector<SearchResponse> &shard_search_responses,
+    SearchResponse *search_response) {
+  const int k = search_request->k();
+  ProfileSpan *search_profile =
+      search_request->profile() ? search_response->mutable_profile() : nullptr;
+  profile::Timer timer(search_profile);
+
+  // Each shard returns its neighbors sorted best first, so a k-way merge of
+  // the shard results gives them in global order.
+  // For now, assume that greater scores are better. This is compatible with
+  // dot product indexes only.
+  // Drop the stale copies a shard returned, so only the copy of the shard
+  // a vector is routed to is kept.
+  std::vector<std::pair<const Neighbor *const *, int>> shard_neighbors;
+  std::vector<std::vector<const Neighbor *>> served_neighbors(
+      shard_search_responses.size());
+  int num_candidates = 0;
+  for (int i = 0; i < shard_search_responses.size(); i++) {
+    const SearchResponse &shard_search_response = shard_search_responses[i];
+    const std::unordered_set<uint32_t> *stale_ids =
+        plan.shard_stale_ids[i].get();
+    if (!stale_ids) {
+      shard_neighbors.emplace_back(shard_search_response.neighbors().data(),
+                                   shard_search_response.neighbors_size());
+    } else {
+      for (const Neighbor &neighbor : shard_search_response.neighbors()) {
+        if (neighbor.id() < 0 || !stale_ids->count(neighbor.id()))
+          served_neighbors[i].push_back(&neighbor);
+      }
+      shard_neighbors.emplace_back(served_neighbors[i].data(),
+                                   served_neighbors[i].size());
+    }
+    num_candidates += shard_neighbors.back().second;
+  }
 
-  first_shard_search_request.CopyFrom(*search_request);
+  std::vector<const Neighbor *> candidates(num_candidates);
+  algo::merge_top_k(
+      shard_neighbors, num_candidates, candidates.data(),
+      [](const Neighbor *first_neighbor, const Neighbor *second_neighbor) {
+        return first_neighbor->score() > second_neighbor->score();
+      });
+
+  // While a range of vectors is cut over between shards, its vectors are
+  // briefly served by both shards, so only keep the first copy of each.
+  // Note: `-1` ids pad results of shards with fewer than k vectors and are
+  // kept as is.
+  absl::flat_hash_set<int> seen_ids;
+  for (const Neighbor *candidate : candidates) {
+    if (search_response->neighbors_size() == k)
+      break;
+    if (candidate->id() >= 0 && !seen_ids.insert(candidate->id()).second)
+      continue;
+
+    search_response->add_neighbors()->CopyFrom(*candidate);
+  }
 
-  auto &first_shard_stub = m_shard_service_stubs_.at(0);
+  profile::set_stat(timer.lap("merge"), "candidates", num_candidates);
 
-  LOG(INFO) << absl::StrFormat("Searching shard 0. shard_size=%d",
-                               m_shard_sizes_[0]);
+  if (plan.partial)
+    search_response->set_partial(true);
+  else if (m_query_cache_ && !search_request->profile())
+    m_query_cache_->insert(plan.cache_key, plan.shard_epochs,
+                           *search_response);
 
-  first_shard_stub->Search(&first_shard_client_context,
-                           first_shard_search_request,
-                           &first_shard_search_response);
+  // Note: gRPC serializes the response once the handler returns, so time
+  // serializing a copy of it instead.
+  if (search_profile) {
+    const size_t num_bytes = search_response->SerializeAsString().size();
+    profile::set_stat(timer.lap("serialize"), "bytes", num_bytes);
+  }
+}
 
-  LOG(INFO) << absl::StrFormat("Successfully searched shard 0.");
+Status ShardedIndexServiceImpl::Search(
+    grpc::ServerContext *context,
+    const index_service::SearchRequest *search_request,
+    index_service::SearchResponse *search_response) {
+  const Status status = check_search(*search_request);
+  if (!status.ok())
+    return status;
 
-  // Neighbors from each shard are already sorted. Add neighbors from the first
-  // shard in reverse order so smallest scored is first in the min-heap array.
-  const RepeatedPtrField<Neighbor> first_shard_neighbors =
-      first_shard_search_response.neighbors();
-  for (int i = first_shard_neighbors.size() - 1; i >= 0; i--)
-    best_candidates[first_shard_neighbors.size() - i - 1] =
-        first_shard_neighbors[i];
+  ProfileSpan *search_profile =
+      profile::start(*search_request, search_response, "router_search");
+  profile::Timer timer(search_profile);
 
-  // Define a comparator function used to build the k-sized min-heap of best
-  // neighbors seen.
-  auto is_score_greater = [](const Neighbor &first_neighbor,
-                             const Neighbor &second_neighbor) {
-    return first_neighbor.score() > second_neighbor.score();
+  SearchPlan plan;
+  if (!plan_search(search_request, search_response, &plan)) {
+    timer.finish();
+    return Status::OK;
+  }
+
+  std::vector<SearchResponse> shard_search_responses(plan.shard_idx.size());
+  std::vector<double> shard_latencies_ms(plan.shard_idx.size());
+  for (int i = 0; i < plan.shard_idx.size(); i++) {
+    LOG(INFO) << absl::StrFormat("Searching shard %d...", plan.shard_idx[i]);
+
+    ClientContext shard_client_context;
+    const auto start = std::chrono::steady_clock::now();
+    Status shard_status = plan.shard_stubs[i]->Search(
+        &shard_client_context, *search_request, &shard_search_responses[i]);
+
+    if (!shard_status.ok()) {
+      report_shard_failure(plan.shard_idx[i], shard_status);
+      return shard_error(shard_status);
+    }
+    shard_latencies_ms[i] = milliseconds_since(start);
+    m_monitor_.report_latency(plan.shard_idx[i], shard_latencies_ms[i]);
+
+    LOG(INFO) << absl::StrFormat("Successfully searched shard %d.",
+                                 plan.shard_idx[i]);
+  }
+
+  if (search_profile)
+    add_shard_spans(plan.shard_idx, shard_latencies_ms,
+                    &shard_search_responses, search_profile);
+  merge_search(search_request, plan, shard_search_responses, search_response);
+  timer.finish();
+
+  return Status::OK;
+}
+
+void ShardedIndexServiceImpl::SearchAsync(
+    grpc::ServerContext *context,
+    const index_service::SearchRequest *search_request,
+    index_service::SearchResponse *search_response, async::Done done) {
+  // The state of a search fanned out to shards, shared by the callbacks of
+  // its shard searches. The last callback to run merges their results.
+  struct FanOut {
+    SearchPlan plan;
+    std::vector<ClientContext> shard_client_contexts;
+    std::vector<SearchResponse> shard_search_responses;
+    std::vector<Status> shard_statuses;
+    std::vector<double> shard_latencies_ms;
+    std::atomic<int> num_pending;
+    std::chrono::steady_clock::time_point start;
+    profile::Timer timer{nullptr};
   };
 
-  // Add each neighbor returned from subsequent shards to the min-heap if it
-  // has a higher score than the min value of the heap.
-  int shard_idx;
-  for (int i = 1; i < search_shard_idx.size(); i++) {
-    shard_idx = search_shard_idx[i];
+  const Status status = check_search(*search_request);
+  if (!status.ok()) {
+    done(status);
+    return;
+  }
 
-    LOG(INFO) << absl::StrFormat("Searching shard %d... .shard_size=%d",
-                                 shard_idx, m_shard_sizes_[shard_idx]);
+  auto fan_out = std::make_shared<FanOut>();
+  ProfileSpan *search_profile =
+      profile::start(*search_request, search_response, "router_search");
+  fan_out->timer = profile::Timer(search_profile);
+  if (!plan_search(search_request, search_response, &fan_out->plan)) {
+    fan_out->timer.finish();
+    done(Status::OK);
+    return;
+  }
 
-    ClientContext shard_client_context;
-    SearchRequest shard_search_request;
-    SearchResponse shard_search_response;
+  const int num_shards = fan_out->plan.shard_idx.size();
+  fan_out->shard_client_contexts = std::vector<ClientContext>(num_shards);
+  fan_out->shard_search_responses.resize(num_shards);
+  fan_out->shard_statuses.resize(num_shards);
+  fan_out->shard_latencies_ms.resize(num_shards);
+  fan_out->num_pending = num_shards;
+  fan_out->start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < num_shards; i++) {
+    LOG(INFO) << absl::StrFormat("Searching shard %d...",
+                                 fan_out->plan.shard_idx[i]);
+
+    fan_out->plan.shard_stubs[i]->async()->Search(
+        &fan_out->shard_client_contexts[i], search_request,
+        &fan_out->shard_search_responses[i],
+        [this, fan_out, i, search_request, search_response, search_profile,
+         done](Status shard_status) {
+          const int shard_idx = fan_out->plan.shard_idx[i];
+          if (shard_status.ok()) {
+            fan_out->shard_latencies_ms[i] =
+                milliseconds_since(fan_out->start);
+            m_monitor_.report_latency(shard_idx,
+                                      fan_out->shard_latencies_ms[i]);
+          } else {
+            report_shard_failure(shard_idx, shard_status);
+          }
+
+          fan_out->shard_statuses[i] = std::move(shard_status);
+          if (--fan_out->num_pending > 0)
+            return;
+
+          for (const Status &status : fan_out->shard_statuses) {
+            if (!status.ok()) {
+              done(shard_error(status));
+              return;
+            }
+          }
+
+          if (search_profile)
+            add_shard_spans(fan_out->plan.shard_idx,
+                            fan_out->shard_latencies_ms,
+                            &fan_out->shard_search_responses, search_profile);
+          merge_search(search_request, fan_out->plan,
+                       fan_out->shard_search_responses, search_response);
+          fan_out->timer.finish();
+          done(Status::OK);
+        });
+  }
+}
 
-    shard_search_request.CopyFrom(*search_request);
+Status ShardedIndexServiceImpl::Remove(grpc::ServerContext *context,
+                                       const RemoveRequest *remove_request,
+                                       RemoveResponse *remove_response) {
+  const Status collection_status =
+      check_collection(remove_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
 
-    auto &shard_stub = m_shard_service_stubs_.at(shard_idx);
+  const std::lock_guard<std::mutex> _(m_write_mutex_);
+
+  LOG(INFO) << absl::StrFormat("Received remove request. num_ids=%d",
+                               remove_request->ids_size());
 
-    Status shard_status = shard_stub->Search(
-        &shard_client_context, shard_search_request, &shard_search_response);
+  remove_all_pending();
+
+  // Only send each id to the shard storing it.
+  std::map<int, RemoveRequest> shard_remove_requests;
+  for (uint32_t id : remove_request->ids()) {
+    auto it = m_vector_shard_assignments_.find(id);
+    if (it != m_vector_shard_assignments_.end())
+      shard_remove_requests[it->second].add_ids(id);
+  }
+
+  std::vector<int> target_shard_idx;
+  for (const auto &[shard_idx, shard_remove_request] : shard_remove_requests)
+    target_shard_idx.push_back(shard_idx);
+  const Status status = check_healthy(target_shard_idx);
+  if (!status.ok())
+    return status;
+
+  int num_removed = 0;
+  for (const auto &[shard_idx, shard_remove_request] : shard_remove_requests) {
+    ClientContext shard_client_context;
+    RemoveResponse shard_remove_response;
+
+    for (uint32_t id : shard_remove_request.ids())
+      record_moving_write(shard_idx, id);
+
+    Status shard_status = m_shard_service_stubs_[shard_idx]->Remove(
+        &shard_client_context, shard_remove_request, &shard_remove_response);
 
     if (!shard_status.ok()) {
-      LOG(INFO) << absl::StrFormat(
-          "Shard returned non-ok response. error_code=%v, error_message=%s",
-          shard_status.error_code(), shard_status.error_message());
+      record_shard_write(shard_idx, 0);
+      report_shard_failure(shard_idx, shard_status);
+      return shard_error(shard_status);
+    }
 
-      return Status(StatusCode::UNAVAILABLE,
-                    "One or more shards are not healthy.");
+    for (uint32_t id : shard_remove_request.ids())
+      m_vector_shard_assignments_.erase(id);
+    record_shard_write(shard_idx, -(int)shard_remove_response.num_removed());
+    num_removed += shard_remove_response.num_removed();
+  }
+
+  remove_response->set_num_removed(num_removed);
+
+  return Status::OK;
+}
+
+Status ShardedIndexServiceImpl::Export(ServerContext *context,
+                                       const ExportRequest *export_request,
+                                       ServerWriter<ExportResponse> *writer) {
+  const Status collection_status =
+      check_collection(export_request->collection());
+  if (!collection_status.ok())
+    return collection_status;
+
+  const int batch_size =
+      algo::export_batch_size(export_request->batch_size(), m_dimensions_);
+
+  LOG(INFO) << absl::StrFormat(
+      "Received export request. begin_id=%d, end_id=%d, num_buckets=%d, "
+      "bucket=%d, batch_size=%d",
+      export_request->begin_id(), export_request->end_id(),
+      export_request->num_buckets(), export_request->bucket(), batch_size);
+
+  if (export_request->num_buckets() &&
+      export_request->bucket() >= export_request->num_buckets())
+    return Status(StatusCode::INVALID_ARGUMENT,
+                  absl::StrFormat("Expected a bucket less than %d. Bucket: "
+                                  "(%d).",
+                                  export_request->num_buckets(),
+                                  export_request->bucket()));
+
+  // An export stream from a shard, and its next vector.
+  struct ShardExport {
+    ClientContext context;
+    std::unique_ptr<grpc::ClientReader<ExportResponse>> reader;
+    ExportResponse response;
+    int position = 0;
+
+    // Dropped from the shard's stream.
+    std::shared_ptr<const std::unordered_set<uint32_t>> stale_ids;
+  };
+
+  // Start exporting from every non-empty shard at once, with the same
+  // filters.
+  std::vector<std::unique_ptr<ShardExport>> shard_exports;
+  {
+    const std::shared_lock<std::shared_mutex> _(m_shards_mutex_);
+    for (int shard_idx : get_search_shard_idx()) {
+      auto shard_export = std::make_unique<ShardExport>();
+      shard_export->reader = m_shard_service_stubs_[shard_idx]->Export(
+          &shard_export->context, *export_request);
+      shard_export->stale_ids = m_stale_ids_[shard_idx];
+      shard_exports.push_back(std::move(shard_export));
     }
+  }
 
-    LOG(INFO) << absl::StrFormat("Successfully searched shard %d.", shard_idx);
+  // Reads responses until `shard_export` has a vector that isn't stale at
+  // its position. Returns false once the shard's stream has ended.
+  auto fill = [](ShardExport *shard_export) {
+    while (true) {
+      while (shard_export->position >= shard_export->response.vectors_size()) {
+        shard_export->position = 0;
+        if (!shard_export->reader->Read(&shard_export->response))
+          return false;
+      }
 
-    for (const Neighbor &neighbor : shard_search_response.neighbors()) {
-      const Neighbor &current_worst_candidate = best_candidates[0];
+      const uint32_t id =
+          shard_export->response.vectors(shard_export->position).id();
+      if (!shard_export->stale_ids || !shard_export->stale_ids->count(id))
+        return true;
+      shard_export->position++;
+    }
+  };
+
+  // Shards stream in ascending id order, so a min-heap of each shard's next
+  // id merges them into one stream in ascending id order.
+  using Head = std::pair<uint32_t, int>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  for (int i = 0; i < shard_exports.size(); i++) {
+    ShardExport *shard_export = shard_exports[i].get();
+    if (fill(shard_export))
+      heads.push({shard_export->response.vectors(0).id(), i});
+  }
+
+  ExportResponse batch;
+  int num_exported = 0;
+  uint32_t last_id = 0;
+  bool cancelled = false;
+  while (!heads.empty() && !cancelled) {
+    const auto [id, i] = heads.top();
+    heads.pop();
+
+    // Note: While a rebalance cuts a vector over, it's served by both
+    // shards, so only keep its first copy.
+    ShardExport *shard_export = shard_exports[i].get();
+    if (!num_exported || id != last_id) {
+      batch.add_vectors()->Swap(
+          shard_export->response.mutable_vectors(shard_export->position));
+      last_id = id;
+      num_exported++;
+    }
+
+    shard_export->position++;
+    if (fill(shard_export))
+      heads.push(
+          {shard_export->response.vectors(shard_export->position).id(), i});
 
-      if (is_score_greater(neighbor, current_worst_candidate)) {
-        // Replace the smallest (i.e. worst) candidate so far if this one is
-        // better.
-        auto smallest = algo::heap_replace(best_candidates, search_request->k(),
-                                           neighbor, is_score_greater);
+    if (batch.vectors_size() == batch_size ||
+        (heads.empty() && batch.vectors_size())) {
+      cancelled = !writer->Write(batch);
+      batch.mutable_vectors()->Clear();
+    }
+  }
+
+  Status status = Status::OK;
+  for (const auto &shard_export : shard_exports) {
+    if (cancelled)
+      shard_export->context.TryCancel();
+    const Status shard_status = shard_export->reader->Finish();
+    if (!shard_status.ok() && status.ok() && !cancelled)
+      status = shard_error(shard_status);
+  }
+
+  if (cancelled)
+    return Status(StatusCode::CANCELLED, "Export was cancelled.");
+
+  LOG(INFO) << absl::StrFormat("Exported %d vectors from %d shards.",
+                               num_exported, shard_exports.size());
+
+  return status;
+}
+
+Status ShardedIndexServiceImpl::AddShard(
+    grpc::ServerContext *context, const AddShardRequest *add_shard_request,
+    AddShardResponse *add_shard_response) {
+  LOG(INFO) << absl::StrFormat("Received add shard request. address=%s",
+                               add_shard_request->address());
+
+  std::shared_ptr<Channel> channel = grpc::CreateChannel(
+      add_shard_request->address(), grpc::InsecureChannelCredentials());
+  std::unique_ptr<IndexService::Stub> stub = IndexService::NewStub(channel);
+
+  // Make sure the shard is reachable and can hold vectors of this index. It
+  // must also be empty, since we don't know which vectors it would hold.
+  ClientContext shard_client_context;
+  DescribeResponse shard_describe_response;
+  Status shard_status = stub->Describe(
+      &shard_client_context, DescribeRequest(), &shard_describe_response);
+
+  if (!shard_status.ok())
+    return shard_error(shard_status);
+
+  if (shard_describe_response.dimensions() != m_dimensions_ ||
+      shard_describe_response.num_vectors())
+    return Status(
+        StatusCode::FAILED_PRECONDITION,
+        absl::StrFormat("Expected an empty shard with %d dimensions. Shard "
+                        "dimensions: (%d). Shard vectors: (%d).",
+                        m_dimensions_, shard_describe_response.dimensions(),
+                        shard_describe_response.num_vectors()));
+
+  const std::lock_guard<std::mutex> write_lock(m_write_mutex_);
+  const std::lock_guard<std::shared_mutex> shards_lock(m_shards_mutex_);
+
+  m_shard_service_stubs_.push_back(std::move(stub));
+  m_shard_sizes_.push_back(0);
+  m_shard_epochs_.push_back(0);
+  m_stale_ids_.emplace_back();
+  m_pending_removes_.emplace_back();
+  m_monitor_.add_shard(std::move(channel));
+
+  add_shard_response->set_shard_idx(m_shard_service_stubs_.size() - 1);
+
+  LOG(INFO) << absl::StrFormat("Added shard %d.",
+                               add_shard_response->shard_idx());
+
+  return Status::OK;
+}
+
+Status ShardedIndexServiceImpl::load_prebuilt_shards(int num_vectors) {
+  const std::lock_guard<std::mutex> write_lock(m_write_mutex_);
+  if (!m_vector_shard_assignments_.empty())
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  "Expected an index without any vectors placed yet.");
+
+  const std::pair<int, std::map<int, int>> placement = algo::greedy_fill(
+      num_vectors, m_shard_capacity_, std::vector<int>(m_shard_sizes_.size()));
+  if (placement.first)
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  absl::StrFormat("%d vectors don't fit in the shards.",
+                                  num_vectors));
+
+  // Make sure every shard holds as many vectors as the placement expects,
+  // e.g. that no shard was started without its snapshot.
+  std::vector<int> shard_sizes(m_shard_sizes_.size());
+  for (const auto &[shard_idx, num_filled] : placement.second)
+    shard_sizes[shard_idx] = num_filled;
+
+  for (int shard_idx = 0; shard_idx < shard_sizes.size(); shard_idx++) {
+    ClientContext context;
+    DescribeResponse describe_response;
+    const Status status = m_shard_service_stubs_[shard_idx]->Describe(
+        &context, DescribeRequest(), &describe_response);
+    if (!status.ok())
+      return shard_error(status);
+
+    if (describe_response.num_vectors() != shard_sizes[shard_idx])
+      return Status(StatusCode::FAILED_PRECONDITION,
+                    absl::StrFormat("Expected shard %d to hold %d vectors. "
+                                    "Shard vectors: (%d).",
+                                    shard_idx, shard_sizes[shard_idx],
+                                    describe_response.num_vectors()));
+  }
+
+  const std::lock_guard<std::shared_mutex> shards_lock(m_shards_mutex_);
+  m_vector_shard_assignments_.reserve(num_vectors);
+  int id = 0;
+  for (int shard_idx = 0; shard_idx < shard_sizes.size(); shard_idx++) {
+    for (int i = 0; i < shard_sizes[shard_idx]; i++)
+      m_vector_shard_assignments_.insert({id++, shard_idx});
+    m_shard_sizes_[shard_idx] = shard_sizes[shard_idx];
+    m_shard_epochs_[shard_idx]++;
+  }
+
+  LOG(INFO) << absl::StrFormat("Loaded %d prebuilt vectors across %d shards.",
+                               num_vectors, shard_sizes.size());
+
+  return Status::OK;
+}
+
+Status ShardedIndexServiceImpl::Rebalance(
+    grpc::ServerContext *context, const RebalanceRequest *rebalance_request,
+    RebalanceResponse *rebalance_response) {
+  LOG(INFO) << absl::StrFormat(
+      "Received rebalance request. max_vectors_per_second=%d, range_size=%d",
+      rebalance_request->max_vectors_per_second(),
+      rebalance_request->range_size());
+
+  const std::lock_guard<std::mutex> rebalance_lock(m_rebalance_mutex_);
+  if (m_rebalancing_)
+    return Status(StatusCode::FAILED_PRECONDITION,
+                  "A rebalance is already in progress.");
+
+  // Join the thread of the last rebalance, which has completed.
+  if (m_rebalance_thread_.joinable())
+    m_rebalance_thread_.join();
+
+  std::vector<algo::BucketMove> moves;
+  std::vector<std::vector<uint32_t>> shard_ids;
+  {
+    const std::lock_guard<std::mutex> write_lock(m_write_mutex_);
+
+    moves = algo::rebalance_plan(m_shard_sizes_);
+
+    shard_ids.resize(m_shard_sizes_.size());
+    for (const auto &[id, shard_idx] : m_vector_shard_assignments_)
+      shard_ids[shard_idx].push_back(id);
+  }
+
+  // Moving contiguous ids lets each range be exported by its bounds.
+  int num_vectors_to_move = 0;
+  for (const algo::BucketMove &move : moves) {
+    std::vector<uint32_t> &ids = shard_ids[move.source];
+    if (!std::is_sorted(ids.begin(), ids.end()))
+      std::sort(ids.begin(), ids.end());
+    num_vectors_to_move += move.num_elements;
+  }
+
+  rebalance_response->set_num_vectors_to_move(num_vectors_to_move);
+  if (moves.empty())
+    return Status::OK;
+
+  LOG(INFO) << absl::StrFormat("Moving %d vectors in %d moves.",
+                               num_vectors_to_move, moves.size());
+
+  const int range_size = rebalance_request->range_size()
+                             ? rebalance_request->range_size()
+                             : kDefaultRebalanceRangeSize;
+
+  m_rebalancing_ = true;
+  m_rebalance_thread_ =
+      std::thread(&ShardedIndexServiceImpl::run_rebalance, this,
+                  std::move(moves), std::move(shard_ids), range_size,
+                  rebalance_request->max_vectors_per_second());
+
+  return Status::OK;
+}
+
+void ShardedIndexServiceImpl::run_rebalance(
+    std::vector<algo::BucketMove> moves,
+    std::vector<std::vector<uint32_t>> shard_ids, int range_size,
+    int max_vectors_per_second) {
+  metrics::Gauge *in_progress = m_metrics_.gauge("rebalance_in_progress");
+  metrics::Counter *vectors_moved =
+      m_metrics_.counter("rebalance_vectors_moved");
+  metrics::Counter *ranges_moved = m_metrics_.counter("rebalance_ranges_moved");
+  metrics::Counter *errors = m_metrics_.counter("rebalance_errors");
+  in_progress->set(1);
+
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point start = Clock::now();
+  int64_t num_moved_total = 0;
+
+  // The next id to move from each shard.
+  std::vector<int> cursors(shard_ids.size(), 0);
+
+  for (const algo::BucketMove &move : moves) {
+    const std::vector<uint32_t> &ids = shard_ids[move.source];
+    int &cursor = cursors[move.source];
+    const int end = std::min<int>(cursor + move.num_elements, ids.size());
+
+    while (cursor < end && !m_stopping_) {
+      const std::vector<uint32_t> range(
+          ids.begin() + cursor,
+          ids.begin() + std::min(cursor + range_size, end));
+      cursor += range.size();
+
+      int num_moved = 0;
+      Status status = move_range(move.source, move.target, range, &num_moved);
+      if (!status.ok()) {
+        LOG(WARNING) << absl::StrFormat(
+            "Stopping rebalance after failing to move vectors from shard %d "
+            "to shard %d. error_message=%s",
+            move.source, move.target, status.error_message());
+        errors->increment();
+        retry_pending_removes();
+        in_progress->set(0);
+        m_rebalancing_ = false;
+        return;
+      }
+
+      vectors_moved->increment(num_moved);
+      ranges_moved->increment();
+      num_moved_total += num_moved;
+
+      // Throttle by waiting until the moves so far are within the budget,
+      // or until the index is destroyed.
+      if (max_vectors_per_second > 0) {
+        const Clock::time_point deadline =
+            start + std::chrono::microseconds(num_moved_total * 1000000 /
+                                              max_vectors_per_second);
+        std::unique_lock<std::mutex> lock(m_stop_mutex_);
+        m_stop_cv_.wait_until(lock, deadline,
+                              [this] { return m_stopping_.load(); });
       }
     }
   }
 
-  // Reverse sort the min-heap so larger values are first.
-  // For now, assume that greater scores are better. This is compatible with
-  // dot product indexes only.
-  std::sort(best_candidates, best_candidates + search_request->k(),
-            is_score_greater);
-  for (int i = 0; i < search_request->k(); i++) {
-    search_response->add_neighbors()->CopyFrom(best_candidates[i]);
+  LOG(INFO) << absl::StrFormat("Rebalance moved %d vectors.", num_moved_total);
+
+  retry_pending_removes();
+  in_progress->set(0);
+  m_rebalancing_ = false;
+}
+
+Status ShardedIndexServiceImpl::copy_vectors(
+    int source, int target, uint32_t begin_id, uint32_t end_id,
+    const std::function<bool(uint32_t)> &keep,
+    std::vector<uint32_t> *copied_ids) {
+  IndexService::Stub *source_stub;
+  IndexService::Stub *target_stub;
+  {
+    const std::shared_lock<std::shared_mutex> _(m_shards_mutex_);
+    source_stub = m_shard_service_stubs_[source].get();
+    target_stub = m_shard_service_stubs_[target].get();
+  }
+
+  ExportRequest export_request;
+  export_request.set_begin_id(begin_id);
+  export_request.set_end_id(end_id);
+  export_request.set_batch_size(kMaxMoveBatchSize);
+
+  ClientContext export_context;
+  export_context.set_deadline(std::chrono::system_clock::now() +
+                              kMoveCallTimeout);
+  std::unique_ptr<grpc::ClientReader<ExportResponse>> reader =
+      source_stub->Export(&export_context, export_request);
+
+  ExportResponse export_response;
+  Status status = Status::OK;
+  while (reader->Read(&export_response)) {
+    UpsertRequest upsert_request;
+    std::vector<uint32_t> batch_ids;
+    for (Vector &vector : *export_response.mutable_vectors()) {
+      if (keep(vector.id())) {
+        batch_ids.push_back(vector.id());
+        upsert_request.add_vectors()->Swap(&vector);
+      }
+    }
+    if (batch_ids.empty())
+      continue;
+
+    // Note: Mark the copies stale before writing them, so the target never
+    // serves them before they're routed to it.
+    update_stale_ids(target, batch_ids, {});
+    copied_ids->insert(copied_ids->end(), batch_ids.begin(), batch_ids.end());
+
+    ClientContext upsert_context;
+    upsert_context.set_deadline(std::chrono::system_clock::now() +
+                                kMoveCallTimeout);
+    UpsertResponse upsert_response;
+    status =
+        target_stub->Upsert(&upsert_context, upsert_request, &upsert_response);
+    if (!status.ok()) {
+      export_context.TryCancel();
+      break;
+    }
+  }
+
+  const Status export_status = reader->Finish();
+  if (status.ok())
+    status = export_status;
+
+  return status;
+}
+
+Status ShardedIndexServiceImpl::move_range(int source, int target,
+                                           const std::vector<uint32_t> &ids,
+                                           int *num_moved) {
+  *num_moved = 0;
+  if (ids.empty())
+    return Status::OK;
+
+  const uint32_t begin_id = ids.front();
+  const uint32_t end_id = ids.back() + 1;
+  {
+    const std::lock_guard<std::mutex> _(m_write_mutex_);
+    remove_all_pending();
+    m_moving_range_ = MovingRange{source, begin_id, end_id, {}};
+  }
+
+  // Copy the range to the target without blocking writes. Writes to the
+  // range meanwhile are recorded, and copied again below. Upserting makes
+  // copying a vector twice safe.
+  std::vector<uint32_t> copied_ids;
+  Status status = copy_vectors(
+      source, target, begin_id, end_id,
+      [&ids](uint32_t id) {
+        return std::binary_search(ids.begin(), ids.end(), id);
+      },
+      &copied_ids);
+
+  // Block writes while catching up and cutting over, so no vector in the
+  // range changes between being copied and being routed to the target.
+  const std::lock_guard<std::mutex> _(m_write_mutex_);
+  const std::unordered_set<uint32_t> written_ids =
+      std::move(m_moving_range_.written_ids);
+  m_moving_range_ = MovingRange();
+
+  // Copy the vectors written since the copy started that the source still
+  // stores. The ones it doesn't store anymore were removed.
+  std::vector<uint32_t> recopied_ids;
+  if (status.ok() && !written_ids.empty()) {
+    const auto [min_id, max_id] =
+        std::minmax_element(written_ids.begin(), written_ids.end());
+    status = copy_vectors(
+        source, target, *min_id, *max_id + 1,
+        [&written_ids](uint32_t id) { return written_ids.count(id) > 0; },
+        &recopied_ids);
+  }
+
+  std::unordered_set<uint32_t> &target_pending = m_pending_removes_[target];
+  if (!status.ok()) {
+    // Undo the partial copy so the target only stores vectors routed to it.
+    target_pending.insert(copied_ids.begin(), copied_ids.end());
+    target_pending.insert(recopied_ids.begin(), recopied_ids.end());
+    m_pending_removes_gauge_->set(count_ids(m_pending_removes_));
+    remove_pending(target);
+    return status;
+  }
+
+  const std::unordered_set<uint32_t> recopied(recopied_ids.begin(),
+                                              recopied_ids.end());
+  std::vector<uint32_t> moved_ids = recopied_ids;
+  std::vector<uint32_t> removed_ids;
+  for (uint32_t id : copied_ids) {
+    if (!written_ids.count(id))
+      moved_ids.push_back(id);
+    else if (!recopied.count(id))
+      removed_ids.push_back(id);
+  }
+
+  // Cut over: route the range to the target. The target serves the vectors
+  // before the source stops serving them, so searches in between see both
+  // copies and keep one, rather than neither.
+  for (uint32_t id : moved_ids)
+    m_vector_shard_assignments_[id] = target;
+  update_stale_ids(target, {}, moved_ids);
+  update_stale_ids(source, moved_ids, {});
+  record_shard_write(target, moved_ids.size());
+  record_shard_write(source, -(int)moved_ids.size());
+  *num_moved = moved_ids.size();
+
+  // Remove the moved vectors from the source, and the copies of vectors
+  // removed since from the target. If that fails, neither serves them, and
+  // removing them is retried later.
+  m_pending_removes_[source].insert(moved_ids.begin(), moved_ids.end());
+  target_pending.insert(removed_ids.begin(), removed_ids.end());
+  m_pending_removes_gauge_->set(count_ids(m_pending_removes_));
+  for (int shard_idx : {target, source}) {
+    const Status remove_status = remove_pending(shard_idx);
+    if (!remove_status.ok())
+      LOG(WARNING) << absl::StrFormat(
+          "Failed to remove vectors moved by a rebalance from shard %d. "
+          "Retrying later. error_message=%s",
+          shard_idx, remove_status.error_message());
   }
 
+  LOG(INFO) << absl::StrFormat("Moved %d vectors from shard %d to shard %d.",
+                               moved_ids.size(), source, target);
+
   return Status::OK;
 }
+
+void ShardedIndexServiceImpl::record_moving_write(int shard_idx,
+                                                  uint32_t id) {
+  if (shard_idx == m_moving_range_.source && id >= m_moving_range_.begin_id &&
+      id < m_moving_range_.end_id)
+    m_moving_range_.written_ids.insert(id);
+}
+
+void ShardedIndexServiceImpl::update_stale_ids(
+    int shard_idx, const std::vector<uint32_t> &add,
+    const std::vector<uint32_t> &erase) {
+  const std::lock_guard<std::shared_mutex> _(m_shards_mutex_);
+  std::shared_ptr<const std::unordered_set<uint32_t>> &stale_ids =
+      m_stale_ids_[shard_idx];
+
+  auto updated = std::make_shared<std::unordered_set<uint32_t>>();
+  if (stale_ids)
+    *updated = *stale_ids;
+  updated->insert(add.begin(), add.end());
+  for (uint32_t id : erase)
+    updated->erase(id);
+
+  if (updated->empty())
+    stale_ids.reset();
+  else
+    stale_ids = std::move(updated);
+}
+
+Status ShardedIndexServiceImpl::check_not_stale(uint32_t id) const {
+  const std::shared_lock<std::shared_mutex> _(m_shards_mutex_);
+  for (int i = 0; i < m_stale_ids_.size(); i++) {
+    if (m_stale_ids_[i] && m_stale_ids_[i]->count(id))
+      return Status(StatusCode::UNAVAILABLE,
+                    absl::StrFormat("Shard %d still stores a stale copy of "
+                                    "the vector with id=%d.",
+                                    i, id));
+  }
+
+  return Status::OK;
+}
+
+Status ShardedIndexServiceImpl::remove_pending(int shard_idx) {
+  std::unordered_set<uint32_t> &pending = m_pending_removes_[shard_idx];
+  if (pending.empty())
+    return Status::OK;
+
+  RemoveRequest remove_request;
+  remove_request.mutable_ids()->Add(pending.begin(), pending.end());
+
+  ClientContext shard_client_context;
+  shard_client_context.set_deadline(std::chrono::system_clock::now() +
+                                    kMoveCallTimeout);
+  RemoveResponse remove_response;
+  const Status shard_status = m_shard_service_stubs_[shard_idx]->Remove(
+      &shard_client_context, remove_request, &remove_response);
+  if (!shard_status.ok()) {
+    report_shard_failure(shard_idx, shard_status);
+    return shard_error(shard_status);
+  }
+
+  update_stale_ids(shard_idx, {},
+                   std::vector<uint32_t>(pending.begin(), pending.end()));
+  pending.clear();
+  m_pending_removes_gauge_->set(count_ids(m_pending_removes_));
+
+  return Status::OK;
+}
+
+void ShardedIndexServiceImpl::remove_all_pending() {
+  std::shared_ptr<const ClusterView> view;
+  for (int i = 0; i < m_pending_removes_.size(); i++) {
+    if (m_pending_removes_[i].empty())
+      continue;
+
+    // Note: Skip shards that are down, rather than waiting on them in every
+    // write.
+    if (!view)
+      view = m_monitor_.view();
+    if (!view->healthy(i))
+      continue;
+
+    const Status status = remove_pending(i);
+    if (!status.ok())
+      LOG(WARNING) << absl::StrFormat(
+          "Failed to remove %d pending vectors from shard %d. "
+          "error_message=%s",
+          m_pending_removes_[i].size(), i, status.error_message());
+  }
+}
+
+void ShardedIndexServiceImpl::retry_pending_removes() {
+  for (int attempt = 1; attempt < kMaxRemoveAttempts; attempt++) {
+    {
+      const std::lock_guard<std::mutex> _(m_write_mutex_);
+      if (!count_ids(m_pending_removes_))
+        return;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(m_stop_mutex_);
+      if (m_stop_cv_.wait_for(lock, kRemoveRetryDelay,
+                              [this] { return m_stopping_.load(); }))
+        return;
+    }
+
+    const std::lock_guard<std::mutex> _(m_write_mutex_);
+    remove_all_pending();
+  }
+}
@@ -1,10 +1,26 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "src/cpp/admission.h"
+#include "src/cpp/algo.h"
+#include "src/cpp/async_server.h"
+#include "src/cpp/metrics.h"
+#include "src/cpp/query_cache.h"
+#include "src/cpp/shard_monitor.h"
 #include "src/proto/index_service.grpc.pb.h"
 #include "src/proto/index_service.pb.h"
 
@@ -13,11 +29,25 @@ namespace index_service::sharded {
 class ShardedIndexServiceImpl final
     : public index_service::IndexService::Service {
 public:
+  // If `query_cache_bytes` is positive, search responses are cached in up to
+  // that many bytes, so repeated queries don't fan out to every shard.
+  // Only `limits.max_k` applies, since shards enforce their own memory
+  // budgets. Shards are polled once before this returns, and then in the
+  // background as configured by `monitor_config`.
   explicit ShardedIndexServiceImpl(
       int dimensions,
       std::vector<std::shared_ptr<grpc::Channel>> shard_service_channels,
-      int shard_capacity = 1);
+      int shard_capacity = 1, size_t query_cache_bytes = 0,
+      const admission::Limits &limits = {},
+      const MonitorConfig &monitor_config = {});
 
+  // Stops any rebalance in progress after the range it's moving, without
+  // waiting for its throttle.
+  ~ShardedIndexServiceImpl();
+
+  // Answers from the monitor's cached view of the shards, without calling
+  // them, even if some are unhealthy. The health, channel connectivity and
+  // consecutive failed polls of each shard are reported in the metrics.
   // TODO: Consider consolidating this with `FaissIndexServiceImpl`.
   grpc::Status Describe(grpc::ServerContext *context,
                         const index_service::DescribeRequest *describe_request,
@@ -31,13 +61,88 @@ public:
                       const index_service::UpsertRequest *upsert_request,
                       index_service::UpsertResponse *upsert_response);
 
+  // Skips shards the monitor has as unhealthy, and marks the response as
+  // `partial` if it did. Partial responses aren't cached.
   grpc::Status Search(grpc::ServerContext *context,
                       const index_service::SearchRequest *search_request,
                       index_service::SearchResponse *search_response);
 
+  // Like `Search`, but searches all shards at once with asynchronous calls
+  // and calls `done` from the thread that receives the last shard response,
+  // so no thread is blocked while shards search.
+  void SearchAsync(grpc::ServerContext *context,
+                   const index_service::SearchRequest *search_request,
+                   index_service::SearchResponse *search_response,
+                   async::Done done);
+
+  // Streams the exports of every non-empty shard, merged into one stream in
+  // ascending id order. A vector that's in two shards while a rebalance moves
+  // it is exported once.
+  grpc::Status
+  Export(grpc::ServerContext *context,
+         const index_service::ExportRequest *export_request,
+         grpc::ServerWriter<index_service::ExportResponse> *writer);
+
+  grpc::Status Remove(grpc::ServerContext *context,
+                      const index_service::RemoveRequest *remove_request,
+                      index_service::RemoveResponse *remove_response);
+
+  grpc::Status
+  AddShard(grpc::ServerContext *context,
+           const index_service::AddShardRequest *add_shard_request,
+           index_service::AddShardResponse *add_shard_response);
+
+  grpc::Status
+  Rebalance(grpc::ServerContext *context,
+            const index_service::RebalanceRequest *rebalance_request,
+            index_service::RebalanceResponse *rebalance_response);
+
+  // Routes to shards that were built offline by `index_builder` with this
+  // index's shard capacity, holding `num_vectors` vectors with ids
+  // `0..num_vectors-1` placed the way `Insert` would have placed them.
+  // Returns `FAILED_PRECONDITION` if any shard holds a different number of
+  // vectors than that placement, or if this index already placed vectors.
+  grpc::Status load_prebuilt_shards(int num_vectors);
+
+  // The registry of metrics exported through `Describe`.
+  metrics::Registry *metrics() { return &m_metrics_; }
+
 private:
+  // The shards a search fans out to, and how to cache its response.
+  struct SearchPlan {
+    std::vector<int> shard_idx;
+    std::vector<index_service::IndexService::Stub *> shard_stubs;
+
+    // The stale ids of each shard in `shard_idx`, dropped from its results.
+    std::vector<std::shared_ptr<const std::unordered_set<uint32_t>>>
+        shard_stale_ids;
+
+    // The write epochs of all shards before the search started.
+    std::vector<uint64_t> shard_epochs;
+
+    std::string cache_key;
+
+    // Whether non-empty shards were skipped because they're unhealthy.
+    bool partial = false;
+  };
+
+  // Plans a search. Returns false if `search_response` is already complete,
+  // because it was cached or all shards are empty.
+  bool plan_search(const index_service::SearchRequest *search_request,
+                   index_service::SearchResponse *search_response,
+                   SearchPlan *plan);
+
+  // Merges the responses of the shards in `plan` into `search_response`,
+  // and caches it unless the search is partial or profiled.
+  void merge_search(
+      const index_service::SearchRequest *search_request,
+      const SearchPlan &plan,
+      const std::vector<index_service::SearchResponse> &shard_search_responses,
+      index_service::SearchResponse *search_response);
+
   // Returns the shards to use in searches, i.e. shards that have a
   // non-zero number of vectors in them.
+  // Note: The caller must hold `m_shards_mutex_` or `m_write_mutex_`.
   inline std::vector<int> get_search_shard_idx() {
     std::vector<int> non_zero_idx;
     for (int i = 0; i < m_shard_sizes_.size(); i++) {
@@ -48,6 +153,85 @@ private:
     return non_zero_idx;
   }
 
+  // Records that `size_delta` vectors were added to the shard at
+  // `shard_idx`, and bumps its write epoch to invalidate cached searches
+  // computed before the write.
+  // Note: This must be called after the write completes, so a search that
+  // reads the epochs after this call also sees the write. The caller must
+  // hold `m_write_mutex_`.
+  void record_shard_write(int shard_idx, int size_delta);
+
+  // Returns `UNAVAILABLE` if the monitor has any of the shards at
+  // `shard_idx` as unhealthy, so writes fail before writing to any shard
+  // rather than after waiting on one that's down.
+  grpc::Status check_healthy(const std::vector<int> &shard_idx) const;
+
+  // Returns `INVALID_ARGUMENT` if the query doesn't have the index's
+  // dimensions or `k` is over the limit, or `UNIMPLEMENTED` if it names a
+  // collection, before the search is sent to any shard.
+  grpc::Status
+  check_search(const index_service::SearchRequest &search_request) const;
+
+  // Marks the shard at `shard_idx` unhealthy if `shard_status` means it
+  // couldn't be reached or didn't answer in time. Errors the shard returned
+  // itself, e.g. for an invalid request or load it shed, don't make it
+  // unhealthy.
+  void report_shard_failure(int shard_idx, const grpc::Status &shard_status);
+
+  // Moves the vectors in `ids` from the shard at `source` to the shard at
+  // `target`: copies them to `target` through `Export` and `Upsert` without
+  // blocking writes, then, holding `m_write_mutex_`, copies the vectors
+  // written since, routes them to `target`, and removes them from `source`.
+  // Returns the number of vectors moved in `num_moved`.
+  //
+  // `ids` must be sorted, and all of them must have been stored in `source`
+  // when the rebalance was planned.
+  grpc::Status move_range(int source, int target,
+                          const std::vector<uint32_t> &ids, int *num_moved);
+
+  // Copies the vectors with ids in `[begin_id, end_id)` for which `keep`
+  // returns true from the shard at `source` to the shard at `target`, and
+  // appends their ids to `copied_ids`. The copies are stale ids of `target`
+  // until they're routed to it.
+  grpc::Status copy_vectors(int source, int target, uint32_t begin_id,
+                            uint32_t end_id,
+                            const std::function<bool(uint32_t)> &keep,
+                            std::vector<uint32_t> *copied_ids);
+
+  // Records that the vector with `id` is written to the shard at
+  // `shard_idx`, so a range being moved from it copies the write too.
+  // Note: The caller must hold `m_write_mutex_`.
+  void record_moving_write(int shard_idx, uint32_t id);
+
+  // Adds `add` to and erases `erase` from the stale ids of the shard at
+  // `shard_idx`.
+  void update_stale_ids(int shard_idx, const std::vector<uint32_t> &add,
+                        const std::vector<uint32_t> &erase);
+
+  // Returns `UNAVAILABLE` if a shard stores a stale copy of the vector with
+  // `id`, so a new vector with `id` can't be written until the copy is
+  // removed: a shard ignores inserts of ids it already stores.
+  grpc::Status check_not_stale(uint32_t id) const;
+
+  // Removes the pending removes of the shard at `shard_idx` from it.
+  // Note: The caller must hold `m_write_mutex_`.
+  grpc::Status remove_pending(int shard_idx);
+
+  // Removes the pending removes of every healthy shard, and logs failures.
+  // Note: The caller must hold `m_write_mutex_`.
+  void remove_all_pending();
+
+  // Retries removing pending removes a few times before a rebalance
+  // completes, unless the index is being destroyed. Later writes retry any
+  // that still fail.
+  void retry_pending_removes();
+
+  // Executes `moves` on a background thread. `shard_ids[i]` are the sorted
+  // ids stored in shard `i` when the moves were planned.
+  void run_rebalance(std::vector<algo::BucketMove> moves,
+                     std::vector<std::vector<uint32_t>> shard_ids,
+                     int range_size, int max_vectors_per_second);
+
   // The dimensions of vectors in this index. Must match the dimensions of
   // each shard service.
   int m_dimensions_;
@@ -56,7 +240,16 @@ private:
   // For simplicity, this is static across all shards.
   int m_shard_capacity_;
 
+  admission::Limits m_limits_;
+
+  // Guards the stubs, sizes and epochs of shards, since `AddShard` adds to
+  // them while searches read them. Holders of `m_write_mutex_` may read them
+  // without this lock, since only they modify them.
+  mutable std::shared_mutex m_shards_mutex_;
+
   // The service stubs for each shard in this index.
+  // Note: Stubs are never removed, so a stub may be used after releasing
+  // `m_shards_mutex_`.
   std::vector<std::unique_ptr<index_service::IndexService::Stub>>
       m_shard_service_stubs_;
 
@@ -68,15 +261,80 @@ private:
   // over empty shards.
   std::vector<int> m_shard_sizes_;
 
-  // Write lock used to serialize insertions.
-  // This is acquired in every insert request to ensure each insert + the
-  // bookkeeping to update shard sizes is done atomically.
-  std::mutex m_insertion_mutex_;
+  // The number of writes made to each shard, used to invalidate cached
+  // searches.
+  std::vector<uint64_t> m_shard_epochs_;
+
+  // Write lock used to serialize writes.
+  // This is acquired in every insert, upsert and remove request, and while
+  // a rebalance routes a range of vectors to another shard, to ensure each
+  // write + the bookkeeping to update shard sizes and assignments is done
+  // atomically.
+  std::mutex m_write_mutex_;
 
   // Mapping from vector IDs to the shard ID that stores them. Used to
   // ignore existing vectors at insert time and route upserts to the correct
   // shard.
   std::unordered_map<int, int> m_vector_shard_assignments_;
+
+  // The range of ids a rebalance is copying from a shard without holding
+  // `m_write_mutex_`, and the ids written to it there since the copy
+  // started. `source` is `-1` if no range is being copied.
+  // Note: Guarded by `m_write_mutex_`.
+  struct MovingRange {
+    int source = -1;
+    uint32_t begin_id = 0;
+    uint32_t end_id = 0;
+    std::unordered_set<uint32_t> written_ids;
+  };
+  MovingRange m_moving_range_;
+
+  // The ids of vectors each shard stores but doesn't serve: copies a
+  // rebalance is making before routing them to the shard, and vectors it
+  // moved away whose removal is pending. Searches and exports drop them
+  // from the shard's results, so a stale copy is never returned.
+  // Note: Guarded by `m_shards_mutex_`. Each set is replaced rather than
+  // modified, so searches can read it after releasing the lock. Null if
+  // empty.
+  std::vector<std::shared_ptr<const std::unordered_set<uint32_t>>>
+      m_stale_ids_;
+
+  // The ids of vectors moved away from each shard, or copied to it by a move
+  // that failed, that still have to be removed from it. Removing them is
+  // retried before every write.
+  // Note: Guarded by `m_write_mutex_`.
+  std::vector<std::unordered_set<uint32_t>> m_pending_removes_;
+
+  metrics::Registry m_metrics_;
+
+  metrics::Counter *m_search_shards_skipped_;
+
+  metrics::Gauge *m_pending_removes_gauge_;
+
+  // Tracks the health of shards, in the same order as their stubs.
+  ShardMonitor m_monitor_;
+
+  // Caches search responses, or null if caching is disabled.
+  std::unique_ptr<cache::QueryCache> m_query_cache_;
+
+  // Guards `m_rebalance_thread_`.
+  std::mutex m_rebalance_mutex_;
+
+  // The thread running the current or last rebalance, if any.
+  std::thread m_rebalance_thread_;
+
+  // Whether a rebalance is in progress.
+  std::atomic<bool> m_rebalancing_;
+
+  // Set to stop a rebalance in progress.
+  std::atomic<bool> m_stopping_;
+
+  // Guards setting `m_stopping_`, so a rebalance that's throttled can't miss
+  // the notification.
+  std::mutex m_stop_mutex_;
+
+  // Notified to stop a rebalance that's throttled.
+  std::condition_variable m_stop_cv_;
 };
 
 } // namespace index_service::sharded
@@ -1,10 +1,15 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/log/log.h"
+#include "absl/status/statusor.h"
 #include "absl/strings/str_format.h"
 #include "grpc/grpc.h"
 #include "grpcpp/channel.h"
@@ -12,28 +17,75 @@
 #include "grpcpp/security/credentials.h"
 #include "grpcpp/security/server_credentials.h"
 #include "grpcpp/server_builder.h"
+#include "src/cpp/admission.h"
+#include "src/cpp/async_server.h"
 #include "src/cpp/sharded_index_service.h"
 
+ABSL_FLAG(int64_t, cache_bytes, 0,
+          "Approximate number of bytes of search responses to cache. Caching "
+          "is disabled if 0.");
+ABSL_FLAG(int, prebuilt_vectors, 0,
+          "Number of vectors in shards built offline by `index_builder` with "
+          "the same shard capacity, passed in shard order. Shards are assumed "
+          "to start empty if 0.");
+ABSL_FLAG(int, health_check_interval_ms, 1000,
+          "How often shards are polled for their health and stats.");
+ABSL_FLAG(int, health_check_timeout_ms, 500,
+          "How long a health check waits for a shard before routing around "
+          "it until a later check succeeds.");
+ABSL_FLAG(int, num_cqs, 1,
+          "Number of gRPC completion queues, each polled by its own thread.");
+ABSL_FLAG(std::string, poller_cpus, "",
+          "CPUs to pin completion queue polling threads to, e.g. `0-1`, one "
+          "CPU per thread. Pollers aren't pinned if empty.");
+ABSL_FLAG(int, compute_threads, 0,
+          "Number of threads that handle requests other than searches, which "
+          "don't block a thread. Defaults to the number of CPUs.");
+ABSL_FLAG(std::string, compute_cpus, "",
+          "CPUs to pin compute threads to, e.g. `2-15`. Compute threads "
+          "aren't pinned if empty.");
+ABSL_FLAG(int, max_pending_calls, 0,
+          "Number of requests that may be in progress at once before new "
+          "requests are rejected. Unbounded if 0.");
+ABSL_FLAG(int, max_in_flight_searches, 0,
+          "Number of searches that may fan out to shards at once. Unbounded "
+          "if 0.");
+ABSL_FLAG(int, max_queued_searches, 64,
+          "Number of searches that may wait for `--max_in_flight_searches` "
+          "before new searches are rejected.");
+ABSL_FLAG(int, max_k, 1000,
+          "Largest `k` a search may ask for. Unbounded if 0.");
+ABSL_FLAG(int, codel_target_ms, 5,
+          "Queueing delay searches are kept under. Once even the shortest "
+          "queueing delay stays above it for `--codel_interval_ms`, searches "
+          "that queued for more than twice as long are shed.");
+ABSL_FLAG(int, codel_interval_ms, 100,
+          "Window over which queueing delay must stay above "
+          "`--codel_target_ms` before searches are shed.");
+
+using absl::ParseCommandLine;
 using grpc::Server;
 using grpc::ServerBuilder;
 using index_service::sharded::ShardedIndexServiceImpl;
 
 int main(int argc, char *argv[]) {
+  std::vector<char *> args = ParseCommandLine(argc, argv);
+
   const int num_required_args = 3;
-  if (argc < num_required_args) {
+  if (args.size() <= num_required_args) {
     std::cout << "Expected at least 3 arguments: <port> <dimensions> "
                  "<shard_capacity>."
               << std::endl;
     return 1;
   }
   std::vector<std::string> shard_addresses;
-  for (int i = num_required_args + 1; i < argc; i++) {
-    shard_addresses.push_back(argv[i]);
+  for (int i = num_required_args + 1; i < args.size(); i++) {
+    shard_addresses.push_back(args[i]);
   }
 
-  int port = std::stoi(argv[1]);
-  int dimensions = std::stoi(argv[2]);
-  int shard_capacity = std::stoi(argv[3]);
+  int port = std::stoi(args[1]);
+  int dimensions = std::stoi(args[2]);
+  int shard_capacity = std::stoi(args[3]);
 
   std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
 
@@ -43,20 +95,78 @@ int main(int argc, char *argv[]) {
         grpc::CreateChannel(shard_address, grpc::InsecureChannelCredentials()));
   }
 
+  int compute_threads = absl::GetFlag(FLAGS_compute_threads);
+  if (compute_threads <= 0)
+    compute_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  absl::StatusOr<index_service::async::AsyncServerConfig> async_config =
+      index_service::async::make_async_server_config(
+          absl::GetFlag(FLAGS_num_cqs), absl::GetFlag(FLAGS_poller_cpus),
+          compute_threads, absl::GetFlag(FLAGS_compute_cpus),
+          absl::GetFlag(FLAGS_max_pending_calls));
+  if (!async_config.ok()) {
+    std::cout << async_config.status() << std::endl;
+    return 1;
+  }
+  async_config->search_admission.max_in_flight =
+      absl::GetFlag(FLAGS_max_in_flight_searches);
+  async_config->search_admission.max_queued =
+      absl::GetFlag(FLAGS_max_queued_searches);
+  async_config->search_admission.codel_target =
+      std::chrono::milliseconds(absl::GetFlag(FLAGS_codel_target_ms));
+  async_config->search_admission.codel_interval =
+      std::chrono::milliseconds(absl::GetFlag(FLAGS_codel_interval_ms));
+
+  admission::Limits limits;
+  limits.max_k = absl::GetFlag(FLAGS_max_k);
+
+  index_service::sharded::MonitorConfig monitor_config;
+  monitor_config.poll_interval =
+      std::chrono::milliseconds(absl::GetFlag(FLAGS_health_check_interval_ms));
+  monitor_config.poll_timeout =
+      std::chrono::milliseconds(absl::GetFlag(FLAGS_health_check_timeout_ms));
+
   ShardedIndexServiceImpl service(dimensions, shard_service_channels,
-                                  shard_capacity);
+                                  shard_capacity,
+                                  absl::GetFlag(FLAGS_cache_bytes), limits,
+                                  monitor_config);
+
+  if (absl::GetFlag(FLAGS_prebuilt_vectors) > 0) {
+    const grpc::Status status =
+        service.load_prebuilt_shards(absl::GetFlag(FLAGS_prebuilt_vectors));
+    if (!status.ok()) {
+      std::cout << "Failed to load prebuilt shards: "
+                << status.error_message() << std::endl;
+      return 1;
+    }
+  }
+
+  // Searches fan out to shards asynchronously instead of on a compute
+  // thread.
+  index_service::async::AsyncIndexServer async_server(
+      &service, *async_config,
+      [&service](grpc::ServerContext *context,
+                 const index_service::SearchRequest *search_request,
+                 index_service::SearchResponse *search_response,
+                 index_service::async::Done done) {
+        service.SearchAsync(context, search_request, search_response,
+                            std::move(done));
+      },
+      service.metrics());
 
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
+  async_server.register_with(&builder);
 
   std::unique_ptr<Server> server(builder.BuildAndStart());
+  async_server.start();
 
   LOG(INFO) << absl::StrFormat(
       "Index service with %d dimensions listening on %s ...", dimensions,
       server_address);
 
   server->Wait();
+  async_server.shutdown();
 
   return 0;
 }
@@ -0,0 +1,615 @@
+#include "src/cpp/sharded_index_service.h"
+
+#include <absl/strings/str_format.h>
+#include <grpcpp/channel.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/cpp/admission.h"
+#include "src/cpp/faiss_index_service.h"
+#include "src/cpp/test_server.h"
+#include "src/proto/index_service.pb.h"
+
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::AddShardRequest;
+using index_service::AddShardResponse;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::ExportRequest;
+using index_service::ExportResponse;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::RebalanceRequest;
+using index_service::RebalanceResponse;
+using index_service::RemoveRequest;
+using index_service::RemoveResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::UpsertRequest;
+using index_service::UpsertResponse;
+using index_service::faiss::FaissIndexServiceImpl;
+using index_service::sharded::MonitorConfig;
+using index_service::sharded::ShardedIndexServiceImpl;
+
+namespace {
+
+constexpr int kDimensions = 2;
+
+// Serves a single-node index on a local port.
+class TestShard {
+public:
+  explicit TestShard(const admission::Limits &limits = {})
+      : m_service_(kDimensions, "IDMap,Flat",
+                   faiss::MetricType::METRIC_INNER_PRODUCT, {}, std::nullopt,
+                   limits),
+        m_server_(&m_service_) {}
+
+  const std::string &address() const { return m_server_.address(); }
+
+  std::shared_ptr<grpc::Channel> channel() const {
+    return m_server_.channel();
+  }
+
+  // The shard's own service, to write to and inspect it without the router.
+  FaissIndexServiceImpl *service() { return &m_service_; }
+
+  int num_vectors() {
+    DescribeRequest request;
+    DescribeResponse response;
+    m_service_.Describe(nullptr, &request, &response);
+    return response.num_vectors();
+  }
+
+private:
+  FaissIndexServiceImpl m_service_;
+  test_server::LocalServer m_server_;
+};
+
+// Serves a single-node index whose exports wait until `open_exports` is
+// called, and whose removes fail while `fail_removes` is set, so tests can
+// write while a rebalance copies from it or make it fail to remove vectors.
+class GatedShard final : public index_service::IndexService::Service {
+public:
+  GatedShard() : m_service_(kDimensions), m_server_(this) {}
+
+  ~GatedShard() {
+    open_exports();
+    m_server_.shutdown();
+  }
+
+  std::shared_ptr<grpc::Channel> channel() const {
+    return m_server_.channel();
+  }
+
+  void open_exports() {
+    {
+      const std::lock_guard<std::mutex> _(m_mutex_);
+      m_exports_open_ = true;
+    }
+    m_cv_.notify_all();
+  }
+
+  int num_exports() const { return m_num_exports_; }
+
+  void fail_removes(bool fail) { m_fail_removes_ = fail; }
+
+  int num_vectors() {
+    DescribeRequest request;
+    DescribeResponse response;
+    m_service_.Describe(nullptr, &request, &response);
+    return response.num_vectors();
+  }
+
+  Status Describe(grpc::ServerContext *context,
+                  const DescribeRequest *describe_request,
+                  DescribeResponse *describe_response) {
+    return m_service_.Describe(context, describe_request, describe_response);
+  }
+
+  Status Insert(grpc::ServerContext *context,
+                const InsertRequest *insert_request,
+                InsertResponse *insert_response) {
+    return m_service_.Insert(context, insert_request, insert_response);
+  }
+
+  Status Upsert(grpc::ServerContext *context,
+                const UpsertRequest *upsert_request,
+                UpsertResponse *upsert_response) {
+    return m_service_.Upsert(context, upsert_request, upsert_response);
+  }
+
+  Status Search(grpc::ServerContext *context,
+                const SearchRequest *search_request,
+                SearchResponse *search_response) {
+    return m_service_.Search(context, search_request, search_response);
+  }
+
+  Status Export(grpc::ServerContext *context,
+                const ExportRequest *export_request,
+                grpc::ServerWriter<ExportResponse> *writer) {
+    m_num_exports_++;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex_);
+      m_cv_.wait(lock, [this] { return m_exports_open_; });
+    }
+    return m_service_.Export(context, export_request, writer);
+  }
+
+  Status Remove(grpc::ServerContext *context,
+                const RemoveRequest *remove_request,
+                RemoveResponse *remove_response) {
+    if (m_fail_removes_)
+      return Status(StatusCode::INTERNAL, "Failing removes.");
+    return m_service_.Remove(context, remove_request, remove_response);
+  }
+
+private:
+  FaissIndexServiceImpl m_service_;
+
+  std::mutex m_mutex_;
+  std::condition_variable m_cv_;
+  bool m_exports_open_ = false;
+
+  std::atomic<int> m_num_exports_{0};
+  std::atomic<bool> m_fail_removes_{false};
+
+  // Note: Declared last, so the shard only serves once every other member is
+  // constructed.
+  test_server::LocalServer m_server_;
+};
+
+// Polls shards only once, when the router starts.
+MonitorConfig make_monitor_config() {
+  MonitorConfig config;
+  config.poll_interval = std::chrono::hours(1);
+  return config;
+}
+
+std::unique_ptr<ShardedIndexServiceImpl>
+make_router(const std::vector<std::shared_ptr<grpc::Channel>> &channels,
+            int shard_capacity) {
+  return std::make_unique<ShardedIndexServiceImpl>(
+      kDimensions, channels, shard_capacity, /*query_cache_bytes=*/0,
+      admission::Limits(), make_monitor_config());
+}
+
+InsertRequest make_insert(std::initializer_list<int> ids) {
+  InsertRequest request;
+  for (int id : ids) {
+    auto *vector = request.add_vectors();
+    vector->set_id(id);
+    vector->add_raw(id);
+    vector->add_raw(0);
+  }
+  return request;
+}
+
+// Inserts vectors with `ids`, each with the values `{id, 0}`.
+Status insert(ShardedIndexServiceImpl *router, std::initializer_list<int> ids) {
+  const InsertRequest request = make_insert(ids);
+  InsertResponse response;
+  return router->Insert(nullptr, &request, &response);
+}
+
+SearchRequest make_search(int k, std::initializer_list<float> query) {
+  SearchRequest request;
+  request.set_k(k);
+  for (float value : query)
+    request.add_query_vector(value);
+  return request;
+}
+
+DescribeResponse describe(ShardedIndexServiceImpl *router) {
+  DescribeRequest request;
+  DescribeResponse response;
+  EXPECT_TRUE(router->Describe(nullptr, &request, &response).ok());
+  return response;
+}
+
+// Returns whether the router's view has the shard at `shard_idx` as healthy.
+bool healthy(ShardedIndexServiceImpl *router, int shard_idx) {
+  return describe(router).metrics().at(
+             absl::StrFormat("shard_%d_healthy", shard_idx)) == 1;
+}
+
+// Upserts the vector with `id` with the values `{value, 0}`.
+Status upsert(ShardedIndexServiceImpl *router, int id, float value) {
+  UpsertRequest request;
+  auto *vector = request.add_vectors();
+  vector->set_id(id);
+  vector->add_raw(value);
+  vector->add_raw(0);
+  UpsertResponse response;
+  return router->Upsert(nullptr, &request, &response);
+}
+
+Status remove(ShardedIndexServiceImpl *router, int id) {
+  RemoveRequest request;
+  request.add_ids(id);
+  RemoveResponse response;
+  return router->Remove(nullptr, &request, &response);
+}
+
+std::vector<int> search_ids(ShardedIndexServiceImpl *router, int k,
+                            std::initializer_list<float> query) {
+  const SearchRequest request = make_search(k, query);
+  SearchResponse response;
+  EXPECT_TRUE(router->Search(nullptr, &request, &response).ok());
+  std::vector<int> ids;
+  for (const auto &neighbor : response.neighbors())
+    ids.push_back(neighbor.id());
+  return ids;
+}
+
+Status add_shard(ShardedIndexServiceImpl *router, const TestShard &shard,
+                 int *shard_idx) {
+  AddShardRequest request;
+  request.set_address(shard.address());
+  AddShardResponse response;
+  Status status = router->AddShard(nullptr, &request, &response);
+  *shard_idx = response.shard_idx();
+  return status;
+}
+
+// Waits for the rebalance in progress to complete. A new rebalance is only
+// accepted once the last one completed, and has nothing left to move then.
+void wait_for_rebalance(ShardedIndexServiceImpl *router) {
+  while (true) {
+    RebalanceRequest request;
+    RebalanceResponse response;
+    Status status = router->Rebalance(nullptr, &request, &response);
+    if (status.error_code() != StatusCode::FAILED_PRECONDITION) {
+      ASSERT_TRUE(status.ok());
+      EXPECT_EQ(response.num_vectors_to_move(), 0);
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+} // namespace
+
+TEST(ShardedIndexServiceTest, RejectsQueriesWithWrongDimensions) {
+  TestShard first;
+  TestShard second;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel(), second.channel()}, 2);
+  ASSERT_TRUE(insert(router.get(), {1, 2, 3}).ok());
+
+  const SearchRequest search_request = make_search(1, {1, 0, 0});
+  SearchResponse search_response;
+  EXPECT_EQ(router->Search(nullptr, &search_request, &search_response)
+                .error_code(),
+            StatusCode::INVALID_ARGUMENT);
+
+  std::promise<Status> status;
+  router->SearchAsync(nullptr, &search_request, &search_response,
+                      [&status](Status s) { status.set_value(s); });
+  EXPECT_EQ(status.get_future().get().error_code(),
+            StatusCode::INVALID_ARGUMENT);
+
+  // Neither shard was called, so both are still healthy.
+  EXPECT_TRUE(healthy(router.get(), 0));
+  EXPECT_TRUE(healthy(router.get(), 1));
+}
+
+TEST(ShardedIndexServiceTest, ShardErrorsDontMarkShardsUnhealthy) {
+  // The first shard only has room for one vector, so it rejects the second
+  // insert with `RESOURCE_EXHAUSTED` even though the router has room for it.
+  admission::Limits limits;
+  limits.memory_budget_bytes = admission::estimated_vector_bytes(kDimensions);
+  TestShard first(limits);
+  TestShard second;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel(), second.channel()}, 2);
+  ASSERT_TRUE(insert(router.get(), {1}).ok());
+
+  EXPECT_EQ(insert(router.get(), {2}).error_code(),
+            StatusCode::RESOURCE_EXHAUSTED);
+
+  EXPECT_TRUE(healthy(router.get(), 0));
+  const SearchRequest search_request = make_search(1, {1, 0});
+  SearchResponse search_response;
+  ASSERT_TRUE(router->Search(nullptr, &search_request, &search_response).ok());
+  EXPECT_FALSE(search_response.partial());
+  EXPECT_EQ(search_response.neighbors(0).id(), 1);
+}
+
+TEST(ShardedIndexServiceTest, DescribesUnhealthyShards) {
+  TestShard first;
+  auto second = std::make_unique<TestShard>();
+  const std::shared_ptr<grpc::Channel> second_channel = second->channel();
+  second.reset();
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel(), second_channel}, 2);
+
+  // The view is described even though the second shard is down.
+  const DescribeResponse response = describe(router.get());
+  EXPECT_EQ(response.metrics().at("shard_0_healthy"), 1);
+  EXPECT_EQ(response.metrics().at("shard_0_consecutive_failures"), 0);
+  EXPECT_EQ(response.metrics().at("shard_0_connectivity"), GRPC_CHANNEL_READY);
+  EXPECT_EQ(response.metrics().at("shard_1_healthy"), 0);
+  EXPECT_EQ(response.metrics().at("shard_1_consecutive_failures"), 1);
+  EXPECT_NE(response.metrics().at("shard_1_connectivity"), GRPC_CHANNEL_READY);
+}
+
+TEST(ShardedIndexServiceTest, RejectsRequestsForCollections) {
+  TestShard shard;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({shard.channel()}, 10);
+  ASSERT_TRUE(insert(router.get(), {1}).ok());
+
+  InsertRequest insert_request;
+  insert_request.set_collection("other");
+  auto *vector = insert_request.add_vectors();
+  vector->set_id(2);
+  vector->add_raw(2);
+  vector->add_raw(0);
+  InsertResponse insert_response;
+  EXPECT_EQ(router->Insert(nullptr, &insert_request, &insert_response)
+                .error_code(),
+            StatusCode::UNIMPLEMENTED);
+
+  UpsertRequest upsert_request;
+  upsert_request.set_collection("other");
+  upsert_request.mutable_vectors()->CopyFrom(insert_request.vectors());
+  UpsertResponse upsert_response;
+  EXPECT_EQ(router->Upsert(nullptr, &upsert_request, &upsert_response)
+                .error_code(),
+            StatusCode::UNIMPLEMENTED);
+
+  RemoveRequest remove_request;
+  remove_request.set_collection("other");
+  remove_request.add_ids(1);
+  RemoveResponse remove_response;
+  EXPECT_EQ(router->Remove(nullptr, &remove_request, &remove_response)
+                .error_code(),
+            StatusCode::UNIMPLEMENTED);
+
+  SearchRequest search_request = make_search(2, {1, 0});
+  search_request.set_collection("other");
+  SearchResponse search_response;
+  EXPECT_EQ(router->Search(nullptr, &search_request, &search_response)
+                .error_code(),
+            StatusCode::UNIMPLEMENTED);
+
+  DescribeRequest describe_request;
+  describe_request.set_collection("other");
+  DescribeResponse describe_response;
+  EXPECT_EQ(router->Describe(nullptr, &describe_request, &describe_response)
+                .error_code(),
+            StatusCode::UNIMPLEMENTED);
+
+  // Nothing was written to the default collection.
+  search_request.clear_collection();
+  ASSERT_TRUE(router->Search(nullptr, &search_request, &search_response).ok());
+  ASSERT_EQ(search_response.neighbors_size(), 2);
+  EXPECT_EQ(search_response.neighbors(0).id(), 1);
+  EXPECT_EQ(search_response.neighbors(1).id(), -1);
+}
+
+TEST(ShardedIndexServiceTest, AddShardOnlyAcceptsEmptyShards) {
+  TestShard first;
+  TestShard second;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel()}, 2);
+  ASSERT_TRUE(insert(router.get(), {1, 2}).ok());
+
+  // The first shard is full, and a shard that already holds vectors can't be
+  // added since the router doesn't know which.
+  int shard_idx;
+  EXPECT_EQ(add_shard(router.get(), first, &shard_idx).error_code(),
+            StatusCode::FAILED_PRECONDITION);
+  EXPECT_EQ(insert(router.get(), {3}).error_code(),
+            StatusCode::RESOURCE_EXHAUSTED);
+
+  ASSERT_TRUE(add_shard(router.get(), second, &shard_idx).ok());
+  EXPECT_EQ(shard_idx, 1);
+
+  ASSERT_TRUE(insert(router.get(), {3}).ok());
+  EXPECT_EQ(first.num_vectors(), 2);
+  EXPECT_EQ(second.num_vectors(), 1);
+  EXPECT_EQ(search_ids(router.get(), 3, {1, 0}),
+            (std::vector<int>{3, 2, 1}));
+}
+
+TEST(ShardedIndexServiceTest, RebalanceMovesVectorsToNewShards) {
+  TestShard first;
+  TestShard second;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel()}, 10);
+  ASSERT_TRUE(insert(router.get(), {1, 2, 3, 4, 5, 6}).ok());
+  int shard_idx;
+  ASSERT_TRUE(add_shard(router.get(), second, &shard_idx).ok());
+
+  RebalanceRequest rebalance_request;
+  rebalance_request.set_range_size(2);
+  RebalanceResponse rebalance_response;
+  ASSERT_TRUE(
+      router->Rebalance(nullptr, &rebalance_request, &rebalance_response)
+          .ok());
+  EXPECT_EQ(rebalance_response.num_vectors_to_move(), 3);
+  wait_for_rebalance(router.get());
+
+  // The smallest ids were moved, and each vector is stored once.
+  EXPECT_EQ(first.num_vectors(), 3);
+  EXPECT_EQ(second.num_vectors(), 3);
+  EXPECT_EQ(search_ids(router.get(), 6, {1, 0}),
+            (std::vector<int>{6, 5, 4, 3, 2, 1}));
+
+  // Writes to moved vectors are routed to the shard they were moved to.
+  UpsertRequest upsert_request;
+  auto *vector = upsert_request.add_vectors();
+  vector->set_id(1);
+  vector->add_raw(100);
+  vector->add_raw(0);
+  UpsertResponse upsert_response;
+  ASSERT_TRUE(router->Upsert(nullptr, &upsert_request, &upsert_response).ok());
+
+  RemoveRequest remove_request;
+  remove_request.add_ids(2);
+  RemoveResponse remove_response;
+  ASSERT_TRUE(router->Remove(nullptr, &remove_request, &remove_response).ok());
+
+  EXPECT_EQ(first.num_vectors(), 3);
+  EXPECT_EQ(second.num_vectors(), 2);
+  EXPECT_EQ(search_ids(router.get(), 5, {1, 0}),
+            (std::vector<int>{1, 6, 5, 4, 3}));
+}
+
+TEST(ShardedIndexServiceTest, KeepsOneCopyOfVectorsBeingMoved) {
+  TestShard first;
+  TestShard second;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel(), second.channel()}, 2);
+  ASSERT_TRUE(insert(router.get(), {1, 2, 3}).ok());
+
+  // Copy vector 2 to the second shard, as a rebalance does before removing
+  // it from the first one.
+  const InsertRequest insert_request = make_insert({2});
+  InsertResponse insert_response;
+  ASSERT_TRUE(
+      second.service()->Insert(nullptr, &insert_request, &insert_response)
+          .ok());
+
+  EXPECT_EQ(search_ids(router.get(), 3, {1, 0}),
+            (std::vector<int>{3, 2, 1}));
+
+  test_server::LocalServer server(router.get());
+  std::unique_ptr<index_service::IndexService::Stub> stub = server.stub();
+
+  grpc::ClientContext context;
+  std::unique_ptr<grpc::ClientReader<ExportResponse>> reader =
+      stub->Export(&context, ExportRequest());
+  std::vector<int> exported_ids;
+  ExportResponse export_response;
+  while (reader->Read(&export_response)) {
+    for (const auto &vector : export_response.vectors())
+      exported_ids.push_back(vector.id());
+  }
+  ASSERT_TRUE(reader->Finish().ok());
+  EXPECT_EQ(exported_ids, (std::vector<int>{1, 2, 3}));
+}
+
+TEST(ShardedIndexServiceTest, DestroyingStopsThrottledRebalance) {
+  TestShard first;
+  TestShard second;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel()}, 10);
+  ASSERT_TRUE(insert(router.get(), {1, 2, 3, 4, 5, 6}).ok());
+  int shard_idx;
+  ASSERT_TRUE(add_shard(router.get(), second, &shard_idx).ok());
+
+  // Moving one vector a second leaves the rebalance throttled for seconds
+  // after the first move.
+  RebalanceRequest rebalance_request;
+  rebalance_request.set_max_vectors_per_second(1);
+  rebalance_request.set_range_size(1);
+  RebalanceResponse rebalance_response;
+  ASSERT_TRUE(
+      router->Rebalance(nullptr, &rebalance_request, &rebalance_response)
+          .ok());
+  while (first.num_vectors() == 6)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  const auto start = std::chrono::steady_clock::now();
+  router.reset();
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(500));
+
+  EXPECT_EQ(first.num_vectors(), 5);
+  EXPECT_EQ(second.num_vectors(), 1);
+}
+
+TEST(ShardedIndexServiceTest, WritesArentBlockedWhileARangeIsCopied) {
+  GatedShard first;
+  TestShard second;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel()}, 10);
+  ASSERT_TRUE(insert(router.get(), {1, 2, 3, 4, 5, 6}).ok());
+  int shard_idx;
+  ASSERT_TRUE(add_shard(router.get(), second, &shard_idx).ok());
+
+  RebalanceRequest rebalance_request;
+  rebalance_request.set_range_size(3);
+  RebalanceResponse rebalance_response;
+  ASSERT_TRUE(
+      router->Rebalance(nullptr, &rebalance_request, &rebalance_response)
+          .ok());
+  while (first.num_exports() == 0)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+  // The range of ids 1-3 is being copied, but can still be written to.
+  ASSERT_TRUE(upsert(router.get(), 1, 100).ok());
+  ASSERT_TRUE(remove(router.get(), 2).ok());
+  ASSERT_TRUE(upsert(router.get(), 2, 50).ok());
+  first.open_exports();
+  wait_for_rebalance(router.get());
+
+  // The writes were copied along with the range.
+  EXPECT_EQ(first.num_vectors(), 3);
+  EXPECT_EQ(second.num_vectors(), 3);
+  EXPECT_EQ(search_ids(router.get(), 6, {1, 0}),
+            (std::vector<int>{1, 2, 6, 5, 4, 3}));
+
+  const SearchRequest search_request = make_search(2, {1, 0});
+  SearchResponse search_response;
+  ASSERT_TRUE(second.service()
+                  ->Search(nullptr, &search_request, &search_response)
+                  .ok());
+  EXPECT_EQ(search_response.neighbors(0).id(), 1);
+  EXPECT_EQ(search_response.neighbors(1).id(), 2);
+}
+
+TEST(ShardedIndexServiceTest, DoesntServeMovedVectorsThatFailedToBeRemoved) {
+  GatedShard first;
+  first.open_exports();
+  first.fail_removes(true);
+  TestShard second;
+  std::unique_ptr<ShardedIndexServiceImpl> router =
+      make_router({first.channel()}, 10);
+  ASSERT_TRUE(insert(router.get(), {1, 2, 3, 4, 5, 6}).ok());
+  int shard_idx;
+  ASSERT_TRUE(add_shard(router.get(), second, &shard_idx).ok());
+
+  RebalanceRequest rebalance_request;
+  RebalanceResponse rebalance_response;
+  ASSERT_TRUE(
+      router->Rebalance(nullptr, &rebalance_request, &rebalance_response)
+          .ok());
+  wait_for_rebalance(router.get());
+  EXPECT_EQ(first.num_vectors(), 6);
+  EXPECT_EQ(second.num_vectors(), 3);
+  EXPECT_EQ(router->metrics()->snapshot()["rebalance_pending_removes"], 3);
+
+  // The stale copy of vector 1 left in the first shard would be the nearest
+  // neighbor, but only the copy in the shard it was moved to is served.
+  ASSERT_TRUE(upsert(router.get(), 1, 100).ok());
+  EXPECT_EQ(search_ids(router.get(), 6, {-1, 0}),
+            (std::vector<int>{2, 3, 4, 5, 6, 1}));
+
+  // A removed vector can't be inserted again while a shard has a stale copy
+  // of it, which the shard would keep instead.
+  ASSERT_TRUE(remove(router.get(), 2).ok());
+  EXPECT_EQ(insert(router.get(), {2}).error_code(), StatusCode::UNAVAILABLE);
+
+  // The next write removes the stale copies.
+  first.fail_removes(false);
+  ASSERT_TRUE(insert(router.get(), {2}).ok());
+  EXPECT_EQ(first.num_vectors(), 4);
+  EXPECT_EQ(second.num_vectors(), 2);
+  EXPECT_EQ(router->metrics()->snapshot()["rebalance_pending_removes"], 0);
+  EXPECT_EQ(search_ids(router.get(), 6, {-1, 0}),
+            (std::vector<int>{2, 3, 4, 5, 6, 1}));
+}
@@ -0,0 +1,49 @@
+#include "src/cpp/snapshot.h"
+
+#include <faiss/Index.h>
+#include <faiss/index_io.h>
+
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_format.h"
+
+namespace snapshot {
+
+absl::Status write(const ::faiss::Index &index, const std::string &path) {
+  const std::string temp_path = path + ".tmp";
+  try {
+    ::faiss::write_index(&index, temp_path.c_str());
+  } catch (const std::exception &e) {
+    std::remove(temp_path.c_str());
+    return absl::InternalError(
+        absl::StrFormat("Failed to write %s: %s", temp_path, e.what()));
+  }
+
+  if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+    return absl::InternalError(
+        absl::StrFormat("Failed to rename %s to %s.", temp_path, path));
+  }
+
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::unique_ptr<::faiss::Index>> read(const std::string &path) {
+  try {
+    return std::unique_ptr<::faiss::Index>(::faiss::read_index(path.c_str()));
+  } catch (const std::exception &e) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("Failed to read %s: %s", path, e.what()));
+  }
+}
+
+std::string shard_path(const std::string &path, int shard_idx) {
+  return absl::StrFormat("%s.shard%d", path, shard_idx);
+}
+
+} // namespace snapshot
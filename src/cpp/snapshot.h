@@ -0,0 +1,25 @@
+#pragma once
+
+#include <faiss/Index.h>
+
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+
+namespace snapshot {
+
+// Writes `index` to `path` in `faiss`'s own format. The index is written to
+// a temporary file next to `path` first and then renamed over it, so a
+// service starting from `path` never reads a partially written snapshot.
+absl::Status write(const ::faiss::Index &index, const std::string &path);
+
+// Reads an index written by `write`.
+absl::StatusOr<std::unique_ptr<::faiss::Index>> read(const std::string &path);
+
+// The path of shard `shard_idx` of a snapshot split into shards, e.g.
+// `index.faiss.shard2`.
+std::string shard_path(const std::string &path, int shard_idx);
+
+} // namespace snapshot
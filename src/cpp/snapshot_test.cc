@@ -0,0 +1,96 @@
+#include "src/cpp/snapshot.h"
+
+#include <faiss/Index.h>
+#include <faiss/MetricType.h>
+#include <faiss/index_factory.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/cpp/faiss_index_service.h"
+#include "src/proto/index_service.pb.h"
+
+using faiss::idx_t;
+using faiss::MetricType;
+using grpc::StatusCode;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::faiss::FaissIndexServiceImpl;
+
+namespace {
+
+// Builds a 2-dimensional `IDMap,Flat` index of the vectors (id, 0) with ids
+// in `ids`.
+std::unique_ptr<faiss::Index> make_index(const std::vector<idx_t> &ids) {
+  std::unique_ptr<faiss::Index> index(
+      faiss::index_factory(2, "IDMap,Flat", MetricType::METRIC_INNER_PRODUCT));
+  std::vector<float> raw;
+  for (idx_t id : ids)
+    raw.insert(raw.end(), {(float)id, 0});
+  index->add_with_ids(ids.size(), raw.data(), ids.data());
+  return index;
+}
+
+} // namespace
+
+TEST(SnapshotTest, WritesAndReadsIndex) {
+  const std::string path = testing::TempDir() + "snapshot_test.faiss";
+  ASSERT_TRUE(snapshot::write(*make_index({1, 2, 3}), path).ok());
+
+  absl::StatusOr<std::unique_ptr<faiss::Index>> index = snapshot::read(path);
+  ASSERT_TRUE(index.ok()) << index.status();
+  EXPECT_EQ((*index)->d, 2);
+  EXPECT_EQ((*index)->ntotal, 3);
+
+  EXPECT_FALSE(snapshot::read(path + ".missing").ok());
+}
+
+TEST(SnapshotTest, ServesRestoredIndex) {
+  FaissIndexServiceImpl service(2);
+  ASSERT_TRUE(service.restore(make_index({1, 2, 3})).ok());
+
+  DescribeRequest describe_request;
+  DescribeResponse describe_response;
+  ASSERT_TRUE(
+      service.Describe(nullptr, &describe_request, &describe_response).ok());
+  EXPECT_EQ(describe_response.num_vectors(), 3);
+
+  SearchRequest search_request;
+  search_request.set_k(1);
+  search_request.add_query_vector(1);
+  search_request.add_query_vector(0);
+  SearchResponse search_response;
+  ASSERT_TRUE(service.Search(nullptr, &search_request, &search_response).ok());
+  ASSERT_EQ(search_response.neighbors_size(), 1);
+  EXPECT_EQ(search_response.neighbors(0).id(), 3);
+
+  // Restored ids are known, so inserting them again is a no-op.
+  InsertRequest insert_request;
+  auto *vector = insert_request.add_vectors();
+  vector->set_id(3);
+  vector->add_raw(0);
+  vector->add_raw(1);
+  InsertResponse insert_response;
+  ASSERT_TRUE(service.Insert(nullptr, &insert_request, &insert_response).ok());
+  ASSERT_TRUE(
+      service.Describe(nullptr, &describe_request, &describe_response).ok());
+  EXPECT_EQ(describe_response.num_vectors(), 3);
+}
+
+TEST(SnapshotTest, RejectsMismatchedSnapshots) {
+  FaissIndexServiceImpl other_dimensions(3);
+  EXPECT_EQ(other_dimensions.restore(make_index({1})).error_code(),
+            StatusCode::INVALID_ARGUMENT);
+
+  FaissIndexServiceImpl not_empty(2);
+  ASSERT_TRUE(not_empty.restore(make_index({1})).ok());
+  EXPECT_EQ(not_empty.restore(make_index({2})).error_code(),
+            StatusCode::FAILED_PRECONDITION);
+}
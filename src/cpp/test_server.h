@@ -0,0 +1,76 @@
+/* This is a header-only library for tests that serve gRPC services on a free
+ * local port and call them through real channels.
+ */
+#pragma once
+
+#include <grpcpp/channel.h>
+#include <grpcpp/create_channel.h>
+#include <grpcpp/security/credentials.h>
+#include <grpcpp/security/server_credentials.h>
+#include <grpcpp/server.h>
+#include <grpcpp/server_builder.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "src/proto/index_service.grpc.pb.h"
+
+namespace test_server {
+
+// Serves on a port of `localhost` picked by the OS, until shut down or
+// destroyed.
+class LocalServer {
+public:
+  // Serves `service`, which must outlive the server.
+  explicit LocalServer(grpc::Service *service)
+      : LocalServer([service](grpc::ServerBuilder *builder) {
+          builder->RegisterService(service);
+        }) {}
+
+  // Calls `configure` to register services with the builder, e.g. async
+  // services, before the server starts.
+  explicit LocalServer(
+      const std::function<void(grpc::ServerBuilder *)> &configure) {
+    grpc::ServerBuilder builder;
+    int port;
+    builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(),
+                             &port);
+    configure(&builder);
+    m_server_ = builder.BuildAndStart();
+    m_address_ = "localhost:" + std::to_string(port);
+  }
+
+  LocalServer(const LocalServer &) = delete;
+  LocalServer &operator=(const LocalServer &) = delete;
+
+  ~LocalServer() { shutdown(); }
+
+  // Stops serving, e.g. to test how clients handle a server that's down.
+  // Does nothing if the server was already shut down.
+  void shutdown() {
+    if (m_server_)
+      m_server_->Shutdown();
+    m_server_.reset();
+  }
+
+  const std::string &address() const { return m_address_; }
+
+  // Returns a new channel to the server.
+  std::shared_ptr<grpc::Channel> channel() const {
+    return grpc::CreateChannel(m_address_, grpc::InsecureChannelCredentials());
+  }
+
+  // Returns a new stub calling the server's `IndexService` over a new
+  // channel.
+  std::unique_ptr<index_service::IndexService::Stub> stub() const {
+    return index_service::IndexService::NewStub(channel());
+  }
+
+private:
+  std::unique_ptr<grpc::Server> m_server_;
+
+  std::string m_address_;
+};
+
+} // namespace test_server
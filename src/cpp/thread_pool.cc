@@ -0,0 +1,172 @@
+#include "src/cpp/thread_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+
+namespace executor {
+
+absl::StatusOr<std::vector<int>> parse_cpu_list(const std::string &cpu_list) {
+  std::vector<int> cpus;
+  for (absl::string_view range :
+       absl::StrSplit(cpu_list, ',', absl::SkipWhitespace())) {
+    std::pair<absl::string_view, absl::string_view> bounds =
+        absl::StrSplit(range, absl::MaxSplits('-', 1));
+
+    int first, last;
+    if (!absl::SimpleAtoi(bounds.first, &first))
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Could not parse CPU list. cpu_list=%s", cpu_list));
+
+    last = first;
+    if (!bounds.second.empty() && !absl::SimpleAtoi(bounds.second, &last))
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Could not parse CPU list. cpu_list=%s", cpu_list));
+
+    if (first < 0 || last < first)
+      return absl::InvalidArgumentError(
+          absl::StrFormat("Found invalid CPU range. cpu_list=%s", cpu_list));
+
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+
+  return cpus;
+}
+
+bool pin_current_thread(const std::vector<int> &cpus) {
+  if (cpus.empty())
+    return false;
+
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &cpu_set);
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) ==
+         0;
+}
+
+ThreadPool::ThreadPool(const std::vector<std::vector<int>> &worker_cpus)
+    : m_stopping_(false) {
+  std::map<std::vector<int>, int> groups;
+  for (const std::vector<int> &cpus : worker_cpus) {
+    m_workers_.push_back(std::make_unique<Worker>());
+    m_workers_.back()->cpus = cpus;
+    m_workers_.back()->group =
+        groups.emplace(cpus, groups.size()).first->second;
+  }
+  m_num_queued_.resize(groups.size());
+
+  // Note: Start workers only once all of them exist, since any worker may
+  // steal from any other.
+  for (int i = 0; i < m_workers_.size(); i++)
+    m_workers_[i]->thread = std::thread(&ThreadPool::run, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    m_stopping_ = true;
+  }
+  m_cv_.notify_all();
+
+  for (auto &worker : m_workers_)
+    worker->thread.join();
+}
+
+void ThreadPool::submit(int worker_idx, std::function<void()> task) {
+  Worker &worker = *m_workers_.at(worker_idx);
+  {
+    const std::lock_guard<std::mutex> _(worker.mutex);
+    worker.tasks.push_back(std::move(task));
+  }
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    m_num_queued_[worker.group]++;
+  }
+
+  // Wake up every idle worker, since the owner may be busy and any worker in
+  // its group can steal the task.
+  m_cv_.notify_all();
+}
+
+bool ThreadPool::try_pop(int worker_idx, std::function<void()> *task) {
+  // The owner takes the oldest task from its own queue.
+  {
+    Worker &worker = *m_workers_[worker_idx];
+    const std::lock_guard<std::mutex> _(worker.mutex);
+    if (!worker.tasks.empty()) {
+      *task = std::move(worker.tasks.front());
+      worker.tasks.pop_front();
+      return true;
+    }
+  }
+
+  // Thieves take the newest task from another queue, which keeps them away
+  // from the end the owner is working on.
+  const int group = m_workers_[worker_idx]->group;
+  for (int i = 1; i < m_workers_.size(); i++) {
+    Worker &victim = *m_workers_[(worker_idx + i) % m_workers_.size()];
+    if (victim.group != group)
+      continue;
+
+    const std::lock_guard<std::mutex> _(victim.mutex);
+    if (!victim.tasks.empty()) {
+      *task = std::move(victim.tasks.back());
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::run(int worker_idx) {
+  const std::vector<int> &cpus = m_workers_[worker_idx]->cpus;
+  const int group = m_workers_[worker_idx]->group;
+  if (!cpus.empty() && !pin_current_thread(cpus))
+    LOG(WARNING) << absl::StrFormat("Failed to pin worker %d to its CPUs.",
+                                    worker_idx);
+
+  std::function<void()> task;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex_);
+      m_cv_.wait(lock, [this, group] {
+        return m_num_queued_[group] > 0 || m_stopping_;
+      });
+
+      if (!m_num_queued_[group] && m_stopping_)
+        return;
+    }
+
+    if (!try_pop(worker_idx, &task))
+      // Another worker got to the task first.
+      continue;
+
+    {
+      const std::lock_guard<std::mutex> _(m_mutex_);
+      m_num_queued_[group]--;
+    }
+
+    task();
+    task = nullptr;
+  }
+}
+
+} // namespace executor
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/status/statusor.h"
+
+namespace executor {
+
+// Parses a Linux-style CPU list, e.g. "0-3,8,10-11", into the CPU ids it
+// names.
+absl::StatusOr<std::vector<int>> parse_cpu_list(const std::string &cpu_list);
+
+// Pins the calling thread to the given CPUs. Returns false if pinning failed
+// or `cpus` is empty.
+bool pin_current_thread(const std::vector<int> &cpus);
+
+// A fixed-size thread pool where each worker has its own task queue.
+//
+// Tasks are submitted to a specific worker, so related work (e.g. all work
+// for one index shard) can be kept on the same, optionally pinned, worker
+// and the memory it touches. Workers run their own tasks in FIFO order and
+// steal from the back of other workers' queues when they run out, so a busy
+// worker doesn't leave others idle. Workers only steal from workers pinned to
+// the same CPUs, so a task never runs on other CPUs than the worker it was
+// submitted to, and the memory it allocates stays on the same NUMA node.
+class ThreadPool {
+public:
+  // Starts one worker per entry of `worker_cpus`, pinning each worker to the
+  // CPUs in its entry. Workers with an empty entry aren't pinned.
+  explicit ThreadPool(const std::vector<std::vector<int>> &worker_cpus);
+
+  // Note: Deleting the copy constructor and assignment operator makes this
+  // class non-copyable, since it owns threads.
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Runs all queued tasks and then joins the workers.
+  ~ThreadPool();
+
+  // Queues `task` on the worker at `worker_idx`.
+  void submit(int worker_idx, std::function<void()> task);
+
+  int size() const { return m_workers_.size(); }
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    std::vector<int> cpus;
+
+    // Workers pinned to the same CPUs, or all unpinned workers, have the
+    // same group and steal from each other.
+    int group = 0;
+    std::thread thread;
+  };
+
+  void run(int worker_idx);
+
+  // Pops the next task for `worker_idx`, first from its own queue and then
+  // from the queues of other workers in its group. Returns false if all of
+  // them are empty.
+  bool try_pop(int worker_idx, std::function<void()> *task);
+
+  std::vector<std::unique_ptr<Worker>> m_workers_;
+
+  // Guards `m_num_queued_` and `m_stopping_`, and is used with `m_cv_` to
+  // put idle workers to sleep.
+  std::mutex m_mutex_;
+  std::condition_variable m_cv_;
+
+  // The number of tasks queued across the workers of each group.
+  std::vector<int> m_num_queued_;
+
+  bool m_stopping_;
+};
+
+} // namespace executor
@@ -0,0 +1,88 @@
+#include "src/cpp/thread_pool.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <vector>
+
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/notification.h"
+
+using executor::parse_cpu_list;
+using executor::ThreadPool;
+
+using testing::ElementsAre;
+using testing::IsEmpty;
+
+TEST(ParseCpuListTest, RangesAndSingles) {
+  auto cpus = parse_cpu_list("0-2,5, 7-8");
+  ASSERT_TRUE(cpus.ok());
+  EXPECT_THAT(*cpus, ElementsAre(0, 1, 2, 5, 7, 8));
+}
+
+TEST(ParseCpuListTest, Empty) {
+  auto cpus = parse_cpu_list("");
+  ASSERT_TRUE(cpus.ok());
+  EXPECT_THAT(*cpus, IsEmpty());
+}
+
+TEST(ParseCpuListTest, Invalid) {
+  EXPECT_FALSE(parse_cpu_list("a-b").ok());
+  EXPECT_FALSE(parse_cpu_list("3-1").ok());
+}
+
+TEST(ThreadPoolTest, RunsAllTasks) {
+  ThreadPool pool({{}, {}, {}});
+  std::atomic<int> sum{0};
+  absl::BlockingCounter pending(100);
+
+  for (int i = 0; i < 100; i++) {
+    pool.submit(i % pool.size(), [&, i]() {
+      sum += i;
+      pending.DecrementCount();
+    });
+  }
+
+  pending.Wait();
+  EXPECT_EQ(sum, 4950);
+}
+
+TEST(ThreadPoolTest, IdleWorkersSteal) {
+  // Test that tasks queued behind a blocked worker are run by another worker.
+  ThreadPool pool({{}, {}});
+  absl::Notification unblock;
+  absl::Notification stolen;
+
+  pool.submit(0, [&]() { unblock.WaitForNotification(); });
+  pool.submit(0, [&]() { stolen.Notify(); });
+
+  stolen.WaitForNotification();
+  unblock.Notify();
+}
+
+TEST(ThreadPoolTest, WorkersOnlyStealFromWorkersOnTheSameCpus) {
+  ThreadPool pool({{0}, {0}, {1}});
+  absl::Notification started;
+  absl::Notification unblock;
+  absl::Notification ran;
+
+  // Block the only worker pinned to CPU 1 and queue a task behind it, which
+  // the idle workers pinned to CPU 0 must not steal.
+  pool.submit(2, [&]() {
+    started.Notify();
+    unblock.WaitForNotification();
+  });
+  started.WaitForNotification();
+  pool.submit(2, [&]() { ran.Notify(); });
+  EXPECT_FALSE(ran.WaitForNotificationWithTimeout(absl::Milliseconds(50)));
+
+  // Workers pinned to CPU 0 still steal from each other.
+  absl::Notification stolen;
+  pool.submit(0, [&]() { stolen.WaitForNotification(); });
+  pool.submit(0, [&]() { stolen.Notify(); });
+  stolen.WaitForNotification();
+
+  unblock.Notify();
+  ran.WaitForNotification();
+}
@@ -0,0 +1,66 @@
+#include "src/cpp/threading.h"
+
+#include <algorithm>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_format.h"
+#include "grpcpp/resource_quota.h"
+#include "grpcpp/server_builder.h"
+
+namespace executor {
+
+absl::StatusOr<ThreadingPolicy>
+parse_threading_policy(const std::string &policy) {
+  if (policy == "inter_query")
+    return ThreadingPolicy::kInterQuery;
+
+  if (policy == "intra_query")
+    return ThreadingPolicy::kIntraQuery;
+
+  return absl::InvalidArgumentError(absl::StrFormat(
+      "Expected threading policy to be `inter_query` or `intra_query`. "
+      "policy=%s",
+      policy));
+}
+
+ExecutorConfig make_executor_config(ThreadingPolicy policy, int num_cpus,
+                                    int max_concurrent_queries,
+                                    int max_queued_queries) {
+  num_cpus = std::max(1, num_cpus);
+
+  ExecutorConfig config;
+  if (max_concurrent_queries > 0)
+    config.max_concurrent_queries = std::min(max_concurrent_queries, num_cpus);
+  else if (policy == ThreadingPolicy::kInterQuery)
+    config.max_concurrent_queries = num_cpus;
+  else
+    config.max_concurrent_queries = 1;
+
+  if (policy == ThreadingPolicy::kInterQuery)
+    config.omp_threads_per_query = 1;
+  else
+    config.omp_threads_per_query = num_cpus / config.max_concurrent_queries;
+
+  // Leave one thread for gRPC to poll for new requests.
+  config.max_server_threads =
+      config.max_concurrent_queries + std::max(0, max_queued_queries) + 1;
+
+  return config;
+}
+
+void configure_server_builder(const ExecutorConfig &config,
+                              grpc::ServerBuilder *builder) {
+  grpc::ResourceQuota quota("index_service");
+  quota.SetMaxThreads(config.max_server_threads);
+  builder->SetResourceQuota(quota);
+
+  builder->SetSyncServerOption(grpc::ServerBuilder::SyncServerOption::NUM_CQS,
+                               1);
+  builder->SetSyncServerOption(
+      grpc::ServerBuilder::SyncServerOption::MAX_POLLERS,
+      config.max_server_threads);
+}
+
+} // namespace executor
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+#include "absl/status/statusor.h"
+#include "grpcpp/server_builder.h"
+
+namespace executor {
+
+// How a shard spends its CPUs on searches.
+enum class ThreadingPolicy {
+  // Many concurrent queries, one thread each. Best for high rates of small
+  // queries, where running one OpenMP team per query would oversubscribe the
+  // CPUs.
+  kInterQuery,
+
+  // Few concurrent queries, each parallelized across many threads by
+  // `faiss`/OpenMP. Best for low rates of large (e.g. batched or IVF) queries.
+  kIntraQuery,
+};
+
+// Parses `inter_query` or `intra_query`.
+absl::StatusOr<ThreadingPolicy>
+parse_threading_policy(const std::string &policy);
+
+// Sizes server threads and OpenMP threads together, so that
+// `max_concurrent_queries * omp_threads_per_query` never exceeds the number
+// of CPUs.
+struct ExecutorConfig {
+  // The number of searches that may run at once. Others wait for a slot.
+  // There is no limit if not positive.
+  int max_concurrent_queries = 0;
+
+  // The number of OpenMP threads `faiss` may use for a single search. If not
+  // positive, OpenMP's default (usually one thread per CPU) is used.
+  int omp_threads_per_query = 0;
+
+  // The maximum number of gRPC server threads. This bounds how many requests
+  // can wait for a search slot; beyond it, gRPC rejects requests with
+  // `RESOURCE_EXHAUSTED`.
+  int max_server_threads = 0;
+};
+
+// Builds the executor config for `policy` on `num_cpus` CPUs.
+// `max_concurrent_queries` overrides the policy's default number of
+// concurrent queries if positive. `max_queued_queries` is the number of
+// requests that may wait for a slot.
+ExecutorConfig make_executor_config(ThreadingPolicy policy, int num_cpus,
+                                    int max_concurrent_queries = 0,
+                                    int max_queued_queries = 64);
+
+// Bounds the number of gRPC server threads according to `config`.
+void configure_server_builder(const ExecutorConfig &config,
+                              grpc::ServerBuilder *builder);
+
+// A counting semaphore bounding how many callers may be inside a section of
+// code at once, used to bound the number of concurrent searches.
+class ConcurrencyLimiter {
+public:
+  // No limit is applied if `max_concurrency` isn't positive.
+  explicit ConcurrencyLimiter(int max_concurrency)
+      : m_max_concurrency_(max_concurrency), m_num_active_(0) {}
+
+  // Holds a slot for as long as it's in scope.
+  class Slot {
+  public:
+    explicit Slot(ConcurrencyLimiter *limiter) : m_limiter_(limiter) {
+      m_limiter_->acquire();
+    }
+    ~Slot() { m_limiter_->release(); }
+
+    Slot(const Slot &) = delete;
+    Slot &operator=(const Slot &) = delete;
+
+  private:
+    ConcurrencyLimiter *m_limiter_;
+  };
+
+  void acquire() {
+    if (m_max_concurrency_ <= 0)
+      return;
+
+    std::unique_lock<std::mutex> lock(m_mutex_);
+    m_cv_.wait(lock, [this] { return m_num_active_ < m_max_concurrency_; });
+    m_num_active_++;
+  }
+
+  void release() {
+    if (m_max_concurrency_ <= 0)
+      return;
+
+    {
+      const std::lock_guard<std::mutex> _(m_mutex_);
+      m_num_active_--;
+    }
+    m_cv_.notify_one();
+  }
+
+private:
+  const int m_max_concurrency_;
+
+  std::mutex m_mutex_;
+  std::condition_variable m_cv_;
+  int m_num_active_;
+};
+
+} // namespace executor
@@ -0,0 +1,66 @@
+#include "src/cpp/threading.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using executor::ConcurrencyLimiter;
+using executor::ExecutorConfig;
+using executor::make_executor_config;
+using executor::ThreadingPolicy;
+
+TEST(ExecutorConfigTest, InterQuery) {
+  ExecutorConfig config =
+      make_executor_config(ThreadingPolicy::kInterQuery, 16, 0, 64);
+
+  EXPECT_EQ(config.max_concurrent_queries, 16);
+  EXPECT_EQ(config.omp_threads_per_query, 1);
+  EXPECT_EQ(config.max_server_threads, 16 + 64 + 1);
+}
+
+TEST(ExecutorConfigTest, IntraQuery) {
+  ExecutorConfig config =
+      make_executor_config(ThreadingPolicy::kIntraQuery, 16, 0, 8);
+
+  EXPECT_EQ(config.max_concurrent_queries, 1);
+  EXPECT_EQ(config.omp_threads_per_query, 16);
+  EXPECT_EQ(config.max_server_threads, 1 + 8 + 1);
+}
+
+TEST(ExecutorConfigTest, IntraQueryWithConcurrentQueries) {
+  // Test that threads are split across concurrent queries without exceeding
+  // the number of CPUs.
+  ExecutorConfig config =
+      make_executor_config(ThreadingPolicy::kIntraQuery, 16, 3, 0);
+
+  EXPECT_EQ(config.max_concurrent_queries, 3);
+  EXPECT_EQ(config.omp_threads_per_query, 5);
+}
+
+TEST(ConcurrencyLimiterTest, BoundsConcurrency) {
+  ConcurrencyLimiter limiter(2);
+  std::atomic<int> num_active{0};
+  std::atomic<int> max_active{0};
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.emplace_back([&]() {
+      const ConcurrencyLimiter::Slot slot(&limiter);
+      int active = ++num_active;
+
+      int max = max_active;
+      while (active > max && !max_active.compare_exchange_weak(max, active))
+        ;
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      num_active--;
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+
+  EXPECT_LE(max_active, 2);
+}
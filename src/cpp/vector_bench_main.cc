@@ -0,0 +1,439 @@
+/* A load generator and recall benchmark for a running index service.
+ *
+ * The benchmark:
+ * 1. loads (or generates) a base dataset and a set of queries,
+ * 2. bulk-loads the base dataset through `Insert`,
+ * 3. drives `Search` either at a fixed concurrency (closed loop) or at a
+ * fixed rate (open loop),
+ * 4. reports throughput, a latency histogram and recall@k against exact
+ * brute-force ground truth.
+ *
+ * Vectors and queries can be sent with a compact wire `--encoding`, in which
+ * case the benchmark also reports the bytes sent per vector and per query.
+ *
+ * It works against both a single-node and a sharded index service since both
+ * serve the same API, e.g. `scripts/run_single.sh` and
+ * `scripts/run_sharded.sh`.
+ */
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/log.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_format.h"
+#include "grpc/grpc.h"
+#include "grpcpp/channel.h"
+#include "grpcpp/client_context.h"
+#include "grpcpp/completion_queue.h"
+#include "grpcpp/create_channel.h"
+#include "grpcpp/security/credentials.h"
+#include "src/cpp/dataset.h"
+#include "src/cpp/encoding.h"
+#include "src/cpp/histogram.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+ABSL_FLAG(std::string, target, "localhost:50051",
+          "Address of the index service to benchmark.");
+ABSL_FLAG(std::string, dataset, "synthetic",
+          "Base vectors to insert. Either `synthetic` or a path to a .fvecs "
+          "or .npy file.");
+ABSL_FLAG(std::string, queries, "synthetic",
+          "Query vectors to search for. Either `synthetic` or a path to a "
+          ".fvecs or .npy file.");
+ABSL_FLAG(int, num_vectors, 10000,
+          "Number of base vectors to generate or to load at most.");
+ABSL_FLAG(int, num_queries, 1000,
+          "Number of query vectors to generate or to load at most.");
+ABSL_FLAG(int, dimensions, 128, "Dimensions of synthetic vectors.");
+ABSL_FLAG(uint64_t, seed, 42, "Seed for synthetic vectors.");
+ABSL_FLAG(int, k, 10, "Number of neighbors to search for.");
+ABSL_FLAG(bool, skip_insert, false,
+          "Skip bulk-loading, e.g. when the index was already loaded by a "
+          "previous run with the same dataset flags.");
+ABSL_FLAG(int, insert_batch_size, 1000,
+          "Maximum number of vectors per `Insert` request.");
+ABSL_FLAG(std::string, mode, "closed",
+          "`closed` to issue searches from a fixed number of concurrent "
+          "clients, `open` to issue searches at a fixed rate.");
+ABSL_FLAG(int, concurrency, 1, "Number of concurrent clients (closed loop).");
+ABSL_FLAG(double, qps, 100, "Target searches per second (open loop).");
+ABSL_FLAG(double, duration_s, 10, "How long to run searches for.");
+ABSL_FLAG(std::string, encoding, "float32",
+          "Wire encoding of inserted vectors and queries. One of `float32`, "
+          "`float16`, `bfloat16` or `int8`.");
+ABSL_FLAG(bool, print_histogram, false,
+          "Print every non-empty latency histogram bucket.");
+
+using dataset::Dataset;
+using grpc::ClientAsyncResponseReader;
+using grpc::ClientContext;
+using grpc::CompletionQueue;
+using grpc::Status;
+using index_service::DescribeRequest;
+using index_service::DescribeResponse;
+using index_service::Encoding;
+using index_service::IndexService;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using stats::LatencyHistogram;
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Aggregated results of a search run.
+struct SearchResults {
+  LatencyHistogram latencies_us;
+  int64_t num_ok = 0;
+  int64_t num_errors = 0;
+  double recall_sum = 0;
+  double elapsed_s = 0;
+};
+
+// Keep at most ~3MB of encoded values per insert request to stay below
+// gRPC's default 4MB message size limit.
+constexpr size_t kMaxInsertBytes = 3 << 20;
+
+int64_t elapsed_us(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+      .count();
+}
+
+absl::StatusOr<Dataset> load_or_generate(const std::string &source,
+                                         int num_vectors, int dimensions,
+                                         uint64_t seed) {
+  if (source == "synthetic")
+    return dataset::generate_synthetic(num_vectors, dimensions, seed);
+
+  return dataset::load(source, num_vectors);
+}
+
+absl::StatusOr<Encoding> parse_encoding(const std::string &name) {
+  Encoding encoding;
+  if (!index_service::Encoding_Parse("ENCODING_" + absl::AsciiStrToUpper(name),
+                                     &encoding))
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "Expected encoding to be `float32`, `float16`, `bfloat16` or `int8`. "
+        "encoding=%s",
+        name));
+
+  return encoding;
+}
+
+SearchRequest make_search_request(const Dataset &queries, int query_idx, int k,
+                                  Encoding encoding) {
+  SearchRequest request;
+  request.set_k(k);
+  encoding::encode_query(queries.vector(query_idx), queries.dimensions,
+                         encoding, &request);
+  return request;
+}
+
+// Returns the fraction of the exact top-k neighbors found in `response`.
+double recall_at_k(const SearchResponse &response,
+                   const std::vector<int64_t> &ground_truth, int query_idx,
+                   int k) {
+  std::unordered_set<int64_t> expected(
+      ground_truth.begin() + (size_t)query_idx * k,
+      ground_truth.begin() + (size_t)(query_idx + 1) * k);
+
+  int found = 0;
+  for (const auto &neighbor : response.neighbors())
+    found += expected.count(neighbor.id());
+
+  return (double)found / k;
+}
+
+Status bulk_insert(IndexService::Stub *stub, const Dataset &base,
+                   Encoding encoding) {
+  const size_t max_batch_size = std::max<size_t>(
+      1, kMaxInsertBytes /
+             (base.dimensions * encoding::bytes_per_value(encoding)));
+  const int batch_size = (int)std::min<size_t>(
+      absl::GetFlag(FLAGS_insert_batch_size), max_batch_size);
+
+  // Note: Encoding is part of the client's cost of ingesting vectors, so it's
+  // included in the elapsed time.
+  int64_t wire_bytes = 0;
+  Clock::time_point start = Clock::now();
+  for (int offset = 0; offset < base.num_vectors; offset += batch_size) {
+    InsertRequest request;
+    InsertResponse response;
+    ClientContext context;
+
+    int end = std::min(offset + batch_size, base.num_vectors);
+    for (int i = offset; i < end; i++) {
+      auto *vector = request.add_vectors();
+      vector->set_id(i);
+      encoding::encode_vector(base.vector(i), base.dimensions, encoding,
+                              vector);
+    }
+    wire_bytes += request.ByteSizeLong();
+
+    Status status = stub->Insert(&context, request, &response);
+    if (!status.ok())
+      return status;
+  }
+
+  double elapsed_s = elapsed_us(start, Clock::now()) / 1e6;
+  std::cout << absl::StrFormat(
+                   "Inserted %d vectors in %.2fs (%.0f vectors/s, batch "
+                   "size %d).\n"
+                   "insert bytes on wire: %d (%.1f bytes/vector, %.1f MB/s)",
+                   base.num_vectors, elapsed_s, base.num_vectors / elapsed_s,
+                   batch_size, wire_bytes,
+                   (double)wire_bytes / base.num_vectors,
+                   wire_bytes / elapsed_s / 1e6)
+            << std::endl;
+
+  return Status::OK;
+}
+
+// Closed loop: each of `concurrency` clients issues its next search as soon
+// as the previous one completes.
+SearchResults run_closed_loop(IndexService::Stub *stub, const Dataset &queries,
+                              const std::vector<int64_t> &ground_truth, int k,
+                              Encoding encoding, int concurrency,
+                              double duration_s) {
+  std::vector<SearchResults> per_client(concurrency);
+  std::atomic<int64_t> next_query{0};
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline =
+      start + std::chrono::microseconds((int64_t)(duration_s * 1e6));
+
+  auto client = [&](int client_idx) {
+    SearchResults &results = per_client[client_idx];
+    while (Clock::now() < deadline) {
+      int query_idx = next_query++ % queries.num_vectors;
+      SearchRequest request =
+          make_search_request(queries, query_idx, k, encoding);
+      SearchResponse response;
+      ClientContext context;
+
+      Clock::time_point sent = Clock::now();
+      Status status = stub->Search(&context, request, &response);
+      results.latencies_us.record(elapsed_us(sent, Clock::now()));
+
+      if (!status.ok()) {
+        results.num_errors++;
+        continue;
+      }
+
+      results.num_ok++;
+      results.recall_sum += recall_at_k(response, ground_truth, query_idx, k);
+    }
+  };
+
+  std::vector<std::thread> clients;
+  for (int i = 0; i < concurrency; i++)
+    clients.emplace_back(client, i);
+  for (std::thread &thread : clients)
+    thread.join();
+
+  SearchResults total;
+  for (const SearchResults &results : per_client) {
+    total.latencies_us.merge(results.latencies_us);
+    total.num_ok += results.num_ok;
+    total.num_errors += results.num_errors;
+    total.recall_sum += results.recall_sum;
+  }
+  total.elapsed_s = elapsed_us(start, Clock::now()) / 1e6;
+
+  return total;
+}
+
+// Open loop: searches are issued asynchronously on a fixed schedule
+// regardless of how many are still outstanding. Latency is measured from the
+// scheduled send time, so it includes any delay caused by falling behind the
+// schedule (i.e. it doesn't suffer from coordinated omission).
+SearchResults run_open_loop(IndexService::Stub *stub, const Dataset &queries,
+                            const std::vector<int64_t> &ground_truth, int k,
+                            Encoding encoding, double qps, double duration_s) {
+  // The state of a single in-flight search.
+  struct Call {
+    int query_idx;
+    Clock::time_point scheduled;
+    ClientContext context;
+    SearchResponse response;
+    Status status;
+    std::unique_ptr<ClientAsyncResponseReader<SearchResponse>> reader;
+  };
+
+  CompletionQueue cq;
+  SearchResults results;
+  const int64_t num_searches = (int64_t)(qps * duration_s);
+
+  // Drain completions on a separate thread so sending stays on schedule.
+  std::thread receiver([&]() {
+    void *tag;
+    bool ok;
+    for (int64_t i = 0; i < num_searches && cq.Next(&tag, &ok); i++) {
+      std::unique_ptr<Call> call(static_cast<Call *>(tag));
+      results.latencies_us.record(elapsed_us(call->scheduled, Clock::now()));
+
+      if (!ok || !call->status.ok()) {
+        results.num_errors++;
+        continue;
+      }
+
+      results.num_ok++;
+      results.recall_sum +=
+          recall_at_k(call->response, ground_truth, call->query_idx, k);
+    }
+  });
+
+  const auto interval = std::chrono::nanoseconds((int64_t)(1e9 / qps));
+  Clock::time_point start = Clock::now();
+  for (int64_t i = 0; i < num_searches; i++) {
+    Clock::time_point scheduled = start + i * interval;
+    std::this_thread::sleep_until(scheduled);
+
+    auto *call = new Call;
+    call->query_idx = i % queries.num_vectors;
+    call->scheduled = scheduled;
+
+    SearchRequest request =
+        make_search_request(queries, call->query_idx, k, encoding);
+    call->reader = stub->AsyncSearch(&call->context, request, &cq);
+    call->reader->Finish(&call->response, &call->status, call);
+  }
+
+  receiver.join();
+  cq.Shutdown();
+  results.elapsed_s = elapsed_us(start, Clock::now()) / 1e6;
+
+  return results;
+}
+
+void print_results(const SearchResults &results, int k) {
+  const LatencyHistogram &latencies = results.latencies_us;
+  std::cout << absl::StrFormat(
+                   "Completed %d searches (%d errors) in %.2fs.\n"
+                   "throughput: %.1f qps\n"
+                   "recall@%d: %.4f\n"
+                   "latency (us): mean=%.0f p50=%d p90=%d p99=%d p99.9=%d "
+                   "max=%d",
+                   results.num_ok, results.num_errors, results.elapsed_s,
+                   results.num_ok / results.elapsed_s, k,
+                   results.num_ok ? results.recall_sum / results.num_ok : 0,
+                   latencies.mean(), latencies.percentile(50),
+                   latencies.percentile(90), latencies.percentile(99),
+                   latencies.percentile(99.9), latencies.max())
+            << std::endl;
+
+  if (absl::GetFlag(FLAGS_print_histogram))
+    std::cout << "latency histogram (us):\n" << latencies.to_string();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  absl::ParseCommandLine(argc, argv);
+
+  const int k = absl::GetFlag(FLAGS_k);
+  const int dimensions = absl::GetFlag(FLAGS_dimensions);
+  const uint64_t seed = absl::GetFlag(FLAGS_seed);
+
+  absl::StatusOr<Dataset> base =
+      load_or_generate(absl::GetFlag(FLAGS_dataset),
+                       absl::GetFlag(FLAGS_num_vectors), dimensions, seed);
+  if (!base.ok()) {
+    std::cout << "Failed to load dataset: " << base.status() << std::endl;
+    return 1;
+  }
+
+  // Use a different seed so synthetic queries aren't copies of base vectors.
+  absl::StatusOr<Dataset> queries = load_or_generate(
+      absl::GetFlag(FLAGS_queries), absl::GetFlag(FLAGS_num_queries),
+      base->dimensions, seed + 1);
+  if (!queries.ok()) {
+    std::cout << "Failed to load queries: " << queries.status() << std::endl;
+    return 1;
+  }
+
+  if (queries->dimensions != base->dimensions || !queries->num_vectors) {
+    std::cout << absl::StrFormat(
+                     "Expected a non-empty set of queries with the dataset's "
+                     "dimensions. Dataset dimensions: (%d). Query dimensions: "
+                     "(%d).",
+                     base->dimensions, queries->dimensions)
+              << std::endl;
+    return 1;
+  }
+
+  LOG(INFO) << absl::StrFormat(
+      "Loaded %d base vectors and %d queries with %d dimensions.",
+      base->num_vectors, queries->num_vectors, base->dimensions);
+
+  absl::StatusOr<Encoding> encoding =
+      parse_encoding(absl::GetFlag(FLAGS_encoding));
+  if (!encoding.ok()) {
+    std::cout << encoding.status() << std::endl;
+    return 1;
+  }
+
+  std::cout << absl::StrFormat(
+                   "Using %s encoding. query bytes on wire: %d",
+                   absl::GetFlag(FLAGS_encoding),
+                   make_search_request(*queries, 0, k, *encoding)
+                       .ByteSizeLong())
+            << std::endl;
+
+  std::unique_ptr<IndexService::Stub> stub =
+      IndexService::NewStub(grpc::CreateChannel(
+          absl::GetFlag(FLAGS_target), grpc::InsecureChannelCredentials()));
+
+  if (!absl::GetFlag(FLAGS_skip_insert)) {
+    Status status = bulk_insert(stub.get(), *base, *encoding);
+    if (!status.ok()) {
+      std::cout << absl::StrFormat("Insert failed. error_code=%d, "
+                                   "error_message=%s",
+                                   status.error_code(), status.error_message())
+                << std::endl;
+      return 1;
+    }
+  }
+
+  ClientContext describe_context;
+  DescribeResponse describe_response;
+  stub->Describe(&describe_context, DescribeRequest(), &describe_response);
+  std::cout << absl::StrFormat("Index has %d vectors with %d dimensions.",
+                               describe_response.num_vectors(),
+                               describe_response.dimensions())
+            << std::endl;
+
+  LOG(INFO) << "Computing brute-force ground truth...";
+  std::vector<int64_t> ground_truth = dataset::brute_force_knn(
+      *base, *queries, k, std::max(1u, std::thread::hardware_concurrency()));
+
+  const std::string mode = absl::GetFlag(FLAGS_mode);
+  const double duration_s = absl::GetFlag(FLAGS_duration_s);
+
+  SearchResults results;
+  if (mode == "closed") {
+    results = run_closed_loop(stub.get(), *queries, ground_truth, k,
+                              *encoding, absl::GetFlag(FLAGS_concurrency),
+                              duration_s);
+  } else if (mode == "open") {
+    results = run_open_loop(stub.get(), *queries, ground_truth, k, *encoding,
+                            absl::GetFlag(FLAGS_qps), duration_s);
+  } else {
+    std::cout << "Expected --mode to be `closed` or `open`." << std::endl;
+    return 1;
+  }
+
+  print_results(results, k);
+
+  return 0;
+}
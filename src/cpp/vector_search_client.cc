@@ -0,0 +1,436 @@
+#include "src/cpp/vector_search_client.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "grpc/grpc.h"
+#include "grpcpp/channel.h"
+#include "grpcpp/client_context.h"
+#include "grpcpp/create_channel.h"
+#include "grpcpp/security/credentials.h"
+#include "grpcpp/support/channel_arguments.h"
+#include "grpcpp/support/status.h"
+#include "src/cpp/histogram.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::IndexService;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::Vector;
+
+namespace index_service::client {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t microseconds_since(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                               start)
+      .count();
+}
+
+} // namespace
+
+template <typename Request, typename Response>
+struct VectorSearchClient::Call {
+  // Note: The contexts hold the last references to channels once the client
+  // is destroyed, and a channel can't be destroyed from its own callback, so
+  // the client waits for every call to be destroyed rather than completed.
+  ~Call() {
+    contexts.clear();
+    if (client)
+      client->finish_call();
+  }
+
+  // Set once the call is sent.
+  VectorSearchClient *client = nullptr;
+
+  Request request;
+  Response response;
+
+  // The contexts of every attempt, the last one current.
+  // Note: A context must outlive its call's callback, which starts the next
+  // attempt, so the contexts of earlier attempts are kept until the call is
+  // destroyed.
+  std::vector<std::unique_ptr<ClientContext>> contexts;
+
+  // Sends `request` through a stub's callback API.
+  std::function<void(IndexService::Stub *, ClientContext *, const Request *,
+                     Response *, std::function<void(Status)>)>
+      rpc;
+
+  // Called once the last attempt completes.
+  std::function<void(const Status &, const Response &)> done;
+
+  // Where the latency of the call is recorded.
+  stats::LatencyHistogram *latency;
+
+  int channel_idx;
+  int attempt = 1;
+  Clock::time_point start;
+};
+
+absl::StatusOr<std::unique_ptr<VectorSearchClient>>
+VectorSearchClient::create(const ClientConfig &config) {
+  if (config.addresses.empty())
+    return absl::InvalidArgumentError("Expected at least one address.");
+  if (config.channels_per_address <= 0 || config.max_attempts <= 0 ||
+      config.max_insert_batch_vectors <= 0)
+    return absl::InvalidArgumentError(
+        "Expected a positive channels_per_address, max_attempts and "
+        "max_insert_batch_vectors.");
+
+  // Note: Channels with the same target and arguments share their
+  // connection unless each has its own subchannel pool. Channels are
+  // interleaved by address, so consecutive channels reach different
+  // addresses and a retry on the next channel goes elsewhere.
+  std::vector<std::shared_ptr<Channel>> channels;
+  for (int i = 0; i < config.channels_per_address; i++) {
+    for (const std::string &address : config.addresses) {
+      grpc::ChannelArguments args;
+      args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+      channels.push_back(grpc::CreateCustomChannel(
+          address, grpc::InsecureChannelCredentials(), args));
+    }
+  }
+
+  return std::unique_ptr<VectorSearchClient>(
+      new VectorSearchClient(config, std::move(channels)));
+}
+
+VectorSearchClient::VectorSearchClient(
+    const ClientConfig &config, std::vector<std::shared_ptr<Channel>> channels)
+    : m_config_(config), m_channels_(std::move(channels)),
+      m_next_channel_(0), m_searches_(m_metrics_.counter("searches")),
+      m_searches_coalesced_(m_metrics_.counter("searches_coalesced")),
+      m_inserts_(m_metrics_.counter("inserts")),
+      m_insert_batches_sent_(m_metrics_.counter("insert_batches")),
+      m_retries_(m_metrics_.counter("retries")),
+      m_retries_throttled_(m_metrics_.counter("retries_throttled")),
+      m_retry_tokens_(config.retry_budget_max_tokens) {
+  for (const auto &channel : m_channels_)
+    m_stubs_.push_back(IndexService::NewStub(channel));
+
+  m_flusher_ = std::thread(&VectorSearchClient::run_flusher, this);
+}
+
+VectorSearchClient::~VectorSearchClient() {
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    m_stopping_ = true;
+  }
+  m_cv_.notify_all();
+  m_flusher_.join();
+
+  Flush();
+
+  std::unique_lock<std::mutex> lock(m_mutex_);
+  m_cv_.wait(lock, [this] { return m_num_in_flight_ == 0; });
+}
+
+int VectorSearchClient::next_channel() {
+  return m_next_channel_.fetch_add(1, std::memory_order_relaxed) %
+         m_stubs_.size();
+}
+
+bool VectorSearchClient::try_retry() {
+  const std::lock_guard<std::mutex> _(m_retry_mutex_);
+  if (m_retry_tokens_ < 1)
+    return false;
+
+  m_retry_tokens_--;
+  return true;
+}
+
+template <typename Request, typename Response>
+void VectorSearchClient::start_call(
+    std::shared_ptr<Call<Request, Response>> call) {
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    m_num_in_flight_++;
+  }
+  call->client = this;
+  {
+    const std::lock_guard<std::mutex> _(m_retry_mutex_);
+    m_retry_tokens_ = std::min(m_config_.retry_budget_max_tokens,
+                               m_retry_tokens_ + m_config_.retry_budget_ratio);
+  }
+
+  call->start = Clock::now();
+  call->channel_idx = next_channel();
+  start_attempt(std::move(call));
+}
+
+template <typename Request, typename Response>
+void VectorSearchClient::start_attempt(
+    std::shared_ptr<Call<Request, Response>> call) {
+  ClientContext *context =
+      call->contexts.emplace_back(std::make_unique<ClientContext>()).get();
+  if (m_config_.timeout.count())
+    context->set_deadline(std::chrono::system_clock::now() +
+                          m_config_.timeout);
+
+  IndexService::Stub *stub = m_stubs_[call->channel_idx].get();
+  call->rpc(stub, context, &call->request, &call->response,
+            [this, call](Status status) {
+              if (status.error_code() == StatusCode::UNAVAILABLE &&
+                  call->attempt < m_config_.max_attempts) {
+                if (try_retry()) {
+                  m_retries_->increment();
+                  call->attempt++;
+                  call->channel_idx =
+                      (call->channel_idx + 1) % m_stubs_.size();
+                  call->response.Clear();
+                  start_attempt(call);
+                  return;
+                }
+                m_retries_throttled_->increment();
+              }
+
+              {
+                const std::lock_guard<std::mutex> _(m_latency_mutex_);
+                call->latency->record(microseconds_since(call->start));
+              }
+              call->done(status, call->response);
+            });
+}
+
+void VectorSearchClient::finish_call() {
+  // Note: Notify while holding the lock, so the destructor can't return
+  // between the count reaching 0 and the notification.
+  const std::lock_guard<std::mutex> _(m_mutex_);
+  m_num_in_flight_--;
+  m_cv_.notify_all();
+}
+
+void VectorSearchClient::Search(const SearchRequest &request,
+                                SearchCallback done) {
+  m_searches_->increment();
+
+  // Note: Equal requests serialize to the same bytes within a process, so
+  // the serialized request identifies identical searches by every field.
+  std::string key = request.SerializeAsString();
+  {
+    const std::lock_guard<std::mutex> _(m_search_mutex_);
+    auto [it, inserted] = m_searches_in_flight_.try_emplace(key);
+    it->second.push_back(std::move(done));
+    if (!inserted) {
+      m_searches_coalesced_->increment();
+      return;
+    }
+  }
+
+  auto call = std::make_shared<Call<SearchRequest, SearchResponse>>();
+  call->request = request;
+  call->rpc = [](IndexService::Stub *stub, ClientContext *context,
+                 const SearchRequest *request, SearchResponse *response,
+                 std::function<void(Status)> done) {
+    stub->async()->Search(context, request, response, std::move(done));
+  };
+  call->latency = &m_search_latency_;
+  call->done = [this, key = std::move(key)](const Status &status,
+                                            const SearchResponse &response) {
+    std::vector<SearchCallback> callbacks;
+    {
+      const std::lock_guard<std::mutex> _(m_search_mutex_);
+      auto it = m_searches_in_flight_.find(key);
+      callbacks = std::move(it->second);
+      m_searches_in_flight_.erase(it);
+    }
+
+    for (const SearchCallback &callback : callbacks)
+      callback(status, response);
+  };
+
+  start_call(std::move(call));
+}
+
+std::future<SearchResult>
+VectorSearchClient::Search(const SearchRequest &request) {
+  auto promise = std::make_shared<std::promise<SearchResult>>();
+  std::future<SearchResult> future = promise->get_future();
+  Search(request,
+         [promise](const Status &status, const SearchResponse &response) {
+           promise->set_value({status, response});
+         });
+
+  return future;
+}
+
+std::future<std::vector<SearchResult>>
+VectorSearchClient::BatchSearch(const std::vector<SearchRequest> &requests) {
+  // The results of a batch, completed by the last search to finish.
+  struct Batch {
+    std::vector<SearchResult> results;
+    std::atomic<int> num_pending;
+    std::promise<std::vector<SearchResult>> promise;
+  };
+
+  auto batch = std::make_shared<Batch>();
+  batch->results.resize(requests.size());
+  batch->num_pending = requests.size();
+  std::future<std::vector<SearchResult>> future = batch->promise.get_future();
+  if (requests.empty()) {
+    batch->promise.set_value({});
+    return future;
+  }
+
+  for (int i = 0; i < requests.size(); i++) {
+    Search(requests[i],
+           [batch, i](const Status &status, const SearchResponse &response) {
+             batch->results[i] = {status, response};
+             if (--batch->num_pending == 0)
+               batch->promise.set_value(std::move(batch->results));
+           });
+  }
+
+  return future;
+}
+
+void VectorSearchClient::Insert(InsertRequest request, InsertCallback done) {
+  m_inserts_->increment();
+
+  const int batch_size = m_config_.max_insert_batch_vectors;
+  if (request.vectors_size() >= batch_size) {
+    InsertBatch batch;
+    batch.request = std::move(request);
+    batch.callbacks.push_back(std::move(done));
+    send_inserts(std::move(batch));
+    return;
+  }
+
+  std::vector<InsertBatch> full_batches;
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    InsertBatch &batch = m_insert_batches_[request.collection()];
+
+    // Send the pending batch first if this insert doesn't fit in it.
+    if (batch.request.vectors_size() + request.vectors_size() > batch_size) {
+      full_batches.push_back(std::move(batch));
+      batch = InsertBatch();
+    }
+
+    if (batch.callbacks.empty()) {
+      batch.request.set_collection(request.collection());
+      batch.deadline = Clock::now() + m_config_.max_insert_delay;
+      m_cv_.notify_all();
+    }
+
+    for (Vector &vector : *request.mutable_vectors())
+      batch.request.add_vectors()->Swap(&vector);
+    batch.callbacks.push_back(std::move(done));
+
+    if (batch.request.vectors_size() == batch_size) {
+      full_batches.push_back(std::move(batch));
+      m_insert_batches_.erase(request.collection());
+    }
+  }
+
+  for (InsertBatch &batch : full_batches)
+    send_inserts(std::move(batch));
+}
+
+std::future<Status> VectorSearchClient::Insert(InsertRequest request) {
+  auto promise = std::make_shared<std::promise<Status>>();
+  std::future<Status> future = promise->get_future();
+  Insert(std::move(request),
+         [promise](const Status &status) { promise->set_value(status); });
+
+  return future;
+}
+
+void VectorSearchClient::Flush() {
+  std::map<std::string, InsertBatch> batches;
+  {
+    const std::lock_guard<std::mutex> _(m_mutex_);
+    batches.swap(m_insert_batches_);
+  }
+
+  for (auto &[collection, batch] : batches)
+    send_inserts(std::move(batch));
+}
+
+void VectorSearchClient::send_inserts(InsertBatch batch) {
+  m_insert_batches_sent_->increment();
+
+  auto call = std::make_shared<Call<InsertRequest, InsertResponse>>();
+  call->request = std::move(batch.request);
+  call->rpc = [](IndexService::Stub *stub, ClientContext *context,
+                 const InsertRequest *request, InsertResponse *response,
+                 std::function<void(Status)> done) {
+    stub->async()->Insert(context, request, response, std::move(done));
+  };
+  call->latency = &m_insert_latency_;
+  call->done = [callbacks = std::move(batch.callbacks)](
+                   const Status &status, const InsertResponse &response) {
+    for (const InsertCallback &callback : callbacks)
+      callback(status);
+  };
+
+  start_call(std::move(call));
+}
+
+void VectorSearchClient::run_flusher() {
+  std::unique_lock<std::mutex> lock(m_mutex_);
+  while (!m_stopping_) {
+    if (m_insert_batches_.empty()) {
+      m_cv_.wait(lock);
+      continue;
+    }
+
+    Clock::time_point deadline = Clock::time_point::max();
+    for (const auto &[collection, batch] : m_insert_batches_)
+      deadline = std::min(deadline, batch.deadline);
+
+    const Clock::time_point now = Clock::now();
+    if (now < deadline) {
+      m_cv_.wait_until(lock, deadline);
+      continue;
+    }
+
+    std::vector<InsertBatch> expired_batches;
+    for (auto it = m_insert_batches_.begin(); it != m_insert_batches_.end();) {
+      if (it->second.deadline <= now) {
+        expired_batches.push_back(std::move(it->second));
+        it = m_insert_batches_.erase(it);
+      } else {
+        it++;
+      }
+    }
+
+    lock.unlock();
+    for (InsertBatch &batch : expired_batches)
+      send_inserts(std::move(batch));
+    lock.lock();
+  }
+}
+
+stats::LatencyHistogram VectorSearchClient::search_latency() const {
+  const std::lock_guard<std::mutex> _(m_latency_mutex_);
+  return m_search_latency_;
+}
+
+stats::LatencyHistogram VectorSearchClient::insert_latency() const {
+  const std::lock_guard<std::mutex> _(m_latency_mutex_);
+  return m_insert_latency_;
+}
+
+} // namespace index_service::client
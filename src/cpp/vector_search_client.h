@@ -0,0 +1,213 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "grpcpp/channel.h"
+#include "grpcpp/support/status.h"
+#include "src/cpp/histogram.h"
+#include "src/cpp/metrics.h"
+#include "src/proto/index_service.grpc.pb.h"
+#include "src/proto/index_service.pb.h"
+
+namespace index_service::client {
+
+struct ClientConfig {
+  // The addresses of the index services to spread requests across, e.g.
+  // several routers of one sharded index.
+  std::vector<std::string> addresses;
+
+  // The number of channels to open to each address. Each channel has its own
+  // connection, so concurrent requests aren't capped by one connection's
+  // stream limit.
+  int channels_per_address = 1;
+
+  // Inserts smaller than this are held for up to `max_insert_delay` and sent
+  // together with other inserts into the same collection, in batches of up
+  // to this many vectors.
+  int max_insert_batch_vectors = 1000;
+  std::chrono::microseconds max_insert_delay{1000};
+
+  // How long each attempt of a request may take. Unbounded if 0.
+  std::chrono::milliseconds timeout{0};
+
+  // The number of times a request is sent at most, including its first
+  // attempt. Only `UNAVAILABLE` requests are retried, each on the next
+  // channel of the pool.
+  int max_attempts = 3;
+
+  // Retries draw from a budget of tokens, so a failing service sees at most
+  // a fraction more load rather than `max_attempts` times as much. Every
+  // request adds `retry_budget_ratio` tokens, and every retry takes one. The
+  // budget starts with, and holds at most, `retry_budget_max_tokens`.
+  double retry_budget_ratio = 0.1;
+  double retry_budget_max_tokens = 10;
+};
+
+// The outcome of a search. `response` is only set if `status` is ok.
+struct SearchResult {
+  grpc::Status status;
+  index_service::SearchResponse response;
+};
+
+// A client of `IndexService` that keeps many requests in flight instead of
+// making one blocking call at a time.
+//
+// Requests are sent with gRPC's callback API round-robin across a pool of
+// channels to every address, and complete through a callback or a future.
+// Callbacks run on gRPC's threads, so they must not block.
+//
+// On top of that, the client:
+// 1. sends small inserts into the same collection as one batched `Insert`,
+// once enough vectors are pending or the oldest of them waited
+// `max_insert_delay`,
+// 2. sends identical searches that are in flight at the same time once, and
+// completes all of them with its response,
+// 3. retries `UNAVAILABLE` requests on the next channel, within a retry
+// budget,
+// 4. records the latency of every request, including its retries, in
+// histograms.
+class VectorSearchClient {
+public:
+  using SearchCallback = std::function<void(
+      const grpc::Status &, const index_service::SearchResponse &)>;
+  using InsertCallback = std::function<void(const grpc::Status &)>;
+
+  // Opens the channel pool. Returns `INVALID_ARGUMENT` if `config` has no
+  // addresses or a non-positive count.
+  static absl::StatusOr<std::unique_ptr<VectorSearchClient>>
+  create(const ClientConfig &config);
+
+  // Sends any pending inserts and waits for every request in flight.
+  ~VectorSearchClient();
+
+  VectorSearchClient(const VectorSearchClient &) = delete;
+  VectorSearchClient &operator=(const VectorSearchClient &) = delete;
+
+  void Search(const index_service::SearchRequest &request,
+              SearchCallback done);
+
+  std::future<SearchResult>
+  Search(const index_service::SearchRequest &request);
+
+  // Sends every search in `requests` at once, and completes with their
+  // results in the same order.
+  std::future<std::vector<SearchResult>>
+  BatchSearch(const std::vector<index_service::SearchRequest> &requests);
+
+  // Note: An insert batched with others fails if the batch does, e.g. if
+  // another insert in it has the wrong dimensions.
+  void Insert(index_service::InsertRequest request, InsertCallback done);
+
+  std::future<grpc::Status> Insert(index_service::InsertRequest request);
+
+  // Sends all pending inserts now instead of waiting for their batches to
+  // fill.
+  void Flush();
+
+  // The latencies of searches and inserts in microseconds, from when they
+  // were sent until they completed, including retries. Inserts don't count
+  // the time they waited to be batched.
+  stats::LatencyHistogram search_latency() const;
+  stats::LatencyHistogram insert_latency() const;
+
+  // The registry of the client's counters, e.g. `retries` and
+  // `searches_coalesced`.
+  metrics::Registry *metrics() { return &m_metrics_; }
+
+private:
+  // A request and its attempts.
+  template <typename Request, typename Response> struct Call;
+
+  // Inserts into one collection, waiting to be sent together.
+  struct InsertBatch {
+    index_service::InsertRequest request;
+    std::vector<InsertCallback> callbacks;
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  VectorSearchClient(const ClientConfig &config,
+                     std::vector<std::shared_ptr<grpc::Channel>> channels);
+
+  // Sends `call` on the next channel of the pool.
+  template <typename Request, typename Response>
+  void start_call(std::shared_ptr<Call<Request, Response>> call);
+
+  // Sends an attempt of `call` on its current channel.
+  template <typename Request, typename Response>
+  void start_attempt(std::shared_ptr<Call<Request, Response>> call);
+
+  // Returns the channel to send the next request on.
+  int next_channel();
+
+  // Takes a token from the retry budget, if there's one.
+  bool try_retry();
+
+  void send_inserts(InsertBatch batch);
+
+  // Sends insert batches once their deadline passes.
+  void run_flusher();
+
+  // Called once a call is destroyed.
+  void finish_call();
+
+  ClientConfig m_config_;
+
+  std::vector<std::shared_ptr<grpc::Channel>> m_channels_;
+  std::vector<std::unique_ptr<index_service::IndexService::Stub>> m_stubs_;
+  std::atomic<uint64_t> m_next_channel_;
+
+  metrics::Registry m_metrics_;
+  metrics::Counter *m_searches_;
+  metrics::Counter *m_searches_coalesced_;
+  metrics::Counter *m_inserts_;
+  metrics::Counter *m_insert_batches_sent_;
+  metrics::Counter *m_retries_;
+  metrics::Counter *m_retries_throttled_;
+
+  // Guards the retry budget.
+  std::mutex m_retry_mutex_;
+  double m_retry_tokens_;
+
+  // Guards the histograms.
+  mutable std::mutex m_latency_mutex_;
+  stats::LatencyHistogram m_search_latency_;
+  stats::LatencyHistogram m_insert_latency_;
+
+  // Guards `m_searches_in_flight_`.
+  std::mutex m_search_mutex_;
+
+  // The callbacks of every search in flight, by its serialized request.
+  std::unordered_map<std::string, std::vector<SearchCallback>>
+      m_searches_in_flight_;
+
+  // Guards the pending inserts, `m_num_in_flight_` and `m_stopping_`.
+  std::mutex m_mutex_;
+
+  // Inserts waiting to be batched, by collection.
+  std::map<std::string, InsertBatch> m_insert_batches_;
+
+  // The number of calls sent but not destroyed.
+  int m_num_in_flight_ = 0;
+
+  bool m_stopping_ = false;
+
+  // Notified when an insert batch is started, when requests finish, and to
+  // stop.
+  std::condition_variable m_cv_;
+
+  std::thread m_flusher_;
+};
+
+} // namespace index_service::client
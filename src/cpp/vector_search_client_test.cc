@@ -0,0 +1,231 @@
+#include "src/cpp/vector_search_client.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "absl/synchronization/notification.h"
+#include "src/cpp/test_server.h"
+#include "src/proto/index_service.grpc.pb.h"
+
+using grpc::ServerContext;
+using grpc::Status;
+using grpc::StatusCode;
+using index_service::IndexService;
+using index_service::InsertRequest;
+using index_service::InsertResponse;
+using index_service::SearchRequest;
+using index_service::SearchResponse;
+using index_service::client::ClientConfig;
+using index_service::client::SearchResult;
+using index_service::client::VectorSearchClient;
+
+namespace {
+
+// Searches return a neighbor with the request's `k` as its id, and inserts
+// record how many vectors they had. Requests fail with `UNAVAILABLE` if
+// `unavailable` is set. If `unblock` is set, a search notifies `searching`
+// and blocks until `unblock` is notified, so only one search may reach it.
+class FakeService final : public IndexService::Service {
+public:
+  Status Search(ServerContext *context, const SearchRequest *search_request,
+                SearchResponse *search_response) override {
+    num_searches++;
+    if (unavailable)
+      return Status(StatusCode::UNAVAILABLE, "Unavailable.");
+
+    if (unblock) {
+      searching.Notify();
+      unblock->WaitForNotification();
+    }
+
+    search_response->add_neighbors()->set_id(search_request->k());
+    return Status::OK;
+  }
+
+  Status Insert(ServerContext *context, const InsertRequest *insert_request,
+                InsertResponse *insert_response) override {
+    if (unavailable)
+      return Status(StatusCode::UNAVAILABLE, "Unavailable.");
+
+    const std::lock_guard<std::mutex> _(mutex);
+    insert_sizes.push_back(insert_request->vectors_size());
+    return Status::OK;
+  }
+
+  std::atomic<int> num_searches = 0;
+  std::atomic<bool> unavailable = false;
+  absl::Notification searching;
+  absl::Notification *unblock = nullptr;
+
+  std::mutex mutex;
+  std::vector<int> insert_sizes;
+};
+
+// Serves a `FakeService` on a local port.
+struct TestServer {
+  FakeService service;
+  test_server::LocalServer server{&service};
+  const std::string address = server.address();
+};
+
+std::unique_ptr<VectorSearchClient> make_client(const ClientConfig &config) {
+  auto client = VectorSearchClient::create(config);
+  EXPECT_TRUE(client.ok());
+  return std::move(*client);
+}
+
+SearchRequest make_search(int k) {
+  SearchRequest request;
+  request.set_k(k);
+  request.add_query_vector(1);
+  return request;
+}
+
+InsertRequest make_insert(int first_id, int num_vectors) {
+  InsertRequest request;
+  for (int i = 0; i < num_vectors; i++) {
+    auto *vector = request.add_vectors();
+    vector->set_id(first_id + i);
+    vector->add_raw(1);
+  }
+  return request;
+}
+
+} // namespace
+
+TEST(VectorSearchClientTest, RejectsInvalidConfigs) {
+  EXPECT_FALSE(VectorSearchClient::create(ClientConfig()).ok());
+
+  ClientConfig config;
+  config.addresses = {"localhost:1"};
+  config.channels_per_address = 0;
+  EXPECT_FALSE(VectorSearchClient::create(config).ok());
+}
+
+TEST(VectorSearchClientTest, BatchSearchKeepsOrder) {
+  TestServer server;
+  ClientConfig config;
+  config.addresses = {server.address};
+  config.channels_per_address = 2;
+  std::unique_ptr<VectorSearchClient> client = make_client(config);
+
+  std::vector<SearchResult> results =
+      client->BatchSearch({make_search(1), make_search(2), make_search(3)})
+          .get();
+  ASSERT_EQ(results.size(), 3);
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(results[i].status.ok());
+    EXPECT_EQ(results[i].response.neighbors(0).id(), i + 1);
+  }
+
+  EXPECT_TRUE(client->BatchSearch({}).get().empty());
+  EXPECT_EQ(client->search_latency().count(), 3);
+}
+
+TEST(VectorSearchClientTest, CoalescesIdenticalSearches) {
+  TestServer server;
+  absl::Notification unblock;
+  server.service.unblock = &unblock;
+  ClientConfig config;
+  config.addresses = {server.address};
+  std::unique_ptr<VectorSearchClient> client = make_client(config);
+
+  std::future<SearchResult> first = client->Search(make_search(5));
+  server.service.searching.WaitForNotification();
+  std::future<SearchResult> second = client->Search(make_search(5));
+  std::future<SearchResult> third = client->Search(make_search(5));
+  unblock.Notify();
+
+  for (std::future<SearchResult> *result : {&first, &second, &third}) {
+    SearchResult search_result = result->get();
+    ASSERT_TRUE(search_result.status.ok());
+    EXPECT_EQ(search_result.response.neighbors(0).id(), 5);
+  }
+  EXPECT_EQ(server.service.num_searches, 1);
+  EXPECT_EQ(client->metrics()->snapshot().at("searches_coalesced"), 2);
+}
+
+TEST(VectorSearchClientTest, BatchesSmallInserts) {
+  TestServer server;
+  ClientConfig config;
+  config.addresses = {server.address};
+  config.max_insert_batch_vectors = 4;
+  config.max_insert_delay = std::chrono::hours(1);
+  std::unique_ptr<VectorSearchClient> client = make_client(config);
+
+  // The third insert fills the batch, which sends it.
+  std::future<Status> first = client->Insert(make_insert(0, 1));
+  std::future<Status> second = client->Insert(make_insert(1, 2));
+  std::future<Status> third = client->Insert(make_insert(3, 1));
+  EXPECT_TRUE(first.get().ok());
+  EXPECT_TRUE(second.get().ok());
+  EXPECT_TRUE(third.get().ok());
+
+  // Large inserts aren't batched, and `Flush` sends a partial batch.
+  EXPECT_TRUE(client->Insert(make_insert(4, 5)).get().ok());
+  std::future<Status> pending = client->Insert(make_insert(9, 3));
+  // An insert that doesn't fit in the pending batch sends it first.
+  std::future<Status> overflow = client->Insert(make_insert(12, 2));
+  EXPECT_TRUE(pending.get().ok());
+  client->Flush();
+  EXPECT_TRUE(overflow.get().ok());
+
+  EXPECT_EQ(server.service.insert_sizes, std::vector<int>({4, 5, 3, 2}));
+  EXPECT_EQ(client->metrics()->snapshot().at("insert_batches"), 4);
+}
+
+TEST(VectorSearchClientTest, SendsInsertsAfterDelay) {
+  TestServer server;
+  ClientConfig config;
+  config.addresses = {server.address};
+  config.max_insert_delay = std::chrono::milliseconds(1);
+  std::unique_ptr<VectorSearchClient> client = make_client(config);
+
+  EXPECT_TRUE(client->Insert(make_insert(0, 1)).get().ok());
+  EXPECT_EQ(client->insert_latency().count(), 1);
+}
+
+TEST(VectorSearchClientTest, RetriesOnOtherAddresses) {
+  TestServer healthy;
+  TestServer unhealthy;
+  unhealthy.service.unavailable = true;
+  ClientConfig config;
+  config.addresses = {healthy.address, unhealthy.address};
+  std::unique_ptr<VectorSearchClient> client = make_client(config);
+
+  for (int k = 1; k <= 4; k++) {
+    SearchResult result = client->Search(make_search(k)).get();
+    ASSERT_TRUE(result.status.ok());
+    EXPECT_EQ(result.response.neighbors(0).id(), k);
+  }
+  EXPECT_EQ(client->metrics()->snapshot().at("retries"), 2);
+}
+
+TEST(VectorSearchClientTest, RetryBudgetLimitsRetries) {
+  TestServer server;
+  server.service.unavailable = true;
+  ClientConfig config;
+  config.addresses = {server.address};
+  config.max_attempts = 3;
+  config.retry_budget_ratio = 0;
+  config.retry_budget_max_tokens = 2;
+  std::unique_ptr<VectorSearchClient> client = make_client(config);
+
+  // The first search retries twice and exhausts the budget, so the others
+  // aren't retried.
+  for (int k = 1; k <= 5; k++)
+    EXPECT_EQ(client->Search(make_search(k)).get().status.error_code(),
+              StatusCode::UNAVAILABLE);
+
+  const auto metrics = client->metrics()->snapshot();
+  EXPECT_EQ(metrics.at("retries"), 2);
+  EXPECT_EQ(metrics.at("retries_throttled"), 4);
+  EXPECT_EQ(server.service.num_searches, 7);
+}